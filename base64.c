@@ -1,5 +1,11 @@
 // system
 #include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(__x86_64__) || defined(__i386__)
+#   define B64_X86 1
+#   include <immintrin.h>
+#endif
 // self
 #include "base64.h"
 
@@ -26,7 +32,9 @@ static const uint8_t k_decode_table[256] = {
 };
 
 
-void b64_encode(const uint8_t *inbuf, size_t insize, uint8_t *outbuf) {
+
+
+static void b64_encode_scalar(const uint8_t *inbuf, size_t insize, uint8_t *outbuf) {
     while (insize >= 3) {
         // outbuf[0] = k_encode_table[inbuf[0] & 0b00111111];
         outbuf[0] = k_encode_table[inbuf[0] >> 2];
@@ -59,7 +67,7 @@ void b64_encode(const uint8_t *inbuf, size_t insize, uint8_t *outbuf) {
     }
 }
 
-int b64_decode(const uint8_t *inbuf, size_t *insize, uint8_t *outbuf, size_t *outsize) {
+static int b64_decode_scalar(const uint8_t *inbuf, size_t *insize, uint8_t *outbuf, size_t *outsize) {
     const uint8_t *in_begin = inbuf;
     const uint8_t *out_begin = outbuf;
     const uint8_t *in_end = inbuf + *insize;
@@ -126,3 +134,407 @@ int b64_decode(const uint8_t *inbuf, size_t *insize, uint8_t *outbuf, size_t *ou
     *outsize = outbuf - out_begin;
     return 0;
 }
+
+// SIMD kernels
+//
+// The kernels only handle whole blocks of plain alphabet characters. Anything
+// else (padding, whitespace, a tail shorter than a block) is left to the scalar
+// code, which keeps the exact semantics of the scalar decoder.
+//
+// encode kernels return the number of input bytes consumed (a multiple of 3).
+// decode kernels return the number of input chars consumed (a multiple of 4)
+// and the number of bytes written in *produced.
+
+#ifdef B64_X86
+
+__attribute__((target("ssse3,sse4.1")))
+static inline __m128i _enc_lookup_sse(__m128i indices) {
+    const __m128i shift_lut = _mm_setr_epi8(
+        'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+        '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+        '/' - 63, 'A', 0, 0);
+    __m128i result = _mm_subs_epu8(indices, _mm_set1_epi8(51));
+    const __m128i less = _mm_cmpgt_epi8(_mm_set1_epi8(26), indices);
+    result = _mm_or_si128(result, _mm_and_si128(less, _mm_set1_epi8(13)));
+    result = _mm_shuffle_epi8(shift_lut, result);
+    return _mm_add_epi8(result, indices);
+}
+
+__attribute__((target("ssse3,sse4.1")))
+static inline __m128i _enc_split_sse(__m128i in) {
+    // 3 bytes -> 4 x 6 bits, one 32-bit lane per triplet
+    in = _mm_shuffle_epi8(in, _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+    const __m128i t0 = _mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00));
+    const __m128i t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+    const __m128i t2 = _mm_and_si128(in, _mm_set1_epi32(0x003f03f0));
+    const __m128i t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+    return _mm_or_si128(t1, t3);
+}
+
+__attribute__((target("ssse3,sse4.1")))
+static size_t _encode_sse41(const uint8_t *inbuf, size_t insize, uint8_t *outbuf) {
+    size_t consumed = 0;
+    // loads 16 bytes, uses 12
+    while (insize - consumed >= 16) {
+        __m128i in = _mm_loadu_si128((const __m128i *)(inbuf + consumed));
+        __m128i out = _enc_lookup_sse(_enc_split_sse(in));
+        _mm_storeu_si128((__m128i *)outbuf, out);
+        consumed += 12;
+        outbuf += 16;
+    }
+    return consumed;
+}
+
+__attribute__((target("ssse3,sse4.1")))
+static size_t _decode_sse41(const uint8_t *inbuf, size_t insize, uint8_t *outbuf, size_t outsize, size_t *produced) {
+    const __m128i lut_lo = _mm_setr_epi8(
+        0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+        0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a);
+    const __m128i lut_hi = _mm_setr_epi8(
+        0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+        0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+    const __m128i lut_roll = _mm_setr_epi8(
+        0, 16, 19, 4, -65, -65, -71, -71,
+        0, 0, 0, 0, 0, 0, 0, 0);
+    const __m128i mask_2f = _mm_set1_epi8(0x2f);
+
+    size_t consumed = 0;
+    size_t written = 0;
+    // writes 16 bytes, 12 of them valid
+    while (insize - consumed >= 16 && outsize - written >= 16) {
+        __m128i str = _mm_loadu_si128((const __m128i *)(inbuf + consumed));
+
+        // validate and translate ascii to 6-bit values
+        const __m128i hi_nibbles = _mm_and_si128(_mm_srli_epi32(str, 4), mask_2f);
+        const __m128i lo_nibbles = _mm_and_si128(str, mask_2f);
+        const __m128i lo = _mm_shuffle_epi8(lut_lo, lo_nibbles);
+        const __m128i hi = _mm_shuffle_epi8(lut_hi, hi_nibbles);
+        if (!_mm_testz_si128(lo, hi)) {
+            break;
+        }
+        const __m128i eq_2f = _mm_cmpeq_epi8(str, mask_2f);
+        const __m128i roll = _mm_shuffle_epi8(lut_roll, _mm_add_epi8(eq_2f, hi_nibbles));
+        str = _mm_add_epi8(str, roll);
+
+        // pack 4 x 6 bits -> 3 bytes
+        const __m128i merge_ab_bc = _mm_maddubs_epi16(str, _mm_set1_epi32(0x01400140));
+        __m128i out = _mm_madd_epi16(merge_ab_bc, _mm_set1_epi32(0x00011000));
+        out = _mm_shuffle_epi8(out, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+        _mm_storeu_si128((__m128i *)(outbuf + written), out);
+
+        consumed += 16;
+        written += 12;
+    }
+    *produced = written;
+    return consumed;
+}
+
+__attribute__((target("avx2")))
+static size_t _encode_avx2(const uint8_t *inbuf, size_t insize, uint8_t *outbuf) {
+    const __m256i shuf = _mm256_setr_epi8(
+        1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10,
+        1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10);
+    const __m256i shift_lut = _mm256_setr_epi8(
+        'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+        '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+        '/' - 63, 'A', 0, 0,
+        'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+        '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+        '/' - 63, 'A', 0, 0);
+
+    size_t consumed = 0;
+    // loads 12 + 16 bytes, uses 24
+    while (insize - consumed >= 28) {
+        const __m128i lo = _mm_loadu_si128((const __m128i *)(inbuf + consumed));
+        const __m128i hi = _mm_loadu_si128((const __m128i *)(inbuf + consumed + 12));
+        __m256i in = _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+
+        in = _mm256_shuffle_epi8(in, shuf);
+        const __m256i t0 = _mm256_and_si256(in, _mm256_set1_epi32(0x0fc0fc00));
+        const __m256i t1 = _mm256_mulhi_epu16(t0, _mm256_set1_epi32(0x04000040));
+        const __m256i t2 = _mm256_and_si256(in, _mm256_set1_epi32(0x003f03f0));
+        const __m256i t3 = _mm256_mullo_epi16(t2, _mm256_set1_epi32(0x01000010));
+        const __m256i indices = _mm256_or_si256(t1, t3);
+
+        __m256i result = _mm256_subs_epu8(indices, _mm256_set1_epi8(51));
+        const __m256i less = _mm256_cmpgt_epi8(_mm256_set1_epi8(26), indices);
+        result = _mm256_or_si256(result, _mm256_and_si256(less, _mm256_set1_epi8(13)));
+        result = _mm256_shuffle_epi8(shift_lut, result);
+        result = _mm256_add_epi8(result, indices);
+        _mm256_storeu_si256((__m256i *)outbuf, result);
+
+        consumed += 24;
+        outbuf += 32;
+    }
+    return consumed;
+}
+
+__attribute__((target("avx2")))
+static size_t _decode_avx2(const uint8_t *inbuf, size_t insize, uint8_t *outbuf, size_t outsize, size_t *produced) {
+    const __m256i lut_lo = _mm256_setr_epi8(
+        0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+        0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a,
+        0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+        0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a);
+    const __m256i lut_hi = _mm256_setr_epi8(
+        0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+        0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+        0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+        0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+    const __m256i lut_roll = _mm256_setr_epi8(
+        0, 16, 19, 4, -65, -65, -71, -71,
+        0, 0, 0, 0, 0, 0, 0, 0,
+        0, 16, 19, 4, -65, -65, -71, -71,
+        0, 0, 0, 0, 0, 0, 0, 0);
+    const __m256i mask_2f = _mm256_set1_epi8(0x2f);
+
+    size_t consumed = 0;
+    size_t written = 0;
+    // writes 32 bytes, 24 of them valid
+    while (insize - consumed >= 32 && outsize - written >= 32) {
+        __m256i str = _mm256_loadu_si256((const __m256i *)(inbuf + consumed));
+
+        const __m256i hi_nibbles = _mm256_and_si256(_mm256_srli_epi32(str, 4), mask_2f);
+        const __m256i lo_nibbles = _mm256_and_si256(str, mask_2f);
+        const __m256i lo = _mm256_shuffle_epi8(lut_lo, lo_nibbles);
+        const __m256i hi = _mm256_shuffle_epi8(lut_hi, hi_nibbles);
+        if (!_mm256_testz_si256(lo, hi)) {
+            break;
+        }
+        const __m256i eq_2f = _mm256_cmpeq_epi8(str, mask_2f);
+        const __m256i roll = _mm256_shuffle_epi8(lut_roll, _mm256_add_epi8(eq_2f, hi_nibbles));
+        str = _mm256_add_epi8(str, roll);
+
+        const __m256i merge_ab_bc = _mm256_maddubs_epi16(str, _mm256_set1_epi32(0x01400140));
+        __m256i out = _mm256_madd_epi16(merge_ab_bc, _mm256_set1_epi32(0x00011000));
+        out = _mm256_shuffle_epi8(out, _mm256_setr_epi8(
+            2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+            2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+        out = _mm256_permutevar8x32_epi32(out, _mm256_setr_epi32(0, 1, 2, 4, 5, 6, -1, -1));
+        _mm256_storeu_si256((__m256i *)(outbuf + written), out);
+
+        consumed += 32;
+        written += 24;
+    }
+    *produced = written;
+    return consumed;
+}
+
+#ifndef B64_NO_AVX512
+
+// gcc warns about _mm512_undefined_epi32() inside the vbmi intrinsics
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+
+// ascii -> 6-bit value, 0x80 for everything that is not plain alphabet
+static uint8_t g_avx512_decode_lut[128] __attribute__((aligned(64)));
+
+__attribute__((target("avx512f,avx512bw,avx512vbmi")))
+static size_t _encode_avx512vbmi(const uint8_t *inbuf, size_t insize, uint8_t *outbuf) {
+    const __m512i shuffle_input = _mm512_setr_epi32(
+        0x01020001, 0x04050304, 0x07080607, 0x0a0b090a,
+        0x0d0e0c0d, 0x10110f10, 0x13141213, 0x16171516,
+        0x191a1819, 0x1c1d1b1c, 0x1f201e1f, 0x22232122,
+        0x25262425, 0x28292728, 0x2b2c2a2b, 0x2e2f2d2e);
+    const __m512i shifts = _mm512_set1_epi64(0x3036242a1016040aLL);
+    const __m512i lookup = _mm512_loadu_si512((const void *)k_encode_table);
+
+    size_t consumed = 0;
+    // loads 64 bytes, uses 48
+    while (insize - consumed >= 64) {
+        const __m512i v = _mm512_loadu_si512((const void *)(inbuf + consumed));
+        const __m512i in = _mm512_permutexvar_epi8(shuffle_input, v);
+        const __m512i indices = _mm512_multishift_epi64_epi8(shifts, in);
+        const __m512i result = _mm512_permutexvar_epi8(indices, lookup);
+        _mm512_storeu_si512((void *)outbuf, result);
+
+        consumed += 48;
+        outbuf += 64;
+    }
+    return consumed;
+}
+
+__attribute__((target("avx512f,avx512bw,avx512vbmi")))
+static size_t _decode_avx512vbmi(const uint8_t *inbuf, size_t insize, uint8_t *outbuf, size_t outsize, size_t *produced) {
+    const __m512i lookup_0 = _mm512_load_si512((const void *)&g_avx512_decode_lut[0]);
+    const __m512i lookup_1 = _mm512_load_si512((const void *)&g_avx512_decode_lut[64]);
+    const __m512i pack = _mm512_setr_epi32(
+        0x06000102, 0x090a0405, 0x0c0d0e08, 0x16101112,
+        0x191a1415, 0x1c1d1e18, 0x26202122, 0x292a2425,
+        0x2c2d2e28, 0x36303132, 0x393a3435, 0x3c3d3e38,
+        0, 0, 0, 0);
+
+    size_t consumed = 0;
+    size_t written = 0;
+    // writes 64 bytes, 48 of them valid
+    while (insize - consumed >= 64 && outsize - written >= 64) {
+        const __m512i input = _mm512_loadu_si512((const void *)(inbuf + consumed));
+        const __m512i translated = _mm512_permutex2var_epi8(lookup_0, input, lookup_1);
+        if (_mm512_movepi8_mask(_mm512_or_si512(translated, input)) != 0) {
+            break;
+        }
+
+        const __m512i merge_ab_bc = _mm512_maddubs_epi16(translated, _mm512_set1_epi32(0x01400140));
+        const __m512i merged = _mm512_madd_epi16(merge_ab_bc, _mm512_set1_epi32(0x00011000));
+        const __m512i out = _mm512_permutexvar_epi8(pack, merged);
+        _mm512_storeu_si512((void *)(outbuf + written), out);
+
+        consumed += 64;
+        written += 48;
+    }
+    *produced = written;
+    return consumed;
+}
+
+#pragma GCC diagnostic pop
+
+#endif  // B64_NO_AVX512
+#endif  // B64_X86
+
+
+// dispatch
+
+struct B64Impl {
+    const char *name;
+    // NULL for scalar only
+    size_t (*encode)(const uint8_t *inbuf, size_t insize, uint8_t *outbuf);
+    size_t (*decode)(const uint8_t *inbuf, size_t insize, uint8_t *outbuf, size_t outsize, size_t *produced);
+    int (*supported)(void);
+};
+
+static int _always(void) {
+    return 1;
+}
+
+#ifdef B64_X86
+static int _has_sse41(void) {
+    return __builtin_cpu_supports("ssse3") && __builtin_cpu_supports("sse4.1");
+}
+
+static int _has_avx2(void) {
+    return __builtin_cpu_supports("avx2");
+}
+
+#ifndef B64_NO_AVX512
+static int _has_avx512vbmi(void) {
+    return __builtin_cpu_supports("avx512f")
+        && __builtin_cpu_supports("avx512bw")
+        && __builtin_cpu_supports("avx512vbmi");
+}
+#endif
+#endif  // B64_X86
+
+// ordered from slowest to fastest
+static const struct B64Impl k_impls[] = {
+    {"scalar", NULL, NULL, &_always},
+#ifdef B64_X86
+    {"sse4.1", &_encode_sse41, &_decode_sse41, &_has_sse41},
+    {"avx2", &_encode_avx2, &_decode_avx2, &_has_avx2},
+#ifndef B64_NO_AVX512
+    {"avx512vbmi", &_encode_avx512vbmi, &_decode_avx512vbmi, &_has_avx512vbmi},
+#endif
+#endif
+};
+
+static const size_t k_impl_count = sizeof(k_impls) / sizeof(k_impls[0]);
+
+static const struct B64Impl *g_impl = &k_impls[0];
+
+// pick the fastest supported kernel once at startup, PTY_PROXY_BASE64 overrides it
+__attribute__((constructor))
+static void b64_init(void) {
+#ifdef B64_X86
+    __builtin_cpu_init();
+#ifndef B64_NO_AVX512
+    for (size_t i = 0; i < 128; ++i) {
+        uint8_t v = k_decode_table[i];
+        g_avx512_decode_lut[i] = v < 64 ? v : 0x80;
+    }
+#endif
+#endif
+
+    for (size_t i = k_impl_count; i > 0; --i) {
+        if (k_impls[i - 1].supported()) {
+            g_impl = &k_impls[i - 1];
+            break;
+        }
+    }
+
+    const char *val = getenv("PTY_PROXY_BASE64");
+    if (val && *val) {
+        (void)b64_select(val);
+    }
+}
+
+const char *b64_impl_name(void) {
+    return g_impl->name;
+}
+
+int b64_select(const char *name) {
+    for (size_t i = 0; i < k_impl_count; ++i) {
+        if (0 == strcmp(name, k_impls[i].name)) {
+            if (!k_impls[i].supported()) {
+                return -1;
+            }
+            g_impl = &k_impls[i];
+            return 0;
+        }
+    }
+    return -1;
+}
+
+void b64_encode(const uint8_t *inbuf, size_t insize, uint8_t *outbuf) {
+    size_t consumed = 0;
+    if (g_impl->encode) {
+        consumed = g_impl->encode(inbuf, insize, outbuf);
+    }
+    b64_encode_scalar(inbuf + consumed, insize - consumed, outbuf + consumed / 3 * 4);
+}
+
+int b64_decode(const uint8_t *inbuf, size_t *insize, uint8_t *outbuf, size_t *outsize) {
+    if (!g_impl->decode) {
+        return b64_decode_scalar(inbuf, insize, outbuf, outsize);
+    }
+
+    // the scalar code steps over what the kernel can not handle, a window at a time
+    const size_t k_scalar_window = 64;
+    const uint8_t *in = inbuf;
+    const uint8_t *in_end = inbuf + *insize;
+    uint8_t *out = outbuf;
+    uint8_t *out_end = outbuf + *outsize;
+    while (in < in_end) {
+        size_t produced = 0;
+        in += g_impl->decode(in, in_end - in, out, out_end - out, &produced);
+        out += produced;
+
+        size_t remain = in_end - in;
+        size_t win = remain < k_scalar_window ? remain : k_scalar_window;
+        size_t n_in = win;
+        size_t n_out = out_end - out;
+        if (0 != b64_decode_scalar(in, &n_in, out, &n_out)) {
+            return -1;
+        }
+        in += n_in;
+        out += n_out;
+
+        if (win == remain) {
+            // scalar did the tail
+            break;
+        }
+        if (n_in == 0) {
+            // no complete quad in the window (output full or sparse input)
+            n_in = in_end - in;
+            n_out = out_end - out;
+            if (0 != b64_decode_scalar(in, &n_in, out, &n_out)) {
+                return -1;
+            }
+            in += n_in;
+            out += n_out;
+            break;
+        }
+    }
+
+    *insize = in - inbuf;
+    *outsize = out - outbuf;
+    return 0;
+}
@@ -16,3 +16,9 @@ __EXTERN_C inline size_t b64_encoded_size(size_t insize) {
 
 __EXTERN_C void b64_encode(const uint8_t *inbuf, size_t insize, uint8_t *outbuf);
 __EXTERN_C int b64_decode(const uint8_t *inbuf, size_t *insize, uint8_t *outbuf, size_t *outsize);
+
+// SIMD kernels are picked once at startup by checking the CPU,
+// PTY_PROXY_BASE64=scalar|sse4.1|avx2|avx512vbmi overrides the choice.
+__EXTERN_C const char *b64_impl_name(void);
+// returns -1 if the kernel is unknown or not supported by this CPU
+__EXTERN_C int b64_select(const char *name);
@@ -0,0 +1,971 @@
+// End-to-end benchmark: runs pty_proxy_master with pty_proxy_slave behind
+// it, the way a user would, and measures what goes through them.
+//
+//     pty_proxy_bench [--size=MB] [--rounds=N] [--corpus=FILE]...
+//                     [--master=ARG]... [--slave=ARG]... [--micro]
+//
+// Bulk: the slave cats each corpus, reports MB/s of the master's output,
+// and per MB: CPU time, read/write syscalls and context switches of the
+// master and the slave. Echo: single keystrokes through `cat`, reports the
+// round trip percentiles. Every mode is run in tty and --no-tty, with and
+// without --base64, and with the slave's --epoll and --uring engines. I/O
+// done through io_uring is not in rw/MB, compare cpu ms/MB instead.
+//
+// Memory: the slave's peak RSS (VmHWM) once the session is up and after the
+// binary corpus went through, --no-tty with and without --low-mem. The
+// difference is what the session costs; --low-mem must keep it under
+// k_low_mem_budget_kb.
+//
+// Framing: the protocol alone, in-process over a pipe with pty sized
+// writes, reports MB/s, the bytes copied (memmove) per MB delivered and the
+// wire bytes per byte delivered.
+//
+// Codec: each codec's loops alone, for keystroke (1 byte) and bulk frames.
+// Frames are batched into a memfd, then parsed back from memory through
+// read_cb, so few syscalls are left in either number. Reports ns per frame
+// both ways and MB/s parsed. --micro runs only framing and codec.
+//
+// The built-in corpora are generated from a fixed seed, so they are the
+// same bytes on every run and every version; --corpus adds recorded ones
+// (e.g. a `script` typescript).
+
+// system
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <pthread.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+// proj
+#include "protocol.h"
+#include "pty.h"
+#include "util.h"
+
+
+using namespace std;
+
+
+// no single wait may take longer than this
+const int k_timeout_ms = 30000;
+// what the slave's --low-mem promises a --no-tty session
+const long k_low_mem_budget_kb = 1024;
+
+struct Opts {
+    size_t size = 16 << 20;
+    size_t rounds = 2000;
+    vector<string> corpora;
+    vector<string> master_args;
+    vector<string> slave_args;
+    int micro = 0;
+};
+
+struct Mode {
+    const char *name;
+    int tty;
+    int base64;
+    const char *engine;         // of the slave, NULL: threads
+};
+
+struct Framing {
+    const char *name;
+    int base64;
+    int escape;                 // the default set
+    uint32_t flags;             // of the hello
+};
+
+// resources of the proxy processes, the workload (cat) is not counted
+struct Usage {
+    double cpu_s = 0;
+    uint64_t syscalls = 0;      // read and write family
+    uint64_t csw = 0;           // voluntary and involuntary
+};
+
+struct Proc {
+    pid_t pid = -1;
+    int in_fd = -1;
+    int out_fd = -1;
+};
+
+
+// xorshift, the corpora must not depend on the libc
+struct Rng {
+    uint64_t s = 0x9e3779b97f4a7c15ull;
+    uint32_t next() {
+        s ^= s << 13;
+        s ^= s >> 7;
+        s ^= s << 17;
+        return (uint32_t)(s >> 11);
+    }
+    uint32_t below(uint32_t n) {
+        return next() % n;
+    }
+};
+
+static void appendf(string &s, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+static void appendf(string &s, const char *fmt, ...) {
+    char buf[512];
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    s.append(buf, n < (int)sizeof(buf) ? (size_t)n : sizeof(buf) - 1);
+}
+
+// a parallel build: mostly repeated lines, some colored diagnostics
+static string gen_compiler(size_t size) {
+    static const char *dirs[] = {"src/core", "src/net", "src/ui/widgets", "third_party/zlib", "tests/unit"};
+    static const char *names[] = {"buffer", "parser", "socket", "render", "inflate", "scheduler", "config"};
+    Rng rng;
+    string s;
+    while (s.size() < size) {
+        const char *dir = dirs[rng.below(5)];
+        const char *name = names[rng.below(7)];
+        uint32_t pct = rng.below(100);
+        uint32_t kind = rng.below(20);
+        if (kind == 0) {
+            uint32_t line = 1 + rng.below(2000);
+            appendf(s, "\x1b[1m%s/%s.cpp:%u:%u:\x1b[0m \x1b[1;35mwarning:\x1b[0m unused variable '\x1b[1mtmp%u\x1b[0m' [\x1b[1;35m-Wunused-variable\x1b[0m]\n",
+                dir, name, line, 1 + rng.below(80), rng.below(100));
+            appendf(s, "  %u |     int tmp%u = compute(%u);\n      |         \x1b[1;35m^~~~\x1b[0m\n", line, rng.below(100), rng.below(1000));
+        } else if (kind == 1) {
+            appendf(s, "[%3u%%] \x1b[32m\x1b[1mLinking CXX static library lib%s.a\x1b[0m\n", pct, name);
+        } else {
+            appendf(s, "[%3u%%] \x1b[32mBuilding CXX object %s/CMakeFiles/%s.dir/%s.cpp.o\x1b[0m\n", pct, dir, name, name);
+        }
+    }
+    s.resize(size);
+    return s;
+}
+
+// an editor scrolling through a file: full redraws with syntax colors and a
+// status line, each screen mostly differs from the last
+static string gen_vim(size_t size) {
+    static const char *words[] = {"if", "return", "static", "int", "const", "for", "while", "size_t", "buf", "len", "err"};
+    Rng rng;
+    string s = "\x1b[?1049h\x1b[?1h\x1b=\x1b[H\x1b[2J";
+    for (uint32_t top = 1; s.size() < size; top += 1 + rng.below(30)) {
+        s += "\x1b[?25l\x1b[H";
+        for (int row = 0; row < 47; ++row) {
+            appendf(s, "\x1b[33m%4u \x1b[m", top + row);
+            int indent = (int)rng.below(4) * 4;
+            s.append((size_t)indent, ' ');
+            for (uint32_t w = rng.below(9); w > 0; --w) {
+                uint32_t k = rng.below(11);
+                if (k < 6) {
+                    appendf(s, "\x1b[38;5;%um%s\x1b[m ", 100 + k * 11, words[k]);
+                } else {
+                    appendf(s, "%s ", words[k]);
+                }
+            }
+            s += "\x1b[K\r\n";
+        }
+        appendf(s, "\x1b[7m main.c [+]%*s%u,%u        %u%% \x1b[m", 120, "", top + 10, 1 + rng.below(60), top % 100);
+        appendf(s, "\x1b[%u;%uH\x1b[?25h", 1 + rng.below(47), 6 + rng.below(60));
+    }
+    s.resize(size);
+    return s;
+}
+
+// top: the same table redrawn in place, a few numbers change each time
+static string gen_top(size_t size) {
+    static const char *cmds[] = {"postgres", "nginx", "java", "python3", "kworker/2:1", "systemd", "sshd", "node"};
+    Rng rng;
+    string s;
+    while (s.size() < size) {
+        s += "\x1b[H";
+        appendf(s, "top - 12:%02u:%02u up 41 days,  3:07,  2 users,  load average: %u.%02u, %u.%02u, %u.%02u\x1b[K\r\n",
+            rng.below(60), rng.below(60), rng.below(8), rng.below(100), rng.below(8), rng.below(100), rng.below(8), rng.below(100));
+        appendf(s, "Tasks: %u total,   %u running, %u sleeping,   0 stopped,   0 zombie\x1b[K\r\n", 300 + rng.below(20), 1 + rng.below(5), 290 + rng.below(20));
+        appendf(s, "%%Cpu(s): %2u.%u us,  %u.%u sy,  0.0 ni, %2u.%u id,  0.1 wa,  0.0 hi,  0.2 si,  0.0 st\x1b[K\r\n",
+            rng.below(40), rng.below(10), rng.below(10), rng.below(10), 50 + rng.below(40), rng.below(10));
+        s += "\x1b[K\r\n\x1b[7m    PID USER      PR  NI    VIRT    RES    SHR S  %CPU  %MEM     TIME+ COMMAND    \x1b[m\x1b[K\r\n";
+        for (uint32_t i = 0; i < 40; ++i) {
+            appendf(s, "%7u %-8s  20   0 %7u %6u %6u %c %5u.%u %5u.%u %4u:%02u.%02u %s\x1b[K\r\n",
+                1000 + i * 37, i % 3 ? "app" : "root", 100000 + rng.below(900000), 10000 + rng.below(90000), 5000 + rng.below(9000),
+                rng.below(8) ? 'S' : 'R', rng.below(30), rng.below(10), rng.below(5), rng.below(10),
+                rng.below(500), rng.below(60), rng.below(100), cmds[i % 8]);
+        }
+        s += "\x1b[J";
+    }
+    s.resize(size);
+    return s;
+}
+
+// `cat` of a binary
+static string gen_binary(size_t size) {
+    Rng rng;
+    string s(size, '\0');
+    for (size_t i = 0; i < size; ++i) {
+        s[i] = (char)rng.next();
+    }
+    return s;
+}
+
+static int read_file(const string &path, string &data) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        log_err(errno, "open(%s)", path.c_str());
+        return -1;
+    }
+    char buf[1 << 16];
+    ssize_t n = 0;
+    while ((n = TEMP_FAILURE_RETRY(read(fd, buf, sizeof(buf)))) > 0) {
+        data.append(buf, (size_t)n);
+    }
+    (void)close(fd);
+    if (n < 0) {
+        log_err(errno, "read(%s)", path.c_str());
+        return -1;
+    }
+    return 0;
+}
+
+static int write_file(const string &path, const string &data) {
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        log_err(errno, "open(%s)", path.c_str());
+        return -1;
+    }
+    ssize_t n = write(fd, data.data(), data.size());
+    (void)close(fd);
+    if (n != (ssize_t)data.size()) {
+        log_err(errno, "write(%s)", path.c_str());
+        return -1;
+    }
+    return 0;
+}
+
+// master [args] -- slave [args] cmd...
+static vector<string> proxy_argv(const Opts &opts, const Mode &mode, const vector<string> &cmd) {
+    vector<string> argv = {"./pty_proxy_master"};
+    argv.insert(argv.end(), opts.master_args.begin(), opts.master_args.end());
+    vector<string> common;
+    if (!mode.tty) {
+        common.push_back("--no-tty");
+    }
+    if (mode.base64) {
+        common.push_back("--base64");
+    }
+    argv.insert(argv.end(), common.begin(), common.end());
+    argv.push_back("--");
+    argv.push_back("./pty_proxy_slave");
+    argv.insert(argv.end(), opts.slave_args.begin(), opts.slave_args.end());
+    if (mode.engine) {
+        argv.push_back(mode.engine);
+    }
+    argv.insert(argv.end(), common.begin(), common.end());
+    argv.insert(argv.end(), cmd.begin(), cmd.end());
+    return argv;
+}
+
+static void exec_argv(const vector<string> &args) {
+    vector<char *> argv;
+    for (const string &a : args) {
+        argv.push_back((char *)a.c_str());
+    }
+    argv.push_back(NULL);
+    (void)execvp(argv[0], argv.data());
+    log_err(errno, "execvp(%s)", argv[0]);
+    _exit(127);
+}
+
+// in tty mode the master gets a pty of its own, otherwise pipes
+static int spawn(const Opts &opts, const Mode &mode, const vector<string> &cmd, Proc &p) {
+    vector<string> argv = proxy_argv(opts, mode, cmd);
+    if (mode.tty) {
+        struct winsize ws = {};
+        ws.ws_row = 50;
+        ws.ws_col = 200;
+        int err = pty_fork(p.pid, p.in_fd, NULL, &ws);
+        if (err) {
+            log_err(err, "pty_fork()");
+            if (p.pid == 0) {
+                _exit(127);
+            }
+            return -1;
+        }
+        if (p.pid == 0) {
+            exec_argv(argv);
+        }
+        // Raw before anything is typed, through the master side so the child
+        // cannot be late: a local echo would pass for the remote one while
+        // the master is starting, and what was typed by then is flushed when
+        // it switches the tty to raw.
+        struct termios t = {};
+        if (0 == tcgetattr(p.in_fd, &t)) {
+            cfmakeraw(&t);
+            (void)tcsetattr(p.in_fd, TCSANOW, &t);
+        }
+        p.out_fd = p.in_fd;
+        return 0;
+    }
+
+    int in[2];
+    int out[2];
+    if (0 != pipe2(in, O_CLOEXEC) || 0 != pipe2(out, O_CLOEXEC)) {
+        log_err(errno, "pipe()");
+        return -1;
+    }
+    p.pid = fork();
+    if (p.pid < 0) {
+        log_err(errno, "fork()");
+        return -1;
+    }
+    if (p.pid == 0) {
+        (void)dup2(in[0], STDIN_FILENO);
+        (void)dup2(out[1], STDOUT_FILENO);
+        exec_argv(argv);
+    }
+    (void)close(in[0]);
+    (void)close(out[1]);
+    p.in_fd = in[1];
+    p.out_fd = out[0];
+    return 0;
+}
+
+static void read_proc_io(pid_t pid, Usage &u) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/io", (int)pid);
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        return;
+    }
+    char key[32];
+    unsigned long long v = 0;
+    while (2 == fscanf(f, "%31[^:]: %llu\n", key, &v)) {
+        if (0 == strcmp(key, "syscr") || 0 == strcmp(key, "syscw")) {
+            u.syscalls += v;
+        }
+    }
+    (void)fclose(f);
+}
+
+static int is_proxy(pid_t pid) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/comm", (int)pid);
+    char comm[64] = {};
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        return 0;
+    }
+    int ok = fgets(comm, sizeof(comm), f) != NULL;
+    (void)fclose(f);
+    return ok && 0 == strncmp(comm, "pty_proxy_", 10);
+}
+
+// Waits for the master and everything it started, we are their subreaper.
+// Exited processes are looked at before they are reaped. Returns the
+// master's status, the slave may be hung up on in tty mode.
+static int reap(pid_t master, Usage &u) {
+    int status = 0;
+    while (1) {
+        siginfo_t si = {};
+        if (0 != waitid(P_ALL, 0, &si, WEXITED | WNOWAIT)) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != ECHILD) {
+                log_err(errno, "waitid()");
+            }
+            break;
+        }
+        pid_t pid = si.si_pid;
+        int proxy = is_proxy(pid);
+        if (proxy) {
+            read_proc_io(pid, u);
+        }
+        struct rusage ru = {};
+        int st = 0;
+        if (wait4(pid, &st, 0, &ru) < 0) {
+            log_err(errno, "wait4()");
+            break;
+        }
+        if (proxy) {
+            u.cpu_s += ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 + ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+            u.csw += (uint64_t)(ru.ru_nvcsw + ru.ru_nivcsw);
+        }
+        if (pid == master) {
+            status = st;
+        }
+    }
+    return status;
+}
+
+// -1: error or timeout, 0: eof
+static ssize_t read_wait(int fd, void *buf, size_t len) {
+    struct pollfd pfd = {fd, POLLIN, 0};
+    int n = TEMP_FAILURE_RETRY(poll(&pfd, 1, k_timeout_ms));
+    if (n <= 0) {
+        log_err(n == 0 ? ETIMEDOUT : errno, "poll()");
+        return -1;
+    }
+    ssize_t nread = TEMP_FAILURE_RETRY(read(fd, buf, len));
+    if (nread < 0 && errno == EIO) {
+        // the pty closed
+        return 0;
+    }
+    return nread;
+}
+
+static void close_proc(Proc &p) {
+    if (p.in_fd >= 0) {
+        (void)close(p.in_fd);
+    }
+    if (p.out_fd >= 0 && p.out_fd != p.in_fd) {
+        (void)close(p.out_fd);
+    }
+    p = Proc();
+}
+
+static int bench_bulk(const Opts &opts, const Mode &mode, const string &name, const string &path) {
+    Proc p;
+    if (0 != spawn(opts, mode, {"cat", path}, p)) {
+        return -1;
+    }
+    if (!mode.tty) {
+        // nothing to send
+        (void)close(p.in_fd);
+        p.in_fd = -1;
+    }
+
+    static char buf[1 << 20];
+    size_t total = 0;
+    uint64_t start = 0;
+    int err = 0;
+    while (1) {
+        ssize_t n = read_wait(p.out_fd, buf, sizeof(buf));
+        if (n < 0) {
+            err = -1;
+            (void)kill(p.pid, SIGKILL);
+            break;
+        }
+        if (n == 0) {
+            break;
+        }
+        if (total == 0) {
+            start = monotonic_us();
+        }
+        total += (size_t)n;
+    }
+    uint64_t elapsed = monotonic_us() - start;
+    pid_t pid = p.pid;
+    close_proc(p);
+
+    Usage u;
+    if (0 != reap(pid, u) || err) {
+        log_err(0, "[bench_bulk] %s %s failed", mode.name, name.c_str());
+        return -1;
+    }
+    double mb = total / 1048576.0;
+    printf("%-12s %-10s %9.1f %9.2f %9.0f %9.0f\n",
+        mode.name, name.c_str(), elapsed ? mb / (elapsed / 1e6) : 0.0,
+        u.cpu_s * 1000 / mb, u.syscalls / mb, u.csw / mb);
+    fflush(stdout);
+    return 0;
+}
+
+// the master's child, -1 if it is not there (yet)
+static pid_t find_slave(pid_t master) {
+    DIR *dir = opendir("/proc");
+    if (!dir) {
+        return -1;
+    }
+    pid_t slave = -1;
+    while (struct dirent *e = readdir(dir)) {
+        pid_t pid = (pid_t)atoi(e->d_name);
+        char path[64];
+        snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+        FILE *f = pid > 0 ? fopen(path, "r") : NULL;
+        if (!f) {
+            continue;
+        }
+        char comm[64] = {};
+        int ppid = 0;
+        if (2 == fscanf(f, "%*d (%63[^)]) %*c %d", comm, &ppid) && ppid == (int)master
+            && 0 == strcmp(comm, "pty_proxy_slave"))
+        {
+            slave = pid;
+        }
+        (void)fclose(f);
+    }
+    (void)closedir(dir);
+    return slave;
+}
+
+// kB, from /proc/PID/status
+static long proc_status(pid_t pid, const char *key) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        return -1;
+    }
+    char line[256];
+    long kb = -1;
+    size_t key_len = strlen(key);
+    while (fgets(line, sizeof(line), f)) {
+        if (0 == strncmp(line, key, key_len) && line[key_len] == ':') {
+            kb = atol(&line[key_len + 1]);
+            break;
+        }
+    }
+    (void)fclose(f);
+    return kb;
+}
+
+// reads until the corpus is through, or eof with total == 0
+static int read_n(const Proc &p, size_t total) {
+    static char buf[1 << 20];
+    for (size_t got = 0; got < total || total == 0; ) {
+        ssize_t n = read_wait(p.out_fd, buf, sizeof(buf));
+        if (n <= 0) {
+            return n < 0 || total ? -1 : 0;
+        }
+        got += (size_t)n;
+    }
+    return 0;
+}
+
+// The command waits for a line before and after the corpus, the slave's
+// VmHWM is read at both points: the process' own and with the session's.
+static int bench_mem(const Opts &opts, const Mode &mode, const string &name, const string &path) {
+    Proc p;
+    const vector<string> cmd = {"--", "sh", "-c", "echo; read x; cat \"$0\"; read x", path};
+    if (0 != spawn(opts, mode, cmd, p)) {
+        return -1;
+    }
+    long idle = -1;
+    long peak = -1;
+    pid_t slave = -1;
+    struct stat st = {};
+    int err = stat(path.c_str(), &st) || read_n(p, 1) || (slave = find_slave(p.pid)) < 0;
+    if (!err) {
+        idle = proc_status(slave, "VmHWM");
+        err = write(p.in_fd, "\n", 1) != 1 || read_n(p, (size_t)st.st_size);
+    }
+    if (!err) {
+        peak = proc_status(slave, "VmHWM");
+        err = write(p.in_fd, "\n", 1) != 1;
+    }
+    (void)close(p.in_fd);
+    p.in_fd = -1;
+    err = err || read_n(p, 0);
+    if (err) {
+        (void)kill(p.pid, SIGKILL);
+    }
+    pid_t pid = p.pid;
+    close_proc(p);
+
+    Usage u;
+    if (0 != reap(pid, u) || err || idle < 0 || peak < 0) {
+        log_err(0, "[bench_mem] %s %s failed", mode.name, name.c_str());
+        return -1;
+    }
+    printf("%-12s %-10s %9ld %9ld %9ld\n", mode.name, name.c_str(), idle, peak, peak - idle);
+    fflush(stdout);
+    if (mode.engine && !strcmp(mode.engine, "--low-mem") && peak - idle >= k_low_mem_budget_kb) {
+        log_err(0, "[bench_mem] %s: the session takes %ld kB, over %ld kB", mode.name, peak - idle, k_low_mem_budget_kb);
+        return -1;
+    }
+    return 0;
+}
+
+// one byte in, the same byte echoed back
+static int echo_once(const Proc &p, int timeout_ms, uint64_t &rtt) {
+    uint64_t t0 = monotonic_us();
+    if (write(p.in_fd, "x", 1) != 1) {
+        log_err(errno, "write(x)");
+        return -1;
+    }
+    char c = 0;
+    do {
+        struct pollfd pfd = {p.out_fd, POLLIN, 0};
+        int n = TEMP_FAILURE_RETRY(poll(&pfd, 1, timeout_ms));
+        if (n <= 0) {
+            return n == 0 ? 1 : -1;
+        }
+        if (TEMP_FAILURE_RETRY(read(p.out_fd, &c, 1)) != 1) {
+            return -1;
+        }
+    } while (c != 'x');
+    rtt = monotonic_us() - t0;
+    return 0;
+}
+
+static int bench_echo(const Opts &opts, const Mode &mode) {
+    Proc p;
+    if (0 != spawn(opts, mode, {"cat"}, p)) {
+        return -1;
+    }
+
+    // until the session is up
+    uint64_t rtt = 0;
+    int ret = 1;
+    for (int i = 0; i < k_timeout_ms / 100 && ret == 1; ++i) {
+        ret = echo_once(p, 100, rtt);
+    }
+    vector<uint64_t> rtts;
+    for (size_t i = 0; i < 100 + opts.rounds && ret == 0; ++i) {
+        // a tty line holds 4095 bytes, the ^U is echoed as backspaces
+        if (mode.tty && i % 1024 == 1023) {
+            (void)write(p.in_fd, "\x15", 1);
+        }
+        ret = echo_once(p, k_timeout_ms, rtt);
+        if (i >= 100) {
+            rtts.push_back(rtt);
+        }
+    }
+
+    // the first ^D sends what is left on the tty line, the second is the eof
+    if (mode.tty) {
+        (void)write(p.in_fd, "\x04\x04", 2);
+    } else {
+        (void)close(p.in_fd);
+        p.in_fd = -1;
+    }
+    char buf[4096];
+    ssize_t n = 0;
+    while ((n = read_wait(p.out_fd, buf, sizeof(buf))) > 0) {}
+    if (n < 0) {
+        (void)kill(p.pid, SIGKILL);
+    }
+    pid_t pid = p.pid;
+    close_proc(p);
+    Usage u;
+    int status = reap(pid, u);
+    if (ret != 0 || n < 0 || status != 0) {
+        log_err(0, "[bench_echo] %s failed", mode.name);
+        return -1;
+    }
+
+    sort(rtts.begin(), rtts.end());
+    auto pct = [&](double q) {
+        size_t i = (size_t)(q * rtts.size());
+        return rtts[i < rtts.size() ? i : rtts.size() - 1];
+    };
+    printf("%-12s %9llu %9llu %9llu %9llu\n", mode.name,
+        (unsigned long long)pct(0.5), (unsigned long long)pct(0.99),
+        (unsigned long long)pct(0.999), (unsigned long long)rtts.back());
+    fflush(stdout);
+    return 0;
+}
+
+struct FrameWriter {
+    Stream *s;
+    const string *data;
+    uint32_t flags;
+    int err;
+};
+
+// what the slave does with the output of its pty
+static void *frame_writer(void *user) {
+    FrameWriter &w = *(FrameWriter *)user;
+    Hello h;
+    h.version = PROTO_V2;
+    h.flags = w.flags;
+    h.max_frame = MAX_PAYLOAD_V2;
+    w.err = send_hello(w.s, h, MAX_PAYLOAD_V2);
+    vector<char> buf(FRAME_HEADROOM + k_io_buf_size);
+    Rng rng;
+    for (size_t pos = 0; pos < w.data->size() && !w.err; ) {
+        size_t n = min((size_t)1 + rng.below(k_io_buf_size), w.data->size() - pos);
+        for (size_t off = 0; off < n && !w.err; ) {
+            size_t len = min(n - off, stream_max_payload(w.s));
+            memcpy(&buf[FRAME_HEADROOM], w.data->data() + pos + off, len);
+            w.err = send_payload(w.s, CMD_DATA, &buf[FRAME_HEADROOM], len);
+            off += len;
+        }
+        pos += n;
+    }
+    w.err |= send_eof(w.s);
+    (void)close(w.s->wfd);
+    return NULL;
+}
+
+static int count_data(Parser &p, void *user) {
+    if (p.cmd == CMD_DATA) {
+        *(size_t *)user += p.size;
+    }
+    return 0;
+}
+
+static int bench_framing(const Framing &f, const string &name, const string &data) {
+    int fds[2];
+    if (0 != pipe2(fds, O_CLOEXEC)) {
+        log_err(errno, "pipe()");
+        return -1;
+    }
+    Stream *ws = new Stream;
+    Stream *rs = new Stream;
+    stream_reset(ws, -1, fds[1]);
+    stream_reset(rs, fds[0], -1);
+    EscapeSet escape;
+    esc_set_default(&escape);
+    stream_set_codec(ws, f.base64, f.escape ? &escape : NULL);
+    stream_set_codec(rs, f.base64, f.escape ? &escape : NULL);
+
+    uint64_t start = monotonic_us();
+    FrameWriter w = {ws, &data, f.flags, 0};
+    pthread_t thread_id;
+    int err = pthread_create(&thread_id, NULL, &frame_writer, &w);
+    if (err) {
+        log_err(err, "pthread_create()");
+        return -1;
+    }
+    Parser p;
+    size_t total = 0;
+    while (!p.eof && 0 == (err = feed_frame(p, rs, count_data, &total))) {}
+    (void)pthread_join(thread_id, NULL);
+    uint64_t elapsed = monotonic_us() - start;
+    (void)close(fds[0]);
+
+    double mb = total / 1048576.0;
+    uint64_t copied = rs->stats.rx.moved + ws->stats.tx.moved;
+    uint64_t wire = ws->stats.tx.wire_bytes;
+    delete ws;
+    delete rs;
+    if (err || w.err || total != data.size()) {
+        log_err(0, "[bench_framing] %s %s failed", f.name, name.c_str());
+        return -1;
+    }
+    printf("%-12s %-10s %9.1f %9.0f %9.3f\n", f.name, name.c_str(), elapsed ? mb / (elapsed / 1e6) : 0.0, copied / mb,
+        total ? (double)wire / total : 0.0);
+    fflush(stdout);
+    return 0;
+}
+
+// the wire the codec run parses, handed out as the fd would
+struct MemWire {
+    const uint8_t *data;
+    size_t len;
+    size_t pos;
+};
+
+static ssize_t mem_read(void *user, void *buf, size_t len) {
+    MemWire &m = *(MemWire *)user;
+    size_t n = min(len, m.len - m.pos);
+    memcpy(buf, m.data + m.pos, n);
+    m.pos += n;
+    return (ssize_t)n;
+}
+
+static int bench_codec(const Framing &f, const char *name, size_t frame_size, size_t count) {
+    int fd = memfd_create("pty_proxy_bench", MFD_CLOEXEC);
+    if (fd < 0) {
+        log_err(errno, "memfd_create()");
+        return -1;
+    }
+    EscapeSet escape;
+    esc_set_default(&escape);
+    Stream *ws = new Stream;
+    Stream *rs = new Stream;
+    stream_reset(ws, -1, fd);
+    stream_set_codec(ws, f.base64, f.escape ? &escape : NULL);
+    stream_set_codec(rs, f.base64, f.escape ? &escape : NULL);
+    Hello h;
+    h.version = PROTO_V2;
+    h.max_frame = MAX_PAYLOAD_V2;
+    int err = send_hello(ws, h, MAX_PAYLOAD_V2);
+
+    // as the slave with --coalesce, flushed when full
+    Batch *b = new Batch;
+    b->deadline_us = 1000000;
+    Rng rng;
+    uint64_t start = monotonic_us();
+    for (size_t i = 0; i < count && !err; ++i) {
+        size_t avail = 0;
+        char *buf = batch_reserve(*b, ws, &avail);
+        if (!buf || avail < frame_size) {
+            err = batch_flush(*b, ws, &b->stats->flush_size);
+            buf = batch_reserve(*b, ws, &avail);
+        }
+        memset(buf, ' ' + rng.below(95), frame_size);
+        err |= batch_commit(*b, ws, CMD_DATA, frame_size, 0);
+    }
+    err |= batch_flush(*b, ws, &b->stats->flush_other);
+    uint64_t encode_us = monotonic_us() - start;
+    delete b;
+
+    size_t wire_len = (size_t)lseek(fd, 0, SEEK_END);
+    void *wire = wire_len ? mmap(NULL, wire_len, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0) : MAP_FAILED;
+    (void)close(fd);
+    if (wire == MAP_FAILED) {
+        log_err(errno, "mmap(memfd)");
+        delete ws;
+        delete rs;
+        return -1;
+    }
+    MemWire m = {(const uint8_t *)wire, wire_len, 0};
+    rs->read_cb = &mem_read;
+    rs->read_user = &m;
+    Parser p;
+    size_t total = 0;
+    start = monotonic_us();
+    while (!err && !p.eof && 0 == (err = feed_frame(p, rs, count_data, &total))) {}
+    uint64_t decode_us = monotonic_us() - start;
+    (void)munmap(wire, wire_len);
+    delete ws;
+    delete rs;
+    if (err || total != frame_size * count) {
+        log_err(0, "[bench_codec] %s %s failed", f.name, name);
+        return -1;
+    }
+    printf("%-12s %-10s %9.1f %9.1f %9.1f\n", f.name, name, encode_us * 1000.0 / count, decode_us * 1000.0 / count,
+        decode_us ? total / 1048576.0 / (decode_us / 1e6) : 0.0);
+    fflush(stdout);
+    return 0;
+}
+
+int main(int argc, char *const *argv) {
+    Opts opts;
+    struct option long_options[] = {
+        /* bytes of each built-in corpus, in MB */
+        {"size", required_argument, NULL, 's'},
+        /* keystrokes per echo run */
+        {"rounds", required_argument, NULL, 'r'},
+        /* a recorded corpus, may be repeated */
+        {"corpus", required_argument, NULL, 'c'},
+        /* extra args for pty_proxy_master and pty_proxy_slave */
+        {"master", required_argument, NULL, 'm'},
+        {"slave", required_argument, NULL, 'S'},
+        /* only the in-process framing and codec runs */
+        {"micro", no_argument, &opts.micro, 1},
+        {0, 0, 0, 0}
+    };
+    int opt = 0;
+    while (-1 != (opt = getopt_long(argc, argv, "", long_options, NULL))) {
+        if (opt == 's') {
+            opts.size = (size_t)strtoull(optarg, NULL, 10) << 20;
+        } else if (opt == 'r') {
+            opts.rounds = (size_t)strtoull(optarg, NULL, 10);
+        } else if (opt == 'c') {
+            opts.corpora.push_back(optarg);
+        } else if (opt == 'm') {
+            opts.master_args.push_back(optarg);
+        } else if (opt == 'S') {
+            opts.slave_args.push_back(optarg);
+        } else if (opt != 0) {
+            log_err(0, "usage: pty_proxy_bench [--size=MB] [--rounds=N] [--corpus=FILE]... [--master=ARG]... [--slave=ARG]... [--micro]");
+            return 1;
+        }
+    }
+    if (opts.size == 0 || opts.rounds == 0) {
+        log_err(0, "--size and --rounds must be > 0");
+        return 1;
+    }
+
+    // the slave outlives the master at times, it is reaped by us
+    if (0 != prctl(PR_SET_CHILD_SUBREAPER, 1)) {
+        log_err(errno, "prctl(PR_SET_CHILD_SUBREAPER)");
+        return -1;
+    }
+    (void)signal(SIGPIPE, SIG_IGN);
+
+    char dir[] = "/tmp/pty_proxy_bench.XXXXXX";
+    if (!mkdtemp(dir)) {
+        log_err(errno, "mkdtemp()");
+        return -1;
+    }
+    struct Gen {
+        const char *name;
+        string (*gen)(size_t);
+    } gens[] = {
+        {"compiler", gen_compiler},
+        {"vim", gen_vim},
+        {"top", gen_top},
+        {"binary", gen_binary},
+    };
+    vector<pair<string, string>> corpora;
+    int err = 0;
+    for (const Gen &g : gens) {
+        string path = string(dir) + "/" + g.name;
+        err |= write_file(path, g.gen(opts.size));
+        corpora.push_back({g.name, path});
+    }
+    for (const string &path : opts.corpora) {
+        const char *slash = strrchr(path.c_str(), '/');
+        corpora.push_back({slash ? slash + 1 : path.c_str(), path});
+    }
+
+    const Mode modes[] = {
+        {"tty", 1, 0, NULL},
+        {"tty+b64", 1, 1, NULL},
+        {"no-tty", 0, 0, NULL},
+        {"no-tty+b64", 0, 1, NULL},
+        {"tty+epoll", 1, 0, "--epoll"},
+        {"tty+uring", 1, 0, "--uring"},
+        {"no-tty+epoll", 0, 0, "--epoll"},
+        {"no-tty+uring", 0, 0, "--uring"},
+    };
+    if (!err && !opts.micro) {
+        printf("%-12s %-10s %9s %9s %9s %9s\n", "bulk", "corpus", "MB/s", "cpu ms/MB", "rw/MB", "csw/MB");
+        for (const Mode &mode : modes) {
+            for (const auto &c : corpora) {
+                err |= bench_bulk(opts, mode, c.first, c.second);
+            }
+        }
+        printf("\n%-12s %9s %9s %9s %9s\n", "echo", "p50 us", "p99 us", "p999 us", "max us");
+        for (const Mode &mode : modes) {
+            err |= bench_echo(opts, mode);
+        }
+
+        // the slave's arg goes where its engine would
+        const Mode mem_modes[] = {
+            {"no-tty", 0, 0, NULL},
+            {"no-tty+low", 0, 0, "--low-mem"},
+        };
+        printf("\n%-12s %-10s %9s %9s %9s\n", "memory", "corpus", "idle kB", "peak kB", "session");
+        for (const Mode &mode : mem_modes) {
+            // gens[3]
+            err |= bench_mem(opts, mode, "binary", corpora[3].second);
+        }
+    }
+
+    const Framing framings[] = {
+        {"plain", 0, 0, 0},
+        {"b64", 1, 0, 0},
+        {"esc", 0, 1, 0},
+        {"lz", 0, 0, HELLO_F_LZ},
+        {"lz+b64", 1, 0, HELLO_F_LZ},
+        {"lz+esc", 0, 1, HELLO_F_LZ},
+    };
+    if (!err) {
+        printf("\n%-12s %-10s %9s %9s %9s\n", "framing", "corpus", "MB/s", "copied/MB", "wire/B");
+        for (const Framing &f : framings) {
+            for (const auto &c : corpora) {
+                string data;
+                err |= read_file(c.second, data) || bench_framing(f, c.first, data);
+            }
+        }
+    }
+    if (!err) {
+        printf("\n%-12s %-10s %9s %9s %9s\n", "codec", "frames", "enc ns/f", "dec ns/f", "dec MB/s");
+        for (const Framing &f : framings) {
+            if (f.flags) {
+                continue;
+            }
+            err |= bench_codec(f, "keystroke", 1, opts.rounds * 500);
+            err |= bench_codec(f, "bulk", MAX_FRAME_SIZE * 4, opts.size / (MAX_FRAME_SIZE * 4));
+        }
+    }
+
+    for (const Gen &g : gens) {
+        (void)unlink((string(dir) + "/" + g.name).c_str());
+    }
+    (void)rmdir(dir);
+    return err ? 1 : 0;
+}
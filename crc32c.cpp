@@ -0,0 +1,148 @@
+// system
+#include <string.h>
+#if defined(__x86_64__)
+#   define CRC_X86 1
+#   include <immintrin.h>
+#elif defined(__aarch64__)
+#   define CRC_ARM 1
+#   include <arm_acle.h>
+#   include <sys/auxv.h>
+#endif
+// self
+#include "crc32c.h"
+
+
+// reflected 0x1EDC6F41
+static const uint32_t k_poly = 0x82f63b78;
+
+static uint32_t g_table[8][256];
+
+static void init_table() {
+    for (uint32_t i = 0; i < 256; ++i) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; ++k) {
+            c = c & 1 ? (c >> 1) ^ k_poly : c >> 1;
+        }
+        g_table[0][i] = c;
+    }
+    for (uint32_t i = 0; i < 256; ++i) {
+        for (int t = 1; t < 8; ++t) {
+            g_table[t][i] = (g_table[t - 1][i] >> 8) ^ g_table[0][g_table[t - 1][i] & 0xff];
+        }
+    }
+}
+
+static uint32_t crc_table(uint32_t crc, const uint8_t *p, size_t len) {
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t v = 0;
+        memcpy(&v, p, 8);
+        v ^= crc;
+        crc = g_table[7][v & 0xff] ^ g_table[6][(v >> 8) & 0xff]
+            ^ g_table[5][(v >> 16) & 0xff] ^ g_table[4][(v >> 24) & 0xff]
+            ^ g_table[3][(v >> 32) & 0xff] ^ g_table[2][(v >> 40) & 0xff]
+            ^ g_table[1][(v >> 48) & 0xff] ^ g_table[0][v >> 56];
+    }
+    for (; len > 0; ++p, --len) {
+        crc = (crc >> 8) ^ g_table[0][(crc ^ *p) & 0xff];
+    }
+    return crc;
+}
+
+#ifdef CRC_X86
+__attribute__((target("sse4.2")))
+static uint32_t crc_sse42(uint32_t crc, const uint8_t *p, size_t len) {
+    uint64_t c = crc;
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t v = 0;
+        memcpy(&v, p, 8);
+        c = _mm_crc32_u64(c, v);
+    }
+    for (; len > 0; ++p, --len) {
+        c = _mm_crc32_u8((uint32_t)c, *p);
+    }
+    return (uint32_t)c;
+}
+
+static int has_sse42() {
+    return __builtin_cpu_supports("sse4.2");
+}
+#endif
+
+#ifdef CRC_ARM
+__attribute__((target("+crc")))
+static uint32_t crc_armv8(uint32_t crc, const uint8_t *p, size_t len) {
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t v = 0;
+        memcpy(&v, p, 8);
+        crc = __crc32cd(crc, v);
+    }
+    for (; len > 0; ++p, --len) {
+        crc = __crc32cb(crc, *p);
+    }
+    return crc;
+}
+
+static int has_armv8_crc() {
+    return !!(getauxval(AT_HWCAP) & HWCAP_CRC32);
+}
+#endif
+
+static int always() {
+    return 1;
+}
+
+struct CrcImpl {
+    const char *name;
+    uint32_t (*run)(uint32_t crc, const uint8_t *p, size_t len);
+    int (*supported)();
+};
+
+// ordered from slowest to fastest
+static const CrcImpl k_impls[] = {
+    {"table", &crc_table, &always},
+#ifdef CRC_X86
+    {"sse4.2", &crc_sse42, &has_sse42},
+#endif
+#ifdef CRC_ARM
+    {"armv8", &crc_armv8, &has_armv8_crc},
+#endif
+};
+
+static const size_t k_impl_count = sizeof(k_impls) / sizeof(k_impls[0]);
+
+static const CrcImpl *g_impl = &k_impls[0];
+
+__attribute__((constructor))
+static void crc32c_init() {
+    init_table();
+#ifdef CRC_X86
+    __builtin_cpu_init();
+#endif
+    for (size_t i = k_impl_count; i > 0; --i) {
+        if (k_impls[i - 1].supported()) {
+            g_impl = &k_impls[i - 1];
+            break;
+        }
+    }
+}
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len) {
+    return ~g_impl->run(~crc, (const uint8_t *)buf, len);
+}
+
+const char *crc32c_impl_name() {
+    return g_impl->name;
+}
+
+int crc32c_select(const char *name) {
+    for (size_t i = 0; i < k_impl_count; ++i) {
+        if (0 == strcmp(name, k_impls[i].name)) {
+            if (!k_impls[i].supported()) {
+                return -1;
+            }
+            g_impl = &k_impls[i];
+            return 0;
+        }
+    }
+    return -1;
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+// system
+#include <stdint.h>
+#include <stddef.h>
+
+
+// CRC-32C (Castagnoli), as in iSCSI and ext4. The SSE4.2 or ARMv8 CRC
+// instructions are used when the CPU has them, a table per byte of a 64 bit
+// word otherwise; picked once at startup.
+//
+// crc is the value of the data before, 0 for the first call.
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+
+// "table", "sse4.2" or "armv8"
+const char *crc32c_impl_name();
+// returns -1 if the implementation is unknown or not supported by this CPU
+int crc32c_select(const char *name);
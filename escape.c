@@ -0,0 +1,311 @@
+// system
+#include <stdlib.h>
+#include <string.h>
+#if defined(__x86_64__) || defined(__i386__)
+#   define ESC_X86 1
+#   include <immintrin.h>
+#endif
+// self
+#include "escape.h"
+
+
+static void esc_set_add(struct EscapeSet *set, uint8_t c) {
+    uint8_t *table = c & 0x80 ? set->hi : set->lo;
+    table[c & 15] |= (uint8_t)(1 << ((c >> 4) & 7));
+}
+
+void esc_set_default(struct EscapeSet *set) {
+    static const uint8_t k_default[] = {0x00, 0x03, 0x04, 0x0d, 0x11, 0x13};
+    memset(set, 0, sizeof(*set));
+    esc_set_add(set, ESC_CHAR);
+    for (size_t i = 0; i < sizeof(k_default); ++i) {
+        esc_set_add(set, k_default[i]);
+    }
+}
+
+int esc_set_parse(const char *spec, struct EscapeSet *set) {
+    memset(set, 0, sizeof(*set));
+    esc_set_add(set, ESC_CHAR);
+    for (const char *p = spec; *spec; ) {
+        char *end = NULL;
+        unsigned long c = strtoul(p, &end, 16);
+        if (end == p || c > 0xff || (*end != ',' && *end != 0)) {
+            return -1;
+        }
+        esc_set_add(set, (uint8_t)c);
+        if (!*end) {
+            break;
+        }
+        p = end + 1;
+    }
+    // the escaped form must go through unchanged
+    for (unsigned c = 0; c < 256; ++c) {
+        if (esc_set_has(set, (uint8_t)c) && esc_set_has(set, (uint8_t)(c ^ ESC_XOR))) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static size_t esc_scan_scalar(const struct EscapeSet *set, const uint8_t *buf, size_t len) {
+    size_t i = 0;
+    while (i < len && !esc_set_has(set, buf[i])) {
+        ++i;
+    }
+    return i;
+}
+
+// SIMD kernels
+//
+// A byte is looked up by its low nibble in the table of its high bit, the
+// result is tested against the bit of its high nibble. Kernels only handle
+// whole vectors, the scalar code does the rest: scan kernels return the
+// index of the first byte in the set or how far they got without finding
+// one, encode kernels the number of input bytes consumed and the number of
+// bytes written in *produced. A vector without escapes is stored as is.
+
+#ifdef ESC_X86
+
+__attribute__((target("ssse3")))
+static inline unsigned _hits_ssse3(__m128i lo, __m128i hi, __m128i c) {
+    const __m128i bits = _mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128);
+    // a lookup with the high bit set gives 0, so each table only hits its half
+    const __m128i row = _mm_or_si128(
+        _mm_shuffle_epi8(lo, c),
+        _mm_shuffle_epi8(hi, _mm_xor_si128(c, _mm_set1_epi8(-128))));
+    const __m128i bit = _mm_shuffle_epi8(bits, _mm_and_si128(_mm_srli_epi16(c, 4), _mm_set1_epi8(0x0f)));
+    const __m128i miss = _mm_cmpeq_epi8(_mm_and_si128(row, bit), _mm_setzero_si128());
+    return ~(unsigned)_mm_movemask_epi8(miss) & 0xffff;
+}
+
+__attribute__((target("ssse3")))
+static size_t _scan_ssse3(const struct EscapeSet *set, const uint8_t *buf, size_t len) {
+    const __m128i lo = _mm_loadu_si128((const __m128i *)set->lo);
+    const __m128i hi = _mm_loadu_si128((const __m128i *)set->hi);
+    size_t i = 0;
+    for (; len - i >= 16; i += 16) {
+        unsigned hits = _hits_ssse3(lo, hi, _mm_loadu_si128((const __m128i *)(buf + i)));
+        if (hits) {
+            return i + __builtin_ctz(hits);
+        }
+    }
+    return i;
+}
+
+__attribute__((target("ssse3")))
+static size_t _encode_ssse3(const struct EscapeSet *set, const uint8_t *inbuf, size_t insize, uint8_t *outbuf, size_t *produced) {
+    const __m128i lo = _mm_loadu_si128((const __m128i *)set->lo);
+    const __m128i hi = _mm_loadu_si128((const __m128i *)set->hi);
+    uint8_t *out = outbuf;
+    size_t i = 0;
+    // the vector after the current one is read and the output may be
+    // written that far ahead
+    for (; insize - i >= 32; i += 16) {
+        const __m128i c = _mm_loadu_si128((const __m128i *)(inbuf + i));
+        unsigned hits = _hits_ssse3(lo, hi, c);
+        _mm_storeu_si128((__m128i *)out, c);
+        size_t done = 0;
+        while (hits) {
+            size_t k = __builtin_ctz(hits);
+            hits &= hits - 1;
+            out += k - done;
+            out[0] = ESC_CHAR;
+            out[1] = inbuf[i + k] ^ ESC_XOR;
+            out += 2;
+            done = k + 1;
+            _mm_storeu_si128((__m128i *)out, _mm_loadu_si128((const __m128i *)(inbuf + i + done)));
+        }
+        out += 16 - done;
+    }
+    *produced = out - outbuf;
+    return i;
+}
+
+__attribute__((target("avx2")))
+static inline unsigned _hits_avx2(__m256i lo, __m256i hi, __m256i c) {
+    const __m256i bits = _mm256_setr_epi8(
+        1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128,
+        1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128);
+    const __m256i row = _mm256_or_si256(
+        _mm256_shuffle_epi8(lo, c),
+        _mm256_shuffle_epi8(hi, _mm256_xor_si256(c, _mm256_set1_epi8(-128))));
+    const __m256i bit = _mm256_shuffle_epi8(bits, _mm256_and_si256(_mm256_srli_epi16(c, 4), _mm256_set1_epi8(0x0f)));
+    const __m256i miss = _mm256_cmpeq_epi8(_mm256_and_si256(row, bit), _mm256_setzero_si256());
+    return ~(unsigned)_mm256_movemask_epi8(miss);
+}
+
+__attribute__((target("avx2")))
+static size_t _scan_avx2(const struct EscapeSet *set, const uint8_t *buf, size_t len) {
+    const __m256i lo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)set->lo));
+    const __m256i hi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)set->hi));
+    size_t i = 0;
+    for (; len - i >= 32; i += 32) {
+        unsigned hits = _hits_avx2(lo, hi, _mm256_loadu_si256((const __m256i *)(buf + i)));
+        if (hits) {
+            return i + __builtin_ctz(hits);
+        }
+    }
+    return i;
+}
+
+__attribute__((target("avx2")))
+static size_t _encode_avx2(const struct EscapeSet *set, const uint8_t *inbuf, size_t insize, uint8_t *outbuf, size_t *produced) {
+    const __m256i lo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)set->lo));
+    const __m256i hi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)set->hi));
+    uint8_t *out = outbuf;
+    size_t i = 0;
+    // the vector after the current one is read and the output may be
+    // written that far ahead
+    for (; insize - i >= 64; i += 32) {
+        const __m256i c = _mm256_loadu_si256((const __m256i *)(inbuf + i));
+        unsigned hits = _hits_avx2(lo, hi, c);
+        _mm256_storeu_si256((__m256i *)out, c);
+        size_t done = 0;
+        while (hits) {
+            size_t k = __builtin_ctz(hits);
+            hits &= hits - 1;
+            out += k - done;
+            out[0] = ESC_CHAR;
+            out[1] = inbuf[i + k] ^ ESC_XOR;
+            out += 2;
+            done = k + 1;
+            _mm256_storeu_si256((__m256i *)out, _mm256_loadu_si256((const __m256i *)(inbuf + i + done)));
+        }
+        out += 32 - done;
+    }
+    *produced = out - outbuf;
+    return i;
+}
+
+#endif  // ESC_X86
+
+
+// dispatch
+
+struct EscImpl {
+    const char *name;
+    // NULL for scalar only
+    size_t (*scan)(const struct EscapeSet *set, const uint8_t *buf, size_t len);
+    size_t (*encode)(const struct EscapeSet *set, const uint8_t *inbuf, size_t insize, uint8_t *outbuf, size_t *produced);
+    int (*supported)(void);
+};
+
+static int _always(void) {
+    return 1;
+}
+
+#ifdef ESC_X86
+static int _has_ssse3(void) {
+    return __builtin_cpu_supports("ssse3");
+}
+
+static int _has_avx2(void) {
+    return __builtin_cpu_supports("avx2");
+}
+#endif
+
+// ordered from slowest to fastest
+static const struct EscImpl k_impls[] = {
+    {"scalar", NULL, NULL, &_always},
+#ifdef ESC_X86
+    {"ssse3", &_scan_ssse3, &_encode_ssse3, &_has_ssse3},
+    {"avx2", &_scan_avx2, &_encode_avx2, &_has_avx2},
+#endif
+};
+
+static const size_t k_impl_count = sizeof(k_impls) / sizeof(k_impls[0]);
+
+static const struct EscImpl *g_impl = &k_impls[0];
+
+// pick the fastest supported kernel once at startup, PTY_PROXY_ESCAPE overrides it
+__attribute__((constructor))
+static void esc_init(void) {
+#ifdef ESC_X86
+    __builtin_cpu_init();
+#endif
+    for (size_t i = k_impl_count; i > 0; --i) {
+        if (k_impls[i - 1].supported()) {
+            g_impl = &k_impls[i - 1];
+            break;
+        }
+    }
+
+    const char *val = getenv("PTY_PROXY_ESCAPE");
+    if (val && *val) {
+        (void)esc_select(val);
+    }
+}
+
+const char *esc_impl_name(void) {
+    return g_impl->name;
+}
+
+int esc_select(const char *name) {
+    for (size_t i = 0; i < k_impl_count; ++i) {
+        if (0 == strcmp(name, k_impls[i].name)) {
+            if (!k_impls[i].supported()) {
+                return -1;
+            }
+            g_impl = &k_impls[i];
+            return 0;
+        }
+    }
+    return -1;
+}
+
+size_t esc_scan(const struct EscapeSet *set, const uint8_t *buf, size_t len) {
+    size_t i = 0;
+    if (g_impl->scan) {
+        i = g_impl->scan(set, buf, len);
+    }
+    return i + esc_scan_scalar(set, buf + i, len - i);
+}
+
+static size_t esc_encode_scalar(const struct EscapeSet *set, const uint8_t *inbuf, size_t insize, uint8_t *outbuf) {
+    uint8_t *out = outbuf;
+    for (size_t i = 0; i < insize; ++i) {
+        if (esc_set_has(set, inbuf[i])) {
+            *out++ = ESC_CHAR;
+            *out++ = inbuf[i] ^ ESC_XOR;
+        } else {
+            *out++ = inbuf[i];
+        }
+    }
+    return out - outbuf;
+}
+
+size_t esc_encode(const struct EscapeSet *set, const uint8_t *inbuf, size_t insize, uint8_t *outbuf) {
+    size_t consumed = 0;
+    size_t produced = 0;
+    if (g_impl->encode) {
+        consumed = g_impl->encode(set, inbuf, insize, outbuf, &produced);
+    }
+    return produced + esc_encode_scalar(set, inbuf + consumed, insize - consumed, outbuf + produced);
+}
+
+// memchr() is vectorized by the libc, runs are copied whole
+void esc_decode(const uint8_t *inbuf, size_t *insize, uint8_t *outbuf, size_t *outsize) {
+    const uint8_t *in = inbuf;
+    const uint8_t *in_end = inbuf + *insize;
+    uint8_t *out = outbuf;
+    uint8_t *out_end = outbuf + *outsize;
+    while (in < in_end && out < out_end) {
+        size_t n = (size_t)(in_end - in) < (size_t)(out_end - out) ? (size_t)(in_end - in) : (size_t)(out_end - out);
+        const uint8_t *esc = (const uint8_t *)memchr(in, ESC_CHAR, n);
+        size_t run = esc ? (size_t)(esc - in) : n;
+        memcpy(out, in, run);
+        in += run;
+        out += run;
+        if (!esc) {
+            continue;
+        }
+        if (in + 1 == in_end) {
+            // the escaped byte is still on its way
+            break;
+        }
+        *out++ = in[1] ^ ESC_XOR;
+        in += 2;
+    }
+    *insize = in - inbuf;
+    *outsize = out - outbuf;
+}
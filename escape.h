@@ -0,0 +1,54 @@
+#pragma once
+
+// system
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+#   define __EXTERN_C extern "C"
+#else
+#   define __EXTERN_C
+#endif
+
+// A wire encoding for transports that mangle a few bytes only: a byte in the
+// set goes out as ESC_CHAR, byte ^ ESC_XOR, everything else as is. ESC_CHAR
+// is always in the set. The decoder does not need the set, each side escapes
+// what its own output path can not carry.
+#define ESC_CHAR 0x10   // DLE
+#define ESC_XOR 0x40
+
+// bit (c >> 4) & 7 of lo[c & 15] for c < 0x80, of hi[c & 15] otherwise: the
+// nibble tables the SIMD scan uses as they are
+struct EscapeSet {
+    uint8_t lo[16];
+    uint8_t hi[16];
+};
+
+__EXTERN_C inline __attribute__((always_inline)) int esc_set_has(const struct EscapeSet *set, uint8_t c) {
+    const uint8_t *table = c & 0x80 ? set->hi : set->lo;
+    return (table[c & 15] >> ((c >> 4) & 7)) & 1;
+}
+
+// NUL, ^C, ^D, CR, XON and XOFF
+__EXTERN_C void esc_set_default(struct EscapeSet *set);
+// comma separated hex bytes, e.g. "00,03,0d"; returns -1 if malformed or if
+// a byte and its escaped form are both in the set
+__EXTERN_C int esc_set_parse(const char *spec, struct EscapeSet *set);
+
+__EXTERN_C inline size_t esc_encoded_max(size_t insize) {
+    return insize * 2;
+}
+
+// bytes before the first one in the set
+__EXTERN_C size_t esc_scan(const struct EscapeSet *set, const uint8_t *buf, size_t len);
+// returns the encoded size, at most esc_encoded_max(insize)
+__EXTERN_C size_t esc_encode(const struct EscapeSet *set, const uint8_t *inbuf, size_t insize, uint8_t *outbuf);
+// decodes until either buffer runs out, *insize and *outsize are updated to
+// what was used; an ESC_CHAR at the end is left for the next call
+__EXTERN_C void esc_decode(const uint8_t *inbuf, size_t *insize, uint8_t *outbuf, size_t *outsize);
+
+// SIMD kernels are picked once at startup by checking the CPU,
+// PTY_PROXY_ESCAPE=scalar|ssse3|avx2 overrides the choice.
+__EXTERN_C const char *esc_impl_name(void);
+// returns -1 if the kernel is unknown or not supported by this CPU
+__EXTERN_C int esc_select(const char *name);
@@ -0,0 +1,181 @@
+// system
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+// self
+#include "event.h"
+#include "trace.h"
+#include "util.h"
+
+
+static int wq_reserve(WriteQueue &q, size_t len) {
+    if (q.cap - q.end >= len) {
+        return 0;
+    }
+    // compact
+    size_t pending = wq_pending(q);
+    if (q.begin > 0) {
+        if (q.stats) {
+            stat_add(q.stats->moved, pending);
+        }
+        memmove(q.buf, q.buf + q.begin, pending);
+        q.begin = 0;
+        q.end = pending;
+    }
+    if (q.cap - q.end >= len) {
+        return 0;
+    }
+
+    size_t cap = q.cap ? q.cap : 4096;
+    while (cap - q.end < len) {
+        cap *= 2;
+    }
+    uint8_t *buf = (uint8_t *)realloc(q.buf, cap);
+    if (!buf) {
+        log_err(errno, "[wq_reserve] realloc(%zu)", cap);
+        return -1;
+    }
+    q.buf = buf;
+    q.cap = cap;
+    return 0;
+}
+
+int wq_write(WriteQueue &q, const void *data, size_t len) {
+    const uint8_t *p = (const uint8_t *)data;
+    if (wq_pending(q) == 0 && !q.defer) {
+        ssize_t nwrite = TEMP_FAILURE_RETRY(write(q.fd, p, len));
+        trace(TR_WRITE, (uint32_t)q.fd, (uint64_t)nwrite, nwrite < 0 ? errno : 0);
+        if (q.stats) {
+            stat_add(q.stats->syscalls, 1);
+            stat_add(q.stats->short_io, nwrite != (ssize_t)len);
+        }
+        if (nwrite < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                log_err(errno, "[wq_write] write(fd:%d)", q.fd);
+                return -1;
+            }
+            nwrite = 0;
+        }
+        p += nwrite;
+        len -= (size_t)nwrite;
+    }
+    if (len == 0) {
+        return 0;
+    }
+
+    if (wq_reserve(q, len)) {
+        return -1;
+    }
+    memcpy(q.buf + q.end, p, len);
+    q.end += len;
+    trace(TR_WQ_QUEUE, (uint32_t)q.fd, len, wq_pending(q));
+    return 0;
+}
+
+int wq_flush(WriteQueue &q) {
+    while (wq_pending(q) > 0) {
+        ssize_t nwrite = TEMP_FAILURE_RETRY(write(q.fd, q.buf + q.begin, wq_pending(q)));
+        trace(TR_WRITE, (uint32_t)q.fd, (uint64_t)nwrite, nwrite < 0 ? errno : 0);
+        if (q.stats) {
+            stat_add(q.stats->syscalls, 1);
+            stat_add(q.stats->short_io, nwrite != (ssize_t)wq_pending(q));
+        }
+        if (nwrite < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            }
+            log_err(errno, "[wq_flush] write(fd:%d)", q.fd);
+            return -1;
+        }
+        q.begin += (size_t)nwrite;
+    }
+    q.begin = q.end = 0;
+    return 0;
+}
+
+int wq_drain(WriteQueue &q) {
+    while (wq_pending(q) > 0) {
+        if (wq_flush(q)) {
+            return -1;
+        }
+        if (wq_pending(q) > 0) {
+            struct pollfd pfd = {q.fd, POLLOUT, 0};
+            if (TEMP_FAILURE_RETRY(poll(&pfd, 1, -1)) < 0) {
+                log_err(errno, "[wq_drain] poll()");
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+void wq_free(WriteQueue &q) {
+    free(q.buf);
+    q.buf = NULL;
+    q.cap = q.begin = q.end = 0;
+}
+
+int ev_update(int epfd, EvFd &e, uint32_t events) {
+    if (e.added ? e.events == events : events == 0) {
+        return 0;
+    }
+
+    struct epoll_event ev = {};
+    ev.events = events;
+    ev.data.fd = e.fd;
+    int op = !e.added ? EPOLL_CTL_ADD : events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
+    if (0 != epoll_ctl(epfd, op, e.fd, &ev)) {
+        return -1;
+    }
+    e.added = op != EPOLL_CTL_DEL;
+    e.events = events;
+    return 0;
+}
+
+int fd_set_nonblock(int fd, int *prev_flags) {
+    int flags = fcntl(fd, F_GETFL);
+    if (flags < 0) {
+        return -1;
+    }
+    if (prev_flags) {
+        *prev_flags = flags;
+    }
+    if (flags & O_NONBLOCK) {
+        return 0;
+    }
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+int fd_set_cloexec(int fd) {
+    int flags = fcntl(fd, F_GETFD);
+    if (flags < 0) {
+        return -1;
+    }
+    return fcntl(fd, F_SETFD, flags | FD_CLOEXEC);
+}
+
+ssize_t write_full(int fd, const void *buf, size_t len) {
+    const uint8_t *p = (const uint8_t *)buf;
+    size_t remain = len;
+    while (remain > 0) {
+        ssize_t nwrite = TEMP_FAILURE_RETRY(write(fd, p, remain));
+        if (nwrite < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                return -1;
+            }
+            struct pollfd pfd = {fd, POLLOUT, 0};
+            if (TEMP_FAILURE_RETRY(poll(&pfd, 1, -1)) < 0) {
+                return -1;
+            }
+            continue;
+        }
+        p += nwrite;
+        remain -= (size_t)nwrite;
+    }
+    return (ssize_t)len;
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+// system
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+// proj
+#include "stats.h"
+
+
+// Output buffer for non-blocking fds driven by the event loop.
+// Data the fd does not take right away is kept until wq_flush().
+struct WriteQueue {
+    int fd = -1;
+    DirStats *stats = NULL;     // counts the writes if set
+    int defer = 0;              // only queue, the owner writes, see UringOut
+    // private
+    uint8_t *buf = NULL;
+    size_t cap = 0;
+    size_t begin = 0;
+    size_t end = 0;
+};
+
+inline size_t wq_pending(const WriteQueue &q) {
+    return q.end - q.begin;
+}
+
+int wq_write(WriteQueue &q, const void *data, size_t len);
+int wq_flush(WriteQueue &q);
+int wq_drain(WriteQueue &q);
+void wq_free(WriteQueue &q);
+
+// epoll registration of one fd, only touches the kernel when the mask changes
+struct EvFd {
+    int fd = -1;
+    uint32_t events = 0;
+    int added = 0;
+};
+
+int ev_update(int epfd, EvFd &e, uint32_t events);
+
+int fd_set_nonblock(int fd, int *prev_flags);
+int fd_set_cloexec(int fd);
+// write everything, waits for POLLOUT if the fd is non-blocking
+ssize_t write_full(int fd, const void *buf, size_t len);
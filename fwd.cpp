@@ -0,0 +1,658 @@
+// system
+#include <errno.h>
+#include <limits.h>
+#include <netdb.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+// self
+#include "fwd.h"
+#include "event.h"
+#include "util.h"
+
+
+// a forwarded connection, the acceptor's or the connector's end
+struct FwdConn {
+    Forwards *f = NULL;
+    uint32_t id = 0;
+    int fd = -1;                // -1 while the connector connects
+    int wake = -1;              // eventfd, news for conn_run()
+    int connect = 0;
+    char target[PATH_MAX] = {};
+    // guarded by f->mu
+    WriteQueue wq;              // channel --> socket
+    uint32_t window = 0;        // we may send
+    uint64_t received = 0;      // payload bytes from the peer
+    uint64_t granted = 0;       // what it may send in all
+    int local_eof = 0;          // CMD_EOF sent
+    int peer_eof = 0;           // CMD_EOF received
+    int shut = 0;               // passed on with shutdown(SHUT_WR)
+    int dead = 0;               // CMD_ERR either way, or fwd_stop()
+    int err = 0;                // ours, conn_run() sends the CMD_ERR
+    const char *what = NULL;
+    int refs = 0;
+};
+
+static const int k_one = 1;
+
+struct FwdListener {
+    Forwards *f = NULL;
+    int fd = -1;
+    char listen[PATH_MAX] = {};
+    char target[PATH_MAX] = {};
+    pthread_t thread;
+};
+
+
+int fwd_split(const char *spec, char *listen, size_t listen_size, char *target, size_t target_size) {
+    const char *sep = strrchr(spec, ':');
+    if (sep && !sep[1]) {
+        sep = NULL;
+    } else if (sep && !strchr(sep + 1, '/')) {
+        // HOST:PORT, the colon before
+        const char *host = sep;
+        while (host > spec && host[-1] != ':') {
+            --host;
+        }
+        sep = host > spec ? host - 1 : NULL;
+    }
+    if (!sep || sep == spec || !sep[1]) {
+        log_err(0, "bad forward: %s, expected LISTEN:HOST:PORT or LISTEN:PATH", spec);
+        return -1;
+    }
+    size_t listen_len = (size_t)(sep - spec);
+    size_t target_len = strlen(sep + 1);
+    if (listen_len >= listen_size || target_len >= target_size) {
+        log_err(0, "forward too long: %s", spec);
+        return -1;
+    }
+    memcpy(listen, spec, listen_len);
+    listen[listen_len] = '\0';
+    memcpy(target, sep + 1, target_len + 1);
+    return 0;
+}
+
+// "[HOST:]PORT" or a path, returns a listening or connected socket, -1 with
+// errno
+static int endpoint_open(const char *ep, int listening) {
+    if (strchr(ep, '/')) {
+        struct sockaddr_un addr = {};
+        addr.sun_family = AF_UNIX;
+        if (strlen(ep) >= sizeof(addr.sun_path)) {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        strcpy(addr.sun_path, ep);
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+            return -1;
+        }
+        int err = listening ? bind(fd, (struct sockaddr *)&addr, sizeof(addr)) || listen(fd, 16)
+            : connect(fd, (struct sockaddr *)&addr, sizeof(addr));
+        if (err) {
+            err = errno;
+            (void)close(fd);
+            errno = err;
+            return -1;
+        }
+        return fd;
+    }
+
+    char host[256] = "localhost";
+    const char *port = ep;
+    if (const char *sep = strrchr(ep, ':')) {
+        if ((size_t)(sep - ep) >= sizeof(host)) {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        memcpy(host, ep, (size_t)(sep - ep));
+        host[sep - ep] = '\0';
+        port = sep + 1;
+    }
+    struct addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo *res = NULL;
+    if (int rc = getaddrinfo(host, port, &hints, &res)) {
+        log_err(0, "getaddrinfo(%s): %s", ep, gai_strerror(rc));
+        errno = rc == EAI_SYSTEM ? errno : EADDRNOTAVAIL;
+        return -1;
+    }
+    int fd = -1;
+    int err = EADDRNOTAVAIL;
+    for (struct addrinfo *ai = res; ai; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+        if (fd < 0) {
+            err = errno;
+            continue;
+        }
+        if (listening) {
+            (void)setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &k_one, sizeof(k_one));
+        }
+        if (listening ? 0 == bind(fd, ai->ai_addr, ai->ai_addrlen) && 0 == listen(fd, 16)
+            : 0 == connect(fd, ai->ai_addr, ai->ai_addrlen))
+        {
+            if (!listening) {
+                // interactive programs ride on these too
+                (void)setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &k_one, sizeof(k_one));
+            }
+            break;
+        }
+        err = errno;
+        (void)close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    if (fd < 0) {
+        errno = err;
+    }
+    return fd;
+}
+
+static int send_error(Stream *s, uint32_t chan, const char *fmt, ...) __attribute__((format(printf, 3, 4)));
+
+static int send_error(Stream *s, uint32_t chan, const char *fmt, ...) {
+    char buf[FRAME_HEADROOM + 512];
+    va_list args;
+    va_start(args, fmt);
+    int len = vsnprintf(&buf[FRAME_HEADROOM], sizeof(buf) - FRAME_HEADROOM, fmt, args);
+    va_end(args);
+    if (len <= 0) {
+        return -1;
+    }
+    size_t size = (size_t)len < sizeof(buf) - FRAME_HEADROOM ? (size_t)len : sizeof(buf) - FRAME_HEADROOM - 1;
+    return send_payload(s, CMD_ERR, &buf[FRAME_HEADROOM], size, chan);
+}
+
+// CMD_OPEN: [flags][0 4 bytes][a, and with OPEN_F_LISTEN '\0' b]
+static int send_open_fwd(Stream *s, uint32_t chan, uint8_t flags, const char *a, const char *b) {
+    size_t a_len = strlen(a);
+    size_t b_len = b ? strlen(b) + 1 : 0;
+    char buf[FRAME_HEADROOM + 5 + 2 * PATH_MAX] = {};
+    if (a_len >= PATH_MAX || b_len > PATH_MAX) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    uint8_t *payload = (uint8_t *)&buf[FRAME_HEADROOM];
+    payload[0] = flags;
+    memcpy(&payload[5], a, a_len);
+    if (b) {
+        memcpy(&payload[5 + a_len + 1], b, b_len - 1);
+    }
+    return send_payload(s, CMD_OPEN, (const char *)payload, 5 + a_len + b_len, chan);
+}
+
+static void wake(FwdConn *c) {
+    uint64_t one = 1;
+    (void)write(c->wake, &one, sizeof(one));
+}
+
+static FwdConn *conn_get(Forwards &f, uint32_t id) {
+    FwdConn *c = NULL;
+    pthread_mutex_lock(&f.mu);
+    auto it = f.conns.find(id);
+    if (it != f.conns.end()) {
+        c = it->second;
+        c->refs++;
+    }
+    pthread_mutex_unlock(&f.mu);
+    return c;
+}
+
+static void conn_put(FwdConn *c) {
+    Forwards &f = *c->f;
+    pthread_mutex_lock(&f.mu);
+    int last = --c->refs == 0;
+    pthread_mutex_unlock(&f.mu);
+    if (!last) {
+        return;
+    }
+    if (c->fd >= 0) {
+        (void)close(c->fd);
+    }
+    if (c->wake >= 0) {
+        (void)close(c->wake);
+    }
+    wq_free(c->wq);
+    delete c;
+}
+
+// the channel is done, later frames for it are dropped
+static void conn_end(FwdConn *c) {
+    Forwards &f = *c->f;
+    pthread_mutex_lock(&f.mu);
+    if (f.conns.count(c->id) && f.conns[c->id] == c) {
+        f.conns.erase(c->id);
+        c->refs--;
+    }
+    pthread_cond_broadcast(&f.cond);
+    pthread_mutex_unlock(&f.mu);
+}
+
+// a free id of our range, 0 if none; called with f.mu
+static uint32_t chan_pick(Forwards &f) {
+    for (uint32_t i = 0; i < k_fwd_chans; ++i) {
+        uint32_t id = f.first_chan + (f.next_chan + i) % k_fwd_chans;
+        if (!f.conns.count(id)) {
+            f.next_chan = (f.next_chan + i + 1) % k_fwd_chans;
+            return id;
+        }
+    }
+    return 0;
+}
+
+// More window for the peer once half of it was written to the socket, what
+// it may have in flight stays k_fwd_window less what waits for the socket.
+// Called with f.mu, returns the credit to send.
+static uint32_t conn_grant(FwdConn *c) {
+    if (c->fd < 0 || c->peer_eof || c->dead) {
+        return 0;
+    }
+    uint64_t limit = c->received - wq_pending(c->wq) + k_fwd_window;
+    if (limit - c->granted < k_fwd_window / 2) {
+        return 0;
+    }
+    uint32_t credit = (uint32_t)(limit - c->granted);
+    c->granted = limit;
+    return credit;
+}
+
+// ends the connection with an error for the peer; called with f.mu
+static void conn_fail(FwdConn *c, const char *what, int err) {
+    if (!c->dead) {
+        c->dead = 1;
+        c->what = what;
+        c->err = err;
+    }
+}
+
+// socket --> channel within the window, and what fwd_frame() could not
+// write. All frames of the connection are sent from here, the transport's
+// reader never waits for its writer.
+static void *conn_run(void *user) {
+    FwdConn *c = (FwdConn *)user;
+    Forwards &f = *c->f;
+    Stream *s = f.stream;
+
+    if (c->connect) {
+        int fd = endpoint_open(c->target, 0);
+        int err = fd < 0 || 0 != fd_set_nonblock(fd, NULL) ? errno : 0;
+        pthread_mutex_lock(&f.mu);
+        if (err) {
+            log_err(err, "[fwd] [chan:%u] connect(%s)", c->id, c->target);
+            conn_fail(c, "connect", err);
+            stat_add(f.failed, 1);
+        }
+        c->fd = c->wq.fd = fd;
+        pthread_mutex_unlock(&f.mu);
+    }
+
+    char *bufstore = (char *)malloc(FRAME_HEADROOM + s->bufs.io);
+    if (!bufstore) {
+        pthread_mutex_lock(&f.mu);
+        conn_fail(c, "malloc", ENOMEM);
+        pthread_mutex_unlock(&f.mu);
+    }
+    char *buf = bufstore ? &bufstore[FRAME_HEADROOM] : NULL;
+    while (bufstore) {
+        pthread_mutex_lock(&f.mu);
+        uint32_t credit = conn_grant(c);
+        if (c->peer_eof && !c->shut && !c->dead && wq_pending(c->wq) == 0) {
+            (void)shutdown(c->fd, SHUT_WR);
+            c->shut = 1;
+        }
+        int done = c->dead || (c->local_eof && c->shut);
+        short events = (!c->local_eof && c->window > 0 ? POLLIN : 0) | (wq_pending(c->wq) > 0 ? POLLOUT : 0);
+        size_t room = c->window;
+        pthread_mutex_unlock(&f.mu);
+        if (credit && 0 != send_window(s, credit, c->id)) {
+            break;
+        }
+        if (done) {
+            break;
+        }
+
+        struct pollfd pfd[2] = {{events ? c->fd : -1, events, 0}, {c->wake, POLLIN, 0}};
+        if (TEMP_FAILURE_RETRY(poll(pfd, 2, -1)) < 0) {
+            log_err(errno, "[fwd] [chan:%u] poll()", c->id);
+            break;
+        }
+        if (pfd[1].revents) {
+            uint64_t n = 0;
+            (void)read(c->wake, &n, sizeof(n));
+        }
+        if ((events & POLLOUT) && pfd[0].revents) {
+            pthread_mutex_lock(&f.mu);
+            if (!c->dead && 0 != wq_flush(c->wq)) {
+                conn_fail(c, "write", errno);
+            }
+            pthread_mutex_unlock(&f.mu);
+        }
+        if ((events & POLLIN) && pfd[0].revents) {
+            size_t max_payload = stream_max_payload(s);
+            size_t len = room < s->bufs.io ? room : s->bufs.io;
+            len = len < max_payload ? len : max_payload;
+            ssize_t nread = read(c->fd, buf, len);
+            if (nread < 0 && (errno == EAGAIN || errno == EINTR)) {
+                continue;
+            }
+            pthread_mutex_lock(&f.mu);
+            if (nread < 0) {
+                conn_fail(c, "read", errno);
+            } else {
+                c->local_eof = nread == 0;
+                c->window -= (uint32_t)nread;
+            }
+            pthread_mutex_unlock(&f.mu);
+            if (nread >= 0 && 0 != (nread ? send_payload(s, CMD_DATA, buf, (size_t)nread, c->id) : send_eof(s, c->id))) {
+                break;
+            }
+        }
+    }
+
+    free(bufstore);
+
+    if (c->err) {
+        log_dbg("[fwd] [chan:%u] %s: %s", c->id, c->what, strerror(c->err));
+        if (c->connect && !strcmp(c->what, "connect")) {
+            (void)send_error(s, c->id, "connect(%s): %s\n", c->target, strerror(c->err));
+        } else {
+            (void)send_error(s, c->id, "%s: %s\n", c->what, strerror(c->err));
+        }
+    }
+    log_dbg("[fwd] [chan:%u] closed", c->id);
+    conn_end(c);
+    conn_put(c);
+    return NULL;
+}
+
+static int conn_start(FwdConn *c) {
+    pthread_attr_t attr;
+    if (0 != thread_attr_init(&attr, 1)) {
+        return -1;
+    }
+    pthread_t thread_id;
+    int err = pthread_create(&thread_id, &attr, &conn_run, c);
+    (void)pthread_attr_destroy(&attr);
+    if (err) {
+        log_err(err, "pthread_create(&thread_id, &attr, &conn_run, c)");
+        return -1;
+    }
+    return 0;
+}
+
+static FwdConn *conn_new(Forwards &f) {
+    FwdConn *c = new FwdConn;
+    c->f = &f;
+    c->wake = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (c->wake < 0) {
+        log_err(errno, "eventfd()");
+        delete c;
+        return NULL;
+    }
+    return c;
+}
+
+// a connection to a listener of ours, takes fd
+static int conn_accept(Forwards &f, int fd, const char *target) {
+    FwdConn *c = conn_new(f);
+    if (!c || 0 != fd_set_nonblock(fd, NULL)) {
+        (void)close(fd);
+        if (c) {
+            conn_put(c);
+        }
+        return -1;
+    }
+    (void)setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &k_one, sizeof(k_one));
+    c->fd = c->wq.fd = fd;
+    // the connector may send right away
+    c->granted = k_fwd_window;
+    // the map and conn_run()
+    c->refs = 2;
+
+    pthread_mutex_lock(&f.mu);
+    c->id = f.stopped ? 0 : chan_pick(f);
+    if (c->id) {
+        f.conns[c->id] = c;
+        stat_add(f.opened, 1);
+    }
+    pthread_mutex_unlock(&f.mu);
+    if (!c->id) {
+        log_err(0, "[fwd] out of channels");
+        c->refs = 1;
+        conn_put(c);
+        return -1;
+    }
+    log_dbg("[fwd] [chan:%u] accepted, to %s", c->id, target);
+    if (0 != send_open_fwd(f.stream, c->id, OPEN_F_CONNECT, target, NULL) || 0 != conn_start(c)) {
+        conn_end(c);
+        conn_put(c);
+        return -1;
+    }
+    return 0;
+}
+
+static void *listener_run(void *user) {
+    FwdListener *l = (FwdListener *)user;
+    while (1) {
+        int fd = accept4(l->fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            // EINVAL: shut down by fwd_stop()
+            if (errno != EINVAL) {
+                log_err(errno, "[fwd] accept()");
+            }
+            break;
+        }
+        (void)conn_accept(*l->f, fd, l->target);
+    }
+    return NULL;
+}
+
+int fwd_listen(Forwards &f, const char *listen, const char *target) {
+    if (strlen(listen) >= PATH_MAX || strlen(target) >= PATH_MAX) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    FwdListener *l = new FwdListener;
+    l->f = &f;
+    strcpy(l->listen, listen);
+    strcpy(l->target, target);
+    l->fd = endpoint_open(listen, 1);
+    if (l->fd < 0) {
+        int err = errno;
+        log_err(err, "[fwd] listen(%s)", listen);
+        delete l;
+        errno = err;
+        return -1;
+    }
+
+    pthread_mutex_lock(&f.mu);
+    int err = f.stopped ? ECANCELED : 0;
+    if (!err) {
+        // signals are for the other threads
+        sigset_t all;
+        sigset_t old;
+        sigfillset(&all);
+        (void)pthread_sigmask(SIG_BLOCK, &all, &old);
+        pthread_attr_t attr;
+        err = thread_attr_init(&attr, 0) ? EAGAIN : 0;
+        if (!err) {
+            err = pthread_create(&l->thread, &attr, &listener_run, l);
+            (void)pthread_attr_destroy(&attr);
+        }
+        (void)pthread_sigmask(SIG_SETMASK, &old, NULL);
+    }
+    if (!err) {
+        f.listeners.push_back(l);
+    }
+    pthread_mutex_unlock(&f.mu);
+    if (err) {
+        log_err(err, "[fwd] pthread_create(&l->thread, &attr, &listener_run, l)");
+        (void)close(l->fd);
+        delete l;
+        errno = err;
+        return -1;
+    }
+    log_dbg("[fwd] listening on %s, to %s", listen, target);
+    return 0;
+}
+
+int fwd_request(Forwards &f, const char *listen, const char *target) {
+    pthread_mutex_lock(&f.mu);
+    uint32_t id = chan_pick(f);
+    pthread_mutex_unlock(&f.mu);
+    log_dbg("[fwd] [chan:%u] the peer listens on %s, to %s", id, listen, target);
+    return send_open_fwd(f.stream, id, OPEN_F_LISTEN, listen, target);
+}
+
+// CMD_OPEN with OPEN_F_CONNECT or OPEN_F_LISTEN
+static int fwd_open(Forwards &f, const Parser &p) {
+    if (p.size <= 5 || p.size > 5 + 2 * PATH_MAX || !(p.payload[0] & (OPEN_F_CONNECT | OPEN_F_LISTEN))) {
+        log_err(0, "[fwd] [chan:%u] bad CMD_OPEN [size:%zu]", p.chan, p.size);
+        return send_error(f.stream, p.chan, "bad forward\n");
+    }
+    char a[2 * PATH_MAX + 1];
+    memcpy(a, &p.payload[5], p.size - 5);
+    a[p.size - 5] = '\0';
+    const char *b = &a[strlen(a) + 1];
+    size_t a_len = strlen(a);
+
+    if (p.payload[0] & OPEN_F_LISTEN) {
+        if (a_len + 1 >= p.size - 5) {
+            return send_error(f.stream, p.chan, "bad forward\n");
+        }
+        if (0 != fwd_listen(f, a, b)) {
+            return send_error(f.stream, p.chan, "listen(%s): %s\n", a, strerror(errno));
+        }
+        return 0;
+    }
+
+    FwdConn *c = a_len < PATH_MAX ? conn_new(f) : NULL;
+    if (!c) {
+        return send_error(f.stream, p.chan, "bad forward\n");
+    }
+    c->id = p.chan;
+    c->connect = 1;
+    strcpy(c->target, a);
+    c->window = k_fwd_window;
+    c->refs = 2;
+    pthread_mutex_lock(&f.mu);
+    int taken = f.stopped || f.conns.count(c->id);
+    if (!taken) {
+        f.conns[c->id] = c;
+        stat_add(f.opened, 1);
+    }
+    pthread_mutex_unlock(&f.mu);
+    if (taken) {
+        c->refs = 1;
+        conn_put(c);
+        return send_error(f.stream, p.chan, "channel %u in use\n", p.chan);
+    }
+    log_dbg("[fwd] [chan:%u] connecting to %s", c->id, c->target);
+    if (0 != conn_start(c)) {
+        conn_end(c);
+        conn_put(c);
+        return send_error(f.stream, p.chan, "no thread\n");
+    }
+    return 0;
+}
+
+int fwd_frame(Forwards &f, const Parser &p) {
+    if (p.chan < k_fwd_first_chan) {
+        return 0;
+    }
+    if (!f.stream) {
+        log_dbg("[fwd] [chan:%u] forwarding is off, [cmd:%u] dropped", p.chan, p.cmd);
+        return 1;
+    }
+    if (p.cmd == CMD_OPEN) {
+        (void)fwd_open(f, p);
+        return 1;
+    }
+    FwdConn *c = conn_get(f, p.chan);
+    if (!c) {
+        if (p.cmd == CMD_ERR) {
+            // a refused fwd_request(), or a connection that failed early
+            log_err(0, "[fwd] [chan:%u] %.*s", p.chan, (int)p.size, (const char *)p.payload);
+        } else {
+            log_dbg("[fwd] [chan:%u] not open, [cmd:%u] dropped", p.chan, p.cmd);
+        }
+        return 1;
+    }
+
+    // conn_run() sends what follows from these
+    pthread_mutex_lock(&f.mu);
+    if (c->dead) {
+        // CMD_ERR crossed ours
+    } else if (p.cmd == CMD_DATA) {
+        if (c->peer_eof || c->received + p.size > c->granted) {
+            log_err(0, "[fwd] [chan:%u] %zu bytes beyond the window", c->id, p.size);
+            conn_fail(c, "write", EPROTO);
+        } else {
+            c->received += p.size;
+            if (0 != wq_write(c->wq, p.payload, p.size)) {
+                conn_fail(c, "write", errno);
+            }
+        }
+    } else if (p.cmd == CMD_WINDOW) {
+        if (p.size >= 4) {
+            c->window += (uint32_t)p.payload[0] | ((uint32_t)p.payload[1] << 8)
+                | ((uint32_t)p.payload[2] << 16) | ((uint32_t)p.payload[3] << 24);
+        }
+    } else if (p.cmd == CMD_EOF) {
+        c->peer_eof = 1;
+    } else if (p.cmd == CMD_ERR) {
+        log_dbg("[fwd] [chan:%u] %.*s", c->id, (int)p.size, (const char *)p.payload);
+        c->dead = 1;
+    } else {
+        log_err(0, "[fwd] [chan:%u] unknown cmd: %u", c->id, p.cmd);
+    }
+    pthread_mutex_unlock(&f.mu);
+    wake(c);
+    conn_put(c);
+    return 1;
+}
+
+void fwd_stop(Forwards &f) {
+    pthread_mutex_lock(&f.mu);
+    f.stopped = 1;
+    std::vector<FwdListener *> listeners;
+    listeners.swap(f.listeners);
+    for (auto &it : f.conns) {
+        FwdConn *c = it.second;
+        c->dead = 1;
+        wake(c);
+    }
+    pthread_mutex_unlock(&f.mu);
+
+    for (FwdListener *l : listeners) {
+        (void)shutdown(l->fd, SHUT_RDWR);
+        (void)pthread_join(l->thread, NULL);
+        (void)close(l->fd);
+        if (strchr(l->listen, '/')) {
+            (void)unlink(l->listen);
+        }
+        delete l;
+    }
+    // a connector may still wait for connect()
+    pthread_mutex_lock(&f.mu);
+    while (!f.conns.empty()) {
+        pthread_cond_wait(&f.cond, &f.mu);
+    }
+    pthread_mutex_unlock(&f.mu);
+    if (f.opened) {
+        log_dbg("[fwd] [opened:%llu][failed:%llu]", (unsigned long long)f.opened, (unsigned long long)f.failed);
+    }
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+// system
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <map>
+#include <vector>
+// proj
+#include "protocol.h"
+
+
+// Port forwarding. Every forwarded connection is a channel of its own:
+// the side that accepted it sends CMD_OPEN with OPEN_F_CONNECT and the
+// target, the other side connects and both relay CMD_DATA, CMD_EOF being
+// a half close. CMD_OPEN with OPEN_F_LISTEN asks the peer to listen and
+// open the channels, as -R does in ssh. CMD_ERR ends a channel at once.
+//
+// A receiver grants the sender a window with CMD_WINDOW [bytes 4], bytes
+// it may send before more is granted. The acceptor starts with a window of
+// k_fwd_window, the connector grants one once connected. Only a window
+// waits for the socket's reader, never the transport, so a stalled or busy
+// connection does not hold up the session or the others.
+//
+// Endpoints are "[HOST:]PORT", HOST defaults to localhost, or a unix
+// socket path, anything with a '/'.
+
+// forwarded channels, below are sessions of the control socket
+const uint32_t k_fwd_first_chan = 0x1000;
+// ids a side picks from, the master the lower half, the slave the upper
+const uint32_t k_fwd_chans = 0x1000;
+const uint32_t k_fwd_window = 256 * 1024;
+
+struct FwdConn;
+struct FwdListener;
+
+struct Forwards {
+    // params
+    Stream *stream = NULL;      // NULL: the peer opens no forwards
+    uint32_t first_chan = k_fwd_first_chan;
+    // private
+    pthread_mutex_t mu = PTHREAD_MUTEX_INITIALIZER;
+    pthread_cond_t cond = PTHREAD_COND_INITIALIZER;     // a conn ended
+    std::map<uint32_t, FwdConn *> conns;
+    std::vector<FwdListener *> listeners;
+    uint32_t next_chan = 0;
+    int stopped = 0;
+    // counters
+    uint64_t opened = 0;
+    uint64_t failed = 0;
+};
+
+// "LISTEN:TARGET" as in ssh's -L and -R, e.g. 8080:localhost:80,
+// 127.0.0.1:5432:/run/pg.sock or /tmp/x.sock:22
+int fwd_split(const char *spec, char *listen, size_t listen_size, char *target, size_t target_size);
+// connections to listen here are forwarded to target at the peer
+int fwd_listen(Forwards &f, const char *listen, const char *target);
+// the peer listens and forwards to target here
+int fwd_request(Forwards &f, const char *listen, const char *target);
+// frames of the channels from k_fwd_first_chan on, 0 if p is not ours
+int fwd_frame(Forwards &f, const Parser &p);
+// the transport is gone, ends the listeners and connections and waits
+// for them
+void fwd_stop(Forwards &f);
@@ -0,0 +1,63 @@
+// self
+#include "hist.h"
+#include "util.h"
+
+
+static size_t bucket_of(uint64_t v) {
+    const uint64_t k_sub = (uint64_t)1 << k_hist_sub_bits;
+    if (v < k_sub) {
+        return (size_t)v;
+    }
+    unsigned shift = 63 - __builtin_clzll(v) - k_hist_sub_bits;
+    return ((size_t)(shift + 1) << k_hist_sub_bits) + (size_t)((v >> shift) - k_sub);
+}
+
+static uint64_t bucket_top(size_t i) {
+    const uint64_t k_sub = (uint64_t)1 << k_hist_sub_bits;
+    if (i < k_sub) {
+        return i;
+    }
+    unsigned shift = (unsigned)(i >> k_hist_sub_bits) - 1;
+    uint64_t m = k_sub + (i & (k_sub - 1));
+    return ((m + 1) << shift) - 1;
+}
+
+void hist_record(Hist &h, uint64_t v) {
+    __atomic_fetch_add(&h.counts[bucket_of(v)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h.total, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h.sum, v, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&h.max, __ATOMIC_RELAXED);
+    while (v > max && !__atomic_compare_exchange_n(&h.max, &max, v, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {}
+}
+
+uint64_t hist_quantile(const Hist &h, double q) {
+    uint64_t total = __atomic_load_n(&h.total, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&h.max, __ATOMIC_RELAXED);
+    if (total == 0) {
+        return 0;
+    }
+    // the rank of the value, 1-based: ceil(q * total)
+    uint64_t rank = (uint64_t)(q * total);
+    if (rank < q * total || rank < 1) {
+        rank += 1;
+    }
+    uint64_t seen = 0;
+    for (size_t i = 0; i < k_hist_buckets; ++i) {
+        seen += __atomic_load_n(&h.counts[i], __ATOMIC_RELAXED);
+        if (seen >= rank) {
+            uint64_t top = bucket_top(i);
+            return top < max ? top : max;
+        }
+    }
+    return max;
+}
+
+void hist_log(const Hist &h, const char *name) {
+    uint64_t total = __atomic_load_n(&h.total, __ATOMIC_RELAXED);
+    uint64_t sum = __atomic_load_n(&h.sum, __ATOMIC_RELAXED);
+    log_err(0, "[%s] [n:%llu][mean:%llu][p50:%llu][p90:%llu][p99:%llu][p999:%llu][max:%llu] us",
+        name, (unsigned long long)total, (unsigned long long)(total ? sum / total : 0),
+        (unsigned long long)hist_quantile(h, 0.5), (unsigned long long)hist_quantile(h, 0.9),
+        (unsigned long long)hist_quantile(h, 0.99), (unsigned long long)hist_quantile(h, 0.999),
+        (unsigned long long)__atomic_load_n(&h.max, __ATOMIC_RELAXED));
+}
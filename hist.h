@@ -0,0 +1,26 @@
+#pragma once
+
+// system
+#include <stdint.h>
+#include <stddef.h>
+
+
+// Latency histogram in the HdrHistogram layout: values below 2^k_hist_sub_bits
+// have a bucket each, every power of two above is split into as many buckets,
+// so a bucket is off by at most 1/16 of its values. Recording is a few
+// relaxed atomic adds, any thread may record while another reads.
+const unsigned k_hist_sub_bits = 4;
+const size_t k_hist_buckets = (64 - k_hist_sub_bits + 1) << k_hist_sub_bits;
+
+struct Hist {
+    uint64_t counts[k_hist_buckets] = {};
+    uint64_t total = 0;
+    uint64_t sum = 0;
+    uint64_t max = 0;
+};
+
+void hist_record(Hist &h, uint64_t v);
+// the highest value of the bucket holding quantile q, at most h.max
+uint64_t hist_quantile(const Hist &h, double q);
+// one line to stderr: name, count, mean and p50/p90/p99/p999/max in us
+void hist_log(const Hist &h, const char *name);
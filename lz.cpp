@@ -0,0 +1,253 @@
+// system
+#include <assert.h>
+#include <string.h>
+#include <stdlib.h>
+// self
+#include "lz.h"
+#include "util.h"
+
+
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 0xffff
+#define LZ_HASH_BITS 14
+
+// the history holds the window plus room for new blocks, it slides down
+// to the last k_lz_window bytes when full
+const size_t k_lz_hist_size = k_lz_window * 2;
+
+struct LzEncoder {
+    uint8_t hist[k_lz_hist_size];
+    size_t len;
+    // position + 1 of the last 4 bytes with this hash, 0 for none
+    uint32_t table[1 << LZ_HASH_BITS];
+};
+
+struct LzDecoder {
+    uint8_t hist[k_lz_hist_size];
+    size_t len;
+};
+
+static inline uint32_t read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t lz_hash(uint32_t v) {
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+static size_t hist_slide(uint8_t *hist, size_t len) {
+    size_t shift = len - k_lz_window;
+    memmove(hist, hist + shift, k_lz_window);
+    return shift;
+}
+
+LzEncoder *lz_encoder_new() {
+    LzEncoder *e = (LzEncoder *)calloc(1, sizeof(LzEncoder));
+    if (!e) {
+        log_err(0, "[lz_encoder_new] calloc(%zu)", sizeof(LzEncoder));
+    }
+    return e;
+}
+
+void lz_encoder_free(LzEncoder *e) {
+    free(e);
+}
+
+// Room for a sequence is checked up front, returns NULL if it does not fit.
+static uint8_t *put_len(uint8_t *op, size_t len) {
+    for (; len >= 255; len -= 255) {
+        *op++ = 255;
+    }
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+static uint8_t *put_seq(
+    uint8_t *op, const uint8_t *op_end,
+    const uint8_t *lit, size_t lit_len, size_t offset, size_t match_len)
+{
+    size_t worst = 1 + lit_len / 255 + 1 + lit_len + 2 + match_len / 255 + 1;
+    if ((size_t)(op_end - op) < worst) {
+        return NULL;
+    }
+
+    uint8_t *token = op++;
+    *token = (uint8_t)((lit_len < 15 ? lit_len : 15) << 4);
+    if (lit_len >= 15) {
+        op = put_len(op, lit_len - 15);
+    }
+    memcpy(op, lit, lit_len);
+    op += lit_len;
+    if (match_len == 0) {
+        return op;
+    }
+
+    *op++ = (uint8_t)offset;
+    *op++ = (uint8_t)(offset >> 8);
+    match_len -= LZ_MIN_MATCH;
+    *token |= (uint8_t)(match_len < 15 ? match_len : 15);
+    if (match_len >= 15) {
+        op = put_len(op, match_len - 15);
+    }
+    return op;
+}
+
+size_t lz_compress(LzEncoder *e, const uint8_t *in, size_t len, uint8_t *out, size_t outcap) {
+    assert(0 < len && len <= k_lz_block_size);
+    if (e->len + len > k_lz_hist_size) {
+        uint32_t shift = (uint32_t)hist_slide(e->hist, e->len);
+        e->len = k_lz_window;
+        for (size_t i = 0; i < (1 << LZ_HASH_BITS); ++i) {
+            e->table[i] = e->table[i] > shift ? e->table[i] - shift : 0;
+        }
+    }
+
+    uint8_t *hist = e->hist;
+    size_t start = e->len;
+    size_t end = start + len;
+    memcpy(&hist[start], in, len);
+    e->len = end;
+
+    uint8_t *op = out;
+    uint8_t *op_end = out + outcap;
+    size_t anchor = start;
+    size_t ip = start;
+    while (ip + LZ_MIN_MATCH <= end) {
+        uint32_t cur = read32(&hist[ip]);
+        uint32_t h = lz_hash(cur);
+        size_t cand = e->table[h];
+        e->table[h] = (uint32_t)ip + 1;
+        if (cand == 0 || ip - (cand - 1) > LZ_MAX_OFFSET || read32(&hist[cand - 1]) != cur) {
+            // skip faster over data that does not match
+            ip += 1 + ((ip - anchor) >> 5);
+            continue;
+        }
+
+        size_t match = cand - 1;
+        size_t match_len = LZ_MIN_MATCH;
+        while (ip + match_len < end && hist[match + match_len] == hist[ip + match_len]) {
+            match_len++;
+        }
+        op = put_seq(op, op_end, &hist[anchor], ip - anchor, ip - match, match_len);
+        if (!op) {
+            return 0;
+        }
+        ip += match_len;
+        anchor = ip;
+    }
+
+    if (anchor < end) {
+        op = put_seq(op, op_end, &hist[anchor], end - anchor, 0, 0);
+        if (!op) {
+            return 0;
+        }
+    }
+    return (size_t)(op - out);
+}
+
+LzDecoder *lz_decoder_new() {
+    LzDecoder *d = (LzDecoder *)calloc(1, sizeof(LzDecoder));
+    if (!d) {
+        log_err(0, "[lz_decoder_new] calloc(%zu)", sizeof(LzDecoder));
+    }
+    return d;
+}
+
+void lz_decoder_free(LzDecoder *d) {
+    free(d);
+}
+
+static void dec_reserve(LzDecoder *d) {
+    if (d->len + k_lz_block_size > k_lz_hist_size) {
+        (void)hist_slide(d->hist, d->len);
+        d->len = k_lz_window;
+    }
+}
+
+static int get_len(const uint8_t *&ip, const uint8_t *ip_end, size_t &len) {
+    uint8_t b = 255;
+    while (b == 255) {
+        if (ip == ip_end) {
+            return -1;
+        }
+        b = *ip++;
+        len += b;
+    }
+    return 0;
+}
+
+int lz_decompress(LzDecoder *d, const uint8_t *in, size_t len, const uint8_t **out, size_t *outlen) {
+    dec_reserve(d);
+    uint8_t *hist = d->hist;
+    size_t op = d->len;
+    size_t op_end = d->len + k_lz_block_size;
+
+    const uint8_t *ip = in;
+    const uint8_t *ip_end = in + len;
+    while (ip < ip_end) {
+        uint8_t token = *ip++;
+        size_t lit_len = token >> 4;
+        if (lit_len == 15 && 0 != get_len(ip, ip_end, lit_len)) {
+            log_err(0, "[lz_decompress] truncated literal length");
+            return -1;
+        }
+        if ((size_t)(ip_end - ip) < lit_len || op_end - op < lit_len) {
+            log_err(0, "[lz_decompress] bad literals [len:%zu]", lit_len);
+            return -1;
+        }
+        memcpy(&hist[op], ip, lit_len);
+        ip += lit_len;
+        op += lit_len;
+        if (ip == ip_end) {
+            break;
+        }
+
+        if (ip_end - ip < 2) {
+            log_err(0, "[lz_decompress] truncated offset");
+            return -1;
+        }
+        size_t offset = (size_t)ip[0] | ((size_t)ip[1] << 8);
+        ip += 2;
+        size_t match_len = token & 15;
+        if (match_len == 15 && 0 != get_len(ip, ip_end, match_len)) {
+            log_err(0, "[lz_decompress] truncated match length");
+            return -1;
+        }
+        match_len += LZ_MIN_MATCH;
+        if (offset == 0 || offset > op || op_end - op < match_len) {
+            log_err(0, "[lz_decompress] bad match [offset:%zu][len:%zu]", offset, match_len);
+            return -1;
+        }
+        const uint8_t *src = &hist[op - offset];
+        uint8_t *dst = &hist[op];
+        if (offset >= match_len) {
+            memcpy(dst, src, match_len);
+        } else {
+            // overlapping, repeats the last offset bytes
+            for (size_t i = 0; i < match_len; ++i) {
+                dst[i] = src[i];
+            }
+        }
+        op += match_len;
+    }
+
+    *out = &hist[d->len];
+    *outlen = op - d->len;
+    d->len = op;
+    return 0;
+}
+
+int lz_store(LzDecoder *d, const uint8_t *in, size_t len, const uint8_t **out, size_t *outlen) {
+    if (len > k_lz_block_size) {
+        log_err(0, "[lz_store] block too large [len:%zu]", len);
+        return -1;
+    }
+    dec_reserve(d);
+    memcpy(&d->hist[d->len], in, len);
+    *out = &d->hist[d->len];
+    *outlen = len;
+    d->len += len;
+    return 0;
+}
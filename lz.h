@@ -0,0 +1,36 @@
+#pragma once
+
+// system
+#include <stdint.h>
+#include <stddef.h>
+
+
+// LZ77 with a window that spans blocks, so text repeated across frames
+// (prompts, escape sequences) is encoded as a short back reference.
+// Every block is complete on its own, nothing is held back for the next one.
+//
+// block: sequences of
+//     [token: literal len << 4 | match len - 4][len ext][literals][offset lo][offset hi][len ext]
+// the last sequence may end right after its literals. A length nibble of 15
+// is followed by bytes that are added to it until one is < 255.
+
+// largest uncompressed block
+const size_t k_lz_block_size = 16 * 1024;
+// match offsets are 16 bits
+const size_t k_lz_window = 64 * 1024;
+
+struct LzEncoder;
+struct LzDecoder;
+
+LzEncoder *lz_encoder_new();
+void lz_encoder_free(LzEncoder *e);
+// Compresses at most k_lz_block_size bytes. The block becomes history either
+// way; returns 0 if the output would not fit in outcap, then send it stored.
+size_t lz_compress(LzEncoder *e, const uint8_t *in, size_t len, uint8_t *out, size_t outcap);
+
+LzDecoder *lz_decoder_new();
+void lz_decoder_free(LzDecoder *d);
+// *out points into the history and is valid until the next call
+int lz_decompress(LzDecoder *d, const uint8_t *in, size_t len, const uint8_t **out, size_t *outlen);
+// a stored block, only added to the history
+int lz_store(LzDecoder *d, const uint8_t *in, size_t len, const uint8_t **out, size_t *outlen);
@@ -1,17 +1,74 @@
 // system
+#include <stdio.h>
 #include <string.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <unistd.h>
 #include <signal.h>
 #include <getopt.h>
 #include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <poll.h>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
 // proj
 #include "pty.h"
 #include "util.h"
+#include "event.h"
 #include "protocol.h"
+#include "pipeline.h"
+#include "hist.h"
+#include "stats.h"
+#include "trace.h"
+#include "xfer.h"
+#include "fwd.h"
+#include "predict.h"
 
 
+// output a channel queues for a client that does not read, more is dropped
+const size_t k_chan_backlog = 8 << 20;
+
+
+struct Context;
+
+// a client attached through the control socket
+struct Channel {
+    Context *ctx = NULL;
+    uint32_t id = 0;
+    int no_tty = 0;
+    int ctl_fd = -1;        // the client's connection
+    int in_fd = -1;         // the client's stdin, stdout and stderr
+    int out_fd = -1;
+    int err_fd = -1;
+    // a file instead of a session, OPEN_F_GET or OPEN_F_PUT; it is out_fd
+    // or in_fd
+    uint8_t file = 0;
+    uint64_t next = 0;      // the offset of the next chunk
+    int sending = 0;        // put_chan() started
+    int cancel = 0;         // stops put_chan()
+    int failed = 0;         // the client exits with 1
+    // guarded by ctx->mu: output chan_frame() queued for chan_writer()
+    WriteQueue out_q;
+    WriteQueue err_q;
+    pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+    int dropped = 0;        // a write failed or the client fell behind
+    // guarded by ctx->mu
+    int closed = 0;
+    int refs = 0;
+};
+
 struct Context {
     int no_tty = 0;
+    int proto = PROTO_VERSION;
+    uint32_t hello_flags = 0;   // offered
+    int hello_sent = 0;
     pthread_mutex_t mu = PTHREAD_MUTEX_INITIALIZER;
     pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
     int exit_flag = 0;
@@ -19,6 +76,38 @@ struct Context {
     int r2l = 0;
     int msg_eof = 0;
     Stream stream;
+    // control socket, channels other than 0 are guarded by mu
+    const char *control_path = NULL;
+    int control_fd = -1;
+    int mux = 0;
+    int file = 0;               // the slave takes file channels
+    std::map<uint32_t, Channel *> chans;
+    uint32_t next_chan = 1;
+    // --local-forward and --remote-forward, LISTEN and TARGET in turn
+    std::vector<std::string> local_fwd;
+    std::vector<std::string> remote_fwd;
+    Forwards fwd;
+    // --reconnect: the slave is run again when the transport drops
+    int reconnect = 0;
+    // --pipeline, buffers between the stdin reader and the transport writer
+    size_t pipeline = 0;
+    char *const *slave_argv = NULL;
+    pid_t slave_pid = -1;
+    unsigned backoff_s = 0;
+    uint64_t rx_seq = 0;        // output bytes received, for CMD_RESUME
+    // latency, dumped on SIGUSR1 and with --latency at exit
+    uint64_t ping_us = 0;       // --ping interval, 0: never
+    int ping = 0;               // the slave answers CMD_PING
+    uint64_t key_at = 0;        // stdin read whose output has not come yet
+    Hist echo_hist;             // stdin read to the next CMD_DATA
+    Hist ping_hist;
+    StatsServer stats;          // --stats
+    // stdout, written by a thread of its own in the threaded engine
+    OutQueue out;
+    // --predict, local echo; l2r() and r2l() both write the screen
+    int predict = 0;
+    Predict pr;
+    pthread_mutex_t predict_mu = PTHREAD_MUTEX_INITIALIZER;
 };
 
 
@@ -34,22 +123,806 @@ static void set_winch(int) {
     g_winch = 1;
 }
 
+static int need_winsize(const Context &ctx) {
+    if (!ctx.no_tty) {
+        return g_winch;
+    }
+    // no window in --no-tty mode, a single CMD_WS carries the hello
+    return !ctx.hello_sent && ctx.proto >= PROTO_V2;
+}
+
+static void predict_write(Context &ctx, const std::string &out);
+
+// the first CMD_WS also offers our protocol version
+static int send_winsize(Context &ctx) {
+    g_winch = 0;
+    struct winsize ws = {};
+    if (!ctx.no_tty && 0 != ioctl(STDIN_FILENO, TIOCGWINSZ, &ws)) {
+        log_err(errno, "ioctl(STDIN_FILENO, TIOCGWINSZ, &ws)");
+        return -1;
+    }
+    if (ctx.predict) {
+        std::string out;
+        pthread_mutex_lock(&ctx.predict_mu);
+        predict_resize(ctx.pr, ws.ws_col, out);
+        predict_write(ctx, out);
+        pthread_mutex_unlock(&ctx.predict_mu);
+    }
+
+    Hello hello;
+    hello.version = (uint8_t)ctx.proto;
+    hello.flags = ctx.hello_flags;
+    hello.max_frame = ctx.stream.bufs.max_frame;
+    const Hello *offer = !ctx.hello_sent && ctx.proto >= PROTO_V2 ? &hello : NULL;
+    ctx.hello_sent = 1;
+    return send_ws(&ctx.stream, ws, offer);
+}
+
+static Channel *chan_get(Context &ctx, uint32_t id) {
+    Channel *ch = NULL;
+    pthread_mutex_lock(&ctx.mu);
+    auto it = ctx.chans.find(id);
+    if (it != ctx.chans.end()) {
+        ch = it->second;
+        ch->refs++;
+    }
+    pthread_mutex_unlock(&ctx.mu);
+    return ch;
+}
+
+static void chan_put(Channel *ch) {
+    Context &ctx = *ch->ctx;
+    pthread_mutex_lock(&ctx.mu);
+    int last = --ch->refs == 0;
+    pthread_mutex_unlock(&ctx.mu);
+    if (!last) {
+        return;
+    }
+    int fds[] = {ch->ctl_fd, ch->in_fd, ch->out_fd, ch->err_fd};
+    for (int fd : fds) {
+        if (fd >= 0) {
+            (void)close(fd);
+        }
+    }
+    wq_free(ch->out_q);
+    wq_free(ch->err_q);
+    delete ch;
+}
+
+// the slave closed the channel, chan_writer() ends it once the output is
+// written
+static void chan_close(Context &ctx, Channel *ch) {
+    log_dbg("[chan_close] [chan:%u]", ch->id);
+    pthread_mutex_lock(&ctx.mu);
+    ch->closed = 1;
+    pthread_cond_signal(&ch->cond);
+    pthread_mutex_unlock(&ctx.mu);
+    __atomic_store_n(&ch->cancel, 1, __ATOMIC_RELAXED);
+}
+
+// the client exits
+static void chan_end(Context &ctx, Channel *ch) {
+    uint8_t status = (uint8_t)__atomic_load_n(&ch->failed, __ATOMIC_RELAXED);
+    (void)write(ch->ctl_fd, &status, 1);
+    // wakes up l2r_chan()
+    (void)shutdown(ch->ctl_fd, SHUT_RDWR);
+
+    // we may exit once the last one is gone
+    pthread_mutex_lock(&ctx.mu);
+    ctx.chans.erase(ch->id);
+    pthread_cond_signal(&ctx.cond);
+    pthread_mutex_unlock(&ctx.mu);
+    // the reference of the map
+    chan_put(ch);
+}
+
+// queued output --> the client, then chan_end() once the slave closed the
+// channel. Only this thread waits for the client to read, the transport's
+// reader goes on with the other channels.
+static void *chan_writer(void *user) {
+    Channel *ch = (Channel *)user;
+    Context &ctx = *ch->ctx;
+    // swapped with out_q and err_q, written without the lock
+    WriteQueue out;
+    WriteQueue err;
+    out.fd = ch->out_q.fd;
+    err.fd = ch->err_q.fd;
+    out.defer = err.defer = 1;
+    pthread_mutex_lock(&ctx.mu);
+    while (1) {
+        if (wq_pending(ch->out_q) == 0 && wq_pending(ch->err_q) == 0) {
+            if (ch->closed) {
+                break;
+            }
+            pthread_cond_wait(&ch->cond, &ctx.mu);
+            continue;
+        }
+        std::swap(ch->out_q, out);
+        std::swap(ch->err_q, err);
+        pthread_mutex_unlock(&ctx.mu);
+        int ret = wq_drain(out);
+        ret |= wq_drain(err);
+        pthread_mutex_lock(&ctx.mu);
+        if (ret) {
+            // the client is gone, later output is dropped
+            ch->dropped = 1;
+            __atomic_store_n(&ch->failed, 1, __ATOMIC_RELAXED);
+            WriteQueue *qs[] = {&ch->out_q, &ch->err_q, &out, &err};
+            for (WriteQueue *q : qs) {
+                wq_free(*q);
+            }
+        }
+    }
+    pthread_mutex_unlock(&ctx.mu);
+    wq_free(out);
+    wq_free(err);
+
+    chan_end(ctx, ch);
+    chan_put(ch);
+    return NULL;
+}
+
+// output for chan_writer(), a client that is k_chan_backlog behind loses it
+// rather than hold up the transport
+static void chan_queue(Context &ctx, Channel *ch, WriteQueue &q, const void *data, size_t len) {
+    pthread_mutex_lock(&ctx.mu);
+    int overrun = !ch->dropped && wq_pending(ch->out_q) + wq_pending(ch->err_q) + len > k_chan_backlog;
+    if (overrun || (!ch->dropped && 0 != wq_write(q, data, len))) {
+        ch->dropped = 1;
+        __atomic_store_n(&ch->failed, 1, __ATOMIC_RELAXED);
+    }
+    pthread_cond_signal(&ch->cond);
+    pthread_mutex_unlock(&ctx.mu);
+    if (overrun) {
+        log_err(0, "[chan:%u] the client is %zu bytes behind, its output is dropped", ch->id, k_chan_backlog);
+    }
+}
+
+// the client's file, the slave sends it or the messages why not
+static void chan_fail(Context &ctx, Channel *ch, const char *what, int err) {
+    if (__atomic_exchange_n(&ch->failed, 1, __ATOMIC_RELAXED)) {
+        return;
+    }
+    if (what) {
+        char msg[256];
+        int len = snprintf(msg, sizeof(msg), "pty_proxy_master: %s: %s\n", what, strerror(err));
+        chan_queue(ctx, ch, ch->err_q, msg, (size_t)len < sizeof(msg) ? (size_t)len : sizeof(msg) - 1);
+    }
+    if (ch->file == OPEN_F_GET) {
+        // cancel, the slave closes the channel
+        (void)send_eof(&ctx.stream, ch->id);
+    } else {
+        __atomic_store_n(&ch->cancel, 1, __ATOMIC_RELAXED);
+    }
+}
+
+// the client's file --> channel, from the offset the slave continues at
+static void *put_chan(void *user) {
+    Channel *ch = (Channel *)user;
+    Context &ctx = *ch->ctx;
+    if (0 != xfer_send(&ctx.stream, ch->id, ch->in_fd, ch->next, &ch->cancel) && errno != ECANCELED) {
+        chan_fail(ctx, ch, "read", errno);
+    }
+    // closes the file at the slave, it closes the channel
+    (void)send_eof(&ctx.stream, ch->id);
+    chan_put(ch);
+    return NULL;
+}
+
+// CMD_RESUME on a put channel
+static int chan_put_start(Context &ctx, Channel *ch, const Parser &p) {
+    if (p.size < 8 || ch->sending) {
+        log_err(0, "[chan:%u] bad CMD_RESUME [size:%zu]", ch->id, p.size);
+        return -1;
+    }
+    ch->next = 0;
+    for (size_t i = 0; i < 8; ++i) {
+        ch->next |= (uint64_t)p.payload[i] << (8 * i);
+    }
+    log_dbg("[chan_put_start] [chan:%u] [offset:%llu]", ch->id, (unsigned long long)ch->next);
+    ch->sending = 1;
+
+    pthread_mutex_lock(&ctx.mu);
+    ch->refs++;
+    pthread_mutex_unlock(&ctx.mu);
+    pthread_attr_t attr;
+    if (0 != thread_attr_init(&attr, 1)) {
+        chan_put(ch);
+        return -1;
+    }
+    pthread_t thread_id;
+    int err = pthread_create(&thread_id, &attr, &put_chan, ch);
+    (void)pthread_attr_destroy(&attr);
+    if (err) {
+        log_err(err, "pthread_create(&thread_id, &attr, &put_chan, ch)");
+        chan_put(ch);
+        return -1;
+    }
+    return 0;
+}
+
+// frames for channels other than 0, a client that went away does not end
+// the others
+static int chan_frame(Context &ctx, const Parser &p) {
+    Channel *ch = chan_get(ctx, p.chan);
+    if (!ch) {
+        log_dbg("[chan_frame] [chan:%u] not open, [cmd:%u] dropped", p.chan, p.cmd);
+        return 0;
+    }
+    if (p.cmd == CMD_DATA || p.cmd == CMD_ERR) {
+        chan_queue(ctx, ch, p.cmd == CMD_DATA ? ch->out_q : ch->err_q, p.payload, p.size);
+        if (p.cmd == CMD_ERR && ch->file) {
+            chan_fail(ctx, ch, NULL, 0);
+        }
+    } else if (p.cmd == CMD_CHUNK && ch->file == OPEN_F_GET) {
+        int err = ch->failed ? 0 : xfer_recv(ch->out_fd, ch->next, p.payload, p.size);
+        if (err) {
+            chan_fail(ctx, ch, "write", err);
+        }
+    } else if (p.cmd == CMD_RESUME && ch->file == OPEN_F_PUT) {
+        if (0 != chan_put_start(ctx, ch, p)) {
+            chan_fail(ctx, ch, "start", errno);
+            (void)send_eof(&ctx.stream, ch->id);
+        }
+    } else if (p.cmd == CMD_EOF) {
+        chan_close(ctx, ch);
+    } else {
+        log_err(0, "[chan:%u] unknown cmd: %u", ch->id, p.cmd);
+    }
+    chan_put(ch);
+    return 0;
+}
+
+// client stdin --> channel, 'W' on the control connection is a sigwinch
+static void *l2r_chan(void *user) {
+    Channel *ch = (Channel *)user;
+    Context &ctx = *ch->ctx;
+    // a file channel only waits for the client to go away
+    int in_open = !ch->file;
+    char *bufstore = in_open ? (char *)malloc(FRAME_HEADROOM + ctx.stream.bufs.io) : NULL;
+    if (in_open && !bufstore) {
+        log_err(errno, "[chan:%u] out of memory", ch->id);
+        in_open = 0;
+    }
+    while (1) {
+        struct pollfd pfd[2] = {{ch->ctl_fd, POLLIN, 0}, {in_open ? ch->in_fd : -1, POLLIN, 0}};
+        if (TEMP_FAILURE_RETRY(poll(pfd, 2, -1)) < 0) {
+            log_err(errno, "[chan:%u] poll()", ch->id);
+            break;
+        }
+        if (pfd[0].revents) {
+            char c = 0;
+            if (TEMP_FAILURE_RETRY(read(ch->ctl_fd, &c, 1)) != 1) {
+                // the client is gone, or the channel closed
+                break;
+            }
+            struct winsize ws = {};
+            if (c == 'W' && !ch->no_tty && 0 == ioctl(ch->in_fd, TIOCGWINSZ, &ws)) {
+                if (0 != send_ws(&ctx.stream, ws, NULL, ch->id)) {
+                    break;
+                }
+            }
+        }
+        if (pfd[1].revents) {
+            size_t max_payload = stream_max_payload(&ctx.stream);
+            const size_t k_buf_size = max_payload < ctx.stream.bufs.io ? max_payload : ctx.stream.bufs.io;
+            char *buf = &bufstore[FRAME_HEADROOM];
+
+            ssize_t nread = TEMP_FAILURE_RETRY(read(ch->in_fd, buf, k_buf_size));
+            if (nread <= 0) {
+                in_open = 0;
+                if (0 != send_eof(&ctx.stream, ch->id)) {
+                    break;
+                }
+            } else if (0 != send_payload(&ctx.stream, CMD_DATA, buf, nread, ch->id)) {
+                break;
+            }
+        }
+    }
+
+    free(bufstore);
+
+    pthread_mutex_lock(&ctx.mu);
+    int closed = ch->closed;
+    pthread_mutex_unlock(&ctx.mu);
+    if (ch->file && !closed) {
+        // cancelled
+        chan_fail(ctx, ch, NULL, 0);
+    } else if (in_open && !closed) {
+        // the slave closes the channel once its command is done
+        (void)send_eof(&ctx.stream, ch->id);
+    }
+    chan_put(ch);
+    return NULL;
+}
+
+// [flags] with the client's stdin, stdout and stderr; a file transfer
+// adds [offset 8 bytes][path] and its file is passed as stdin and stdout
+static int recv_open(int fd, uint8_t *buf, size_t bufsize, size_t &len, int fds[3]) {
+    char cbuf[CMSG_SPACE(3 * sizeof(int))] = {};
+    struct iovec iov = {buf, bufsize};
+    struct msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+    ssize_t nread = TEMP_FAILURE_RETRY(recvmsg(fd, &msg, MSG_CMSG_CLOEXEC));
+    if (nread < 1) {
+        log_err(errno, "recvmsg(control)");
+        return -1;
+    }
+    len = (size_t)nread;
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS
+        || cmsg->cmsg_len != CMSG_LEN(3 * sizeof(int)))
+    {
+        log_err(0, "recvmsg(control): expected 3 fds");
+        return -1;
+    }
+    memcpy(fds, CMSG_DATA(cmsg), 3 * sizeof(int));
+    return 0;
+}
+
+static int send_open_request(int fd, const void *buf, size_t len, const int fds[3]) {
+    char cbuf[CMSG_SPACE(3 * sizeof(int))] = {};
+    struct iovec iov = {(void *)buf, len};
+    struct msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(3 * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, 3 * sizeof(int));
+    if (TEMP_FAILURE_RETRY(sendmsg(fd, &msg, 0)) != (ssize_t)len) {
+        log_err(errno, "sendmsg(control)");
+        return -1;
+    }
+    return 0;
+}
+
+// a channel that got no threads: the client exits with 1 and its fds are
+// closed with the map's reference and those of the threads
+static void chan_abort(Context &ctx, Channel *ch) {
+    __atomic_store_n(&ch->failed, 1, __ATOMIC_RELAXED);
+    chan_end(ctx, ch);
+    chan_put(ch);
+    chan_put(ch);
+}
+
+// opens a channel for a new client, takes fd
+static int control_attach(Context &ctx, int fd) {
+    uint8_t buf[9 + PATH_MAX + 1];
+    size_t len = 0;
+    int fds[3] = {-1, -1, -1};
+    if (0 != recv_open(fd, buf, sizeof(buf) - 1, len, fds)) {
+        (void)close(fd);
+        return -1;
+    }
+    uint8_t flags = buf[0];
+    uint8_t file = flags & OPEN_F_GET ? OPEN_F_GET : flags & OPEN_F_PUT;
+    uint64_t offset = 0;
+    const char *path = (const char *)&buf[9];
+    buf[len] = '\0';
+    if (file && (!ctx.file || len <= 9 || strlen(path) != len - 9 || strlen(path) >= PATH_MAX)) {
+        (void)dprintf(fds[2], "pty_proxy_master: %s\n", ctx.file ? "bad file request" : "the slave does not take files");
+        uint8_t status = 1;
+        (void)write(fd, &status, 1);
+        int all[] = {fd, fds[0], fds[1], fds[2]};
+        for (int each : all) {
+            (void)close(each);
+        }
+        return -1;
+    }
+    for (size_t i = 0; file && i < 8; ++i) {
+        offset |= (uint64_t)buf[1 + i] << (8 * i);
+    }
+
+    Channel *ch = new Channel;
+    ch->ctx = &ctx;
+    ch->no_tty = file || (flags & OPEN_F_NO_TTY);
+    ch->file = file;
+    ch->next = offset;
+    ch->ctl_fd = fd;
+    ch->in_fd = fds[0];
+    ch->out_fd = fds[1];
+    ch->err_fd = fds[2];
+    ch->out_q.fd = ch->out_fd;
+    ch->err_q.fd = ch->err_fd;
+    ch->out_q.defer = ch->err_q.defer = 1;
+    // the map, l2r_chan() and chan_writer()
+    ch->refs = 3;
+
+    pthread_mutex_lock(&ctx.mu);
+    // the ids above are the forwards'
+    const uint32_t max_chan = k_fwd_first_chan - 1;
+    if (ctx.chans.size() < max_chan) {
+        while (ctx.chans.count(ctx.next_chan)) {
+            ctx.next_chan = ctx.next_chan % max_chan + 1;
+        }
+        ch->id = ctx.next_chan;
+        ctx.next_chan = ctx.next_chan % max_chan + 1;
+        ctx.chans[ch->id] = ch;
+    }
+    pthread_mutex_unlock(&ctx.mu);
+    if (ch->id == 0) {
+        log_err(0, "[control_attach] out of channels");
+        ch->refs = 1;
+        chan_put(ch);
+        return -1;
+    }
+
+    struct winsize ws = {};
+    if (!ch->no_tty && 0 != ioctl(ch->in_fd, TIOCGWINSZ, &ws)) {
+        log_err(errno, "[chan:%u] ioctl(in_fd, TIOCGWINSZ, &ws)", ch->id);
+    }
+    log_dbg("[control_attach] [chan:%u][flags:%u]", ch->id, flags);
+    if (0 != (file ? xfer_open(&ctx.stream, ch->id, file, offset, path) : send_open(&ctx.stream, ch->id, flags, ws))) {
+        chan_abort(ctx, ch);
+        return -1;
+    }
+
+    pthread_attr_t attr;
+    if (0 != thread_attr_init(&attr, 1)) {
+        // the slave closes it, later frames are dropped
+        (void)send_eof(&ctx.stream, ch->id);
+        chan_abort(ctx, ch);
+        return -1;
+    }
+    pthread_t thread_id;
+    int err = pthread_create(&thread_id, &attr, &chan_writer, ch);
+    if (err) {
+        log_err(err, "pthread_create(&thread_id, &attr, &chan_writer, ch)");
+        (void)pthread_attr_destroy(&attr);
+        (void)send_eof(&ctx.stream, ch->id);
+        chan_abort(ctx, ch);
+        return -1;
+    }
+    err = pthread_create(&thread_id, &attr, &l2r_chan, ch);
+    (void)pthread_attr_destroy(&attr);
+    if (err) {
+        log_err(err, "pthread_create(&thread_id, &attr, &l2r_chan, ch)");
+        // the slave closes it
+        (void)send_eof(&ctx.stream, ch->id);
+        chan_put(ch);
+        return -1;
+    }
+    return 0;
+}
+
+static void *control_accept(void *user) {
+    Context &ctx = *(Context *)user;
+    while (1) {
+        int fd = TEMP_FAILURE_RETRY(accept4(ctx.control_fd, NULL, NULL, SOCK_CLOEXEC));
+        if (fd < 0) {
+            // EINVAL: shut down by control_stop()
+            if (errno != EINVAL) {
+                log_err(errno, "accept(control)");
+            }
+            break;
+        }
+        (void)control_attach(ctx, fd);
+    }
+    return NULL;
+}
+
+static int control_addr(const char *path, struct sockaddr_un &addr) {
+    addr = {};
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        log_err(0, "control path too long: %s", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    return 0;
+}
+
+// called once the slave accepted channels
+static int control_listen(Context &ctx) {
+    struct sockaddr_un addr;
+    if (0 != control_addr(ctx.control_path, addr)) {
+        return -1;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        log_err(errno, "socket(AF_UNIX)");
+        return -1;
+    }
+    if (0 != bind(fd, (struct sockaddr *)&addr, sizeof(addr)) || 0 != listen(fd, 16)) {
+        log_err(errno, "bind(%s)", ctx.control_path);
+        (void)close(fd);
+        return -1;
+    }
+    ctx.control_fd = fd;
+
+    pthread_attr_t attr;
+    if (0 != thread_attr_init(&attr, 1)) {
+        return -1;
+    }
+    pthread_t thread_id;
+    int err = pthread_create(&thread_id, &attr, &control_accept, &ctx);
+    (void)pthread_attr_destroy(&attr);
+    if (err) {
+        log_err(err, "pthread_create(&thread_id, &attr, &control_accept, &ctx)");
+        return -1;
+    }
+    log_dbg("[control_listen] %s", ctx.control_path);
+    return 0;
+}
+
+static void control_stop(Context &ctx) {
+    if (ctx.control_fd >= 0 && ctx.control_path) {
+        (void)unlink(ctx.control_path);
+        (void)shutdown(ctx.control_fd, SHUT_RDWR);
+        ctx.control_path = NULL;
+    }
+}
+
+// --control client: the master that owns the socket does the work, we
+// only pass our stdio and window changes, then wait for the channel to close
+static int run_client(int fd, int no_tty) {
+    if (!no_tty) {
+        if (atexit(tty_reset) != 0) {
+            log_err(errno, "atexit(tty_reset)");
+            return -1;
+        }
+        if (int err = tty_set_raw(STDIN_FILENO, &g_tty_orig)) {
+            log_err(err, "tty_set_raw(STDIN_FILENO)");
+            return -1;
+        }
+        // no SA_RESTART, read() below returns EINTR
+        struct sigaction sa = {};
+        sa.sa_handler = &set_winch;
+        sigemptyset(&sa.sa_mask);
+        (void)sigaction(SIGWINCH, &sa, NULL);
+    }
+    uint8_t flags = no_tty ? OPEN_F_NO_TTY : 0;
+    int fds[3] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+    if (0 != send_open_request(fd, &flags, 1, fds)) {
+        return -1;
+    }
+
+    g_winch = 0;
+    while (1) {
+        if (g_winch) {
+            g_winch = 0;
+            (void)write(fd, "W", 1);
+        }
+        uint8_t status = 0;
+        ssize_t nread = read(fd, &status, 1);
+        if (nread < 0 && errno == EINTR) {
+            continue;
+        }
+        if (nread != 1) {
+            log_err(errno, "control connection lost");
+            return -1;
+        }
+        return status;
+    }
+}
+
+// --get and --put through the master on the control socket, it moves the
+// file; we open ours and wait for the status. --resume continues a get at
+// the size of the local file, a put at the size of the remote one.
+static int run_transfer(int fd, uint8_t file, const char *remote, const char *local, int resume) {
+    int get = file == OPEN_F_GET;
+    int file_fd = get ? open(local, O_WRONLY | O_CREAT | O_CLOEXEC | (resume ? 0 : O_TRUNC), 0666) : open(local, O_RDONLY | O_CLOEXEC);
+    if (file_fd < 0) {
+        log_err(errno, "open(%s)", local);
+        return 1;
+    }
+    uint64_t offset = 0;
+    struct stat st;
+    if (resume && get) {
+        if (0 != fstat(file_fd, &st)) {
+            log_err(errno, "fstat(%s)", local);
+            (void)close(file_fd);
+            return 1;
+        }
+        offset = (uint64_t)st.st_size;
+    } else if (resume) {
+        offset = k_xfer_append;
+    }
+
+    size_t path_len = strlen(remote);
+    if (path_len == 0 || path_len >= PATH_MAX) {
+        log_err(0, "bad remote path: %s", remote);
+        (void)close(file_fd);
+        return 1;
+    }
+    uint8_t buf[9 + PATH_MAX];
+    buf[0] = file;
+    for (size_t i = 0; i < 8; ++i) {
+        buf[1 + i] = (uint8_t)(offset >> (8 * i));
+    }
+    memcpy(&buf[9], remote, path_len);
+    int fds[3] = {file_fd, file_fd, STDERR_FILENO};
+    int err = send_open_request(fd, buf, 9 + path_len, fds);
+    (void)close(file_fd);
+    if (err) {
+        return -1;
+    }
+
+    uint8_t status = 0;
+    if (TEMP_FAILURE_RETRY(read(fd, &status, 1)) != 1) {
+        log_err(errno, "control connection lost");
+        return -1;
+    }
+    return status;
+}
+
+// a keystroke is timed until the output it causes, the first one counts
+static void note_input(Context &ctx) {
+    uint64_t idle = 0;
+    (void)__atomic_compare_exchange_n(&ctx.key_at, &idle, monotonic_us(), 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+static void note_output(Context &ctx) {
+    uint64_t key_at = __atomic_exchange_n(&ctx.key_at, 0, __ATOMIC_RELAXED);
+    if (key_at) {
+        hist_record(ctx.echo_hist, monotonic_us() - key_at);
+    }
+}
+
+static void log_latency(Context &ctx) {
+    hist_log(ctx.echo_hist, "echo");
+    if (ctx.ping_us) {
+        hist_log(ctx.ping_hist, "ping");
+    }
+}
+
+static void stats_dump(std::string &out, void *user) {
+    Context &ctx = *(Context *)user;
+    char labels[64];
+    snprintf(labels, sizeof(labels), "role=\"master\",pid=\"%d\"", (int)getpid());
+    stats_format(out, ctx.stream.stats, labels);
+    stats_format_hist(out, "echo", ctx.echo_hist, labels);
+    stats_format_hist(out, "ping", ctx.ping_hist, labels);
+    const OutQueue &o = ctx.out;
+    stats_format_value(out, "stdout_writes_total", "counter", "write() calls on stdout.",
+        __atomic_load_n(&o.writes, __ATOMIC_RELAXED), labels);
+    stats_format_value(out, "stdout_queue_high_water_bytes", "gauge", "Most output waiting for stdout.",
+        __atomic_load_n(&o.high_water, __ATOMIC_RELAXED), labels);
+    stats_format_value(out, "stdout_stalls_total", "counter", "Transport reads held up by a full stdout queue.",
+        __atomic_load_n(&o.stalls, __ATOMIC_RELAXED), labels);
+    if (ctx.predict) {
+        pthread_mutex_lock(&ctx.predict_mu);
+        uint64_t guessed = ctx.pr.guessed;
+        uint64_t confirmed = ctx.pr.confirmed;
+        uint64_t wrong = ctx.pr.wrong;
+        pthread_mutex_unlock(&ctx.predict_mu);
+        stats_format_value(out, "predict_guessed_total", "counter", "Keys shown before their echo, or waiting to.",
+            guessed, labels);
+        stats_format_value(out, "predict_confirmed_total", "counter", "Guessed keys echoed as shown.", confirmed, labels);
+        stats_format_value(out, "predict_wrong_total", "counter", "Epochs of guesses taken back.", wrong, labels);
+    }
+}
+
+static int recv_ping(Context &ctx, const Parser &p) {
+    uint8_t flags = 0;
+    uint64_t time = 0;
+    if (0 != ping_decode(p.payload, p.size, flags, time)) {
+        return -1;
+    }
+    if (flags & PING_F_PONG) {
+        hist_record(ctx.ping_hist, monotonic_us() - time);
+        return 0;
+    }
+    return send_ping(&ctx.stream, PING_F_PONG, time);
+}
+
+static int write_stdout(Context &ctx, const void *buf, size_t len) {
+    if (ctx.out.fd >= 0) {
+        return outq_write(ctx.out, buf, len);
+    }
+    return write_full(STDOUT_FILENO, buf, len) == (ssize_t)len ? 0 : -1;
+}
+
+// --predict: what the guesses change on the screen, from l2r()
+static void predict_write(Context &ctx, const std::string &out) {
+    if (!out.empty()) {
+        (void)write_stdout(ctx, out.data(), out.size());
+        outq_kick(ctx.out);
+    }
+}
+
+static void predict_keys(Context &ctx, const void *buf, size_t len) {
+    if (!ctx.predict) {
+        return;
+    }
+    std::string out;
+    pthread_mutex_lock(&ctx.predict_mu);
+    predict_input(ctx.pr, (const uint8_t *)buf, len, out);
+    predict_write(ctx, out);
+    pthread_mutex_unlock(&ctx.predict_mu);
+}
+
+// the guesses come off the screen before the output and go back after it
+static int write_output(Context &ctx, const void *buf, size_t len) {
+    if (!ctx.predict) {
+        return write_stdout(ctx, buf, len);
+    }
+    std::string before;
+    std::string after;
+    pthread_mutex_lock(&ctx.predict_mu);
+    predict_output(ctx.pr, (const uint8_t *)buf, len, before, after);
+    int err = (!before.empty() && 0 != write_stdout(ctx, before.data(), before.size()))
+        || 0 != write_stdout(ctx, buf, len)
+        || (!after.empty() && 0 != write_stdout(ctx, after.data(), after.size()));
+    pthread_mutex_unlock(&ctx.predict_mu);
+    return err ? -1 : 0;
+}
+
 static int frame_cb(Parser &p, void *user) {
     Context &ctx = *(Context *)user;
+    if (p.chan != 0) {
+        return fwd_frame(ctx.fwd, p) ? 0 : chan_frame(ctx, p);
+    }
+
     if (p.cmd == CMD_DATA) {
-        if (TEMP_FAILURE_RETRY(write(STDOUT_FILENO, p.payload, p.size)) != (ssize_t)p.size) {
+        note_output(ctx);
+        if (0 != write_output(ctx, p.payload, p.size)) {
             log_err(errno, "write(STDOUT_FILENO, p.payload, p.size)");
             return -1;
         }
+        ctx.rx_seq += p.size;
     } else if (p.cmd == CMD_ERR) {
-        if (TEMP_FAILURE_RETRY(write(STDERR_FILENO, p.payload, p.size)) != (ssize_t)p.size) {
+        if (write_full(STDERR_FILENO, p.payload, p.size) != (ssize_t)p.size) {
             log_err(errno, "write(STDERR_FILENO, p.payload, p.size)");
             return -1;
         }
     } else if (p.cmd == CMD_EOF) {
         log_dbg("[frame_cb] EOF msg received");
+        pthread_mutex_lock(&ctx.mu);
         ctx.msg_eof = 1;
+        pthread_cond_signal(&ctx.cond);
+        pthread_mutex_unlock(&ctx.mu);
+        return 0;
+    } else if (p.cmd == CMD_HELLO) {
+        // the slave picked the version, ack it and switch too
+        Hello h;
+        (void)hello_decode(p.payload, p.size, h);
+        Hello ack;
+        ack.version = h.version;
+        ack.flags = h.flags & ctx.hello_flags;
+        ack.max_frame = ctx.stream.bufs.max_frame;
+        // the slave may be done already, keep reading what it sent
+        (void)send_hello(&ctx.stream, ack, h.max_frame);
+        ctx.backoff_s = 0;
+        __atomic_store_n(&ctx.ping, !!(ack.flags & HELLO_F_PING), __ATOMIC_RELAXED);
+        if (ack.flags & HELLO_F_RESUME) {
+            // a persisted session, only what we miss is sent
+            (void)send_resume(&ctx.stream, ctx.rx_seq);
+        }
+        if (ctx.control_path) {
+            if (!(ack.flags & HELLO_F_MUX)) {
+                log_err(0, "the slave does not support channels, --control is off");
+            } else {
+                ctx.mux = 1;
+                ctx.file = !!(ack.flags & HELLO_F_FILE);
+                (void)control_listen(ctx);
+            }
+        }
+        if (!ctx.local_fwd.empty() || !ctx.remote_fwd.empty()) {
+            if ((ack.flags & (HELLO_F_MUX | HELLO_F_FWD)) != (HELLO_F_MUX | HELLO_F_FWD)) {
+                log_err(0, "the slave does not forward, --local-forward and --remote-forward are off");
+            } else {
+                ctx.mux = 1;
+                ctx.fwd.stream = &ctx.stream;
+                for (size_t i = 0; i < ctx.local_fwd.size(); i += 2) {
+                    (void)fwd_listen(ctx.fwd, ctx.local_fwd[i].c_str(), ctx.local_fwd[i + 1].c_str());
+                }
+                for (size_t i = 0; i < ctx.remote_fwd.size(); i += 2) {
+                    (void)fwd_request(ctx.fwd, ctx.remote_fwd[i].c_str(), ctx.remote_fwd[i + 1].c_str());
+                }
+            }
+        }
         return 0;
+    } else if (p.cmd == CMD_PING) {
+        // the slave may be done already, keep reading what it sent
+        (void)recv_ping(ctx, p);
     } else {
         log_err(0, "Unknown cmd: %u", p.cmd);
         return -1;
@@ -57,44 +930,79 @@ static int frame_cb(Parser &p, void *user) {
     return 0;
 }
 
-// stdin --> child
-static void *l2r(void *user) {
-    Context &ctx = *(Context *)user;
+// stdin --> child, the transport is written by another thread
+static int l2r_pipelined(Context &ctx) {
+    Pipeline pl;
+    pl.stream = &ctx.stream;
+    // typed while the transport is down, dropped
+    pl.keep_going = ctx.reconnect;
+    if (0 != pipeline_start(pl, ctx.pipeline)) {
+        return -1;
+    }
     int ret = 0;
+    int eof = 0;
+    PipeBuf *b = NULL;
+    while (1) {
+        // sigwinch
+        if (need_winsize(ctx)) {
+            if (0 != (ret = send_winsize(ctx)) && !ctx.reconnect) {
+                break;
+            }
+        }
+
+        // NULL once the writer failed
+        if (!b && !(b = pipeline_get(pl))) {
+            break;
+        }
+        ssize_t nread = read(STDIN_FILENO, &b->data[FRAME_HEADROOM], pipeline_room(pl));
+        if (nread < 0) {
+            if (errno == EINTR) {
+                log_dbg("got EINTR, sigwinch: %d", g_winch);
+                continue;   // maybe sigwinch, b is kept
+            }
 
-    if (!ctx.no_tty) {
-        // unblock sigwinch for me
-        sigset_t sigset;
-        sigemptyset(&sigset);
-        sigaddset(&sigset, SIGWINCH);
-        if (0 != pthread_sigmask(SIG_UNBLOCK, &sigset, NULL)) {
-            log_err(errno, "pthread_sigmask(SIG_UNBLOCK, &sigset, NULL)");
+            log_err(errno, "read(STDIN_FILENO)");
+            ret = -1;
+            break;
         }
-        // setup sigwinch
-        struct sigaction sa = {};
-        sa.sa_handler = &set_winch;
-        sigemptyset(&sa.sa_mask);
-        sa.sa_flags = 0;
-        (void)sigaction(SIGWINCH, &sa, NULL);
+        if (nread == 0) {
+            eof = 1;
+            break;
+        }
+
+        note_input(ctx);
+        predict_keys(ctx, &b->data[FRAME_HEADROOM], nread);
+        b->len = nread;
+        pipeline_put(pl, b);
+        b = NULL;
     }
+    // the eof goes after the data still queued
+    int err = pipeline_finish(pl);
+    if (eof && !err) {
+        (void)send_eof(&ctx.stream);
+    }
+    return ret ? ret : err;
+}
 
+// stdin --> child, read and written by this thread
+static int l2r_direct(Context &ctx) {
+    char *bufstore = (char *)malloc(FRAME_HEADROOM + ctx.stream.bufs.io);
+    if (!bufstore) {
+        log_err(errno, "[l2r] out of memory");
+        return -1;
+    }
+    char *buf = &bufstore[FRAME_HEADROOM];
+    int ret = 0;
     while (1) {
         // sigwinch
-        if (!ctx.no_tty && g_winch) {
-            g_winch = 0;
-            struct winsize ws = {};
-            if (0 != (ret = ioctl(STDIN_FILENO, TIOCGWINSZ, &ws))) {
-                log_err(errno, "ioctl(STDIN_FILENO, TIOCGWINSZ, &ws)");
-                break;
-            }
-            if (0 != (ret = send_ws(&ctx.stream, ws))) {
+        if (need_winsize(ctx)) {
+            if (0 != (ret = send_winsize(ctx)) && !ctx.reconnect) {
                 break;
             }
         }
 
-        char bufstore[MAX_FRAME_SIZE];
-        const size_t k_buf_size = MAX_FRAME_SIZE - FRAME_HEADER_SIZE;
-        char *buf = &bufstore[FRAME_HEADER_SIZE];
+        size_t max_payload = stream_max_payload(&ctx.stream);
+        const size_t k_buf_size = max_payload < ctx.stream.bufs.io ? max_payload : ctx.stream.bufs.io;
 
         ssize_t nread = read(STDIN_FILENO, buf, k_buf_size);
         if (nread < 0) {
@@ -112,10 +1020,51 @@ static void *l2r(void *user) {
             break;
         }
 
-        if (0 != (ret = send_payload(&ctx.stream, CMD_DATA, buf, nread))) {
+        note_input(ctx);
+        predict_keys(ctx, buf, nread);
+        // the transport may have been reset to v1 during the read;
+        // send_payload() overwrites the tail of the previous chunk with a
+        // header
+        ret = 0;
+        for (ssize_t pos = 0; pos < nread && ret == 0; ) {
+            max_payload = stream_max_payload(&ctx.stream);
+            size_t len = (size_t)(nread - pos) < max_payload ? (size_t)(nread - pos) : max_payload;
+            ret = send_payload(&ctx.stream, CMD_DATA, &buf[pos], len);
+            pos += (ssize_t)len;
+        }
+        if (ret != 0) {
+            if (ctx.reconnect) {
+                // typed while the transport is down, dropped
+                continue;
+            }
             break;
         }
     }
+    free(bufstore);
+    return ret;
+}
+
+// stdin --> child
+static void *l2r(void *user) {
+    Context &ctx = *(Context *)user;
+
+    if (!ctx.no_tty) {
+        // unblock sigwinch for me
+        sigset_t sigset;
+        sigemptyset(&sigset);
+        sigaddset(&sigset, SIGWINCH);
+        if (0 != pthread_sigmask(SIG_UNBLOCK, &sigset, NULL)) {
+            log_err(errno, "pthread_sigmask(SIG_UNBLOCK, &sigset, NULL)");
+        }
+        // setup sigwinch
+        struct sigaction sa = {};
+        sa.sa_handler = &set_winch;
+        sigemptyset(&sa.sa_mask);
+        sa.sa_flags = 0;
+        (void)sigaction(SIGWINCH, &sa, NULL);
+    }
+
+    int ret = ctx.pipeline ? l2r_pipelined(ctx) : l2r_direct(ctx);
 
     pthread_mutex_lock(&ctx.mu);
     ctx.exit_flag |= 1;
@@ -125,12 +1074,132 @@ static void *l2r(void *user) {
     return NULL;
 }
 
+// runs SLAVE_CMD with its stdin and stdout on pipes to us
+static int spawn_slave(char *const *argv, pid_t &pid, int &rfd, int &wfd) {
+    int pipe_fd[2] = {-1, -1};
+    if (0 != pipe2(pipe_fd, O_CLOEXEC)) {
+        log_err(errno, "pipe()");
+        return -1;
+    }
+    int parent_r = pipe_fd[0];
+    int child_w = pipe_fd[1];
+    if (0 != pipe2(pipe_fd, O_CLOEXEC)) {
+        log_err(errno, "pipe()");
+        (void)close(parent_r);
+        (void)close(child_w);
+        return -1;
+    }
+    int child_r = pipe_fd[0];
+    int parent_w = pipe_fd[1];
+
+    // fork
+    pid = fork();
+    if (pid < 0) {
+        log_err(errno, "fork()");
+        int fds[] = {parent_r, child_w, child_r, parent_w};
+        for (int fd : fds) {
+            (void)close(fd);
+        }
+        return -1;
+    }
+
+    // child
+    if (pid == 0) {
+        // ours are blocked for sigwait
+        sigset_t sigset;
+        sigemptyset(&sigset);
+        (void)sigprocmask(SIG_SETMASK, &sigset, NULL);
+        if (dup2(child_r, STDIN_FILENO) == -1) {
+            log_err(errno, "dup2(child_r, STDIN_FILENO)");
+            _exit(127);
+        }
+        if (dup2(child_w, STDOUT_FILENO) == -1) {
+            log_err(errno, "dup2(child_w, STDOUT_FILENO)");
+            _exit(127);
+        }
+        (void)execvp(argv[0], argv);
+        log_err(errno, "execvp()");
+        _exit(127);
+    }
+
+    // parent
+    (void)close(child_r);
+    (void)close(child_w);
+    rfd = parent_r;
+    wfd = parent_w;
+    return 0;
+}
+
+// --reconnect: runs the slave again until a transport is up, the session
+// lives on if the slave has --persist
+static void reconnect(Context &ctx) {
+    int old_r = ctx.stream.rfd;
+    int old_w = ctx.stream.wfd;
+    (void)kill(ctx.slave_pid, SIGTERM);
+    (void)TEMP_FAILURE_RETRY(waitpid(ctx.slave_pid, NULL, 0));
+    while (1) {
+        log_err(0, "transport lost, reconnecting in %us", ctx.backoff_s);
+        (void)sleep(ctx.backoff_s);
+        ctx.backoff_s = ctx.backoff_s ? (ctx.backoff_s < 16 ? ctx.backoff_s * 2 : 30) : 1;
+
+        int rfd = -1;
+        int wfd = -1;
+        if (0 != spawn_slave(ctx.slave_argv, ctx.slave_pid, rfd, wfd)) {
+            continue;
+        }
+        // no writer is on the old fds after this
+        stream_reset(&ctx.stream, rfd, wfd);
+        if (old_r >= 0) {
+            (void)close(old_r);
+            (void)close(old_w);
+            old_r = old_w = -1;
+        }
+        ctx.hello_sent = 0;
+        if (0 == send_winsize(ctx)) {
+            return;
+        }
+        (void)kill(ctx.slave_pid, SIGTERM);
+        (void)TEMP_FAILURE_RETRY(waitpid(ctx.slave_pid, NULL, 0));
+    }
+}
+
+// pings the slave every --ping, dumps the histograms on SIGUSR1
+static void *stats(void *user) {
+    Context &ctx = *(Context *)user;
+    sigset_t sigset;
+    sigemptyset(&sigset);
+    sigaddset(&sigset, SIGUSR1);
+    struct timespec ts = {(time_t)(ctx.ping_us / 1000000), (long)(ctx.ping_us % 1000000) * 1000};
+    while (1) {
+        int sig = ctx.ping_us ? sigtimedwait(&sigset, NULL, &ts) : sigwaitinfo(&sigset, NULL);
+        if (sig == SIGUSR1) {
+            log_latency(ctx);
+        } else if (sig < 0 && errno == EAGAIN && __atomic_load_n(&ctx.ping, __ATOMIC_RELAXED)) {
+            // lost with the transport if it is down
+            (void)send_ping(&ctx.stream, 0, monotonic_us());
+        }
+    }
+    return NULL;
+}
+
 // child --> stdout
 static void *r2l(void *user) {
     Context &ctx = *(Context *)user;
     int ret = 0;
-    Parser p;
-    while (!p.eof && !ctx.msg_eof && 0 == (ret = feed_frame(p, &ctx.stream, frame_cb, &ctx))) {}
+    while (1) {
+        Parser p;
+        // other channels outlive channel 0
+        // what one pass parsed goes to stdout together
+        while (!p.eof && !(ctx.msg_eof && !ctx.mux) && 0 == (ret = feed_frame(p, &ctx.stream, frame_cb, &ctx))) {
+            outq_kick(ctx.out);
+        }
+        outq_kick(ctx.out);
+        if (!ctx.reconnect || ctx.msg_eof) {
+            break;
+        }
+        reconnect(ctx);
+        ret = 0;
+    }
 
     pthread_mutex_lock(&ctx.mu);
     ctx.exit_flag |= 2;
@@ -140,84 +1209,391 @@ static void *r2l(void *user) {
     return NULL;
 }
 
+// single threaded engine: stdin, the transport and sigwinch in one epoll loop
+static int run_epoll(Context &ctx) {
+    // stop reading stdin while this much is waiting for the transport
+    const size_t k_high_water = 256 * 1024;
+
+    WriteQueue twq;
+    twq.fd = ctx.stream.wfd;
+    twq.stats = &ctx.stream.stats.tx;
+    ctx.stream.wq = &twq;
+
+    int stdin_flags = -1;
+    if (0 != fd_set_nonblock(STDIN_FILENO, &stdin_flags)
+        || 0 != fd_set_nonblock(ctx.stream.rfd, NULL)
+        || 0 != fd_set_nonblock(ctx.stream.wfd, NULL))
+    {
+        log_err(errno, "fd_set_nonblock()");
+        return -1;
+    }
+
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0) {
+        log_err(errno, "epoll_create1()");
+        return -1;
+    }
+
+    EvFd ev_stdin;
+    ev_stdin.fd = STDIN_FILENO;
+    EvFd ev_rfd;
+    ev_rfd.fd = ctx.stream.rfd;
+    EvFd ev_wfd;
+    ev_wfd.fd = ctx.stream.wfd;
+    EvFd ev_sig;
+    ev_sig.fd = -1;
+
+    int ret = 0;
+    int stdin_done = 0;
+    // regular files can not be polled, they are always readable
+    int stdin_always = 0;
+    uint64_t ping_at = monotonic_us() + ctx.ping_us;
+    Parser p;
+    char *bufstore = (char *)malloc(FRAME_HEADROOM + ctx.stream.bufs.io);
+    if (!bufstore) {
+        log_err(errno, "[run_epoll] out of memory");
+        ret = -1;
+        goto L_RETURN;
+    }
+
+    {
+        // blocked since main()
+        sigset_t sigset;
+        sigemptyset(&sigset);
+        sigaddset(&sigset, SIGUSR1);
+        if (!ctx.no_tty) {
+            sigaddset(&sigset, SIGWINCH);
+        }
+        ev_sig.fd = signalfd(-1, &sigset, SFD_NONBLOCK | SFD_CLOEXEC);
+        if (ev_sig.fd < 0 || 0 != ev_update(epfd, ev_sig, EPOLLIN)) {
+            log_err(errno, "signalfd(SIGWINCH, SIGUSR1)");
+            ret = -1;
+            goto L_RETURN;
+        }
+    }
+
+    while (!p.eof && !ctx.msg_eof) {
+        // sigwinch
+        if (need_winsize(ctx)) {
+            if (0 != (ret = send_winsize(ctx))) {
+                ctx.l2r = ret;
+                break;
+            }
+        }
+
+        // interests
+        int want_stdin = !stdin_done && wq_pending(twq) < k_high_water;
+        if (!stdin_always && 0 != ev_update(epfd, ev_stdin, want_stdin ? (uint32_t)EPOLLIN : 0)) {
+            if (errno != EPERM) {
+                log_err(errno, "epoll_ctl(STDIN_FILENO)");
+                ret = -1;
+                break;
+            }
+            stdin_always = 1;
+        }
+        if (0 != ev_update(epfd, ev_rfd, EPOLLIN)
+            || 0 != ev_update(epfd, ev_wfd, wq_pending(twq) ? (uint32_t)EPOLLOUT : 0))
+        {
+            log_err(errno, "epoll_ctl(transport)");
+            ret = -1;
+            break;
+        }
+
+        // ping
+        int timeout = stdin_always && want_stdin ? 0 : -1;
+        if (ctx.ping_us && ctx.ping) {
+            uint64_t now = monotonic_us();
+            if (now >= ping_at) {
+                (void)send_ping(&ctx.stream, 0, now);
+                ping_at = now + ctx.ping_us;
+            }
+            int ping_ms = (int)((ping_at - now + 999) / 1000);
+            timeout = timeout < 0 || ping_ms < timeout ? ping_ms : timeout;
+        }
+
+        struct epoll_event events[8];
+        int n = epoll_wait(epfd, events, 8, timeout);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            log_err(errno, "epoll_wait()");
+            ret = -1;
+            break;
+        }
+
+        int stdin_ready = stdin_always && want_stdin;
+        for (int i = 0; i < n; ++i) {
+            int fd = events[i].data.fd;
+            if (fd == ev_sig.fd) {
+                struct signalfd_siginfo si;
+                while (read(ev_sig.fd, &si, sizeof(si)) == sizeof(si)) {
+                    if (si.ssi_signo == SIGUSR1) {
+                        log_latency(ctx);
+                    } else {
+                        g_winch = 1;
+                    }
+                }
+            } else if (fd == STDIN_FILENO) {
+                stdin_ready = 1;
+            } else if (fd == ev_wfd.fd && (events[i].events & (EPOLLOUT | EPOLLERR))) {
+                if (0 != wq_flush(twq)) {
+                    ctx.l2r = ret = -1;
+                    goto L_RETURN;
+                }
+            }
+            // the transport fds may be the same
+            if (fd == ev_rfd.fd && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+                if (0 != (ret = feed_frame(p, &ctx.stream, frame_cb, &ctx))) {
+                    ctx.r2l = ret;
+                    goto L_RETURN;
+                }
+            }
+        }
+
+        // stdin --> child
+        if (stdin_ready) {
+            size_t max_payload = stream_max_payload(&ctx.stream);
+            const size_t k_buf_size = max_payload < ctx.stream.bufs.io ? max_payload : ctx.stream.bufs.io;
+            char *buf = &bufstore[FRAME_HEADROOM];
+
+            ssize_t nread = TEMP_FAILURE_RETRY(read(STDIN_FILENO, buf, k_buf_size));
+            if (nread < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+                log_err(errno, "read(STDIN_FILENO)");
+                ctx.l2r = -1;
+                stdin_done = 1;
+            } else if (nread == 0) {
+                (void)send_eof(&ctx.stream);
+                stdin_done = 1;
+            } else if (nread > 0) {
+                note_input(ctx);
+                if (0 != (ctx.l2r = send_payload(&ctx.stream, CMD_DATA, buf, nread))) {
+                    stdin_done = 1;
+                }
+            }
+            if (stdin_done) {
+                (void)ev_update(epfd, ev_stdin, 0);
+            }
+        }
+    }
+
+L_RETURN:
+    free(bufstore);
+    // best effort, the remote side is gone or done
+    (void)wq_flush(twq);
+    ctx.stream.wq = NULL;
+    wq_free(twq);
+    if (ev_sig.fd >= 0) {
+        (void)close(ev_sig.fd);
+    }
+    (void)close(epfd);
+    if (stdin_flags >= 0) {
+        (void)fcntl(STDIN_FILENO, F_SETFL, stdin_flags);
+    }
+    log_dbg("[run_epoll] [ret:%d] [l2r:%d][r2l:%d]", ret, ctx.l2r, ctx.r2l);
+    return ctx.l2r ? ctx.l2r : ctx.r2l ? ctx.r2l : ret;
+}
+
 int main(int argc, char *const *argv) {
+    trace_init();
+
     // parse args
     int arg_base64 = 0;
+    const char *arg_escape = NULL;
     int arg_no_tty = 0;
+    int arg_epoll = 0;
+    int arg_compress = 0;
+    int arg_reconnect = 0;
+    size_t arg_pipeline = 0;
+    int arg_latency = 0;
+    uint64_t arg_ping_us = 0;
+    int arg_proto = PROTO_VERSION;
+    const char *arg_control = NULL;
+    const char *arg_get = NULL;
+    const char *arg_put = NULL;
+    int arg_resume = 0;
+    int arg_predict = 0;
+    int arg_reliable = 0;
+    const char *arg_stats = NULL;
+    std::vector<std::string> arg_local_fwd;
+    std::vector<std::string> arg_remote_fwd;
     struct option long_options[] = {
         /* These options set a flag. */
         {"base64", no_argument, &arg_base64, 1},
         {"no-tty", no_argument, &arg_no_tty, 1},
+        {"epoll", no_argument, &arg_epoll, 1},
+        /* instead of --base64, escape only the bytes the transport mangles,
+           hex, e.g. --escape=00,03,0d */
+        {"escape", optional_argument, NULL, 'e'},
+        /* offer streaming compression, needs protocol v2 */
+        {"compress", no_argument, &arg_compress, 1},
+        /* run the slave again if the transport drops, see its --persist */
+        {"reconnect", no_argument, &arg_reconnect, 1},
+        /* read stdin on while a thread writes it, with N buffers */
+        {"pipeline", optional_argument, NULL, 'L'},
+        /* log the latency histograms at exit, SIGUSR1 does any time */
+        {"latency", no_argument, &arg_latency, 1},
+        /* measure the round trip to the slave every SEC seconds */
+        {"ping", required_argument, NULL, 'P'},
+        /* serve the counters on a unix socket at PATH */
+        {"stats", required_argument, NULL, 'S'},
+        /* highest protocol version to offer */
+        {"proto", required_argument, NULL, 'p'},
+        /* attach to the master listening on PATH, or become it */
+        {"control", required_argument, NULL, 'C'},
+        /* with --control, copy the file REMOTE from or to the slave:
+           --get=REMOTE LOCAL or --put=REMOTE LOCAL */
+        {"get", required_argument, NULL, 'g'},
+        {"put", required_argument, NULL, 'u'},
+        /* continue a transfer at the size of the file copied to */
+        {"resume", no_argument, &arg_resume, 1},
+        /* show the keys typed before their echo comes, for slow links */
+        {"predict", no_argument, &arg_predict, 1},
+        /* offer checked frames that are sent again if corrupted or lost,
+           for noisy serial lines; needs protocol v2, without compression */
+        {"reliable", no_argument, &arg_reliable, 1},
+        /* as ssh's -L and -R, LISTEN:HOST:PORT or LISTEN:PATH, repeatable;
+           LISTEN is [HOST:]PORT or a unix socket path */
+        {"local-forward", required_argument, NULL, 'l'},
+        {"remote-forward", required_argument, NULL, 'r'},
         {0, 0, 0, 0}
     };
 
     int option_index = -1;
-    while (-1 != getopt_long(argc, argv, "", long_options, &option_index)) {}
-    int slave_cmd_argc = argc - optind;
-    char *const *slave_cmd_argv = &argv[optind];
-    if (slave_cmd_argc < 1) {
-        log_err(0, "usage: pty_proxy_master [--base64] [--no-tty] -- SLAVE_CMD ARGS...");
+    int opt = 0;
+    while (-1 != (opt = getopt_long(argc, argv, "", long_options, &option_index))) {
+        if (opt == 'p') {
+            arg_proto = atoi(optarg);
+        } else if (opt == 'e') {
+            arg_escape = optarg ? optarg : "";
+        } else if (opt == 'L') {
+            arg_pipeline = optarg ? strtoull(optarg, NULL, 10) : k_pipeline_buffers;
+        } else if (opt == 'C') {
+            arg_control = optarg;
+        } else if (opt == 'g') {
+            arg_get = optarg;
+        } else if (opt == 'u') {
+            arg_put = optarg;
+        } else if (opt == 'P') {
+            arg_ping_us = (uint64_t)(atof(optarg) * 1000000);
+        } else if (opt == 'S') {
+            arg_stats = optarg;
+        } else if (opt == 'l' || opt == 'r') {
+            char listen[PATH_MAX];
+            char target[PATH_MAX];
+            if (0 != fwd_split(optarg, listen, sizeof(listen), target, sizeof(target))) {
+                return 1;
+            }
+            std::vector<std::string> &fwds = opt == 'l' ? arg_local_fwd : arg_remote_fwd;
+            fwds.push_back(listen);
+            fwds.push_back(target);
+        }
+    }
+    if (arg_proto < PROTO_V1 || arg_proto > PROTO_VERSION) {
+        log_err(0, "unsupported --proto=%d", arg_proto);
         return 1;
     }
-
-    // pipes
-    int pipe_fd[2] = {-1, -1};
-    if (0 != pipe(pipe_fd)) {
-        log_err(errno, "pipe()");
-        return -1;
+    if (arg_escape && arg_base64) {
+        log_err(0, "--escape and --base64 do not go together");
+        return 1;
     }
-    int parent_r = pipe_fd[0];
-    int child_w = pipe_fd[1];
-    if (0 != pipe(pipe_fd)) {
-        log_err(errno, "pipe()");
-        return -1;
+    EscapeSet escape_set;
+    esc_set_default(&escape_set);
+    if (arg_escape && *arg_escape && 0 != esc_set_parse(arg_escape, &escape_set)) {
+        log_err(0, "bad --escape=%s", arg_escape);
+        return 1;
     }
-    int child_r = pipe_fd[0];
-    int parent_w = pipe_fd[1];
-
-    // fork
-    pid_t pid = fork();
-    if (pid < 0) {
-        log_err(errno, "fork()");
-        return -1;
+    if (arg_control && (arg_epoll || arg_proto < PROTO_V2)) {
+        log_err(0, "--control needs the threaded engine and protocol v2");
+        return 1;
     }
-
-    // child
-    if (pid == 0) {
-        (void)close(parent_r);
-        (void)close(parent_w);
-        if (dup2(child_r, STDIN_FILENO) == -1) {
-            log_err(errno, "dup2(child_r, STDIN_FILENO)");
-            return -1;
+    int arg_fwd = !arg_local_fwd.empty() || !arg_remote_fwd.empty();
+    if (arg_fwd && (arg_epoll || arg_proto < PROTO_V2)) {
+        log_err(0, "--local-forward and --remote-forward need the threaded engine and protocol v2");
+        return 1;
+    }
+    if (arg_reconnect && (arg_epoll || arg_control || arg_fwd)) {
+        log_err(0, "--reconnect needs the threaded engine, without --control or forwards");
+        return 1;
+    }
+    if (arg_pipeline && arg_epoll) {
+        log_err(0, "--pipeline needs the threaded engine");
+        return 1;
+    }
+    if (arg_predict && (arg_epoll || arg_no_tty)) {
+        log_err(0, "--predict needs the threaded engine and a tty");
+        return 1;
+    }
+    if (arg_reliable && (arg_epoll || arg_base64 || arg_proto < PROTO_V2)) {
+        log_err(0, "--reliable needs the threaded engine and protocol v2, without --base64");
+        return 1;
+    }
+    if ((arg_get || arg_put) && (!arg_control || (arg_get && arg_put) || argc - optind != 1)) {
+        log_err(0, "usage: pty_proxy_master --control=PATH [--resume] --get=REMOTE LOCAL | --put=REMOTE LOCAL");
+        return 1;
+    }
+    if (arg_control) {
+        struct sockaddr_un addr;
+        if (0 != control_addr(arg_control, addr)) {
+            return 1;
         }
-        if (dup2(child_w, STDOUT_FILENO) == -1) {
-            log_err(errno, "dup2(child_w, STDOUT_FILENO)");
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+            log_err(errno, "socket(AF_UNIX)");
             return -1;
         }
-        if (child_r > STDERR_FILENO) {
-            (void)close(child_r);
+        if (0 == connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+            if (arg_get || arg_put) {
+                return run_transfer(fd, arg_get ? OPEN_F_GET : OPEN_F_PUT, arg_get ? arg_get : arg_put, argv[optind], arg_resume);
+            }
+            if (arg_fwd) {
+                log_err(0, "the forwards are the master's at %s, not set up", arg_control);
+            }
+            return run_client(fd, arg_no_tty);
+        }
+        if (arg_get || arg_put) {
+            log_err(errno, "connect(%s)", arg_control);
+            return 1;
         }
-        if (child_w > STDERR_FILENO) {
-            (void)close(child_w);
+        if (errno == ECONNREFUSED) {
+            // left by a master that is gone
+            (void)unlink(arg_control);
+        } else if (errno != ENOENT) {
+            log_err(errno, "connect(%s)", arg_control);
+            return -1;
         }
-        (void)execvp(slave_cmd_argv[0], slave_cmd_argv);
-        log_err(errno, "execvp()");
+        (void)close(fd);
+    }
+    int slave_cmd_argc = argc - optind;
+    char *const *slave_cmd_argv = &argv[optind];
+    if (slave_cmd_argc < 1) {
+        log_err(0, "usage: pty_proxy_master [--base64] [--escape[=XX,...]] [--no-tty] [--epoll] [--compress] [--reliable] [--reconnect] [--pipeline[=N]] [--predict] [--latency] [--ping=SEC] [--stats=PATH] [--proto=N] [--control=PATH [--get=REMOTE LOCAL | --put=REMOTE LOCAL]] [--local-forward=LISTEN:TARGET] [--remote-forward=LISTEN:TARGET] -- SLAVE_CMD ARGS...");
+        return 1;
+    }
+
+    pid_t pid = -1;
+    int parent_r = -1;
+    int parent_w = -1;
+    if (0 != spawn_slave(slave_cmd_argv, pid, parent_r, parent_w)) {
         return -1;
     }
 
-    // parent
-    (void)close(child_r);
-    (void)close(child_w);
+    // a write to an exited slave fails with EPIPE, its output is still read
+    (void)signal(SIGPIPE, SIG_IGN);
 
+    // block sigwinch and sigusr1 for all threads
+    sigset_t sigset;
+    sigemptyset(&sigset);
+    sigaddset(&sigset, SIGUSR1);
     if (!arg_no_tty) {
-        // block sigwinch for all threads
-        sigset_t sigset;
-        sigemptyset(&sigset);
         sigaddset(&sigset, SIGWINCH);
-        if (0 != pthread_sigmask(SIG_BLOCK, &sigset, NULL)) {
-            log_err(errno, "pthread_sigmask(SIG_BLOCK, &sigset, NULL)");
-            return -1;
-        }
+    }
+    if (0 != pthread_sigmask(SIG_BLOCK, &sigset, NULL)) {
+        log_err(errno, "pthread_sigmask(SIG_BLOCK, &sigset, NULL)");
+        return -1;
+    }
+
+    if (!arg_no_tty) {
 
         // reset tty on exit
         if (atexit(tty_reset) != 0) {
@@ -236,17 +1612,57 @@ int main(int argc, char *const *argv) {
     // init ctx
     Context ctx;
     ctx.no_tty = arg_no_tty;
+    ctx.proto = arg_proto;
+    ctx.hello_flags = (arg_compress ? HELLO_F_LZ : 0) | HELLO_F_RESUME | HELLO_F_PING;
+    if (arg_reliable) {
+        ctx.hello_flags |= HELLO_F_REL;
+    }
+    ctx.ping_us = arg_ping_us;
+    ctx.reconnect = arg_reconnect;
+    ctx.pipeline = arg_pipeline;
+    ctx.predict = arg_predict;
+    ctx.slave_argv = slave_cmd_argv;
+    ctx.slave_pid = pid;
+    if (arg_control) {
+        ctx.control_path = arg_control;
+        ctx.hello_flags |= HELLO_F_MUX | HELLO_F_FILE;
+    }
+    if (arg_fwd) {
+        ctx.local_fwd.swap(arg_local_fwd);
+        ctx.remote_fwd.swap(arg_remote_fwd);
+        ctx.hello_flags |= HELLO_F_MUX | HELLO_F_FWD;
+    }
     ctx.stream.rfd = parent_r;
     ctx.stream.wfd = parent_w;
-    ctx.stream.base64 = arg_base64;
+    stream_set_codec(&ctx.stream, arg_base64, arg_escape ? &escape_set : NULL);
+    stream_set_bufs(&ctx.stream, g_bufs);
+    if (arg_stats) {
+        ctx.stats.path = arg_stats;
+        ctx.stats.dump = &stats_dump;
+        ctx.stats.user = &ctx;
+        if (0 != stats_listen(ctx.stats)) {
+            return -1;
+        }
+    }
+
+    if (arg_epoll) {
+        int ret = run_epoll(ctx);
+        stats_stop(ctx.stats);
+        if (arg_latency) {
+            log_latency(ctx);
+        }
+        return ret;
+    }
 
     // start threads
+    ctx.out.fd = STDOUT_FILENO;
+    if (0 != outq_start(ctx.out)) {
+        return -1;
+    }
     pthread_attr_t attr;
-    if (0 != pthread_attr_init(&attr)) {
-        log_err(errno, "pthread_attr_init()");
+    if (0 != thread_attr_init(&attr, 1)) {
         return -1;
     }
-    (void)pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
     pthread_t thread_id;
     if (0 != pthread_create(&thread_id, &attr, &l2r, &ctx)) {
         log_err(errno, "pthread_create(&thread_id, &attr, &l2r, &ctx)");
@@ -256,13 +1672,40 @@ int main(int argc, char *const *argv) {
         log_err(errno, "pthread_create(&thread_id, &attr, &r2l, &ctx)");
         return -1;
     }
+    if (0 != pthread_create(&thread_id, &attr, &stats, &ctx)) {
+        log_err(errno, "pthread_create(&thread_id, &attr, &stats, &ctx)");
+        return -1;
+    }
 
     // wait for remote exit
     pthread_mutex_lock(&ctx.mu);
-    while (!(ctx.exit_flag & 2)) {
+    while (!(ctx.exit_flag & 2) && !(ctx.msg_eof && ctx.mux)) {
         pthread_cond_wait(&ctx.cond, &ctx.mu);
     }
+    if (!(ctx.exit_flag & 2)) {
+        // our session is done, the attached ones keep the transport
+        pthread_mutex_unlock(&ctx.mu);
+        control_stop(ctx);
+        (void)outq_finish(ctx.out);
+        if (!ctx.no_tty) {
+            tty_reset();
+        }
+        pthread_mutex_lock(&ctx.mu);
+        if (!ctx.chans.empty()) {
+            log_err(0, "waiting for %zu attached sessions", ctx.chans.size());
+        }
+        while (!(ctx.exit_flag & 2) && !ctx.chans.empty()) {
+            pthread_cond_wait(&ctx.cond, &ctx.mu);
+        }
+    }
     log_dbg("[exit_flag:%d] [l2r:%d][r2l:%d]", ctx.exit_flag, ctx.l2r, ctx.r2l);
     pthread_mutex_unlock(&ctx.mu);
-    return ctx.l2r ? ctx.l2r : ctx.r2l;
+    control_stop(ctx);
+    fwd_stop(ctx.fwd);
+    int out_err = outq_finish(ctx.out);
+    stats_stop(ctx.stats);
+    if (arg_latency) {
+        log_latency(ctx);
+    }
+    return ctx.l2r ? ctx.l2r : ctx.r2l ? ctx.r2l : out_err;
 }
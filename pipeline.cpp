@@ -0,0 +1,331 @@
+// system
+#include <assert.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <new>
+// self
+#include "pipeline.h"
+#include "util.h"
+
+
+static void futex_wait(uint32_t *addr, uint32_t val) {
+    (void)syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static void futex_wake(uint32_t *addr) {
+    (void)syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+int spsc_open(SpscQueue &q, size_t cap) {
+    size_t n = 1;
+    while (n < cap) {
+        n *= 2;
+    }
+    q.slots = (void **)calloc(n, sizeof(void *));
+    if (!q.slots) {
+        log_err(errno, "calloc(spsc)");
+        return -1;
+    }
+    q.mask = n - 1;
+    q.tail = q.head = 0;
+    q.seq = q.sleeping = 0;
+    q.ended = 0;
+    return 0;
+}
+
+void spsc_close(SpscQueue &q) {
+    free(q.slots);
+    q.slots = NULL;
+}
+
+// the consumer announces its sleep before checking the queue a last time,
+// the producer checks for a sleeper after publishing; the fences make sure
+// at least one of them sees the other
+static void wake_consumer(SpscQueue &q) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&q.sleeping, __ATOMIC_RELAXED)) {
+        __atomic_add_fetch(&q.seq, 1, __ATOMIC_RELAXED);
+        futex_wake(&q.seq);
+    }
+}
+
+int spsc_push(SpscQueue &q, void *item) {
+    uint64_t tail = q.tail;
+    if (tail - __atomic_load_n(&q.head, __ATOMIC_ACQUIRE) > q.mask) {
+        return -1;
+    }
+    q.slots[tail & q.mask] = item;
+    __atomic_store_n(&q.tail, tail + 1, __ATOMIC_RELEASE);
+    wake_consumer(q);
+    return 0;
+}
+
+void spsc_end(SpscQueue &q) {
+    __atomic_store_n(&q.ended, 1, __ATOMIC_RELEASE);
+    wake_consumer(q);
+}
+
+static void *try_pop(SpscQueue &q) {
+    uint64_t head = q.head;
+    if (head == __atomic_load_n(&q.tail, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    void *item = q.slots[head & q.mask];
+    __atomic_store_n(&q.head, head + 1, __ATOMIC_RELEASE);
+    return item;
+}
+
+void *spsc_pop(SpscQueue &q, int wait) {
+    while (1) {
+        void *item = try_pop(q);
+        if (item || !wait) {
+            return item;
+        }
+        uint32_t seq = __atomic_load_n(&q.seq, __ATOMIC_RELAXED);
+        __atomic_store_n(&q.sleeping, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        // items pushed before the end come first
+        int ended = __atomic_load_n(&q.ended, __ATOMIC_ACQUIRE);
+        item = try_pop(q);
+        if (!item && !ended) {
+            futex_wait(&q.seq, seq);
+        }
+        __atomic_store_n(&q.sleeping, 0, __ATOMIC_RELAXED);
+        if (item || ended) {
+            return item;
+        }
+    }
+}
+
+// frames, encodes and writes what the reader passes on, until it ends
+static void *pipeline_writer(void *user) {
+    Pipeline &pl = *(Pipeline *)user;
+    while (PipeBuf *b = (PipeBuf *)spsc_pop(pl.full, 1)) {
+        // after an error, buffers still go back so the reader never blocks
+        if (!pl.err) {
+            int err = send_payload(pl.stream, pl.cmd, &b->data[FRAME_HEADROOM], b->len, pl.chan);
+            if (err && !pl.keep_going) {
+                __atomic_store_n(&pl.err, err, __ATOMIC_RELEASE);
+            } else if (!err) {
+                pl.sent++;
+            }
+        }
+        int ret = spsc_push(pl.empty, b);
+        assert(ret == 0);
+        (void)ret;
+    }
+    return NULL;
+}
+
+static void pool_free(Pipeline &pl) {
+    delete[] pl.pool;
+    free(pl.pool_data);
+    pl.pool = NULL;
+    pl.pool_data = NULL;
+}
+
+int pipeline_start(Pipeline &pl, size_t buffers) {
+    assert(buffers > 0);
+    size_t size = FRAME_HEADROOM + pl.stream->bufs.io;
+    pl.pool = new (std::nothrow) PipeBuf[buffers];
+    pl.pool_data = (char *)malloc(buffers * size);
+    if (!pl.pool || !pl.pool_data) {
+        log_err(ENOMEM, "pipeline pool");
+        pool_free(pl);
+        return -1;
+    }
+    pl.pool_size = buffers;
+    if (0 != spsc_open(pl.full, buffers) || 0 != spsc_open(pl.empty, buffers)) {
+        spsc_close(pl.full);
+        pool_free(pl);
+        return -1;
+    }
+    for (size_t i = 0; i < buffers; ++i) {
+        pl.pool[i].data = &pl.pool_data[i * size];
+        (void)spsc_push(pl.empty, &pl.pool[i]);
+    }
+    pl.err = 0;
+    // signals are for the reader, whose reads they interrupt
+    sigset_t all;
+    sigset_t old;
+    sigfillset(&all);
+    (void)pthread_sigmask(SIG_BLOCK, &all, &old);
+    pthread_attr_t attr;
+    int err = thread_attr_init(&attr, 0) ? EAGAIN : 0;
+    if (!err) {
+        err = pthread_create(&pl.writer, &attr, &pipeline_writer, &pl);
+        (void)pthread_attr_destroy(&attr);
+    }
+    (void)pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (err) {
+        log_err(err, "pthread_create(&pl.writer, &attr, &pipeline_writer, &pl)");
+        spsc_close(pl.full);
+        spsc_close(pl.empty);
+        pool_free(pl);
+        return -1;
+    }
+    return 0;
+}
+
+PipeBuf *pipeline_get(Pipeline &pl) {
+    if (__atomic_load_n(&pl.err, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    PipeBuf *b = (PipeBuf *)spsc_pop(pl.empty, 0);
+    if (!b) {
+        pl.stalls++;
+        b = (PipeBuf *)spsc_pop(pl.empty, 1);
+    }
+    return b;
+}
+
+size_t pipeline_room(Pipeline &pl) {
+    size_t max_payload = stream_max_payload(pl.stream);
+    size_t io = pl.stream->bufs.io;
+    return max_payload < io ? max_payload : io;
+}
+
+void pipeline_put(Pipeline &pl, PipeBuf *b) {
+    assert(b->len > 0);
+    int ret = spsc_push(pl.full, b);
+    assert(ret == 0);
+    (void)ret;
+}
+
+int pipeline_finish(Pipeline &pl) {
+    spsc_end(pl.full);
+    (void)pthread_join(pl.writer, NULL);
+    log_dbg("[pipeline] [sent:%llu] [stalls:%llu]", (unsigned long long)pl.sent, (unsigned long long)pl.stalls);
+    spsc_close(pl.full);
+    spsc_close(pl.empty);
+    pool_free(pl);
+    return pl.err;
+}
+
+static size_t outq_pending(const OutQueue &o) {
+    return wq_pending(o.q) + wq_pending(o.flight);
+}
+
+// takes all that is queued, one write at a time
+static void *outq_writer(void *user) {
+    OutQueue &o = *(OutQueue *)user;
+    pthread_mutex_lock(&o.mu);
+    while (1) {
+        while (wq_pending(o.q) == 0 && !o.ending) {
+            pthread_cond_wait(&o.cond, &o.mu);
+        }
+        if (wq_pending(o.q) == 0) {
+            break;
+        }
+        // the queue takes the emptied buffer of the last write
+        WriteQueue &f = o.flight;
+        uint8_t *buf = f.buf;
+        size_t cap = f.cap;
+        f.buf = o.q.buf;
+        f.cap = o.q.cap;
+        f.begin = o.q.begin;
+        f.end = o.q.end;
+        o.q.buf = buf;
+        o.q.cap = cap;
+        o.q.begin = o.q.end = 0;
+        size_t len = wq_pending(f);
+        pthread_mutex_unlock(&o.mu);
+
+        ssize_t nwrite = write_full(o.fd, f.buf + f.begin, len);
+        int err = nwrite != (ssize_t)len ? errno : 0;
+
+        pthread_mutex_lock(&o.mu);
+        f.begin = f.end = 0;
+        stat_add(o.writes, 1);
+        stat_add(o.bytes, len);
+        pthread_cond_broadcast(&o.room);
+        if (err) {
+            log_err(err, "[outq_writer] write(fd:%d)", o.fd);
+            o.err = err;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&o.mu);
+    return NULL;
+}
+
+int outq_start(OutQueue &o) {
+    o.q.fd = o.flight.fd = o.fd;
+    o.q.defer = 1;
+    o.ending = 0;
+    o.err = 0;
+    // signals are for the other threads
+    sigset_t all;
+    sigset_t old;
+    sigfillset(&all);
+    (void)pthread_sigmask(SIG_BLOCK, &all, &old);
+    pthread_attr_t attr;
+    int err = thread_attr_init(&attr, 0) ? EAGAIN : 0;
+    if (!err) {
+        err = pthread_create(&o.writer, &attr, &outq_writer, &o);
+        (void)pthread_attr_destroy(&attr);
+    }
+    (void)pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (err) {
+        log_err(err, "pthread_create(&o.writer, &attr, &outq_writer, &o)");
+        return -1;
+    }
+    o.started = 1;
+    return 0;
+}
+
+int outq_write(OutQueue &o, const void *buf, size_t len) {
+    pthread_mutex_lock(&o.mu);
+    // a write larger than the limit only waits for the others
+    if (!o.err && o.started && outq_pending(o) > 0 && outq_pending(o) + len > o.limit) {
+        stat_add(o.stalls, 1);
+        pthread_cond_signal(&o.cond);
+        while (!o.err && o.started && outq_pending(o) > 0 && outq_pending(o) + len > o.limit) {
+            pthread_cond_wait(&o.room, &o.mu);
+        }
+    }
+    int ret = -1;
+    if (o.err || !o.started) {
+        errno = o.err ? o.err : EPIPE;
+    } else {
+        ret = wq_write(o.q, buf, len);
+    }
+    if (outq_pending(o) > o.high_water) {
+        __atomic_store_n(&o.high_water, outq_pending(o), __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&o.mu);
+    return ret;
+}
+
+void outq_kick(OutQueue &o) {
+    pthread_mutex_lock(&o.mu);
+    if (wq_pending(o.q) > 0) {
+        pthread_cond_signal(&o.cond);
+    }
+    pthread_mutex_unlock(&o.mu);
+}
+
+int outq_finish(OutQueue &o) {
+    pthread_mutex_lock(&o.mu);
+    int started = o.started;
+    o.ending = 1;
+    pthread_cond_signal(&o.cond);
+    pthread_mutex_unlock(&o.mu);
+    if (started) {
+        (void)pthread_join(o.writer, NULL);
+        log_dbg("[outq] [fd:%d] [writes:%llu][bytes:%llu] [high_water:%llu][stalls:%llu]", o.fd,
+            (unsigned long long)o.writes, (unsigned long long)o.bytes,
+            (unsigned long long)o.high_water, (unsigned long long)o.stalls);
+    }
+    pthread_mutex_lock(&o.mu);
+    o.started = 0;
+    wq_free(o.q);
+    wq_free(o.flight);
+    pthread_cond_broadcast(&o.room);
+    pthread_mutex_unlock(&o.mu);
+    return o.err ? -1 : 0;
+}
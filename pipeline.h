@@ -0,0 +1,111 @@
+#pragma once
+
+// system
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+// proj
+#include "event.h"
+#include "protocol.h"
+
+
+// Lock-free queue for exactly one producer and one consumer thread. Only
+// the consumer ever sleeps, the producer makes a futex call only then.
+struct SpscQueue {
+    void **slots = NULL;
+    size_t mask = 0;            // capacity - 1, a power of 2
+    // each side writes its own cache line
+    alignas(64) uint64_t tail = 0;  // pushed, by the producer
+    alignas(64) uint64_t head = 0;  // popped, by the consumer
+    alignas(64) uint32_t seq = 0;   // futex, bumped to wake the consumer
+    uint32_t sleeping = 0;
+    int ended = 0;
+};
+
+// cap is rounded up to a power of 2
+int spsc_open(SpscQueue &q, size_t cap);
+void spsc_close(SpscQueue &q);
+// returns -1 if full
+int spsc_push(SpscQueue &q, void *item);
+// NULL if empty; with wait, blocks until an item comes and is NULL only
+// once the queue is empty and ended
+void *spsc_pop(SpscQueue &q, int wait);
+// by the producer, no more items, wakes the consumer
+void spsc_end(SpscQueue &q);
+
+// a buffer of the pool, read into data + FRAME_HEADROOM
+struct PipeBuf {
+    size_t len = 0;
+    char *data = NULL;          // FRAME_HEADROOM + the stream's bufs.io
+};
+
+// pool size by default
+const size_t k_pipeline_buffers = 8;
+
+// Reader and writer stages of one output direction. The reader thread fills
+// buffers of a fixed pool and passes them on through `full`, a writer thread
+// frames, encodes and writes them and hands them back through `empty`. Reads
+// go on while a transport write blocks, memory is bounded by the pool.
+struct Pipeline {
+    // params
+    Stream *stream = NULL;
+    uint8_t cmd = CMD_DATA;
+    uint32_t chan = 0;
+    int keep_going = 0;         // a failed write drops the payload instead of stopping
+    // private
+    PipeBuf *pool = NULL;
+    char *pool_data = NULL;
+    size_t pool_size = 0;
+    SpscQueue full;
+    SpscQueue empty;
+    pthread_t writer;
+    int err = 0;                // the writer failed
+    // counters
+    uint64_t sent = 0;          // buffers written
+    uint64_t stalls = 0;        // the reader waited for a buffer
+};
+
+// starts the writer thread with a pool of buffers
+int pipeline_start(Pipeline &pl, size_t buffers);
+// reader: a buffer to fill, blocks until one is free, NULL once the writer
+// failed
+PipeBuf *pipeline_get(Pipeline &pl);
+// reader: how much a buffer may take now, the payload limit grows with hello
+size_t pipeline_room(Pipeline &pl);
+// reader: sends b->len bytes of the buffer from pipeline_get()
+void pipeline_put(Pipeline &pl, PipeBuf *b);
+// reader: waits until everything is written and frees the pipeline,
+// returns the writer's error
+int pipeline_finish(Pipeline &pl);
+
+// Output to a local fd by a thread of its own, e.g. the master's stdout.
+// outq_write() only queues, outq_kick() wakes the writer; what is queued
+// while a write is in progress goes out with the next one. A slow terminal
+// stalls the producer only once `limit` bytes wait.
+struct OutQueue {
+    // params
+    int fd = -1;
+    size_t limit = 1024 * 1024;
+    // private
+    pthread_mutex_t mu = PTHREAD_MUTEX_INITIALIZER;
+    pthread_cond_t cond = PTHREAD_COND_INITIALIZER;   // the writer waits for data
+    pthread_cond_t room = PTHREAD_COND_INITIALIZER;   // producers wait for room
+    WriteQueue q;               // in defer mode
+    WriteQueue flight;          // being written
+    pthread_t writer;
+    int started = 0;
+    int ending = 0;
+    int err = 0;                // errno of the failed write
+    // counters, read any time
+    uint64_t writes = 0;
+    uint64_t bytes = 0;
+    uint64_t high_water = 0;    // most bytes queued and in flight
+    uint64_t stalls = 0;        // a producer waited for room
+};
+
+int outq_start(OutQueue &o);
+// -1 with errno once a write failed or after outq_finish()
+int outq_write(OutQueue &o, const void *buf, size_t len);
+void outq_kick(OutQueue &o);
+// writes the rest and stops the writer, returns -1 if a write failed
+int outq_finish(OutQueue &o);
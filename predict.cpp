@@ -0,0 +1,371 @@
+// system
+#include <limits.h>
+#include <stdio.h>
+// self
+#include "predict.h"
+
+
+enum {
+    ST_GROUND,
+    ST_ESC,
+    ST_ESC_SKIP,        // ESC ( X, ESC # X, ...
+    ST_CSI,
+    ST_STR,             // OSC, DCS, SOS, PM, APC: ignored
+    ST_STR_ESC,
+};
+
+// end when what is right of the cursor is not known
+static const int k_unknown = INT_MAX;
+
+// the guesses were wrong, the next keys start an epoch of their own
+static void wrong(Predict &pr) {
+    if (pr.pending.empty()) {
+        return;
+    }
+    pr.pending.clear();
+    pr.epoch++;
+    pr.hold = 1;
+    pr.wrong++;
+}
+
+static void put_char(Predict &pr, uint8_t c) {
+    if (!pr.pending.empty()) {
+        if (pr.valid && pr.pending.front().ch == c) {
+            pr.good_epoch = pr.pending.front().epoch;
+            pr.pending.pop_front();
+            pr.confirmed++;
+        } else {
+            wrong(pr);
+        }
+    }
+    // the wrap, a new line
+    if (pr.col >= pr.cols) {
+        pr.col = 0;
+        pr.end = 0;
+    }
+    pr.col++;
+    if (pr.end != k_unknown && pr.end < pr.col) {
+        pr.end = pr.col;
+    }
+}
+
+static uint32_t param(const Predict &pr, size_t i, uint32_t def) {
+    return i < pr.nparams && pr.params[i] ? pr.params[i] : def;
+}
+
+static void sgr(Predict &pr) {
+    for (size_t i = 0; i < pr.nparams; ++i) {
+        uint32_t p = pr.params[i];
+        if (p == 0) {
+            pr.underline = 0;
+        } else if (p == 4) {
+            pr.underline = 1;
+        } else if (p == 24) {
+            pr.underline = 0;
+        } else if (p == 38 || p == 48) {
+            // a color follows
+            break;
+        }
+    }
+}
+
+static void csi_dispatch(Predict &pr, uint8_t c) {
+    // colors around the echo are fine, anything else is not an echo
+    if (c != 'm') {
+        wrong(pr);
+    }
+    if (pr.prefix == '?') {
+        if (c == 'h' || c == 'l') {
+            for (size_t i = 0; i < pr.nparams; ++i) {
+                if (pr.params[i] == 1049 || pr.params[i] == 1047 || pr.params[i] == 47) {
+                    pr.app = c == 'h';
+                }
+            }
+        }
+        return;
+    }
+    if (pr.prefix) {
+        return;
+    }
+    int n = (int)param(pr, 0, 1);
+    switch (c) {
+    case 'm':
+        sgr(pr);
+        break;
+    case 'K':
+    case 'J':
+        if (pr.params[0] == 0) {
+            pr.end = pr.end < pr.col ? pr.end : pr.col;
+        } else if (pr.params[0] == 2 || pr.params[0] == 3) {
+            pr.end = 0;
+        }
+        break;
+    case 'C':
+        pr.col = pr.col + n < pr.cols ? pr.col + n : pr.cols - 1;
+        break;
+    case 'D':
+        pr.col = pr.col > n ? pr.col - n : 0;
+        break;
+    case 'G':
+    case '`':
+        pr.col = n - 1 < pr.cols ? n - 1 : pr.cols - 1;
+        break;
+    case 'H':
+    case 'f':
+        // another line, what is on it is not known
+        pr.col = (int)param(pr, 1, 1) - 1 < pr.cols ? (int)param(pr, 1, 1) - 1 : pr.cols - 1;
+        pr.end = k_unknown;
+        pr.valid = 1;
+        break;
+    case 'A':
+    case 'B':
+    case 'd':
+    case 'e':
+    case 'L':
+    case 'M':
+        pr.end = k_unknown;
+        break;
+    case '@':
+        pr.end = pr.end != k_unknown ? pr.end + n : k_unknown;
+        break;
+    case 'P':
+    case 'X':
+    case 'h':
+    case 'l':
+    case 'n':
+    case 'c':
+    case 'q':
+    case 't':
+    case 's':
+        break;
+    default:
+        // 'r' homes the cursor, 'u' restores it, ...
+        pr.valid = 0;
+        break;
+    }
+}
+
+static void esc_dispatch(Predict &pr, uint8_t c) {
+    pr.state = ST_GROUND;
+    if (c != '[') {
+        wrong(pr);
+    }
+    switch (c) {
+    case '[':
+        pr.state = ST_CSI;
+        pr.nparams = 1;
+        pr.params[0] = 0;
+        pr.prefix = 0;
+        break;
+    case ']':
+    case 'P':
+    case 'X':
+    case '^':
+    case '_':
+        pr.state = ST_STR;
+        break;
+    case '(':
+    case ')':
+    case '*':
+    case '+':
+    case '#':
+    case ' ':
+    case '%':
+        pr.state = ST_ESC_SKIP;
+        break;
+    case 'D':
+        pr.end = 0;
+        break;
+    case 'E':
+        pr.col = 0;
+        pr.end = 0;
+        break;
+    case 'M':
+        pr.end = k_unknown;
+        break;
+    case 'c':
+        pr.col = 0;
+        pr.end = 0;
+        pr.valid = 1;
+        pr.app = 0;
+        pr.underline = 0;
+        break;
+    case '8':
+        pr.valid = 0;
+        break;
+    default:
+        break;
+    }
+}
+
+static void control(Predict &pr, uint8_t c) {
+    // a sequence is judged once it is complete
+    if (c != 0x1b) {
+        wrong(pr);
+    }
+    switch (c) {
+    case 0x08:
+        pr.col = pr.col > 0 ? pr.col - 1 : 0;
+        break;
+    case 0x09:
+        pr.col = (pr.col / 8 + 1) * 8 < pr.cols ? (pr.col / 8 + 1) * 8 : pr.cols - 1;
+        break;
+    case 0x0a:
+    case 0x0b:
+    case 0x0c:
+        // a new line at the bottom of a shell, blank
+        pr.end = 0;
+        break;
+    case 0x0d:
+        pr.col = 0;
+        pr.valid = 1;
+        break;
+    case 0x18:
+    case 0x1a:
+        pr.state = ST_GROUND;
+        break;
+    case 0x1b:
+        pr.state = ST_ESC;
+        break;
+    default:
+        break;
+    }
+}
+
+static void step(Predict &pr, uint8_t c) {
+    switch (pr.state) {
+    case ST_GROUND:
+        if (c < 0x20) {
+            control(pr, c);
+        } else if (c < 0x7f) {
+            put_char(pr, c);
+        } else if (c == 0x7f) {
+            // DEL is ignored
+        } else {
+            // utf-8, a lead byte counts as one column
+            wrong(pr);
+            if ((c & 0xc0) != 0x80) {
+                put_char(pr, c);
+            }
+        }
+        break;
+    case ST_ESC:
+        if (c < 0x20) {
+            control(pr, c);
+        } else {
+            esc_dispatch(pr, c);
+        }
+        break;
+    case ST_ESC_SKIP:
+        pr.state = ST_GROUND;
+        break;
+    case ST_CSI:
+        if ('0' <= c && c <= '9') {
+            uint32_t &p = pr.params[pr.nparams - 1];
+            p = p * 10 + (c - '0');
+            p = p > 65535 ? 65535 : p;
+        } else if (c == ';' || c == ':') {
+            if (pr.nparams < sizeof(pr.params) / sizeof(pr.params[0])) {
+                pr.params[pr.nparams++] = 0;
+            }
+        } else if (c == '?' || c == '>' || c == '<' || c == '=') {
+            pr.prefix = (char)c;
+        } else if (0x40 <= c && c <= 0x7e) {
+            pr.state = ST_GROUND;
+            csi_dispatch(pr, c);
+        } else if (c < 0x20) {
+            control(pr, c);
+        }
+        break;
+    case ST_STR:
+        if (c == 0x07 || c == 0x18 || c == 0x1a) {
+            pr.state = ST_GROUND;
+        } else if (c == 0x1b) {
+            pr.state = ST_STR_ESC;
+        }
+        break;
+    case ST_STR_ESC:
+        pr.state = c == '\\' ? ST_GROUND : ST_STR;
+        break;
+    }
+}
+
+// the model knows the line is blank from the cursor on
+static int at_end(const Predict &pr) {
+    return pr.state == ST_GROUND && pr.valid && !pr.app && pr.col >= pr.end;
+}
+
+// the guesses from pending[shown] on that may show, in the epoch known good
+static void show(Predict &pr, std::string &out) {
+    if (!at_end(pr) || pr.underline) {
+        return;
+    }
+    size_t first = out.size();
+    while (pr.shown < pr.pending.size() && pr.pending[pr.shown].epoch == pr.good_epoch
+        && pr.col + (int)pr.shown + 1 < pr.cols)
+    {
+        out += (char)pr.pending[pr.shown++].ch;
+    }
+    if (out.size() > first) {
+        out.insert(first, "\x1b[4m");
+        out += "\x1b[24m";
+    }
+}
+
+// the guesses on the screen are taken off, the cursor goes back to where
+// the remote has it
+static void unshow(Predict &pr, std::string &out) {
+    if (pr.shown) {
+        char buf[32];
+        snprintf(buf, sizeof(buf), "\x1b[%zuD\x1b[K", pr.shown);
+        out += buf;
+        pr.shown = 0;
+    }
+}
+
+void predict_input(Predict &pr, const uint8_t *buf, size_t len, std::string &out) {
+    for (size_t i = 0; i < len; ++i) {
+        uint8_t c = buf[i];
+        if (c < 0x20 || c >= 0x7f) {
+            // not a printable key, the output it causes is not guessed
+            pr.epoch++;
+            pr.hold = 1;
+            if (c == 0x1b) {
+                // the rest is the key's sequence
+                break;
+            }
+            continue;
+        }
+        if (pr.hold || !at_end(pr) || pr.col + (int)pr.pending.size() + 1 >= pr.cols) {
+            // the echo of the ones after would not match
+            pr.hold = 1;
+            continue;
+        }
+        Guess g;
+        g.ch = c;
+        g.epoch = pr.epoch;
+        pr.pending.push_back(g);
+        pr.guessed++;
+    }
+    show(pr, out);
+}
+
+void predict_output(Predict &pr, const uint8_t *buf, size_t len, std::string &before, std::string &after) {
+    unshow(pr, before);
+    for (size_t i = 0; i < len; ++i) {
+        step(pr, buf[i]);
+    }
+    // caught up, the keys typed from now on are guessed again
+    if (pr.pending.empty()) {
+        pr.hold = 0;
+    }
+    show(pr, after);
+}
+
+void predict_resize(Predict &pr, int cols, std::string &out) {
+    unshow(pr, out);
+    pr.cols = cols > 0 ? cols : 80;
+    if (pr.col >= pr.cols) {
+        pr.valid = 0;
+    }
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+// system
+#include <stdint.h>
+#include <stddef.h>
+#include <deque>
+#include <string>
+
+
+// Local echo prediction for the master, as mosh does it. Printable keys
+// typed at the end of the line are shown right away, underlined, and the
+// remote's echo takes their place once it comes. A model of the output
+// follows the cursor column and whether anything is right of it; in doubt,
+// e.g. after cursor addressing or on the alternate screen, it predicts
+// nothing.
+//
+// Keys are grouped in epochs, a key that is not a printable one starts the
+// next. An epoch is only shown once its first key was echoed as predicted,
+// so nothing shows at a password prompt or in a program that reads keys
+// raw, and a wrong guess ends the epoch.
+
+struct Guess {
+    uint8_t ch = 0;
+    uint32_t epoch = 0;
+};
+
+struct Predict {
+    // params
+    int cols = 80;
+    // private, the model of the remote output
+    int col = 0;
+    int end = 0;                // from here on the line is blank
+    int valid = 1;              // col is known
+    int app = 0;                // on the alternate screen
+    int underline = 0;          // the remote's pen underlines
+    int state = 0;              // the escape sequence parser
+    uint32_t params[4];
+    size_t nparams = 0;
+    char prefix = 0;
+    // private, the guesses
+    std::deque<Guess> pending;  // typed, not echoed yet
+    uint32_t epoch = 0;
+    uint32_t good_epoch = UINT32_MAX;   // had a guess echoed
+    size_t shown = 0;           // pending ones on the screen, right of the cursor
+    int hold = 0;               // a key could not be guessed, until pending is empty
+    // counters
+    uint64_t guessed = 0;
+    uint64_t confirmed = 0;
+    uint64_t wrong = 0;
+};
+
+// keys read from the terminal, appends what to show for them
+void predict_input(Predict &pr, const uint8_t *buf, size_t len, std::string &out);
+// output of the remote, before and after are written around it: they take
+// the guesses off the screen and put the ones still pending back
+void predict_output(Predict &pr, const uint8_t *buf, size_t len, std::string &before, std::string &after);
+// the terminal was resized, the guesses on the screen are taken off
+void predict_resize(Predict &pr, int cols, std::string &out);
@@ -3,63 +3,414 @@
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <stdlib.h>
+#include <poll.h>
+#include <sys/uio.h>
 // self
 #include "protocol.h"
 #include "base64.h"
+#include "event.h"
+#include "lz.h"
+#include "rel.h"
+#include "trace.h"
 #include "util.h"
 
 
-ssize_t stream_read(Stream *s, void *buf, size_t bufsize) {
+BufSizes g_bufs;
+
+void bufs_low_mem(BufSizes &b) {
+    b.io = MAX_FRAME_SIZE * 4;
+    b.input = MAX_FRAME_SIZE * 2;
+    b.batch = MAX_FRAME_SIZE * 4;
+    b.max_frame = MAX_FRAME_SIZE * 4;
+}
+
+static size_t clamp(size_t v, size_t lo, size_t hi) {
+    return v < lo ? lo : v > hi ? hi : v;
+}
+
+void stream_set_bufs(Stream *s, const BufSizes &b) {
+    assert(!s->wbuf && !s->gather && !s->rbuf.buf);
+    // a frame of MAX_FRAME_SIZE always fits, whatever was asked for
+    s->bufs.io = clamp(b.io, MAX_FRAME_SIZE, k_io_buf_size);
+    s->bufs.input = clamp(b.input, MAX_FRAME_SIZE * 2, k_input_buf_size);
+    s->bufs.batch = clamp(b.batch, MAX_FRAME_SIZE * 2, k_batch_buf_size);
+    s->bufs.max_frame = (uint32_t)clamp(b.max_frame, MAX_FRAME_SIZE, MAX_PAYLOAD_V2);
+}
+
+// read() or the read_cb, with the counters
+static ssize_t stream_raw_read(Stream *s, void *buf, size_t len) {
+    DirStats &st = s->stats.rx;
+    ssize_t nread = 0;
+    if (s->read_cb) {
+        nread = s->read_cb(s->read_user, buf, len);
+    } else {
+        nread = TEMP_FAILURE_RETRY(read(s->rfd, buf, len));
+        stat_add(st.syscalls, 1);
+        trace(TR_READ, (uint32_t)s->rfd, (uint64_t)nread, nread < 0 ? errno : 0);
+    }
+    stat_add(st.wire_bytes, nread > 0 ? (uint64_t)nread : 0);
+    return nread;
+}
+
+// the wire below compression: raw, base64 or escaped
+template <class Codec>
+static ssize_t read_wire(Stream *s, void *buf, size_t bufsize) {
     assert(bufsize > 0);
-    if (!s->base64) {
-        return TEMP_FAILURE_RETRY(read(s->rfd, buf, bufsize));
+    if (0 != mirror_reserve(s->rbuf, s->bufs.input * 3 / 2)) {
+        return -1;
     }
+    size_t max_read = Codec::max_read(bufsize);
+    size_t outsize = 0;
+    // an incomplete quad or escape decodes to nothing, read more instead of
+    // reporting eof
+    while (outsize == 0) {
+        assert(mirror_room(s->rbuf) > 0);
+        size_t read_limit = mirror_room(s->rbuf);
+        if (read_limit > max_read) {
+            read_limit = max_read;
+        }
+        ssize_t raw_read = stream_raw_read(s, mirror_tail(s->rbuf), read_limit);
+        if (raw_read <= 0) {
+            return raw_read;
+        }
+        mirror_commit(s->rbuf, (size_t)raw_read);
 
-    assert(s->buflen < sizeof(s->rbuf));
-    size_t read_limit = sizeof(s->rbuf) - s->buflen;
-    if (read_limit > bufsize + bufsize / 3) {
-        read_limit = bufsize + bufsize / 3;
+        // what is left over stays in place for the next read
+        size_t insize = mirror_len(s->rbuf);
+        outsize = bufsize;
+        if (0 != Codec::decode(s, mirror_data(s->rbuf), &insize, (uint8_t *)buf, &outsize)) {
+            return -1;
+        }
+        assert(insize <= mirror_len(s->rbuf) && outsize <= bufsize);
+        mirror_consume(s->rbuf, insize);
     }
-    ssize_t raw_read = TEMP_FAILURE_RETRY(read(s->rfd, &s->rbuf[s->buflen], read_limit));
-    if (raw_read <= 0) {
-        return raw_read;
+
+    return (ssize_t)outsize;
+}
+
+// writes all of iov, which is used up, with the counters
+static int stream_raw_writev(Stream *s, struct iovec *iov, size_t count) {
+    DirStats &st = s->stats.tx;
+    size_t remain = 0;
+    for (size_t i = 0; i < count; ++i) {
+        remain += iov[i].iov_len;
     }
-    s->buflen += (size_t)raw_read;
-    assert(s->buflen <= sizeof(s->rbuf));
+    stat_add(st.wire_bytes, remain);
 
-    size_t insize = s->buflen;
-    size_t outsize = bufsize;
-    if (0 != b64_decode(s->rbuf, &insize, (uint8_t *)buf, &outsize)) {
-        return -1;
+    uint64_t start = monotonic_us();
+    while (remain > 0) {
+        ssize_t nwrite = TEMP_FAILURE_RETRY(writev(s->wfd, iov, (int)count));
+        stat_add(st.syscalls, 1);
+        trace(TR_WRITE, (uint32_t)s->wfd, (uint64_t)nwrite, nwrite < 0 ? errno : 0);
+        if (nwrite < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                return -1;
+            }
+            struct pollfd pfd = {s->wfd, POLLOUT, 0};
+            if (TEMP_FAILURE_RETRY(poll(&pfd, 1, -1)) < 0) {
+                return -1;
+            }
+            continue;
+        }
+        stat_add(st.short_io, (size_t)nwrite < remain);
+        remain -= (size_t)nwrite;
+        for (size_t done = (size_t)nwrite; done > 0; ) {
+            size_t n = done < iov->iov_len ? done : iov->iov_len;
+            iov->iov_base = (uint8_t *)iov->iov_base + n;
+            iov->iov_len -= n;
+            done -= n;
+            if (iov->iov_len == 0) {
+                ++iov;
+                --count;
+            }
+        }
     }
-    assert(insize <= s->buflen && outsize <= bufsize);
-    memmove(s->rbuf, &s->rbuf[insize], s->buflen - insize);
-    s->buflen -= insize;
-    log_dbg("[stream_read] [insize:%zu][outsize:%zu] [remain:%zu]", insize, outsize, s->buflen);
+    stat_add(st.blocked_us, monotonic_us() - start);
+    return 0;
+}
 
-    return (ssize_t)outsize;
+// write_full() with the counters
+static ssize_t stream_raw_write(Stream *s, const void *buf, size_t len) {
+    if (s->wq) {
+        stat_add(s->stats.tx.wire_bytes, len);
+        return wq_write(*s->wq, buf, len) ? -1 : (ssize_t)len;
+    }
+    struct iovec iov = {(void *)buf, len};
+    return stream_raw_writev(s, &iov, 1) ? -1 : (ssize_t)len;
 }
 
-ssize_t stream_write(Stream *s, const void *buf, size_t bufsize) {
+// The wire encodings, as policies the loops from read_wire() up to
+// feed_codec() are instantiated with, so none of them checks the codec
+// again. stream_set_codec() picks the instantiation.
+struct StreamOps {
+    ssize_t (*read)(Stream *s, void *buf, size_t bufsize);
+    ssize_t (*write)(Stream *s, const void *buf, size_t bufsize);
+    int (*writev)(Stream *s, struct iovec *iov, size_t count);
+    int (*feed)(Parser &p, Stream *s, int cb(Parser &p, void *user), void *user);
+};
+
+struct RawCodec {
+    static const int k_raw = 1;
+};
+
+struct Base64Codec {
+    static const int k_raw = 0;
+    // 4 chars decode to 3 bytes
+    static size_t max_read(size_t bufsize) {
+        return bufsize + bufsize / 3;
+    }
+    static int decode(Stream *, const uint8_t *in, size_t *insize, uint8_t *out, size_t *outsize) {
+        if (0 != b64_decode(in, insize, out, outsize)) {
+            return -1;
+        }
+        trace(TR_B64_DECODE, 0, *insize, *outsize);
+        return 0;
+    }
+    static size_t max_block(const Stream *s) {
+        return s->bufs.input;
+    }
+    static ssize_t encode_write(Stream *s, const uint8_t *in, size_t len) {
+        assert(b64_encoded_size(len) <= s->bufs.input * 3 / 2);
+        b64_encode(in, len, s->wbuf);
+        return stream_raw_write(s, s->wbuf, b64_encoded_size(len));
+    }
+};
+
+struct EscapeCodec {
+    static const int k_raw = 0;
+    // escapes never decode to more
+    static size_t max_read(size_t bufsize) {
+        return bufsize;
+    }
+    static int decode(Stream *, const uint8_t *in, size_t *insize, uint8_t *out, size_t *outsize) {
+        esc_decode(in, insize, out, outsize);
+        trace(TR_ESC_DECODE, 0, *insize, *outsize);
+        return 0;
+    }
+    // escaping may double every byte
+    static size_t max_block(const Stream *s) {
+        return s->bufs.input * 3 / 4;
+    }
+    static ssize_t encode_write(Stream *s, const uint8_t *in, size_t len) {
+        // text rarely needs an escape, it goes out without a copy
+        size_t clean = esc_scan(s->escape, in, len);
+        if (clean == len) {
+            return stream_raw_write(s, in, len);
+        }
+        memcpy(s->wbuf, in, clean);
+        size_t outsize = clean + esc_encode(s->escape, in + clean, len - clean, s->wbuf + clean);
+        return stream_raw_write(s, s->wbuf, outsize);
+    }
+};
+
+template <class Codec>
+static ssize_t write_wire(Stream *s, const void *buf, size_t bufsize) {
     assert(bufsize > 0);
-    if (!s->base64) {
-        return TEMP_FAILURE_RETRY(write(s->wfd, buf, bufsize));
+    if (!s->wbuf && !(s->wbuf = (uint8_t *)malloc(s->bufs.input * 3 / 2))) {
+        log_err(errno, "[stream_write] out of memory");
+        return -1;
+    }
+
+    const size_t k_max_block = Codec::max_block(s);
+    const uint8_t *input_buf = (const uint8_t *)buf;
+    for (size_t remain = bufsize; remain > 0; ) {
+        size_t block_size = remain > k_max_block ? k_max_block : remain;
+        if (Codec::encode_write(s, input_buf, block_size) < 0) {
+            return -1;
+        }
+        input_buf += block_size;
+        remain -= block_size;
+    }
+    return (ssize_t)bufsize;
+}
+
+template <>
+ssize_t read_wire<RawCodec>(Stream *s, void *buf, size_t bufsize) {
+    return stream_raw_read(s, buf, bufsize);
+}
+
+template <>
+ssize_t write_wire<RawCodec>(Stream *s, const void *buf, size_t bufsize) {
+    return stream_raw_write(s, buf, bufsize);
+}
+
+// room for the block header in front of a compressed block
+#define LZ_HEADROOM 4
+const size_t k_zin_size = (k_lz_block_size + LZ_HEADROOM) * 2;
+
+// its thread takes the writer turn, and writers waiting for acks give up
+static void stream_rel_stop(Stream *s) {
+    RelLink *r = s->rel;
+    if (!r || !r->running) {
+        return;
+    }
+    pthread_mutex_lock(&r->mu);
+    r->stop = 1;
+    pthread_cond_broadcast(&r->cond);
+    while (r->waiters) {
+        pthread_cond_wait(&r->cond, &r->mu);
+    }
+    pthread_mutex_unlock(&r->mu);
+    pthread_join(r->thread, NULL);
+    r->running = 0;
+}
+
+Stream::~Stream() {
+    stream_rel_stop(this);
+    rel_free(rel);
+    lz_encoder_free(ztx);
+    lz_decoder_free(zrx);
+    free(zwbuf);
+    free(wbuf);
+    free(gather);
+    mirror_close(zin);
+    mirror_close(rbuf);
+}
+
+// -1: malformed, 0: incomplete, otherwise the header size
+static int zblock_header(const uint8_t *data, size_t avail, size_t &len, int &stored) {
+    size_t v = 0;
+    for (size_t i = 0; i < LZ_HEADROOM - 1; ++i) {
+        if (i >= avail) {
+            return 0;
+        }
+        v |= (size_t)(data[i] & 0x7f) << (7 * i);
+        if (!(data[i] & 0x80)) {
+            len = v >> 1;
+            stored = (int)(v & 1);
+            if (len == 0 || len > k_lz_block_size) {
+                log_err(0, "[stream_read] bad block [len:%zu]", len);
+                return -1;
+            }
+            return (int)(i + 1);
+        }
+    }
+    log_err(0, "[stream_read] bad block header");
+    return -1;
+}
+
+// -1: malformed, 0: no complete block in zin, 1: decoded into zout
+static int zblock_decode(Stream *s) {
+    size_t len = 0;
+    int stored = 0;
+    int head_len = zblock_header(mirror_data(s->zin), mirror_len(s->zin), len, stored);
+    if (head_len <= 0) {
+        return head_len;
+    }
+    if (head_len + len > mirror_len(s->zin)) {
+        return 0;
+    }
+
+    const uint8_t *block = mirror_data(s->zin) + head_len;
+    int err = stored
+        ? lz_store(s->zrx, block, len, &s->zout, &s->zout_len)
+        : lz_decompress(s->zrx, block, len, &s->zout, &s->zout_len);
+    if (err) {
+        return -1;
+    }
+    trace(TR_LZ_DECODE, (uint32_t)stored, len, s->zout_len);
+
+    mirror_consume(s->zin, head_len + len);
+    return 1;
+}
+
+static int stream_rx_compress(Stream *s, const uint8_t *rest, size_t len) {
+    assert(!s->zrx && len <= k_zin_size);
+    if (0 != mirror_reserve(s->zin, k_zin_size)) {
+        return -1;
+    }
+    s->zrx = lz_decoder_new();
+    if (!s->zrx) {
+        log_err(errno, "[stream_rx_compress] out of memory");
+        return -1;
+    }
+    memcpy(mirror_tail(s->zin), rest, len);
+    mirror_commit(s->zin, len);
+    return 0;
+}
+
+static int stream_tx_compress(Stream *s) {
+    if (s->ztx) {
+        return 0;
+    }
+    s->zwbuf = (uint8_t *)malloc(LZ_HEADROOM + k_lz_block_size);
+    s->ztx = lz_encoder_new();
+    if (!s->zwbuf || !s->ztx) {
+        log_err(errno, "[stream_tx_compress] out of memory");
+        return -1;
+    }
+    return 0;
+}
+
+int stream_pending(const Stream *s) {
+    if (!s->zrx) {
+        return 0;
+    }
+    if (s->zout_len > 0) {
+        return 1;
+    }
+    size_t len = 0;
+    int stored = 0;
+    int head_len = zblock_header(mirror_data(s->zin), mirror_len(s->zin), len, stored);
+    // a bad header is reported by the next read
+    return head_len < 0 || (head_len > 0 && head_len + len <= mirror_len(s->zin));
+}
+
+template <class Codec>
+static ssize_t read_codec(Stream *s, void *buf, size_t bufsize) {
+    if (!s->zrx) {
+        return read_wire<Codec>(s, buf, bufsize);
     }
 
-    const size_t k_max_stream_write = k_input_buf_size;
-    assert(b64_encoded_size(k_max_stream_write) <= sizeof(s->wbuf));
+    while (s->zout_len == 0) {
+        int ret = zblock_decode(s);
+        if (ret < 0) {
+            return -1;
+        }
+        if (ret == 0) {
+            ssize_t raw_read = read_wire<Codec>(s, mirror_tail(s->zin), mirror_room(s->zin));
+            if (raw_read <= 0) {
+                return raw_read;
+            }
+            mirror_commit(s->zin, (size_t)raw_read);
+        }
+    }
+
+    size_t outsize = s->zout_len < bufsize ? s->zout_len : bufsize;
+    memcpy(buf, s->zout, outsize);
+    s->zout += outsize;
+    s->zout_len -= outsize;
+    return (ssize_t)outsize;
+}
+
+template <class Codec>
+static ssize_t write_codec(Stream *s, const void *buf, size_t bufsize) {
+    stat_add(s->stats.tx.bytes, bufsize);
+    if (!s->ztx) {
+        return write_wire<Codec>(s, buf, bufsize);
+    }
 
     const uint8_t *input_buf = (const uint8_t *)buf;
     for (size_t remain = bufsize; remain > 0; ) {
-        size_t block_size = remain > k_max_stream_write ? k_max_stream_write : remain;
-        size_t outsize = b64_encoded_size(block_size);
-        b64_encode(input_buf, block_size, s->wbuf);
-        ssize_t raw_write = TEMP_FAILURE_RETRY(write(s->wfd, s->wbuf, outsize));
-        if (raw_write < 0) {
-            return raw_write;
-        }
-        if (raw_write < (ssize_t)block_size) {
-            log_err(0, "[stream_write] short write [raw_write:%zd] < [block_size:%zu]", raw_write, block_size);
+        size_t block_size = remain > k_lz_block_size ? k_lz_block_size : remain;
+        uint8_t *body = s->zwbuf + LZ_HEADROOM;
+        // only worth it if the header is paid for
+        size_t len = lz_compress(s->ztx, input_buf, block_size, body, block_size - 1);
+        int stored = len == 0;
+        if (stored) {
+            len = block_size;
+            memcpy(body, input_buf, len);
+        }
+        trace(TR_LZ_ENCODE, (uint32_t)stored, block_size, len);
+
+        size_t v = len << 1 | (size_t)stored;
+        size_t head_len = v < (1 << 7) ? 1 : v < (1 << 14) ? 2 : 3;
+        uint8_t *head = body - head_len;
+        for (size_t i = 0; i < head_len; ++i) {
+            head[i] = (uint8_t)((v >> (7 * i)) & 0x7f) | (i + 1 < head_len ? 0x80 : 0);
+        }
+        if (write_wire<Codec>(s, head, head_len + len) < 0) {
             return -1;
         }
 
@@ -69,67 +420,1057 @@ ssize_t stream_write(Stream *s, const void *buf, size_t bufsize) {
     return (ssize_t)bufsize;
 }
 
-static uint8_t g_send_seq = 0;
-static uint8_t g_recv_seq = 0;
+// A single writev() if nothing has to be encoded on the way, otherwise
+// small buffers are copied together and encoded in one stream_write()
+template <class Codec>
+static int writev_codec(Stream *s, struct iovec *iov, size_t count) {
+    if (count == 1 || !Codec::k_raw || s->ztx || s->wq) {
+        if (count > 1 && !s->gather && !(s->gather = (uint8_t *)malloc(s->bufs.input))) {
+            log_err(errno, "[stream_writev] out of memory");
+            return -1;
+        }
+        size_t len = 0;
+        for (size_t i = 0; i <= count; ++i) {
+            int direct = i < count && (count == 1 || iov[i].iov_len > s->bufs.input / 2);
+            if (len > 0 && (i == count || direct || len + iov[i].iov_len > s->bufs.input)) {
+                if (write_codec<Codec>(s, s->gather, len) != (ssize_t)len) {
+                    return -1;
+                }
+                len = 0;
+            }
+            if (i == count) {
+                break;
+            }
+            if (direct) {
+                if (write_codec<Codec>(s, iov[i].iov_base, iov[i].iov_len) != (ssize_t)iov[i].iov_len) {
+                    return -1;
+                }
+                continue;
+            }
+            memcpy(s->gather + len, iov[i].iov_base, iov[i].iov_len);
+            len += iov[i].iov_len;
+        }
+        return 0;
+    }
+    for (size_t i = 0; i < count; ++i) {
+        stat_add(s->stats.tx.bytes, iov[i].iov_len);
+    }
+    return stream_raw_writev(s, iov, count);
+}
+
+size_t stream_max_payload(Stream *s) {
+    if (__atomic_load_n(&s->version, __ATOMIC_RELAXED) >= PROTO_V2) {
+        return __atomic_load_n(&s->peer_max_frame, __ATOMIC_RELAXED);
+    }
+    return MAX_FRAME_SIZE - FRAME_HEADER_SIZE;
+}
+
+static size_t put_varint(uint8_t *buf, size_t v) {
+    size_t n = 0;
+    do {
+        buf[n] = (uint8_t)(v & 0x7f);
+        v >>= 7;
+        buf[n] |= v ? 0x80 : 0;
+        n++;
+    } while (v);
+    return n;
+}
+
+// -1: longer than max_bytes, 0: incomplete, otherwise its size
+static int get_varint(const uint8_t *data, size_t avail, size_t max_bytes, size_t &v) {
+    v = 0;
+    for (size_t i = 0; i < max_bytes; ++i) {
+        if (i >= avail) {
+            return 0;
+        }
+        v |= (size_t)(data[i] & 0x7f) << (7 * i);
+        if (!(data[i] & 0x80)) {
+            return (int)(i + 1);
+        }
+    }
+    return -1;
+}
+
+// A frame sized for the stream as it was may not fit it once another thread
+// reset it to v1, without channels. Called holding the writer turn.
+static int frame_fits(Stream *s, size_t len, uint32_t chan) {
+    return len <= stream_max_payload(s) && (chan == 0 || s->mux);
+}
+
+// Writes the header right in front of payload, FRAME_HEADROOM bytes are
+// available there. Returns the header size. Called holding the writer turn.
+static size_t put_header(Stream *s, uint8_t *payload, uint8_t cmd, size_t len, uint32_t chan) {
+    uint8_t seq = s->send_seq++;
+    stat_frame(s->stats.tx, cmd);
+    trace(TR_FRAME_OUT, chan << 8 | cmd, len, seq);
+    if (s->version < PROTO_V2) {
+        assert(len + FRAME_HEADER_SIZE <= MAX_FRAME_SIZE && chan == 0);
+        uint8_t *head = payload - FRAME_HEADER_SIZE;
+        head[0] = (uint8_t)(len & 0xff);
+        head[1] = (uint8_t)(len >> 8);
+        head[2] = cmd;
+        head[3] = seq;
+        return FRAME_HEADER_SIZE;
+    }
+
+    assert(len <= MAX_PAYLOAD_V2 && cmd < 0x80);
+    assert(chan == 0 || (s->mux && chan <= MAX_CHANNEL));
+    if (cmd == CMD_DATA && chan == 0 && 0 < len && len <= COMPACT_MAX_SIZE) {
+        payload[-1] = 0x80 | (uint8_t)len;
+        return 1;
+    }
+
+    uint8_t varint[8];
+    size_t n = 0;
+    if (s->mux) {
+        n += put_varint(varint, chan);
+    }
+    n += put_varint(varint + n, len);
+
+    uint8_t *head = payload - (2 + n);
+    head[0] = cmd;
+    head[1] = seq;
+    memcpy(head + 2, varint, n);
+    return 2 + n;
+}
+
+// -1: malformed, 0: incomplete, otherwise the header size; compact frames
+// keep the expected seq. After the hello a frame is at most the max_frame
+// we offered in ours.
+static int parse_header(
+    const Parser &p, const Stream *s, const uint8_t *data, size_t avail,
+    uint8_t &cmd, uint8_t &seq, uint32_t &chan, size_t &size)
+{
+    chan = 0;
+    if (p.version < PROTO_V2) {
+        if (avail < FRAME_HEADER_SIZE) {
+            return 0;
+        }
+        size = (size_t)data[0] | ((size_t)data[1] << 8);
+        cmd = data[2];
+        seq = data[3];
+        if (FRAME_HEADER_SIZE + size > MAX_FRAME_SIZE) {
+            log_err(0, "[feed_frame] frame too large [seq:%u][size:%zu][cmd:%u]", seq, size, cmd);
+            return -1;
+        }
+        return FRAME_HEADER_SIZE;
+    }
+
+    if (avail < 1) {
+        return 0;
+    }
+    if (data[0] & 0x80) {
+        size = data[0] & 0x7f;
+        cmd = CMD_DATA;
+        if (size == 0) {
+            log_err(0, "[feed_frame] empty compact frame");
+            return -1;
+        }
+        return 1;
+    }
+
+    if (avail < 3) {
+        return 0;
+    }
+    cmd = data[0];
+    seq = data[1];
+    size_t pos = 2;
+    if (p.mux) {
+        size_t v = 0;
+        int n = get_varint(data + pos, avail - pos, 2, v);
+        if (n <= 0) {
+            if (n < 0) {
+                log_err(0, "[feed_frame] bad channel [seq:%u][cmd:%u]", seq, cmd);
+            }
+            return n;
+        }
+        chan = (uint32_t)v;
+        pos += n;
+    }
+    int n = get_varint(data + pos, avail - pos, 4, size);
+    if (n <= 0) {
+        if (n < 0) {
+            log_err(0, "[feed_frame] bad varint [seq:%u][cmd:%u]", seq, cmd);
+        }
+        return n;
+    }
+    if (size > s->bufs.max_frame) {
+        log_err(0, "[feed_frame] frame too large [seq:%u][size:%zu][cmd:%u]", seq, size, cmd);
+        return -1;
+    }
+    return (int)(pos + n);
+}
+
+// A payload waiting in Stream::txq, on the stack of its send_payload()
+struct TxFrame {
+    TxFrame *next;
+    uint8_t *payload;
+    size_t len;
+    uint32_t chan;
+    uint8_t cmd;
+    int done;               // set last, the owner may return right after
+    int err;                // errno if the write failed
+};
+
+// frames per writev(), well below IOV_MAX
+const size_t k_tx_gather = 64;
+// frames sent again per writev() with HELLO_F_REL
+const size_t k_rel_resend_gather = 8;
+// how often the RelLink's thread looks again while a writer has the turn
+const uint64_t k_rel_busy_us = 1000;
+
+// With HELLO_F_REL frames are encoded into the RelLink's ring, kept there
+// until acked and written from it. The functions below are called holding
+// the writer turn, see rel.h.
+
+// Writes frames sent again, the ones appended to out from `from` on and an
+// ack in one writev(). The ack goes if one is due or along with frames.
+static int rel_flush(Stream *s, uint64_t &from) {
+    RelLink &r = *s->rel;
+    struct iovec iov[2 + k_rel_resend_gather];
+    uint8_t ack[k_rel_header_size + k_rel_ack_size + k_rel_crc_size];
+    size_t count = 0;
+    size_t resent = 0;
+    uint64_t now = monotonic_us();
+
+    pthread_mutex_lock(&r.mu);
+    if (r.failed || r.stop) {
+        pthread_mutex_unlock(&r.mu);
+        errno = EPIPE;
+        return -1;
+    }
+    size_t len = (size_t)(r.out.end - from);
+    int with_ack = r.ack_at && (len > 0 || r.ack_at <= now);
+    if (with_ack) {
+        iov[count].iov_base = ack;
+        iov[count++].iov_len = rel_ack(r, ack);
+    }
+    // older first, the peer passes the new ones on after them
+    RelTx f;
+    while (resent < k_rel_resend_gather && rel_resend(r, now, f)) {
+        trace(TR_REL_RESEND, f.seq, f.size, f.sends);
+        iov[count].iov_base = r.out.buf + (f.pos & (r.out.cap - 1));
+        iov[count++].iov_len = f.size;
+        resent++;
+    }
+    if (len > 0) {
+        iov[count].iov_base = r.out.buf + (from & (r.out.cap - 1));
+        iov[count++].iov_len = len;
+        from += len;
+    }
+    pthread_mutex_unlock(&r.mu);
+    if (count == 0) {
+        return 0;
+    }
+
+    // frames in out stay in place, appending to it takes the turn
+    if (with_ack) {
+        stat_frame(s->stats.tx, CMD_ACK);
+    }
+    stat_add(s->stats.tx.resent, resent);
+    if (s->ops->writev(s, iov, count)) {
+        int err = errno;
+        pthread_mutex_lock(&r.mu);
+        r.failed = 1;
+        pthread_cond_broadcast(&r.cond);
+        pthread_mutex_unlock(&r.mu);
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+static void writer_lock(Stream *s);
+static void writer_pass(Stream *s);
+static void tx_push(Stream *s, TxFrame *f);
+
+// Waits until a frame with a len bytes payload fits in out, holding mu when
+// it returns 0 or 1. While it waits, what was appended from `from` on is
+// written, acks and frames due are sent. Acks come through the reader,
+// which may itself wait for the turn to answer a ping, so the turn is
+// passed on meanwhile, the frames in *held go back to txq first and *held
+// is cleared; 1 is returned then. -1 once the link failed or stopped.
+static int rel_room(Stream *s, uint64_t &from, size_t len, TxFrame **held) {
+    RelLink &r = *s->rel;
+    size_t size = rel_frame_size(len);
+    int passed = 0;
+    pthread_mutex_lock(&r.mu);
+    while (!rel_fits(r, size, len <= k_rel_small)) {
+        if (r.failed || r.stop) {
+            pthread_mutex_unlock(&r.mu);
+            errno = EPIPE;
+            return -1;
+        }
+        uint64_t at = rel_deadline(r);
+        if (from != r.out.end || at <= monotonic_us()) {
+            pthread_mutex_unlock(&r.mu);
+            if (0 != rel_flush(s, from)) {
+                return -1;
+            }
+            pthread_mutex_lock(&r.mu);
+            continue;
+        }
+        // stream_rel_stop() waits for the ones away
+        r.waiters++;
+        pthread_mutex_unlock(&r.mu);
+        for (TxFrame *f = held ? *held : NULL; f; ) {
+            TxFrame *next = f->next;
+            tx_push(s, f);
+            f = next;
+        }
+        if (held) {
+            *held = NULL;
+        }
+        writer_pass(s);
+        pthread_mutex_lock(&r.mu);
+        while (!rel_fits(r, size, len <= k_rel_small) && !r.failed && !r.stop
+            && (at = rel_deadline(r)) > monotonic_us())
+        {
+            rel_wait(r, at);
+        }
+        pthread_mutex_unlock(&r.mu);
+        writer_lock(s);
+        pthread_mutex_lock(&r.mu);
+        r.waiters--;
+        pthread_cond_broadcast(&r.cond);
+        // whoever had the turn meanwhile wrote what it appended
+        from = r.out.end;
+        passed = 1;
+    }
+    return passed;
+}
+
+// Numbers the frame and copies it to out, rel_room() returned >= 0.
+static void rel_append(Stream *s, uint8_t cmd, const uint8_t *payload, size_t len, uint32_t chan) {
+    RelLink &r = *s->rel;
+    rel_push(r, cmd, chan, payload, len, monotonic_us());
+    uint32_t seq = r.next_seq - 1;
+    pthread_mutex_unlock(&r.mu);
+    stat_frame(s->stats.tx, cmd);
+    trace(TR_FRAME_OUT, chan << 8 | cmd, len, seq);
+}
+
+// pushed without a lock, newest first
+static void tx_push(Stream *s, TxFrame *f) {
+    f->next = __atomic_load_n(&s->txq, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&s->txq, &f->next, f, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {}
+}
+
+// the frames in txq, oldest first
+static TxFrame *tx_take(Stream *s) {
+    TxFrame *f = __atomic_exchange_n(&s->txq, (TxFrame *)NULL, __ATOMIC_ACQUIRE);
+    TxFrame *fifo = NULL;
+    while (f) {
+        TxFrame *next = f->next;
+        f->next = fifo;
+        fifo = f;
+        f = next;
+    }
+    return fifo;
+}
+
+static void tx_done(TxFrame *f, int err) {
+    f->err = err;
+    __atomic_store_n(&f->done, 1, __ATOMIC_RELEASE);
+}
+
+// the frames that still fit the stream, the others fail with EMSGSIZE
+static TxFrame *tx_fitting(Stream *s, TxFrame *fifo) {
+    TxFrame *head = NULL;
+    TxFrame **tail = &head;
+    while (fifo) {
+        TxFrame *next = fifo->next;
+        if (frame_fits(s, fifo->len, fifo->chan)) {
+            *tail = fifo;
+            tail = &fifo->next;
+        } else {
+            tx_done(fifo, EMSGSIZE);
+        }
+        fifo = next;
+    }
+    *tail = NULL;
+    return head;
+}
+
+// tx_drain() with HELLO_F_REL. A frame is done once it is in out, the
+// RelLink sends it from there. Only the thread that pushed it waits for
+// room: the reader may end a turn, and would wait for the acks it reads.
+// The others go back to txq until their owners take the turn.
+static void tx_drain_rel(Stream *s, TxFrame *fifo, const TxFrame *own) {
+    RelLink &r = *s->rel;
+    uint64_t from = r.out.end;
+    int err = 0;
+    while (fifo && !err) {
+        TxFrame *f = fifo;
+        fifo = f->next;
+        if (f != own) {
+            pthread_mutex_lock(&r.mu);
+            int fits = rel_fits(r, rel_frame_size(f->len), f->len <= k_rel_small);
+            pthread_mutex_unlock(&r.mu);
+            if (!fits) {
+                tx_push(s, f);
+                continue;
+            }
+        }
+        int ret = rel_room(s, from, f->len, &fifo);
+        if (ret < 0) {
+            err = errno ? errno : EIO;
+            tx_done(f, err);
+            break;
+        }
+        rel_append(s, f->cmd, f->payload, f->len, f->chan);
+        tx_done(f, 0);
+        if (ret > 0) {
+            // the ones after went back to txq while the turn was away
+            fifo = tx_fitting(s, tx_take(s));
+        }
+    }
+    if (!err && 0 != rel_flush(s, from)) {
+        err = errno ? errno : EIO;
+    }
+    while (fifo) {
+        TxFrame *next = fifo->next;
+        tx_done(fifo, err);
+        fifo = next;
+    }
+}
+
+// Sends what is in txq, oldest first. Called holding the writer turn, own
+// is the caller's frame if it pushed one.
+static void tx_drain(Stream *s, const TxFrame *own) {
+    TxFrame *fifo = tx_fitting(s, tx_take(s));
+    if (fifo && s->rel_tx) {
+        tx_drain_rel(s, fifo, own);
+        return;
+    }
+
+    while (fifo) {
+        struct iovec iov[k_tx_gather];
+        size_t count = 0;
+        size_t bytes = 0;
+        TxFrame *end = fifo;
+        for (; end && count < k_tx_gather; end = end->next, ++count) {
+            size_t head_len = put_header(s, end->payload, end->cmd, end->len, end->chan);
+            iov[count].iov_base = end->payload - head_len;
+            iov[count].iov_len = head_len + end->len;
+            bytes += iov[count].iov_len;
+        }
+        trace(TR_TX_DRAIN, (uint32_t)count, bytes);
+        int err = s->ops->writev(s, iov, count) ? (errno ? errno : EIO) : 0;
+        while (fifo != end) {
+            TxFrame *next = fifo->next;
+            tx_done(fifo, err);
+            fifo = next;
+        }
+    }
+}
+
+// Writers take turns in the order they asked, so channels that keep
+// producing output do not starve each other.
+static void writer_lock(Stream *s) {
+    pthread_mutex_lock(&s->wmu);
+    uint64_t ticket = s->wnext++;
+    while (ticket != s->wserving) {
+        pthread_cond_wait(&s->wcond, &s->wmu);
+    }
+    pthread_mutex_unlock(&s->wmu);
+}
+
+// takes the turn once nobody has or waits for it, returns 0 instead if
+// the frame was sent meanwhile
+static int writer_lock_frame(Stream *s, const TxFrame &f) {
+    pthread_mutex_lock(&s->wmu);
+    while (s->wnext != s->wserving && !__atomic_load_n(&f.done, __ATOMIC_ACQUIRE)) {
+        pthread_cond_wait(&s->wcond, &s->wmu);
+    }
+    int take = !__atomic_load_n(&f.done, __ATOMIC_ACQUIRE);
+    if (take) {
+        s->wnext++;
+    }
+    pthread_mutex_unlock(&s->wmu);
+    return take;
+}
+
+// the turn goes to the next in line
+static void writer_pass(Stream *s) {
+    pthread_mutex_lock(&s->wmu);
+    s->wserving++;
+    pthread_cond_broadcast(&s->wcond);
+    pthread_mutex_unlock(&s->wmu);
+}
+
+// payloads pushed during the turn go out before it passes on, with
+// HELLO_F_REL also the acks and frames due
+static void writer_unlock(Stream *s, const TxFrame *own = NULL) {
+    tx_drain(s, own);
+    if (s->rel_tx) {
+        uint64_t from = s->rel->out.end;
+        (void)rel_flush(s, from);
+    }
+    writer_pass(s);
+}
+
+// takes the turn only if nobody has or waits for it
+static int writer_try_lock(Stream *s) {
+    pthread_mutex_lock(&s->wmu);
+    int take = s->wnext == s->wserving;
+    if (take) {
+        s->wnext++;
+    }
+    pthread_mutex_unlock(&s->wmu);
+    return take;
+}
+
+// Sends acks and frames that timed out while no writer does. It never waits
+// for the turn, whoever has it sends them when it ends.
+static void *rel_run(void *user) {
+    Stream *s = (Stream *)user;
+    RelLink &r = *s->rel;
+    pthread_mutex_lock(&r.mu);
+    while (!r.stop) {
+        uint64_t now = monotonic_us();
+        uint64_t at = rel_deadline(r);
+        if (at > now) {
+            rel_wait(r, at);
+            continue;
+        }
+        pthread_mutex_unlock(&r.mu);
+        int took = writer_try_lock(s);
+        if (took) {
+            writer_unlock(s);
+        }
+        pthread_mutex_lock(&r.mu);
+        if (!took) {
+            rel_wait(r, now + k_rel_busy_us);
+        }
+    }
+    pthread_mutex_unlock(&r.mu);
+    return NULL;
+}
+
+// the RelLink and its thread, opened by whichever half switches first
+static RelLink *stream_rel_open(Stream *s) {
+    pthread_mutex_lock(&s->wmu);
+    RelLink *r = s->rel;
+    if (!r && (r = rel_new())) {
+        s->rel = r;
+        pthread_attr_t attr;
+        int err = thread_attr_init(&attr, 0) ? EAGAIN : 0;
+        if (!err) {
+            err = pthread_create(&r->thread, &attr, &rel_run, s);
+            pthread_attr_destroy(&attr);
+        }
+        if (err) {
+            log_err(err, "[stream_rel_open] pthread_create()");
+            s->rel = NULL;
+            rel_free(r);
+            r = NULL;
+        } else {
+            r->running = 1;
+        }
+    }
+    pthread_mutex_unlock(&s->wmu);
+    return r;
+}
+
+void stream_reset(Stream *s, int rfd, int wfd) {
+    stream_rel_stop(s);
+    writer_lock(s);
+    s->rfd = rfd;
+    s->wfd = wfd;
+    s->rbuf.begin = s->rbuf.end = 0;
+    __atomic_store_n(&s->version, PROTO_V1, __ATOMIC_RELAXED);
+    __atomic_store_n(&s->mux, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&s->peer_max_frame, MAX_FRAME_SIZE - FRAME_HEADER_SIZE, __ATOMIC_RELAXED);
+    lz_encoder_free(s->ztx);
+    lz_decoder_free(s->zrx);
+    free(s->zwbuf);
+    mirror_close(s->zin);
+    s->ztx = NULL;
+    s->zrx = NULL;
+    s->zwbuf = NULL;
+    s->zout = NULL;
+    s->zout_len = 0;
+    s->send_seq = 0;
+    s->recv_seq = 0;
+    rel_free(s->rel);
+    s->rel = NULL;
+    s->rel_tx = 0;
+    writer_unlock(s);
+}
+
+static int write_frame(Stream *s, uint8_t *payload, uint8_t cmd, size_t len, uint32_t chan) {
+    if (!frame_fits(s, len, chan)) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    if (s->rel_tx) {
+        uint64_t from = s->rel->out.end;
+        if (rel_room(s, from, len, NULL) < 0) {
+            return -1;
+        }
+        rel_append(s, cmd, payload, len, chan);
+        return rel_flush(s, from);
+    }
+    size_t head_len = put_header(s, payload, cmd, len, chan);
+    size_t write_len = head_len + len;
+    if (stream_write(s, payload - head_len, write_len) != (ssize_t)write_len) {
+        return -1;
+    }
+    return 0;
+}
 
-int send_ws(Stream *s, const struct winsize &ws) {
-    log_dbg("[send_ws] [row:%u][col:%u]", ws.ws_row, ws.ws_col);
+size_t hello_encode(const Hello &h, uint8_t *buf) {
+    buf[0] = 'P';
+    buf[1] = 'P';
+    buf[2] = h.version;
+    for (size_t i = 0; i < 4; ++i) {
+        buf[3 + i] = (uint8_t)(h.flags >> (8 * i));
+        buf[7 + i] = (uint8_t)(h.max_frame >> (8 * i));
+    }
+    return k_hello_size;
+}
 
-    char buf[4 + 4];
-    buf[0] = 4;
-    buf[1] = 0;
-    buf[2] = CMD_WS;
-    buf[3] = g_send_seq++;
-    buf[4] = (uint8_t)ws.ws_row;
-    buf[5] = (uint8_t)(ws.ws_row >> 8);
-    buf[6] = (uint8_t)ws.ws_col;
-    buf[7] = (uint8_t)(ws.ws_col >> 8);
+int hello_decode(const uint8_t *buf, size_t len, Hello &h) {
+    if (len < k_hello_size || buf[0] != 'P' || buf[1] != 'P') {
+        return -1;
+    }
+    h.version = buf[2];
+    h.flags = 0;
+    h.max_frame = 0;
+    for (size_t i = 0; i < 4; ++i) {
+        h.flags |= (uint32_t)buf[3 + i] << (8 * i);
+        h.max_frame |= (uint32_t)buf[7 + i] << (8 * i);
+    }
+    return 0;
+}
+
+int send_ws(Stream *s, const struct winsize &ws, const Hello *hello, uint32_t chan) {
+    log_dbg("[send_ws] [chan:%u] [row:%u][col:%u]", chan, ws.ws_row, ws.ws_col);
+
+    uint8_t buf[FRAME_HEADROOM + 4 + k_hello_size];
+    uint8_t *payload = &buf[FRAME_HEADROOM];
+    payload[0] = (uint8_t)ws.ws_row;
+    payload[1] = (uint8_t)(ws.ws_row >> 8);
+    payload[2] = (uint8_t)ws.ws_col;
+    payload[3] = (uint8_t)(ws.ws_col >> 8);
+    size_t len = 4;
+    if (hello) {
+        len += hello_encode(*hello, payload + 4);
+    }
 
-    if (stream_write(s, buf, sizeof(buf)) != sizeof(buf)) {
+    writer_lock(s);
+    int err = write_frame(s, payload, CMD_WS, len, chan);
+    writer_unlock(s);
+    if (err) {
         log_err(errno, "send_ws()");
         return -1;
     }
     return 0;
 }
 
-int send_payload(Stream *s, uint8_t cmd, const char *buf, size_t len) {
-    assert(0 < len && len + FRAME_HEADER_SIZE <= MAX_FRAME_SIZE);
-    log_dbg("[send_payload] [seq:%u][len:%zu]", g_send_seq, len);
+int send_hello(Stream *s, const Hello &h, uint32_t peer_max_frame) {
+    log_dbg("[send_hello] [version:%u][flags:%u][max_frame:%u]", h.version, h.flags, h.max_frame);
+
+    uint8_t buf[FRAME_HEADROOM + k_hello_size];
+    uint8_t *payload = &buf[FRAME_HEADROOM];
+    size_t len = hello_encode(h, payload);
+
+    writer_lock(s);
+    int err = write_frame(s, payload, CMD_HELLO, len, 0);
+    RelLink *r = NULL;
+    if (!err && (h.flags & HELLO_F_REL) && !(r = stream_rel_open(s))) {
+        err = -1;
+    }
+    if (!err) {
+        if (r) {
+            // checked and numbered from now on, in frames the ring holds
+            pthread_mutex_lock(&r->mu);
+            r->tx_on = 1;
+            pthread_cond_broadcast(&r->cond);
+            pthread_mutex_unlock(&r->mu);
+            s->rel_tx = 1;
+            peer_max_frame = peer_max_frame < k_rel_max_payload ? peer_max_frame : (uint32_t)k_rel_max_payload;
+        }
+        __atomic_store_n(&s->peer_max_frame, peer_max_frame, __ATOMIC_RELAXED);
+        __atomic_store_n(&s->version, h.version, __ATOMIC_RELAXED);
+        __atomic_store_n(&s->mux, (uint8_t)!!(h.flags & HELLO_F_MUX), __ATOMIC_RELAXED);
+        if ((h.flags & HELLO_F_LZ) && !r) {
+            err = stream_tx_compress(s);
+        }
+    }
+    writer_unlock(s);
+    if (err) {
+        log_err(errno, "send_hello()");
+        return -1;
+    }
+    return 0;
+}
+
+int send_open(Stream *s, uint32_t chan, uint8_t flags, const struct winsize &ws) {
+    log_dbg("[send_open] [chan:%u][flags:%u]", chan, flags);
+
+    uint8_t buf[FRAME_HEADROOM + 5];
+    uint8_t *payload = &buf[FRAME_HEADROOM];
+    payload[0] = flags;
+    payload[1] = (uint8_t)ws.ws_row;
+    payload[2] = (uint8_t)(ws.ws_row >> 8);
+    payload[3] = (uint8_t)ws.ws_col;
+    payload[4] = (uint8_t)(ws.ws_col >> 8);
+
+    writer_lock(s);
+    int err = write_frame(s, payload, CMD_OPEN, 5, chan);
+    writer_unlock(s);
+    if (err) {
+        log_err(errno, "send_open()");
+        return -1;
+    }
+    return 0;
+}
+
+int send_resume(Stream *s, uint64_t seq, uint32_t chan) {
+    log_dbg("[send_resume] [chan:%u] [seq:%llu]", chan, (unsigned long long)seq);
+
+    uint8_t buf[FRAME_HEADROOM + 8];
+    uint8_t *payload = &buf[FRAME_HEADROOM];
+    for (size_t i = 0; i < 8; ++i) {
+        payload[i] = (uint8_t)(seq >> (8 * i));
+    }
+
+    writer_lock(s);
+    int err = write_frame(s, payload, CMD_RESUME, 8, chan);
+    writer_unlock(s);
+    if (err) {
+        log_err(errno, "send_resume()");
+        return -1;
+    }
+    return 0;
+}
+
+int send_window(Stream *s, uint32_t bytes, uint32_t chan) {
+    uint8_t buf[FRAME_HEADROOM + 4];
+    uint8_t *payload = &buf[FRAME_HEADROOM];
+    for (size_t i = 0; i < 4; ++i) {
+        payload[i] = (uint8_t)(bytes >> (8 * i));
+    }
+
+    writer_lock(s);
+    int err = write_frame(s, payload, CMD_WINDOW, 4, chan);
+    writer_unlock(s);
+    if (err) {
+        log_err(errno, "send_window()");
+        return -1;
+    }
+    return 0;
+}
+
+int send_ping(Stream *s, uint8_t flags, uint64_t time) {
+    uint8_t buf[FRAME_HEADROOM + 9];
+    uint8_t *payload = &buf[FRAME_HEADROOM];
+    payload[0] = flags;
+    for (size_t i = 0; i < 8; ++i) {
+        payload[1 + i] = (uint8_t)(time >> (8 * i));
+    }
 
-    char *head = (char *)(buf - FRAME_HEADER_SIZE);
-    head[0] = (uint8_t)(len & 0xff);
-    head[1] = (uint8_t)(len >> 8);
-    head[2] = cmd;
-    head[3] = g_send_seq++;
+    writer_lock(s);
+    int err = write_frame(s, payload, CMD_PING, 9, 0);
+    writer_unlock(s);
+    if (err) {
+        log_err(errno, "send_ping()");
+        return -1;
+    }
+    return 0;
+}
 
-    size_t write_len = FRAME_HEADER_SIZE + len;
-    if (stream_write(s, head, write_len) != (ssize_t)write_len) {
-        log_err(errno, "send_payload()");
+int ping_decode(const uint8_t *buf, size_t len, uint8_t &flags, uint64_t &time) {
+    if (len < 9) {
+        log_err(0, "CMD_PING [size:%zu] < 9", len);
         return -1;
     }
+    flags = buf[0];
+    time = 0;
+    for (size_t i = 0; i < 8; ++i) {
+        time |= (uint64_t)buf[1 + i] << (8 * i);
+    }
     return 0;
 }
 
-int send_eof(Stream *s) {
-    char buf[4];
-    buf[0] = 0;
-    buf[1] = 0;
-    buf[2] = CMD_EOF;
-    buf[3] = g_send_seq++;
+int send_payload(Stream *s, uint8_t cmd, const char *buf, size_t len, uint32_t chan) {
+    // the size is checked in the turn, stream_reset() may lower the limit
+    assert(0 < len);
+    TxFrame f = {NULL, (uint8_t *)buf, len, chan, cmd, 0, 0};
+    tx_push(s, &f);
+    // whoever holds the turn sends it along with its own, or we do; with
+    // HELLO_F_REL it may come back to txq for us to wait for room
+    while (writer_lock_frame(s, f)) {
+        writer_unlock(s, &f);
+    }
+    assert(f.done);
+    if (f.err) {
+        log_err(f.err, "send_payload()");
+        return -1;
+    }
+    return 0;
+}
 
-    log_dbg("send CMD_EOF");
-    if (stream_write(s, buf, sizeof(buf)) != sizeof(buf)) {
+int send_eof(Stream *s, uint32_t chan) {
+    uint8_t buf[FRAME_HEADROOM];
+
+    log_dbg("send CMD_EOF [chan:%u]", chan);
+    writer_lock(s);
+    int err = write_frame(s, &buf[FRAME_HEADROOM], CMD_EOF, 0, chan);
+    writer_unlock(s);
+    if (err) {
         log_err(errno, "send_eof()");
         return -1;
     }
     return 0;
 }
 
-int feed_frame(Parser &p, Stream *s, int cb(Parser &p, void *user), void *user) {
+// Each frame in a batch is FRAME_HEADROOM bytes followed by the payload. The
+// headroom holds [len 4 bytes][cmd][chan 2 bytes] until the flush, which writes the real
+// header for the wire version in use at that time and packs the frames.
+
+Batch::~Batch() {
+    free(buf);
+}
+
+char *batch_reserve(Batch &b, Stream *s, size_t *avail) {
+    if (!b.buf) {
+        if (!(b.buf = (uint8_t *)malloc(s->bufs.batch))) {
+            log_err(errno, "[batch_reserve] out of memory");
+            *avail = 0;
+            return NULL;
+        }
+        b.size = s->bufs.batch;
+    }
+    size_t room = b.size - b.len;
+    if (room <= FRAME_HEADROOM) {
+        *avail = 0;
+        return NULL;
+    }
+    room -= FRAME_HEADROOM;
+    size_t max_payload = stream_max_payload(s);
+    *avail = room < max_payload ? room : max_payload;
+    return (char *)&b.buf[b.len + FRAME_HEADROOM];
+}
+
+int batch_commit(Batch &b, Stream *s, uint8_t cmd, size_t len, uint64_t now, uint32_t chan) {
+    assert(0 < len && b.len + FRAME_HEADROOM + len <= b.size);
+    if (b.len == 0) {
+        b.flush_at = now + b.deadline_us;
+    }
+
+    uint8_t *head = &b.buf[b.len];
+    uint32_t len32 = (uint32_t)len;
+    memcpy(head, &len32, sizeof(len32));
+    head[4] = cmd;
+    head[5] = (uint8_t)chan;
+    head[6] = (uint8_t)(chan >> 8);
+    b.len += FRAME_HEADROOM + len;
+    stat_add(b.stats->frames, 1);
+
+    if (b.deadline_us == 0) {
+        return batch_flush(b, s, &b.stats->flush_other);
+    }
+    if (b.size - b.len < FRAME_HEADROOM + MAX_FRAME_SIZE) {
+        return batch_flush(b, s, &b.stats->flush_size);
+    }
+    return 0;
+}
+
+int batch_flush(Batch &b, Stream *s, uint64_t *counter) {
+    if (b.len == 0) {
+        return 0;
+    }
+
+    writer_lock(s);
+    int rel = s->rel_tx;
+    uint64_t from = rel ? s->rel->out.end : 0;
+    int err = 0;
+    size_t out = 0;
+    size_t begin = 0;
+    int packed = 0;
+    for (size_t pos = 0; pos < b.len; ) {
+        uint8_t *payload = &b.buf[pos + FRAME_HEADROOM];
+        uint32_t len = 0;
+        memcpy(&len, &b.buf[pos], sizeof(len));
+        uint8_t cmd = b.buf[pos + 4];
+        uint32_t chan = (uint32_t)b.buf[pos + 5] | ((uint32_t)b.buf[pos + 6] << 8);
+        if (!frame_fits(s, len, chan)) {
+            // reserved before the stream was reset, the peer resumes
+            log_err(EMSGSIZE, "[batch_flush] frame [size:%u][chan:%u] dropped", len, chan);
+            pos += FRAME_HEADROOM + len;
+            continue;
+        }
+        if (rel) {
+            // copied to the RelLink's ring instead of packed here
+            err = err || rel_room(s, from, len, NULL) < 0;
+            if (!err) {
+                rel_append(s, cmd, payload, len, chan);
+            }
+            pos += FRAME_HEADROOM + len;
+            continue;
+        }
+        size_t head_len = put_header(s, payload, cmd, len, chan);
+        size_t frame_begin = pos + FRAME_HEADROOM - head_len;
+        if (!packed++) {
+            begin = out = frame_begin;
+        } else {
+            stat_add(s->stats.tx.moved, head_len + len);
+            memmove(&b.buf[out], &b.buf[frame_begin], head_len + len);
+        }
+        out += head_len + len;
+        pos += FRAME_HEADROOM + len;
+    }
+    trace(TR_BATCH_FLUSH, 0, b.len, out - begin);
+
+    stat_add(*counter, 1);
+    b.len = 0;
+    if (rel) {
+        err = err || rel_flush(s, from);
+    } else if (packed) {
+        err = stream_write(s, &b.buf[begin], out - begin) != (ssize_t)(out - begin);
+    }
+    writer_unlock(s);
+    if (err) {
+        log_err(errno, "batch_flush()");
+        return -1;
+    }
+    return 0;
+}
+
+int64_t batch_timeout(const Batch &b, uint64_t now) {
+    if (b.len == 0) {
+        return -1;
+    }
+    return b.flush_at > now ? (int64_t)(b.flush_at - now) : 0;
+}
+
+Parser::~Parser() {
+    mirror_close(input);
+}
+
+// HELLO_F_REL: what fails its check is dropped and the parser resyncs on
+// the next magic byte, the frames are passed on in order once the ones
+// missing came again
+static int feed_rel(Parser &p, Stream *s, int cb(Parser &p, void *user), void *user) {
+    MirrorRing &in = p.input;
+    RelLink &r = *s->rel;
+    while (mirror_len(in) > 0) {
+        const uint8_t *data = mirror_data(in);
+        size_t avail = mirror_len(in);
+        RelFrame f;
+        int n = rel_decode(data, avail, f);
+        if (n == 0) {
+            trace(TR_FEED_SHORT, 0xff, f.need, avail);
+            p.need = f.need;
+            break;
+        }
+        if (n < 0 || f.bad) {
+            // past the header only, the next frame may start inside what
+            // its length claims
+            size_t skip = n < 0 ? (size_t)-n : k_rel_header_size;
+            trace(TR_REL_DROP, n < 0 ? 0xff : f.cmd, skip, f.seq);
+            // a header that fails its check is mostly a magic byte in a payload
+            stat_add(s->stats.rx.dropped, f.bad);
+            mirror_consume(in, skip);
+            continue;
+        }
+        stat_frame(s->stats.rx, f.cmd);
+        stat_add(s->stats.rx.bytes, (size_t)n);
+        uint64_t now = monotonic_us();
+
+        if (f.cmd == CMD_ACK) {
+            uint32_t cum = 0;
+            uint64_t sack = 0;
+            if (0 == rel_ack_decode(f.payload, f.len, cum, sack)) {
+                pthread_mutex_lock(&r.mu);
+                rel_acked(r, cum, sack, now);
+                pthread_cond_broadcast(&r.cond);
+                pthread_mutex_unlock(&r.mu);
+            }
+            mirror_consume(in, (size_t)n);
+            continue;
+        }
+
+        pthread_mutex_lock(&r.mu);
+        uint64_t ack_at = r.ack_at;
+        int verdict = rel_accept(r, f.seq, now);
+        if (r.ack_at != ack_at) {
+            pthread_cond_broadcast(&r.cond);
+        }
+        pthread_mutex_unlock(&r.mu);
+        if (verdict == REL_DROP) {
+            trace(TR_REL_DROP, f.cmd, (uint64_t)n, f.seq);
+            stat_add(s->stats.rx.dropped, 1);
+        } else if (verdict == REL_STORE) {
+            RelStored &st = r.stored[f.seq % k_rel_max_frames];
+            st.cmd = f.cmd;
+            st.chan = f.chan;
+            st.payload.assign((const char *)f.payload, f.len);
+        } else {
+            trace(TR_FRAME_IN, f.chan << 8 | f.cmd, f.len, f.seq);
+            p.size = f.len;
+            p.cmd = f.cmd;
+            p.chan = f.chan;
+            p.payload = f.payload;
+            int err = cb(p, user);
+            if (err) {
+                return err;
+            }
+        }
+        mirror_consume(in, (size_t)n);
+
+        // the ones that came early follow
+        while (verdict == REL_DELIVER) {
+            pthread_mutex_lock(&r.mu);
+            int slot = rel_next(r, monotonic_us());
+            uint32_t seq = r.expected - 1;
+            if (slot >= 0) {
+                pthread_cond_broadcast(&r.cond);
+            }
+            pthread_mutex_unlock(&r.mu);
+            if (slot < 0) {
+                break;
+            }
+            RelStored &st = r.stored[slot];
+            trace(TR_FRAME_IN, st.chan << 8 | st.cmd, st.payload.size(), seq);
+            p.size = st.payload.size();
+            p.cmd = st.cmd;
+            p.chan = st.chan;
+            p.payload = (const uint8_t *)st.payload.data();
+            int err = cb(p, user);
+            if (err) {
+                return err;
+            }
+        }
+    }
+    return 0;
+}
+
+template <class Codec>
+static int feed_codec(Parser &p, Stream *s, int cb(Parser &p, void *user), void *user) {
     assert(!p.eof);
-    log_dbg("[feed_frame] called");
+    MirrorRing &in = p.input;
+    trace(TR_FEED, 0, in.buf ? mirror_len(in) : 0);
+
+L_AGAIN:
+    // a large frame is read straight into place once its header is known,
+    // with room left for what follows it (base64 decodes 3 bytes at a time)
+    size_t want = p.need + MAX_FRAME_SIZE > s->bufs.input ? p.need + MAX_FRAME_SIZE : s->bufs.input;
+    if (!in.buf || in.cap < want) {
+        stat_add(s->stats.rx.moved, in.buf ? mirror_len(in) : 0);
+        if (0 != mirror_reserve(in, want)) {
+            return -1;
+        }
+    }
 
-    ssize_t nread = stream_read(s, &p.input_buf[p.buf_len], k_input_buf_size - p.buf_len);
+    ssize_t nread = read_codec<Codec>(s, mirror_tail(in), mirror_room(in));
+    if (nread < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        // non-blocking stream drained
+        return 0;
+    }
     if (nread < 0) {
         log_err(errno, "feed_frame() read(fd)");
         return -1;
@@ -140,36 +1481,61 @@ int feed_frame(Parser &p, Stream *s, int cb(Parser &p, void *user), void *user)
     }
 
     // parse each frame
-    size_t buf_end = p.buf_len + (size_t)nread;
-    size_t buf_pos = 0;
-    while (buf_pos < buf_end) {
-        if (buf_pos + FRAME_HEADER_SIZE > buf_end) {
-            log_dbg("[feed_frame] not enough header [nread:%zd]", nread);
-            break;
-        }
-        const uint8_t *data = &p.input_buf[buf_pos];
-        size_t size = (size_t)data[0] | ((size_t)data[1] << 8);
-        uint8_t cmd = data[2];
-        uint8_t seq = data[3];
-        const uint8_t *payload = data + FRAME_HEADER_SIZE;
-        if (FRAME_HEADER_SIZE + size > MAX_FRAME_SIZE) {
-            log_err(0, "[feed_frame] frame too large [seq:%u][size:%zu][cmd:%u] [pos:%zu]", seq, size, cmd, buf_pos);
+    mirror_commit(in, (size_t)nread);
+    p.need = 0;
+    while (mirror_len(in) > 0 && !p.rel) {
+        const uint8_t *data = mirror_data(in);
+        size_t avail = mirror_len(in);
+        uint8_t cmd = 0;
+        uint8_t seq = s->recv_seq;
+        uint32_t chan = 0;
+        size_t size = 0;
+        int head_len = parse_header(p, s, data, avail, cmd, seq, chan, size);
+        if (head_len < 0) {
+            log_err(0, "[feed_frame] bad header [pos:%llu]", (unsigned long long)in.begin);
             return -1;
         }
-        if (buf_pos + FRAME_HEADER_SIZE + size > buf_end) {
-            log_dbg("[feed_frame] not enough payload [nread:%zd] [seq:%u][cmd:%u][size:%zu] [pos:%zu][end:%zu]",
-                nread, seq, cmd, size, buf_pos, buf_end);
+        if (head_len == 0) {
+            trace(TR_FEED_SHORT, 0xff, 0, avail);
+            break;
+        }
+        const uint8_t *payload = data + head_len;
+        if (head_len + size > avail) {
+            trace(TR_FEED_SHORT, cmd, size, avail);
+            p.need = head_len + size;
             break;
         }
-        if (seq != g_recv_seq++) {
-            log_err(0, "[feed_frame] [seq:%u] != [expected:%u] [size:%zu][cmd:%u] [pos:%zu]", seq, g_recv_seq - 1, size, cmd, buf_pos);
+        if (seq != s->recv_seq++) {
+            log_err(0, "[feed_frame] [seq:%u] != [expected:%u] [size:%zu][cmd:%u] [pos:%llu]",
+                seq, (uint8_t)(s->recv_seq - 1), size, cmd, (unsigned long long)in.begin);
             return -1;
         }
+        stat_frame(s->stats.rx, cmd);
+        // by frame, what follows a hello is counted again once decompressed
+        stat_add(s->stats.rx.bytes, head_len + size);
+
+        // the peer switches right after its hello
+        Hello h;
+        if (cmd == CMD_HELLO) {
+            if (0 != hello_decode(payload, size, h) || h.version < PROTO_V1 || h.version > PROTO_VERSION) {
+                log_err(0, "[feed_frame] bad CMD_HELLO [size:%zu]", size);
+                return -1;
+            }
+            p.version = h.version;
+            p.mux = !!(h.flags & HELLO_F_MUX);
+            if ((h.flags & HELLO_F_REL) && !p.rel) {
+                if (!stream_rel_open(s)) {
+                    return -1;
+                }
+                p.rel = 1;
+            }
+        }
 
         // output
-        log_dbg("[feed_frame] [seq:%u][size:%zu][cmd:%u] [pos:%zu]", seq, size, cmd, buf_pos);
+        trace(TR_FRAME_IN, chan << 8 | cmd, size, seq);
         p.size = size;
         p.cmd = cmd;
+        p.chan = chan;
         p.payload = payload;
         int err = cb(p, user);
         if (err) {
@@ -177,13 +1543,58 @@ int feed_frame(Parser &p, Stream *s, int cb(Parser &p, void *user), void *user)
         }
 
         // next
-        buf_pos += FRAME_HEADER_SIZE + size;
+        mirror_consume(in, head_len + size);
+
+        // what was read after the hello is compressed
+        if (cmd == CMD_HELLO && (h.flags & HELLO_F_LZ) && !p.rel && !s->zrx) {
+            if (0 != stream_rx_compress(s, mirror_data(in), mirror_len(in))) {
+                return -1;
+            }
+            mirror_consume(in, mirror_len(in));
+        }
     }
 
-    // move incomplete frame
-    if (buf_pos < buf_end) {
-        memmove(p.input_buf, p.input_buf + buf_pos, buf_end - buf_pos);
+    // the rest of what came with the hello, and every read after it
+    if (p.rel) {
+        int err = feed_rel(p, s, cb, user);
+        if (err) {
+            return err;
+        }
+    }
+
+    // an incomplete frame stays where it is, the next read goes after it
+    stat_add(s->stats.rx.short_io, mirror_len(in) > 0);
+
+    // decoded input would otherwise wait for the fd to become readable
+    if (!p.eof && stream_pending(s)) {
+        goto L_AGAIN;
     }
-    p.buf_len = buf_end - buf_pos;
     return 0;
 }
+
+template <class Codec>
+static constexpr StreamOps stream_ops() {
+    return StreamOps{&read_codec<Codec>, &write_codec<Codec>, &writev_codec<Codec>, &feed_codec<Codec>};
+}
+
+const StreamOps k_stream_raw = stream_ops<RawCodec>();
+static const StreamOps k_stream_base64 = stream_ops<Base64Codec>();
+static const StreamOps k_stream_escape = stream_ops<EscapeCodec>();
+
+void stream_set_codec(Stream *s, int base64, const EscapeSet *escape) {
+    s->base64 = base64;
+    s->escape = escape;
+    s->ops = base64 ? &k_stream_base64 : escape ? &k_stream_escape : &k_stream_raw;
+}
+
+ssize_t stream_read(Stream *s, void *buf, size_t bufsize) {
+    return s->ops->read(s, buf, bufsize);
+}
+
+ssize_t stream_write(Stream *s, const void *buf, size_t bufsize) {
+    return s->ops->write(s, buf, bufsize);
+}
+
+int feed_frame(Parser &p, Stream *s, int cb(Parser &p, void *user), void *user) {
+    return s->ops->feed(p, s, cb, user);
+}
@@ -3,47 +3,249 @@
 // system
 #include <stdint.h>
 #include <stddef.h>
+#include <pthread.h>
 #include <termios.h>
 #include <sys/ioctl.h>
+// proj
+#include "escape.h"
+#include "ring.h"
+#include "stats.h"
 
 #define CMD_DATA 0
 #define CMD_WS 1
 #define CMD_EOF 2
 #define CMD_ERR 3
+#define CMD_HELLO 4
+#define CMD_OPEN 5      // [flags][row 2 bytes][col 2 bytes], starts a channel
+#define CMD_RESUME 6    // [seq 8 bytes], output bytes the master already has
+#define CMD_PING 7      // [flags][time 8 bytes], a pong returns the time
+#define CMD_CHUNK 8     // [offset 8 bytes][crc32c 4 bytes][data], see xfer.h
+#define CMD_WINDOW 9    // [bytes 4], more the peer may send, see fwd.h
+#define CMD_ACK 10      // [cum 4][sack 8], only with HELLO_F_REL, see rel.h
 #define FRAME_HEADER_SIZE 4
 #define MAX_FRAME_SIZE 4096
 
+// v1: [len lo][len hi][cmd][seq], frames up to MAX_FRAME_SIZE
+// v2: [1LLLLLLL] CMD_DATA with 1..127 bytes of payload, seq implied
+//     [0 cmd   ][seq][varint len], payloads up to the peer's max_frame
+//     with HELLO_F_MUX: [0 cmd][seq][varint chan][varint len], the compact
+//     form is channel 0
+#define PROTO_V1 1
+#define PROTO_V2 2
+#define PROTO_VERSION PROTO_V2
+// room callers leave in front of a payload, fits every header
+#define FRAME_HEADROOM 8
+#define MAX_PAYLOAD_V2 (1024 * 1024)
+#define COMPACT_MAX_SIZE 127
+// Hello.flags
+#define HELLO_F_LZ 1
+#define HELLO_F_MUX 2
+#define HELLO_F_RESUME 4
+#define HELLO_F_PING 8
+#define HELLO_F_FILE 16     // with HELLO_F_MUX, OPEN_F_GET and OPEN_F_PUT
+#define HELLO_F_FWD 32      // with HELLO_F_MUX, OPEN_F_CONNECT and OPEN_F_LISTEN
+#define HELLO_F_REL 64      // checked, acked frames, see rel.h; not with HELLO_F_LZ or base64
+// channel ids take at most 2 varint bytes, 0 is the first session
+#define MAX_CHANNEL 0x3fff
+// CMD_OPEN flags
+#define OPEN_F_NO_TTY 1
+#define OPEN_F_GET 2     // the channel carries a file, not a session
+#define OPEN_F_PUT 4
+#define OPEN_F_CONNECT 8 // a forwarded connection
+#define OPEN_F_LISTEN 16
+// CMD_PING flags
+#define PING_F_PONG 1
+
+
+struct WriteQueue;
+struct TxFrame;
+struct StreamOps;
+// the Stream's loops for a raw wire, the default
+extern const StreamOps k_stream_raw;
+struct LzEncoder;
+struct LzDecoder;
+struct RelLink;
 
 const size_t k_input_buf_size = MAX_FRAME_SIZE * 4;
-const size_t k_base64_input_buf_size = MAX_FRAME_SIZE * 6;
-const size_t k_base64_output_buf_size = MAX_FRAME_SIZE * 6;
+const size_t k_batch_buf_size = MAX_FRAME_SIZE * 16;
+// largest payload a single read() is framed into
+const size_t k_io_buf_size = MAX_FRAME_SIZE * 16;
+
+// The buffer sizes of a Stream, the Parser fed from it and the Batches
+// flushed to it. The constants above are the defaults and the maxima.
+struct BufSizes {
+    size_t io = k_io_buf_size;
+    size_t input = k_input_buf_size;    // Parser and gather, base64 takes 3/2 of it
+    size_t batch = k_batch_buf_size;
+    uint32_t max_frame = MAX_PAYLOAD_V2;    // offered in the hello, bounds what the Parser holds
+};
+// the command line's, main() hands them to its streams
+extern BufSizes g_bufs;
+// The low-memory profile, for slaves on small boards: 16 KB reads and
+// frames. With --no-tty, no compression and k_thread_stack_low_mem a
+// session stays within 1 MB of RSS over the process' own, pty_proxy_bench
+// checks it.
+void bufs_low_mem(BufSizes &b);
+
+// Version negotiation. The master appends it to its first CMD_WS, which v1
+// slaves ignore; a v2 slave answers with CMD_HELLO and the master acks with
+// CMD_HELLO. Each side switches after sending/receiving the CMD_HELLO.
+// The flags of the reply and the ack are those both sides agreed on.
+struct Hello {
+    uint8_t version = 0;
+    uint32_t flags = 0;         // HELLO_F_*
+    uint32_t max_frame = 0;     // largest payload the sender of the hello accepts
+};
+
+const size_t k_hello_size = 11;
 
 struct Parser {
+    Parser() = default;
+    Parser(const Parser &) = delete;
+    Parser &operator=(const Parser &) = delete;
+    ~Parser();
     // private
-    uint8_t input_buf[k_input_buf_size];
-    size_t buf_len = 0;
+    MirrorRing input;           // frames are parsed in place, across the wrap, s->bufs.input
+    size_t need = 0;            // bytes the incomplete frame at front needs
+    uint8_t version = PROTO_V1;
+    uint8_t mux = 0;
+    uint8_t rel = 0;
     // output
     uint8_t eof = 0;
     uint8_t cmd = 0;
+    uint32_t chan = 0;
     size_t size = 0;
     const uint8_t *payload = NULL;
 };
 
+// With HELLO_F_LZ everything below the framing is sent as blocks of
+//     [varint: len << 1 | stored][len bytes]
+// compressed against the previous blocks, before base64 or escaping if
+// enabled. Each stream_write ends with a complete block. A block that does
+// not shrink is stored as is.
+//
+// All state is per instance, a process may run any number of streams, each
+// with one reader and any number of writers. The reader and the writer half
+// are on cache lines of their own.
 struct Stream {
+    Stream() = default;
+    Stream(const Stream &) = delete;
+    Stream &operator=(const Stream &) = delete;
+    ~Stream();
     // params
     int rfd = -1;
     int wfd = -1;
+    // the wire encoding, set with stream_set_codec()
     int base64 = 0;
+    // instead of base64, escapes these bytes on write and undoes any escape
+    // on read
+    const EscapeSet *escape = NULL;
+    const StreamOps *ops = &k_stream_raw;
+    // set with stream_set_bufs(), kept across stream_reset()
+    BufSizes bufs;
+    // event loop mode: queue output instead of blocking
+    WriteQueue *wq = NULL;
+    // reads the transport instead of read(rfd) if set, -1 with EAGAIN when
+    // nothing came yet, e.g. what io_uring read for us
+    ssize_t (*read_cb)(void *user, void *buf, size_t len) = NULL;
+    void *read_user = NULL;
+    // counters, kept across stream_reset()
+    IoStats stats;
+    // with HELLO_F_REL, opened by the first side to switch, see rel.h
+    RelLink *rel = NULL;
+
+    // writers queue on wmu for their turn, the writer state below is only
+    // touched by the writer whose turn it is
+    alignas(64) pthread_mutex_t wmu = PTHREAD_MUTEX_INITIALIZER;
+    pthread_cond_t wcond = PTHREAD_COND_INITIALIZER;
+    uint64_t wnext = 0;
+    uint64_t wserving = 0;
+    // payloads pushed without a lock, newest first; the writer whose turn
+    // ends sends them all at once
+    TxFrame *txq = NULL;
+    uint8_t version = PROTO_V1;
+    uint8_t mux = 0;
+    uint8_t send_seq = 0;
+    uint8_t rel_tx = 0;         // frames go through rel
+    uint32_t peer_max_frame = MAX_FRAME_SIZE - FRAME_HEADER_SIZE;
+    LzEncoder *ztx = NULL;
+    uint8_t *zwbuf = NULL;
+    // allocated by the first write that needs them
+    uint8_t *wbuf = NULL;       // base64 or escaped, bufs.input * 3 / 2
+    uint8_t *gather = NULL;     // frames encoded in one pass, bufs.input
+
+    // reader, one thread
+    alignas(64) uint8_t recv_seq = 0;
+    LzDecoder *zrx = NULL;
+    MirrorRing zin;             // blocks not decoded yet
+    const uint8_t *zout = NULL; // decoded, not returned yet
+    size_t zout_len = 0;
+    MirrorRing rbuf;            // base64 or escapes not decoded yet, opened by the first read
+};
+
+// Gathers frames so several of them go out in one stream_write
+struct Batch {
+    Batch() = default;
+    Batch(const Batch &) = delete;
+    Batch &operator=(const Batch &) = delete;
+    ~Batch();
+    // params
+    uint64_t deadline_us = 0;   // 0: flush after every frame
+    BatchStats *stats = &counters;  // or totals shared with other batches
     // private
-    size_t buflen = 0;
-    uint8_t rbuf[k_base64_input_buf_size];
-    uint8_t wbuf[k_base64_output_buf_size];
+    size_t len = 0;
+    uint64_t flush_at = 0;
+    uint8_t *buf = NULL;        // the stream's bufs.batch, allocated by the first batch_reserve()
+    size_t size = 0;
+    // unless stats points elsewhere
+    BatchStats counters;
 };
 
+// switches to a new transport, back to v1 without compression; the caller
+// closes the old fds afterwards
+void stream_reset(Stream *s, int rfd, int wfd);
+// base64, escape or neither, before the stream is used. The read, write and
+// frame parsing loops are instantiated for each codec, this picks the one
+// the stream runs from now on.
+void stream_set_codec(Stream *s, int base64, const EscapeSet *escape);
+// buffer sizes, before the stream is used; clamped to the constants and to
+// what a frame needs
+void stream_set_bufs(Stream *s, const BufSizes &b);
 ssize_t stream_read(Stream *s, void *buf, size_t bufsize);
 ssize_t stream_write(Stream *s, const void *buf, size_t bufsize);
+// largest payload the current wire version lets us send
+size_t stream_max_payload(Stream *s);
+// decoded input is buffered, stream_read() will not touch the fd
+int stream_pending(const Stream *s);
+
+size_t hello_encode(const Hello &h, uint8_t *buf);
+int hello_decode(const uint8_t *buf, size_t len, Hello &h);
 
-int send_ws(Stream *s, const struct winsize &ws);
-int send_payload(Stream *s, uint8_t cmd, const char *buf, size_t len);
-int send_eof(Stream *s);
+// hello is appended for version negotiation if not NULL
+int send_ws(Stream *s, const struct winsize &ws, const Hello *hello = NULL, uint32_t chan = 0);
+// sends CMD_HELLO with the current version, then switches to h.version
+// and h.flags
+int send_hello(Stream *s, const Hello &h, uint32_t peer_max_frame);
+int send_open(Stream *s, uint32_t chan, uint8_t flags, const struct winsize &ws);
+// on a channel other than 0 the offset a file transfer continues at
+int send_resume(Stream *s, uint64_t seq, uint32_t chan = 0);
+int send_window(Stream *s, uint32_t bytes, uint32_t chan);
+// time is the sender's monotonic_us(), a pong echoes the ping's
+int send_ping(Stream *s, uint8_t flags, uint64_t time);
+int ping_decode(const uint8_t *buf, size_t len, uint8_t &flags, uint64_t &time);
+// FRAME_HEADROOM bytes in front of buf are overwritten. Safe from several
+// threads, payloads sent meanwhile by others may go out in the same writev()
+int send_payload(Stream *s, uint8_t cmd, const char *buf, size_t len, uint32_t chan = 0);
+int send_eof(Stream *s, uint32_t chan = 0);
+// room for the next payload, returns NULL if the batch is full
+char *batch_reserve(Batch &b, Stream *s, size_t *avail);
+// frame the payload written to batch_reserve(), flushes when full
+int batch_commit(Batch &b, Stream *s, uint8_t cmd, size_t len, uint64_t now, uint32_t chan = 0);
+// counter: flush_size, flush_deadline or flush_other of b.stats
+int batch_flush(Batch &b, Stream *s, uint64_t *counter);
+// microseconds until the deadline, -1 if empty
+int64_t batch_timeout(const Batch &b, uint64_t now);
+// CMD_HELLO switches the parser to the announced version and flags. With
+// HELLO_F_REL frames that fail their check are dropped and come again, they
+// are passed on in order.
 int feed_frame(Parser &p, Stream *s, int cb(Parser &p, void *user), void *user);
@@ -0,0 +1,284 @@
+// system
+#include <string.h>
+#include <time.h>
+// self
+#include "rel.h"
+#include "crc32c.h"
+#include "protocol.h"
+#include "util.h"
+
+
+static void put_le(uint8_t *buf, uint64_t v, size_t n) {
+    for (size_t i = 0; i < n; ++i) {
+        buf[i] = (uint8_t)(v >> (8 * i));
+    }
+}
+
+static uint64_t get_le(const uint8_t *buf, size_t n) {
+    uint64_t v = 0;
+    for (size_t i = 0; i < n; ++i) {
+        v |= (uint64_t)buf[i] << (8 * i);
+    }
+    return v;
+}
+
+// a before b, across the wrap
+static int seq_before(uint32_t a, uint32_t b) {
+    return (int32_t)(a - b) < 0;
+}
+
+RelLink *rel_new() {
+    RelLink *r = new RelLink;
+    pthread_condattr_t attr;
+    int err = pthread_condattr_init(&attr);
+    if (!err) {
+        err = pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        err = err ? err : pthread_cond_init(&r->cond, &attr);
+        pthread_condattr_destroy(&attr);
+    }
+    if (err) {
+        log_err(err, "[rel_new] pthread_cond_init()");
+        delete r;
+        return NULL;
+    }
+    if (0 != mirror_open(r->out, k_rel_window * 2)) {
+        pthread_cond_destroy(&r->cond);
+        delete r;
+        return NULL;
+    }
+    return r;
+}
+
+void rel_free(RelLink *r) {
+    if (!r) {
+        return;
+    }
+    mirror_close(r->out);
+    pthread_cond_destroy(&r->cond);
+    delete r;
+}
+
+void rel_wait(RelLink &r, uint64_t at) {
+    if (at == UINT64_MAX) {
+        pthread_cond_wait(&r.cond, &r.mu);
+        return;
+    }
+    struct timespec ts = {};
+    ts.tv_sec = (time_t)(at / 1000000);
+    ts.tv_nsec = (long)(at % 1000000) * 1000;
+    (void)pthread_cond_timedwait(&r.cond, &r.mu, &ts);
+}
+
+size_t rel_encode(uint8_t *buf, uint8_t cmd, uint32_t chan, uint32_t seq, const uint8_t *payload, size_t len) {
+    buf[0] = k_rel_magic;
+    buf[1] = cmd;
+    put_le(buf + 2, chan, 2);
+    put_le(buf + 4, len, 2);
+    put_le(buf + 6, seq, 4);
+    put_le(buf + 10, crc32c(0, buf, 10), 4);
+    if (len == 0) {
+        return k_rel_header_size;
+    }
+    memcpy(buf + k_rel_header_size, payload, len);
+    put_le(buf + k_rel_header_size + len, crc32c(0, payload, len), 4);
+    return rel_frame_size(len);
+}
+
+int rel_decode(const uint8_t *data, size_t avail, RelFrame &f) {
+    if (data[0] != k_rel_magic) {
+        const uint8_t *next = (const uint8_t *)memchr(data + 1, k_rel_magic, avail - 1);
+        return -(int)(next ? next - data : avail);
+    }
+    if (avail < k_rel_header_size) {
+        f.need = k_rel_header_size;
+        return 0;
+    }
+    f.cmd = data[1];
+    f.chan = (uint32_t)get_le(data + 2, 2);
+    f.len = (size_t)get_le(data + 4, 2);
+    f.seq = (uint32_t)get_le(data + 6, 4);
+    if (get_le(data + 10, 4) != crc32c(0, data, 10) || f.len > k_rel_max_payload) {
+        return -1;
+    }
+    size_t size = rel_frame_size(f.len);
+    if (avail < size) {
+        f.need = size;
+        return 0;
+    }
+    f.payload = data + k_rel_header_size;
+    f.bad = f.len > 0 && get_le(f.payload + f.len, 4) != crc32c(0, f.payload, f.len);
+    return (int)size;
+}
+
+int rel_ack_decode(const uint8_t *payload, size_t len, uint32_t &cum, uint64_t &sack) {
+    if (len < k_rel_ack_size) {
+        log_err(0, "CMD_ACK [size:%zu] < %zu", len, k_rel_ack_size);
+        return -1;
+    }
+    cum = (uint32_t)get_le(payload, 4);
+    sack = get_le(payload + 4, 8);
+    return 0;
+}
+
+int rel_fits(const RelLink &r, size_t size, int small) {
+    if (small) {
+        return mirror_len(r.out) + size <= r.out.cap;
+    }
+    return mirror_len(r.out) + size <= k_rel_window && r.unacked.size() < k_rel_max_frames;
+}
+
+void rel_push(RelLink &r, uint8_t cmd, uint32_t chan, const uint8_t *payload, size_t len, uint64_t now) {
+    RelTx f;
+    f.seq = r.next_seq++;
+    f.pos = r.out.end;
+    f.size = (uint32_t)rel_encode(mirror_tail(r.out), cmd, chan, f.seq, payload, len);
+    f.sent_us = now;
+    f.sends = 1;
+    mirror_commit(r.out, f.size);
+    r.unacked.push_back(f);
+}
+
+// RFC 6298 without the clock granularity
+static void rtt_sample(RelLink &r, uint64_t rtt) {
+    if (r.srtt_us == 0) {
+        r.srtt_us = rtt ? rtt : 1;
+        r.rttvar_us = rtt / 2;
+    } else {
+        uint64_t delta = r.srtt_us > rtt ? r.srtt_us - rtt : rtt - r.srtt_us;
+        r.rttvar_us = (3 * r.rttvar_us + delta) / 4;
+        r.srtt_us = (7 * r.srtt_us + rtt) / 8;
+    }
+    uint64_t rto = r.srtt_us + 4 * r.rttvar_us;
+    r.rto_us = rto < k_rel_rto_min_us ? k_rel_rto_min_us : rto > k_rel_rto_max_us ? k_rel_rto_max_us : rto;
+}
+
+void rel_acked(RelLink &r, uint32_t cum, uint64_t sack, uint64_t now) {
+    if (r.unacked.empty() || (uint32_t)(cum - r.unacked.front().seq) > r.unacked.size()) {
+        // old, or acks what was not sent
+        return;
+    }
+    while (!r.unacked.empty() && seq_before(r.unacked.front().seq, cum)) {
+        const RelTx &f = r.unacked.front();
+        // Karn: a frame sent again does not tell which send was acked, and
+        // a sacked one was acked before
+        if (f.sends == 1 && !f.sacked) {
+            rtt_sample(r, now - f.sent_us);
+        }
+        mirror_consume(r.out, f.size);
+        r.unacked.pop_front();
+    }
+    // the first one is cum itself
+    for (size_t i = 1; i < r.unacked.size(); ++i) {
+        RelTx &f = r.unacked[i];
+        uint32_t bit = f.seq - cum - 1;
+        if (bit >= 64) {
+            break;
+        }
+        f.sacked |= (int)(sack >> bit & 1);
+    }
+}
+
+// A frame sacked ones came after is taken as lost a little after the round
+// trip instead of after the timeout, once; if it is lost again the timeout
+// tells
+static uint64_t lost_after(const RelLink &r, const RelTx &f, size_t i, size_t holes) {
+    uint64_t fast = r.srtt_us ? r.srtt_us + r.srtt_us / 4 : r.rto_us;
+    return i < holes && f.sends == 1 && fast < r.rto_us ? fast : r.rto_us;
+}
+
+// the frames before the newest sacked one
+static size_t sack_holes(const RelLink &r) {
+    for (size_t i = r.unacked.size(); i > 0; --i) {
+        if (r.unacked[i - 1].sacked) {
+            return i - 1;
+        }
+    }
+    return 0;
+}
+
+int rel_resend(RelLink &r, uint64_t now, RelTx &out) {
+    if (!r.tx_on || r.failed) {
+        return 0;
+    }
+    size_t holes = sack_holes(r);
+    for (size_t i = 0; i < r.unacked.size(); ++i) {
+        RelTx &f = r.unacked[i];
+        if (f.sacked) {
+            continue;
+        }
+        if (now < f.sent_us + lost_after(r, f, i, holes)) {
+            continue;
+        }
+        int timeout = now >= f.sent_us + r.rto_us;
+        if (timeout && i == 0) {
+            // the path may be gone, back off
+            r.rto_us = r.rto_us * 2 < k_rel_rto_max_us ? r.rto_us * 2 : k_rel_rto_max_us;
+        }
+        f.sent_us = now;
+        f.sends++;
+        out = f;
+        return 1;
+    }
+    return 0;
+}
+
+size_t rel_ack(RelLink &r, uint8_t *buf) {
+    uint8_t payload[k_rel_ack_size];
+    put_le(payload, r.expected, 4);
+    put_le(payload + 4, r.sack >> 1, 8);
+    r.ack_at = 0;
+    r.rx_since_ack = 0;
+    return rel_encode(buf, CMD_ACK, 0, 0, payload, sizeof(payload));
+}
+
+int rel_accept(RelLink &r, uint32_t seq, uint64_t now) {
+    uint32_t d = seq - r.expected;
+    if (d == 0) {
+        r.expected++;
+        r.sack >>= 1;
+        r.rx_since_ack++;
+        // a hole is filled, or the sender is kept waiting long enough
+        if (r.sack || r.rx_since_ack >= k_rel_ack_every) {
+            r.ack_at = now;
+        } else if (!r.ack_at) {
+            r.ack_at = now + k_rel_ack_delay_us;
+        }
+        return REL_DELIVER;
+    }
+    // the sender learns of a hole or a lost ack at once
+    r.ack_at = now;
+    if (d < k_rel_max_frames && !(r.sack >> d & 1)) {
+        r.sack |= (uint64_t)1 << d;
+        return REL_STORE;
+    }
+    return REL_DROP;
+}
+
+int rel_next(RelLink &r, uint64_t now) {
+    if (!(r.sack & 1)) {
+        return -1;
+    }
+    int slot = (int)(r.expected % k_rel_max_frames);
+    r.expected++;
+    r.sack >>= 1;
+    r.rx_since_ack++;
+    r.ack_at = now;
+    return slot;
+}
+
+uint64_t rel_deadline(const RelLink &r) {
+    if (!r.tx_on || r.failed) {
+        return UINT64_MAX;
+    }
+    uint64_t at = r.ack_at ? r.ack_at : UINT64_MAX;
+    size_t holes = sack_holes(r);
+    for (size_t i = 0; i < r.unacked.size(); ++i) {
+        const RelTx &f = r.unacked[i];
+        if (f.sacked) {
+            continue;
+        }
+        uint64_t t = f.sent_us + lost_after(r, f, i, holes);
+        at = t < at ? t : at;
+    }
+    return at;
+}
@@ -0,0 +1,151 @@
+#pragma once
+
+// system
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <deque>
+#include <string>
+// proj
+#include "ring.h"
+
+
+// The reliable link, HELLO_F_REL, for transports that flip or lose bytes.
+// Once a side switched, each frame it sends is
+//     [0xa5][cmd][chan 2][len 2][seq 4][crc32c of the 10 bytes before, 4]
+//     [payload][crc32c of the payload, 4, if len > 0]
+// little endian. A frame that fails a check is dropped and the next one is
+// found by its magic byte. Frames are numbered with 32-bit seqs and kept
+// until the peer acks them with CMD_ACK, which is not numbered itself:
+//     [cum 4: the seq expected next][sack 8: bit i set if cum + 1 + i came]
+// Acks are delayed a little unless a frame came out of order, and go along
+// with whatever the receiver sends meanwhile.
+//
+// The sender has up to k_rel_window bytes in flight. A frame is sent again
+// once its timeout passes, computed as in RFC 6298, or as soon as frames
+// after it were sacked. Writers only wait for acks when the window is full,
+// and pass the writer turn on meanwhile; frames with small payloads may go
+// past it, into a reserve as large again, so a reader answering a ping does
+// not wait for the acks it would read.
+
+const uint8_t k_rel_magic = 0xa5;
+const size_t k_rel_header_size = 14;
+const size_t k_rel_crc_size = 4;
+// both sides send no larger payloads, whatever their hellos said
+const size_t k_rel_max_payload = 8192;
+const size_t k_rel_window = 64 * 1024;
+// payloads up to this size may use the reserve, the replies a reader sends
+// (pongs, CMD_ERR) fit
+const size_t k_rel_small = 512;
+// frames in flight, the peer stores as many that came out of order
+const size_t k_rel_max_frames = 64;
+const size_t k_rel_ack_size = 12;
+const uint64_t k_rel_ack_delay_us = 10000;
+// in order frames acked at once
+const uint32_t k_rel_ack_every = 8;
+const uint64_t k_rel_rto_init_us = 200000;
+const uint64_t k_rel_rto_min_us = 50000;
+const uint64_t k_rel_rto_max_us = 10000000;
+
+inline size_t rel_frame_size(size_t len) {
+    return k_rel_header_size + len + (len ? k_rel_crc_size : 0);
+}
+
+struct RelFrame {
+    uint8_t cmd = 0;
+    uint32_t chan = 0;
+    uint32_t seq = 0;
+    size_t len = 0;
+    const uint8_t *payload = NULL;
+    int bad = 0;                // the header is fine, the payload is not
+    size_t need = 0;            // bytes an incomplete frame needs
+};
+
+// a frame in flight, in RelLink::out
+struct RelTx {
+    uint32_t seq = 0;
+    uint64_t pos = 0;
+    uint32_t size = 0;
+    uint64_t sent_us = 0;
+    uint32_t sends = 0;
+    int sacked = 0;
+};
+
+// a frame that came before the ones in front of it
+struct RelStored {
+    uint8_t cmd = 0;
+    uint32_t chan = 0;
+    std::string payload;
+};
+
+enum {
+    REL_DELIVER,
+    REL_STORE,
+    REL_DROP,
+};
+
+// Both directions of one transport. The sender state belongs to the writer
+// whose turn it is, the reader updates it from acks; both hold mu for it.
+struct RelLink {
+    RelLink() = default;
+    RelLink(const RelLink &) = delete;
+    RelLink &operator=(const RelLink &) = delete;
+    pthread_mutex_t mu = PTHREAD_MUTEX_INITIALIZER;
+    pthread_cond_t cond;        // on CLOCK_MONOTONIC, acks came or are due
+    // sender, frames in flight oldest first
+    MirrorRing out;             // 2 * k_rel_window, the window and the reserve
+    std::deque<RelTx> unacked;
+    uint32_t next_seq = 0;
+    uint64_t srtt_us = 0;       // 0 until the first sample
+    uint64_t rttvar_us = 0;
+    uint64_t rto_us = k_rel_rto_init_us;
+    int tx_on = 0;              // frames and acks may be sent
+    int failed = 0;             // a write failed, nothing more is sent
+    // receiver
+    uint32_t expected = 0;
+    uint64_t sack = 0;          // bit i: expected + i is stored, bit 0 is never kept set
+    uint64_t ack_at = 0;        // when an ack is due, 0 if none is
+    uint32_t rx_since_ack = 0;
+    RelStored stored[k_rel_max_frames];    // by seq % k_rel_max_frames, reader only
+    // the thread sending acks and timeouts
+    pthread_t thread;
+    int running = 0;
+    int stop = 0;
+    int waiters = 0;            // writers that passed the turn on, waiting for room
+};
+
+// NULL if the ring or the cond cannot be set up
+RelLink *rel_new();
+// the thread is stopped already
+void rel_free(RelLink *r);
+// waits on cond until at or a signal, at is monotonic_us(), UINT64_MAX for
+// no timeout
+void rel_wait(RelLink &r, uint64_t at);
+
+// buf has rel_frame_size(len) bytes, returns them
+size_t rel_encode(uint8_t *buf, uint8_t cmd, uint32_t chan, uint32_t seq, const uint8_t *payload, size_t len);
+// the frame size; 0 if incomplete; -n if data does not start with a frame,
+// the next one may be n bytes on
+int rel_decode(const uint8_t *data, size_t avail, RelFrame &f);
+int rel_ack_decode(const uint8_t *payload, size_t len, uint32_t &cum, uint64_t &sack);
+
+// The functions below are called holding mu.
+
+// a frame of size bytes may be sent now
+int rel_fits(const RelLink &r, size_t size, int small);
+// numbers the frame and appends it to out, it has to fit
+void rel_push(RelLink &r, uint8_t cmd, uint32_t chan, const uint8_t *payload, size_t len, uint64_t now);
+// an ack from the peer, frames before cum are dropped from out
+void rel_acked(RelLink &r, uint32_t cum, uint64_t sack, uint64_t now);
+// a frame in flight to send again now, returns 0 if none is; it counts as
+// sent from now on
+int rel_resend(RelLink &r, uint64_t now, RelTx &f);
+// the CMD_ACK frame for what came so far, k_rel_header_size +
+// k_rel_ack_size + k_rel_crc_size bytes; no ack is due afterwards
+size_t rel_ack(RelLink &r, uint8_t *buf);
+// REL_DELIVER, REL_STORE or REL_DROP a numbered frame that came
+int rel_accept(RelLink &r, uint32_t seq, uint64_t now);
+// the slot of the stored frame that is in order now, -1 if none is
+int rel_next(RelLink &r, uint64_t now);
+// when an ack or a frame has to be sent next, UINT64_MAX if nothing waits
+uint64_t rel_deadline(const RelLink &r);
@@ -0,0 +1,144 @@
+// system
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+// self
+#include "ring.h"
+#include "util.h"
+
+
+int ring_open(Ring &r, size_t cap, const char *path) {
+    size_t size = 4096;
+    while (size < cap) {
+        size <<= 1;
+    }
+
+    int fd = -1;
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+    if (path) {
+        fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+        if (fd < 0) {
+            log_err(errno, "open(%s)", path);
+            return -1;
+        }
+        if (0 != ftruncate(fd, (off_t)size)) {
+            log_err(errno, "ftruncate(%s)", path);
+            (void)close(fd);
+            return -1;
+        }
+        flags = MAP_SHARED;
+    }
+    // pages are only backed once written
+    void *buf = mmap(NULL, size, PROT_READ | PROT_WRITE, flags, fd, 0);
+    if (buf == MAP_FAILED) {
+        log_err(errno, "mmap(%zu)", size);
+        if (fd >= 0) {
+            (void)close(fd);
+        }
+        return -1;
+    }
+
+    r.buf = (uint8_t *)buf;
+    r.cap = size;
+    r.end = 0;
+    r.fd = fd;
+    return 0;
+}
+
+void ring_close(Ring &r) {
+    if (r.buf) {
+        (void)munmap(r.buf, r.cap);
+    }
+    if (r.fd >= 0) {
+        (void)close(r.fd);
+    }
+    r = Ring();
+}
+
+void ring_append(Ring &r, const void *buf, size_t len) {
+    const uint8_t *p = (const uint8_t *)buf;
+    r.end += len;
+    if (len > r.cap) {
+        // only the tail survives
+        p += len - r.cap;
+        len = r.cap;
+    }
+    size_t pos = (size_t)((r.end - len) & (r.cap - 1));
+    size_t first = r.cap - pos < len ? r.cap - pos : len;
+    memcpy(&r.buf[pos], p, first);
+    memcpy(r.buf, p + first, len - first);
+}
+
+size_t ring_peek(const Ring &r, uint64_t seq, const uint8_t **out) {
+    assert(ring_start(r) <= seq && seq <= r.end);
+    size_t pos = (size_t)(seq & (r.cap - 1));
+    size_t avail = (size_t)(r.end - seq);
+    *out = &r.buf[pos];
+    return r.cap - pos < avail ? r.cap - pos : avail;
+}
+
+int mirror_open(MirrorRing &m, size_t cap) {
+    size_t size = (size_t)sysconf(_SC_PAGESIZE);
+    while (size < cap) {
+        size <<= 1;
+    }
+
+    int fd = memfd_create("pty_proxy", MFD_CLOEXEC);
+    if (fd < 0) {
+        log_err(errno, "memfd_create()");
+        return -1;
+    }
+    if (0 != ftruncate(fd, (off_t)size)) {
+        log_err(errno, "ftruncate(memfd, %zu)", size);
+        (void)close(fd);
+        return -1;
+    }
+    // reserve both halves, then put the same pages in each
+    uint8_t *buf = (uint8_t *)mmap(NULL, size * 2, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    int err = buf == MAP_FAILED;
+    for (size_t half = 0; !err && half < 2; ++half) {
+        err = MAP_FAILED == mmap(buf + half * size, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0);
+    }
+    (void)close(fd);
+    if (err) {
+        log_err(errno, "mmap(memfd, %zu)", size);
+        if (buf != MAP_FAILED) {
+            (void)munmap(buf, size * 2);
+        }
+        return -1;
+    }
+
+    m.buf = buf;
+    m.cap = size;
+    m.begin = 0;
+    m.end = 0;
+    return 0;
+}
+
+void mirror_close(MirrorRing &m) {
+    if (m.buf) {
+        (void)munmap(m.buf, m.cap * 2);
+    }
+    m = MirrorRing();
+}
+
+int mirror_reserve(MirrorRing &m, size_t cap) {
+    if (m.buf && m.cap >= cap) {
+        return 0;
+    }
+    MirrorRing grown;
+    if (0 != mirror_open(grown, cap)) {
+        return -1;
+    }
+    size_t len = m.buf ? mirror_len(m) : 0;
+    if (len > 0) {
+        memcpy(grown.buf, mirror_data(m), len);
+    }
+    grown.end = len;
+    mirror_close(m);
+    m = grown;
+    return 0;
+}
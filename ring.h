@@ -0,0 +1,63 @@
+#pragma once
+
+// system
+#include <stdint.h>
+#include <stddef.h>
+
+
+// Bounded history of a byte stream. Bytes are addressed by their offset in
+// the stream (seq), the oldest are overwritten once it is full.
+struct Ring {
+    uint8_t *buf = NULL;
+    size_t cap = 0;             // power of 2
+    uint64_t end = 0;           // seq after the newest byte
+    int fd = -1;                // backing file
+};
+
+// backed by the file at path if not NULL, cap is rounded up to a power of 2
+int ring_open(Ring &r, size_t cap, const char *path);
+void ring_close(Ring &r);
+void ring_append(Ring &r, const void *buf, size_t len);
+// seq of the oldest byte held
+inline uint64_t ring_start(const Ring &r) {
+    return r.end > r.cap ? r.end - r.cap : 0;
+}
+// the bytes from seq on up to the wrap, seq must be in [ring_start, end]
+size_t ring_peek(const Ring &r, uint64_t seq, const uint8_t **out);
+
+// FIFO of bytes whose pages are mapped twice back to back, so what is
+// queued is contiguous even across the wrap and never has to be moved.
+// The mapping is shared with a forked child, only one side may use it.
+struct MirrorRing {
+    uint8_t *buf = NULL;
+    size_t cap = 0;             // power of 2, at least a page
+    uint64_t begin = 0;         // read position
+    uint64_t end = 0;           // write position
+};
+
+// cap is rounded up to a power of 2
+int mirror_open(MirrorRing &m, size_t cap);
+void mirror_close(MirrorRing &m);
+// grows to at least cap keeping the queued bytes, opens it if needed
+int mirror_reserve(MirrorRing &m, size_t cap);
+
+inline size_t mirror_len(const MirrorRing &m) {
+    return (size_t)(m.end - m.begin);
+}
+inline size_t mirror_room(const MirrorRing &m) {
+    return m.cap - mirror_len(m);
+}
+// mirror_len() bytes can be read from here
+inline uint8_t *mirror_data(const MirrorRing &m) {
+    return m.buf + (m.begin & (m.cap - 1));
+}
+// mirror_room() bytes can be written from here
+inline uint8_t *mirror_tail(const MirrorRing &m) {
+    return m.buf + (m.end & (m.cap - 1));
+}
+inline void mirror_commit(MirrorRing &m, size_t len) {
+    m.end += len;
+}
+inline void mirror_consume(MirrorRing &m, size_t len) {
+    m.begin += len;
+}
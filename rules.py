@@ -21,32 +21,152 @@ def rules(ctx):
         'pty.cpp',
         'util.cpp',
         'protocol.cpp',
-        'base64.c'
+        'event.cpp',
+        'lz.cpp',
+        'screen.cpp',
+        'ring.cpp',
+        'hist.cpp',
+        'stats.cpp',
+        'trace.cpp',
+        'pipeline.cpp',
+        'uring.cpp',
+        'crc32c.cpp',
+        'xfer.cpp',
+        'fwd.cpp',
+        'predict.cpp',
+        'rel.cpp',
+        'base64.c',
+        'escape.c'
     ]
     c_files = lib_files + [
         'master.cpp',
         'slave.cpp',
+        'bench.cpp',
+        'trace_dump.cpp',
         'doctest.cpp',
         'test_base64.cpp',
+        'test_escape.cpp',
+        'test_lz.cpp',
+        'test_screen.cpp',
+        'test_ring.cpp',
+        'test_hist.cpp',
+        'test_trace.cpp',
+        'test_protocol.cpp',
+        'test_pipeline.cpp',
+        'test_uring.cpp',
+        'test_crc32c.cpp',
+        'test_xfer.cpp',
+        'test_fwd.cpp',
+        'test_predict.cpp',
+        'test_rel.cpp',
     ]
 
     # all
-    ctx.add_rule('all', ['pty_proxy_master', 'pty_proxy_slave'], ['true'])
+    ctx.add_rule('all', ['pty_proxy_master', 'pty_proxy_slave', 'libpty_proxy.a'], ['true'])
 
     # compile objects
     for file in c_files:
         cmd = [CXX, *CXXFLAGS, '-o', o(file), '-c', file, '-MD', '-MP']
         ctx.add_rule(o(file), [file], cmd, d_file=d(file))
 
+    # static library, the protocol for other programs
+    lib_file = 'libpty_proxy.a'
+    o_files = [o(file) for file in lib_files]
+    cmd = ['rm', '-f', lib_file, '&&', 'ar', 'rcs', lib_file, *o_files]
+    ctx.add_rule(lib_file, o_files, cmd)
+
     # compile binaries
     for exe in ['master', 'slave']:
         exe_file = f'pty_proxy_{exe}'
-        o_files = [o(file) for file in lib_files] + [o(f'{exe}.cpp')]
+        o_files = [o(f'{exe}.cpp'), lib_file]
         cmd = [LD, *LD_FLAGS, '-o', exe_file, *o_files]
         ctx.add_rule(exe_file, o_files, cmd)
 
+    # bench
+    exe_file = 'pty_proxy_bench'
+    o_files = [o('bench.cpp'), lib_file]
+    cmd = [LD, *LD_FLAGS, '-o', exe_file, *o_files]
+    ctx.add_rule(exe_file, o_files, cmd)
+    ctx.add_rule('bench', [exe_file, 'pty_proxy_master', 'pty_proxy_slave'], ['./pty_proxy_bench'])
+
+    # trace decoder
+    exe_file = 'pty_proxy_trace'
+    o_files = [o('trace_dump.cpp'), o('trace.cpp'), o('util.cpp')]
+    cmd = [LD, *LD_FLAGS, '-o', exe_file, *o_files]
+    ctx.add_rule(exe_file, o_files, cmd)
+
     # tests
     exe_file = 'test_base64'
     o_files = [o('test_base64.cpp'), o('base64.c'), o('doctest.cpp')]
     cmd = [LD, *LD_FLAGS, '-o', exe_file, *o_files]
     ctx.add_rule(exe_file, o_files, cmd)
+
+    exe_file = 'test_escape'
+    o_files = [o('test_escape.cpp'), o('escape.c'), o('doctest.cpp')]
+    cmd = [LD, *LD_FLAGS, '-o', exe_file, *o_files]
+    ctx.add_rule(exe_file, o_files, cmd)
+
+    exe_file = 'test_lz'
+    o_files = [o('test_lz.cpp'), o('lz.cpp'), o('util.cpp'), o('doctest.cpp')]
+    cmd = [LD, *LD_FLAGS, '-o', exe_file, *o_files]
+    ctx.add_rule(exe_file, o_files, cmd)
+
+    exe_file = 'test_screen'
+    o_files = [o('test_screen.cpp'), o('screen.cpp'), o('doctest.cpp')]
+    cmd = [LD, *LD_FLAGS, '-o', exe_file, *o_files]
+    ctx.add_rule(exe_file, o_files, cmd)
+
+    exe_file = 'test_ring'
+    o_files = [o('test_ring.cpp'), o('ring.cpp'), o('util.cpp'), o('doctest.cpp')]
+    cmd = [LD, *LD_FLAGS, '-o', exe_file, *o_files]
+    ctx.add_rule(exe_file, o_files, cmd)
+
+    exe_file = 'test_hist'
+    o_files = [o('test_hist.cpp'), o('hist.cpp'), o('util.cpp'), o('doctest.cpp')]
+    cmd = [LD, *LD_FLAGS, '-o', exe_file, *o_files]
+    ctx.add_rule(exe_file, o_files, cmd)
+
+    exe_file = 'test_trace'
+    o_files = [o('test_trace.cpp'), o('trace.cpp'), o('util.cpp'), o('doctest.cpp')]
+    cmd = [LD, *LD_FLAGS, '-o', exe_file, *o_files]
+    ctx.add_rule(exe_file, o_files, cmd)
+
+    exe_file = 'test_protocol'
+    o_files = [o('test_protocol.cpp'), o('doctest.cpp'), lib_file]
+    cmd = [LD, *LD_FLAGS, '-o', exe_file, *o_files]
+    ctx.add_rule(exe_file, o_files, cmd)
+
+    exe_file = 'test_pipeline'
+    o_files = [o('test_pipeline.cpp'), o('doctest.cpp'), lib_file]
+    cmd = [LD, *LD_FLAGS, '-o', exe_file, *o_files]
+    ctx.add_rule(exe_file, o_files, cmd)
+
+    exe_file = 'test_uring'
+    o_files = [o('test_uring.cpp'), o('uring.cpp'), o('event.cpp'), o('trace.cpp'), o('util.cpp'), o('doctest.cpp')]
+    cmd = [LD, *LD_FLAGS, '-o', exe_file, *o_files]
+    ctx.add_rule(exe_file, o_files, cmd)
+
+    exe_file = 'test_crc32c'
+    o_files = [o('test_crc32c.cpp'), o('crc32c.cpp'), o('doctest.cpp')]
+    cmd = [LD, *LD_FLAGS, '-o', exe_file, *o_files]
+    ctx.add_rule(exe_file, o_files, cmd)
+
+    exe_file = 'test_xfer'
+    o_files = [o('test_xfer.cpp'), o('doctest.cpp'), lib_file]
+    cmd = [LD, *LD_FLAGS, '-o', exe_file, *o_files]
+    ctx.add_rule(exe_file, o_files, cmd)
+
+    exe_file = 'test_fwd'
+    o_files = [o('test_fwd.cpp'), o('doctest.cpp'), lib_file]
+    cmd = [LD, *LD_FLAGS, '-o', exe_file, *o_files]
+    ctx.add_rule(exe_file, o_files, cmd)
+
+    exe_file = 'test_predict'
+    o_files = [o('test_predict.cpp'), o('predict.cpp'), o('doctest.cpp')]
+    cmd = [LD, *LD_FLAGS, '-o', exe_file, *o_files]
+    ctx.add_rule(exe_file, o_files, cmd)
+
+    exe_file = 'test_rel'
+    o_files = [o('test_rel.cpp'), o('doctest.cpp'), lib_file]
+    cmd = [LD, *LD_FLAGS, '-o', exe_file, *o_files]
+    ctx.add_rule(exe_file, o_files, cmd)
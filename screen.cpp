@@ -0,0 +1,1166 @@
+// system
+#include <assert.h>
+#include <string.h>
+#include <stdio.h>
+#ifdef __SSE2__
+#   include <emmintrin.h>
+#endif
+// self
+#include "screen.h"
+
+
+enum {
+    ST_GROUND,
+    ST_ESC,
+    ST_ESC_CHARSET,     // ESC ( X
+    ST_ESC_SKIP,        // ESC # X, ESC SP X, ESC % X
+    ST_CSI,
+    ST_OSC,
+    ST_OSC_ESC,
+    ST_STR,             // DCS, SOS, PM, APC: ignored
+    ST_STR_ESC,
+};
+
+// DEC special graphics for 0x5f..0x7e, the line drawing characters
+static const uint16_t k_dec_graphics[32] = {
+    0x0020, 0x25c6, 0x2592, 0x2409, 0x240c, 0x240d, 0x240a, 0x00b0,
+    0x00b1, 0x2424, 0x240b, 0x2518, 0x2510, 0x250c, 0x2514, 0x253c,
+    0x23ba, 0x23bb, 0x2500, 0x23bc, 0x23bd, 0x251c, 0x2524, 0x2534,
+    0x252c, 0x2502, 0x2264, 0x2265, 0x03c0, 0x2260, 0x00a3, 0x00b7,
+};
+
+static int cp_width(uint32_t cp) {
+    if (cp < 0x300) {
+        return 1;
+    }
+    // combining marks and zero width spaces are dropped
+    if ((cp <= 0x36f) || (0x1ab0 <= cp && cp <= 0x1aff) || (0x1dc0 <= cp && cp <= 0x1dff)
+        || (0x200b <= cp && cp <= 0x200f) || (0x20d0 <= cp && cp <= 0x20ff)
+        || (0xfe00 <= cp && cp <= 0xfe0f) || (0xfe20 <= cp && cp <= 0xfe2f))
+    {
+        return 0;
+    }
+    if ((0x1100 <= cp && cp <= 0x115f) || (0x2e80 <= cp && cp <= 0x303e)
+        || (0x3041 <= cp && cp <= 0x33ff) || (0x3400 <= cp && cp <= 0x4dbf)
+        || (0x4e00 <= cp && cp <= 0x9fff) || (0xa000 <= cp && cp <= 0xa4cf)
+        || (0xac00 <= cp && cp <= 0xd7a3) || (0xf900 <= cp && cp <= 0xfaff)
+        || (0xfe30 <= cp && cp <= 0xfe4f) || (0xff00 <= cp && cp <= 0xff60)
+        || (0xffe0 <= cp && cp <= 0xffe6) || (0x1f300 <= cp && cp <= 0x1f64f)
+        || (0x1f900 <= cp && cp <= 0x1f9ff) || (0x20000 <= cp && cp <= 0x3fffd))
+    {
+        return 2;
+    }
+    return 1;
+}
+
+static inline int attr_eq(const Attr &a, const Attr &b) {
+    return a.fg == b.fg && a.bg == b.bg && a.flags == b.flags;
+}
+
+static inline int cell_eq(const Cell &a, const Cell &b) {
+    return a.ch == b.ch && a.flags == b.flags && attr_eq(a.attr, b.attr);
+}
+
+static inline Cell *row(Term &t, int y) {
+    return &t.cells[(size_t)y * t.cols];
+}
+
+// erased cells keep the background of the pen
+static Cell blank(const Term &t) {
+    Cell c;
+    c.attr.bg = t.cur.attr.bg;
+    return c;
+}
+
+static void clear_cells(Term &t, int y, int x0, int x1) {
+    Cell b = blank(t);
+    Cell *r = row(t, y);
+    for (int x = x0; x < x1; ++x) {
+        r[x] = b;
+    }
+}
+
+static void clear_rows(Term &t, int y0, int y1) {
+    for (int y = y0; y < y1; ++y) {
+        clear_cells(t, y, 0, t.cols);
+    }
+}
+
+static void scroll_up(Term &t, int top, int bottom, int n) {
+    int height = bottom - top + 1;
+    n = n < height ? n : height;
+    memmove(row(t, top), row(t, top + n), sizeof(Cell) * t.cols * (height - n));
+    clear_rows(t, bottom - n + 1, bottom + 1);
+}
+
+static void scroll_down(Term &t, int top, int bottom, int n) {
+    int height = bottom - top + 1;
+    n = n < height ? n : height;
+    memmove(row(t, top + n), row(t, top), sizeof(Cell) * t.cols * (height - n));
+    clear_rows(t, top, top + n);
+}
+
+static void linefeed(Term &t) {
+    t.cur.wrap_pending = 0;
+    if (t.cur.y == t.bottom) {
+        scroll_up(t, t.top, t.bottom, 1);
+    } else if (t.cur.y < t.rows - 1) {
+        t.cur.y++;
+    }
+}
+
+static void reverse_index(Term &t) {
+    t.cur.wrap_pending = 0;
+    if (t.cur.y == t.top) {
+        scroll_down(t, t.top, t.bottom, 1);
+    } else if (t.cur.y > 0) {
+        t.cur.y--;
+    }
+}
+
+// the other half of a wide char that is about to be overwritten
+static void split_wide(Term &t, int y, int x) {
+    Cell *r = row(t, y);
+    if ((r[x].flags & CELL_WIDE_TAIL) && x > 0) {
+        r[x - 1].ch = ' ';
+        r[x - 1].flags = 0;
+    }
+    if ((r[x].flags & CELL_WIDE) && x + 1 < t.cols) {
+        r[x + 1].ch = ' ';
+        r[x + 1].flags = 0;
+    }
+}
+
+static void wrap_if_pending(Term &t) {
+    if (t.cur.wrap_pending) {
+        t.cur.x = 0;
+        linefeed(t);
+    }
+}
+
+static void put_char(Term &t, uint32_t cp) {
+    int dec = t.cur.shift_out ? t.cur.charset_g1 : t.cur.charset_g0;
+    if (dec && 0x5f <= cp && cp <= 0x7e) {
+        cp = k_dec_graphics[cp - 0x5f];
+    }
+    int w = cp_width(cp);
+    if (w == 0) {
+        return;
+    }
+    if (w == 2 && t.cols < 2) {
+        cp = '?';
+        w = 1;
+    }
+    t.last_ch = cp;
+
+    wrap_if_pending(t);
+    if (w == 2 && t.cur.x == t.cols - 1) {
+        if (!t.autowrap) {
+            return;
+        }
+        split_wide(t, t.cur.y, t.cur.x);
+        clear_cells(t, t.cur.y, t.cur.x, t.cols);
+        t.cur.x = 0;
+        linefeed(t);
+    }
+
+    Cell *r = row(t, t.cur.y);
+    int x = t.cur.x;
+    if (t.insert) {
+        split_wide(t, t.cur.y, t.cols - w);
+        memmove(&r[x + w], &r[x], sizeof(Cell) * (t.cols - x - w));
+    }
+    split_wide(t, t.cur.y, x);
+    if (w == 2) {
+        split_wide(t, t.cur.y, x + 1);
+    }
+    r[x].ch = cp;
+    r[x].attr = t.cur.attr;
+    r[x].flags = w == 2 ? CELL_WIDE : 0;
+    if (w == 2) {
+        r[x + 1].ch = ' ';
+        r[x + 1].attr = t.cur.attr;
+        r[x + 1].flags = CELL_WIDE_TAIL;
+    }
+
+    t.cur.x += w;
+    if (t.cur.x >= t.cols) {
+        t.cur.x = t.cols - 1;
+        t.cur.wrap_pending = t.autowrap;
+    }
+}
+
+// length of the leading run of printable ASCII
+static size_t printable_run(const uint8_t *p, size_t n) {
+    size_t i = 0;
+#ifdef __SSE2__
+    const __m128i lo = _mm_set1_epi8(0x1f);
+    const __m128i hi = _mm_set1_epi8(0x7f);
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)&p[i]);
+        // bytes >= 0x80 are negative and fail the first test
+        __m128i ok = _mm_and_si128(_mm_cmpgt_epi8(v, lo), _mm_cmplt_epi8(v, hi));
+        unsigned mask = (unsigned)_mm_movemask_epi8(ok);
+        if (mask != 0xffff) {
+            return i + (size_t)__builtin_ctz(~mask);
+        }
+    }
+#endif
+    while (i < n && 0x20 <= p[i] && p[i] < 0x7f) {
+        ++i;
+    }
+    return i;
+}
+
+// printable ASCII without insert mode or line drawing, a row at a time
+static void put_ascii(Term &t, const uint8_t *p, size_t n) {
+    if (t.insert || t.cur.charset_g0 || t.cur.charset_g1) {
+        for (size_t i = 0; i < n; ++i) {
+            put_char(t, p[i]);
+        }
+        return;
+    }
+
+    t.last_ch = p[n - 1];
+    while (n > 0) {
+        wrap_if_pending(t);
+        int x = t.cur.x;
+        size_t len = (size_t)(t.cols - x) < n ? (size_t)(t.cols - x) : n;
+        Cell *r = row(t, t.cur.y);
+        split_wide(t, t.cur.y, x);
+        split_wide(t, t.cur.y, x + (int)len - 1);
+        for (size_t i = 0; i < len; ++i) {
+            r[x + i].ch = p[i];
+            r[x + i].attr = t.cur.attr;
+            r[x + i].flags = 0;
+        }
+        p += len;
+        n -= len;
+
+        t.cur.x += (int)len;
+        if (t.cur.x >= t.cols) {
+            t.cur.x = t.cols - 1;
+            t.cur.wrap_pending = t.autowrap;
+            if (!t.autowrap) {
+                // the rest overwrites the last column
+                if (n > 0) {
+                    r[t.cols - 1].ch = p[n - 1];
+                }
+                return;
+            }
+        }
+    }
+}
+
+static void save_cursor(Term &t) {
+    t.saved[t.alt_active] = t.cur;
+}
+
+static void restore_cursor(Term &t) {
+    t.cur = t.saved[t.alt_active];
+    t.cur.x = t.cur.x < t.cols ? t.cur.x : t.cols - 1;
+    t.cur.y = t.cur.y < t.rows ? t.cur.y : t.rows - 1;
+}
+
+static void set_alt(Term &t, int on, int clear) {
+    if (t.alt_active == on) {
+        return;
+    }
+    t.alt_active = on;
+    t.cells = on ? t.alt_cells.data() : t.main_cells.data();
+    if (clear) {
+        clear_rows(t, 0, t.rows);
+    }
+}
+
+void term_init(Term &t, int rows, int cols) {
+    assert(rows > 0 && cols > 0);
+    Term fresh;
+    t = fresh;
+    t.rows = rows;
+    t.cols = cols;
+    t.main_cells.assign((size_t)rows * cols, Cell());
+    t.alt_cells.assign((size_t)rows * cols, Cell());
+    t.cells = t.main_cells.data();
+    t.bottom = rows - 1;
+}
+
+static void reset(Term &t) {
+    std::string title = t.title;
+    size_t bells = t.bells;
+    std::string reply = t.reply;
+    term_init(t, t.rows, t.cols);
+    t.title = title;
+    t.bells = bells;
+    t.reply = reply;
+}
+
+static void move_to(Term &t, int y, int x) {
+    if (t.cur.origin) {
+        y += t.top;
+        y = y < t.top ? t.top : y > t.bottom ? t.bottom : y;
+    }
+    t.cur.y = y < 0 ? 0 : y >= t.rows ? t.rows - 1 : y;
+    t.cur.x = x < 0 ? 0 : x >= t.cols ? t.cols - 1 : x;
+    t.cur.wrap_pending = 0;
+}
+
+static void set_color(uint32_t &color, const uint32_t *p, size_t n, size_t &i) {
+    // 38;5;N or 38;2;R;G;B
+    if (i + 2 < n && p[i + 1] == 5) {
+        color = COLOR_INDEX | (p[i + 2] & 0xff);
+        i += 2;
+    } else if (i + 4 < n && p[i + 1] == 2) {
+        color = COLOR_RGB | (p[i + 2] & 0xff) << 16 | (p[i + 3] & 0xff) << 8 | (p[i + 4] & 0xff);
+        i += 4;
+    } else {
+        i = n;
+    }
+}
+
+static void sgr(Term &t) {
+    Attr &a = t.cur.attr;
+    const uint32_t *p = t.params;
+    size_t n = t.nparams;
+    for (size_t i = 0; i < n; ++i) {
+        uint32_t v = p[i];
+        if (v == 0) {
+            a = Attr();
+        } else if (v == 1) {
+            a.flags |= ATTR_BOLD;
+        } else if (v == 2) {
+            a.flags |= ATTR_DIM;
+        } else if (v == 3) {
+            a.flags |= ATTR_ITALIC;
+        } else if (v == 4) {
+            a.flags |= ATTR_UNDERLINE;
+        } else if (v == 5 || v == 6) {
+            a.flags |= ATTR_BLINK;
+        } else if (v == 7) {
+            a.flags |= ATTR_REVERSE;
+        } else if (v == 8) {
+            a.flags |= ATTR_INVISIBLE;
+        } else if (v == 9) {
+            a.flags |= ATTR_STRIKE;
+        } else if (v == 21 || v == 22) {
+            a.flags &= ~(ATTR_BOLD | ATTR_DIM);
+        } else if (v == 23) {
+            a.flags &= ~ATTR_ITALIC;
+        } else if (v == 24) {
+            a.flags &= ~ATTR_UNDERLINE;
+        } else if (v == 25) {
+            a.flags &= ~ATTR_BLINK;
+        } else if (v == 27) {
+            a.flags &= ~ATTR_REVERSE;
+        } else if (v == 28) {
+            a.flags &= ~ATTR_INVISIBLE;
+        } else if (v == 29) {
+            a.flags &= ~ATTR_STRIKE;
+        } else if (30 <= v && v <= 37) {
+            a.fg = COLOR_INDEX | (v - 30);
+        } else if (v == 38) {
+            set_color(a.fg, p, n, i);
+        } else if (v == 39) {
+            a.fg = COLOR_DEFAULT;
+        } else if (40 <= v && v <= 47) {
+            a.bg = COLOR_INDEX | (v - 40);
+        } else if (v == 48) {
+            set_color(a.bg, p, n, i);
+        } else if (v == 49) {
+            a.bg = COLOR_DEFAULT;
+        } else if (90 <= v && v <= 97) {
+            a.fg = COLOR_INDEX | (v - 90 + 8);
+        } else if (100 <= v && v <= 107) {
+            a.bg = COLOR_INDEX | (v - 100 + 8);
+        }
+    }
+}
+
+static uint32_t mode_bit(uint32_t mode) {
+    switch (mode) {
+    case 1: return MODE_APP_CURSOR;
+    case 25: return MODE_CURSOR_VISIBLE;
+    case 1000: return MODE_MOUSE_X10;
+    case 1002: return MODE_MOUSE_BUTTON;
+    case 1003: return MODE_MOUSE_ANY;
+    case 1004: return MODE_FOCUS;
+    case 1006: return MODE_MOUSE_SGR;
+    case 2004: return MODE_PASTE;
+    default: return 0;
+    }
+}
+
+static void set_mode(Term &t, int on) {
+    for (size_t i = 0; i < t.nparams; ++i) {
+        uint32_t mode = t.params[i];
+        if (t.prefix != '?') {
+            if (mode == 4) {
+                t.insert = on;
+            }
+            continue;
+        }
+
+        if (uint32_t bit = mode_bit(mode)) {
+            t.modes = on ? t.modes | bit : t.modes & ~bit;
+        } else if (mode == 6) {
+            t.cur.origin = on;
+            move_to(t, 0, 0);
+        } else if (mode == 7) {
+            t.autowrap = on;
+            t.cur.wrap_pending = 0;
+        } else if (mode == 47 || mode == 1047) {
+            if (!on && mode == 1047) {
+                clear_rows(t, 0, t.rows);
+            }
+            set_alt(t, on, 0);
+        } else if (mode == 1049) {
+            if (on) {
+                save_cursor(t);
+                set_alt(t, 1, 1);
+                t.saved[1] = t.saved[0];
+            } else {
+                set_alt(t, 0, 0);
+                restore_cursor(t);
+            }
+        }
+    }
+}
+
+static void csi_dispatch(Term &t, uint8_t c) {
+    // 0 is the default for every parameter
+    auto arg = [&t](size_t i, int def) -> int {
+        return i < t.nparams && t.params[i] ? (int)t.params[i] : def;
+    };
+    int n = arg(0, 1);
+    Cursor &cur = t.cur;
+
+    if (t.inter) {
+        // DECSTR
+        if (t.inter == '!' && c == 'p') {
+            cur.attr = Attr();
+            t.insert = 0;
+            t.autowrap = 1;
+            cur.origin = 0;
+            t.top = 0;
+            t.bottom = t.rows - 1;
+            t.modes |= MODE_CURSOR_VISIBLE;
+        }
+        return;
+    }
+    // private variants we know are modes and selective erase, DA2 is '>'
+    if (t.prefix == '?' && !strchr("hlJK", c)) {
+        return;
+    }
+    if (t.prefix && t.prefix != '?' && c != 'c') {
+        return;
+    }
+
+    switch (c) {
+    case '@': {     // ICH
+        Cell *r = row(t, cur.y);
+        n = n < t.cols - cur.x ? n : t.cols - cur.x;
+        split_wide(t, cur.y, cur.x);
+        memmove(&r[cur.x + n], &r[cur.x], sizeof(Cell) * (t.cols - cur.x - n));
+        clear_cells(t, cur.y, cur.x, cur.x + n);
+        break;
+    }
+    case 'A': {
+        // stops at the margin if inside the scroll region
+        int min_y = cur.y >= t.top ? t.top : 0;
+        cur.y = cur.y - n < min_y ? min_y : cur.y - n;
+        cur.wrap_pending = 0;
+        break;
+    }
+    case 'B':
+    case 'e': {
+        int max_y = cur.y <= t.bottom ? t.bottom : t.rows - 1;
+        cur.y = cur.y + n > max_y ? max_y : cur.y + n;
+        cur.wrap_pending = 0;
+        break;
+    }
+    case 'C':
+    case 'a':
+        cur.x = cur.x + n >= t.cols ? t.cols - 1 : cur.x + n;
+        cur.wrap_pending = 0;
+        break;
+    case 'D':
+        cur.x = cur.x - n < 0 ? 0 : cur.x - n;
+        cur.wrap_pending = 0;
+        break;
+    case 'E':
+        cur.x = 0;
+        cur.y = cur.y + n >= t.rows ? t.rows - 1 : cur.y + n;
+        cur.wrap_pending = 0;
+        break;
+    case 'F':
+        cur.x = 0;
+        cur.y = cur.y - n < 0 ? 0 : cur.y - n;
+        cur.wrap_pending = 0;
+        break;
+    case 'G':
+    case '`':
+        cur.x = n - 1 >= t.cols ? t.cols - 1 : n - 1;
+        cur.wrap_pending = 0;
+        break;
+    case 'H':
+    case 'f':
+        move_to(t, arg(0, 1) - 1, arg(1, 1) - 1);
+        break;
+    case 'd':
+        move_to(t, n - 1, cur.x);
+        break;
+    case 'I':       // CHT
+        for (int i = 0; i < n; ++i) {
+            cur.x = (cur.x / 8 + 1) * 8 >= t.cols ? t.cols - 1 : (cur.x / 8 + 1) * 8;
+        }
+        break;
+    case 'Z':       // CBT
+        for (int i = 0; i < n && cur.x > 0; ++i) {
+            cur.x = (cur.x - 1) / 8 * 8;
+        }
+        break;
+    case 'J': {
+        int mode = arg(0, 0);
+        if (mode == 0) {
+            split_wide(t, cur.y, cur.x);
+            clear_cells(t, cur.y, cur.x, t.cols);
+            clear_rows(t, cur.y + 1, t.rows);
+        } else if (mode == 1) {
+            split_wide(t, cur.y, cur.x);
+            clear_rows(t, 0, cur.y);
+            clear_cells(t, cur.y, 0, cur.x + 1);
+        } else {
+            clear_rows(t, 0, t.rows);
+        }
+        break;
+    }
+    case 'K': {
+        int mode = arg(0, 0);
+        split_wide(t, cur.y, cur.x);
+        if (mode == 0) {
+            clear_cells(t, cur.y, cur.x, t.cols);
+        } else if (mode == 1) {
+            clear_cells(t, cur.y, 0, cur.x + 1);
+        } else {
+            clear_cells(t, cur.y, 0, t.cols);
+        }
+        break;
+    }
+    case 'L':
+        if (t.top <= cur.y && cur.y <= t.bottom) {
+            scroll_down(t, cur.y, t.bottom, n);
+            cur.x = 0;
+        }
+        break;
+    case 'M':
+        if (t.top <= cur.y && cur.y <= t.bottom) {
+            scroll_up(t, cur.y, t.bottom, n);
+            cur.x = 0;
+        }
+        break;
+    case 'P': {     // DCH
+        Cell *r = row(t, cur.y);
+        n = n < t.cols - cur.x ? n : t.cols - cur.x;
+        split_wide(t, cur.y, cur.x);
+        split_wide(t, cur.y, cur.x + n - 1);
+        memmove(&r[cur.x], &r[cur.x + n], sizeof(Cell) * (t.cols - cur.x - n));
+        clear_cells(t, cur.y, t.cols - n, t.cols);
+        break;
+    }
+    case 'X':       // ECH
+        n = n < t.cols - cur.x ? n : t.cols - cur.x;
+        split_wide(t, cur.y, cur.x);
+        split_wide(t, cur.y, cur.x + n - 1);
+        clear_cells(t, cur.y, cur.x, cur.x + n);
+        break;
+    case 'S':
+        scroll_up(t, t.top, t.bottom, n);
+        break;
+    case 'T':
+        scroll_down(t, t.top, t.bottom, n);
+        break;
+    case 'b':       // REP
+        for (int i = 0; i < n && i < t.cols * t.rows; ++i) {
+            put_char(t, t.last_ch);
+        }
+        break;
+    case 'm':
+        sgr(t);
+        break;
+    case 'h':
+        set_mode(t, 1);
+        break;
+    case 'l':
+        set_mode(t, 0);
+        break;
+    case 'r': {
+        int top = arg(0, 1) - 1;
+        int bottom = arg(1, t.rows) - 1;
+        bottom = bottom < t.rows ? bottom : t.rows - 1;
+        if (top < bottom) {
+            t.top = top;
+            t.bottom = bottom;
+            move_to(t, 0, 0);
+        }
+        break;
+    }
+    case 's':
+        save_cursor(t);
+        break;
+    case 'u':
+        restore_cursor(t);
+        break;
+    case 'n': {
+        // the master's terminal never sees the query, answer it here
+        char buf[32];
+        if (arg(0, 0) == 5) {
+            t.reply += "\x1b[0n";
+        } else if (arg(0, 0) == 6) {
+            int y = cur.origin ? cur.y - t.top : cur.y;
+            snprintf(buf, sizeof(buf), "\x1b[%d;%dR", y + 1, cur.x + 1);
+            t.reply += buf;
+        }
+        break;
+    }
+    case 'c':
+        if (t.prefix == '>') {
+            t.reply += "\x1b[>1;10;0c";
+        } else if (t.prefix == 0) {
+            t.reply += "\x1b[?62;22c";
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+static void osc_dispatch(Term &t) {
+    // title only
+    const std::string &s = t.osc;
+    if (s.size() >= 2 && (s[0] == '0' || s[0] == '2') && s[1] == ';') {
+        t.title = s.substr(2);
+    }
+}
+
+static void esc_dispatch(Term &t, uint8_t c) {
+    t.state = ST_GROUND;
+    switch (c) {
+    case '[':
+        t.state = ST_CSI;
+        t.nparams = 1;
+        t.params[0] = 0;
+        t.prefix = 0;
+        t.inter = 0;
+        break;
+    case ']':
+        t.state = ST_OSC;
+        t.osc.clear();
+        break;
+    case 'P':
+    case 'X':
+    case '^':
+    case '_':
+        t.state = ST_STR;
+        break;
+    case '(':
+    case ')':
+    case '*':
+    case '+':
+        t.state = ST_ESC_CHARSET;
+        t.inter = (char)c;
+        break;
+    case '#':
+    case ' ':
+    case '%':
+        t.state = ST_ESC_SKIP;
+        break;
+    case '7':
+        save_cursor(t);
+        break;
+    case '8':
+        restore_cursor(t);
+        break;
+    case 'D':
+        linefeed(t);
+        break;
+    case 'E':
+        t.cur.x = 0;
+        linefeed(t);
+        break;
+    case 'M':
+        reverse_index(t);
+        break;
+    case 'c':
+        reset(t);
+        break;
+    case '=':
+        t.modes |= MODE_APP_KEYPAD;
+        break;
+    case '>':
+        t.modes &= ~MODE_APP_KEYPAD;
+        break;
+    default:
+        break;
+    }
+}
+
+static void control(Term &t, uint8_t c) {
+    Cursor &cur = t.cur;
+    switch (c) {
+    case 0x07:
+        t.bells++;
+        break;
+    case 0x08:
+        if (cur.x > 0) {
+            cur.x--;
+        }
+        cur.wrap_pending = 0;
+        break;
+    case 0x09:
+        cur.x = (cur.x / 8 + 1) * 8 >= t.cols ? t.cols - 1 : (cur.x / 8 + 1) * 8;
+        cur.wrap_pending = 0;
+        break;
+    case 0x0a:
+    case 0x0b:
+    case 0x0c:
+        linefeed(t);
+        break;
+    case 0x0d:
+        cur.x = 0;
+        cur.wrap_pending = 0;
+        break;
+    case 0x0e:
+        cur.shift_out = 1;
+        break;
+    case 0x0f:
+        cur.shift_out = 0;
+        break;
+    case 0x18:
+    case 0x1a:
+        t.state = ST_GROUND;
+        break;
+    case 0x1b:
+        t.state = ST_ESC;
+        break;
+    default:
+        break;
+    }
+}
+
+static void step(Term &t, uint8_t c) {
+    switch (t.state) {
+    case ST_GROUND:
+        if (t.utf8_need) {
+            if ((c & 0xc0) == 0x80) {
+                t.utf8_cp = t.utf8_cp << 6 | (c & 0x3f);
+                if (--t.utf8_need == 0) {
+                    put_char(t, t.utf8_cp);
+                }
+                return;
+            }
+            t.utf8_need = 0;
+            put_char(t, 0xfffd);
+        }
+        if (c < 0x20) {
+            control(t, c);
+        } else if (c < 0x7f) {
+            put_char(t, c);
+        } else if (c == 0x7f) {
+            // DEL is ignored
+        } else if ((c & 0xe0) == 0xc0) {
+            t.utf8_cp = c & 0x1f;
+            t.utf8_need = 1;
+        } else if ((c & 0xf0) == 0xe0) {
+            t.utf8_cp = c & 0x0f;
+            t.utf8_need = 2;
+        } else if ((c & 0xf8) == 0xf0) {
+            t.utf8_cp = c & 0x07;
+            t.utf8_need = 3;
+        } else {
+            put_char(t, 0xfffd);
+        }
+        break;
+    case ST_ESC:
+        if (c < 0x20) {
+            control(t, c);
+        } else {
+            esc_dispatch(t, c);
+        }
+        break;
+    case ST_ESC_CHARSET:
+        if (t.inter == '(') {
+            t.cur.charset_g0 = c == '0';
+        } else if (t.inter == ')') {
+            t.cur.charset_g1 = c == '0';
+        }
+        t.inter = 0;
+        t.state = ST_GROUND;
+        break;
+    case ST_ESC_SKIP:
+        t.state = ST_GROUND;
+        break;
+    case ST_CSI:
+        if ('0' <= c && c <= '9') {
+            uint32_t &p = t.params[t.nparams - 1];
+            p = p * 10 + (c - '0');
+            p = p > 65535 ? 65535 : p;
+        } else if (c == ';' || c == ':') {
+            if (t.nparams < sizeof(t.params) / sizeof(t.params[0])) {
+                t.params[t.nparams++] = 0;
+            }
+        } else if (c == '?' || c == '>' || c == '<' || c == '=') {
+            t.prefix = (char)c;
+        } else if (0x20 <= c && c <= 0x2f) {
+            t.inter = (char)c;
+        } else if (0x40 <= c && c <= 0x7e) {
+            t.state = ST_GROUND;
+            csi_dispatch(t, c);
+            t.inter = 0;
+        } else if (c < 0x20) {
+            control(t, c);
+        }
+        break;
+    case ST_OSC:
+        if (c == 0x07) {
+            osc_dispatch(t);
+            t.state = ST_GROUND;
+        } else if (c == 0x1b) {
+            t.state = ST_OSC_ESC;
+        } else if (c == 0x18 || c == 0x1a) {
+            t.state = ST_GROUND;
+        } else if (t.osc.size() < 512) {
+            t.osc += (char)c;
+        }
+        break;
+    case ST_OSC_ESC:
+        osc_dispatch(t);
+        // ESC \ ends it, anything else starts a new sequence
+        t.state = ST_ESC;
+        if (c != '\\') {
+            step(t, c);
+        } else {
+            t.state = ST_GROUND;
+        }
+        break;
+    case ST_STR:
+        if (c == 0x1b) {
+            t.state = ST_STR_ESC;
+        } else if (c == 0x18 || c == 0x1a) {
+            t.state = ST_GROUND;
+        }
+        break;
+    case ST_STR_ESC:
+        t.state = c == '\\' ? ST_GROUND : ST_STR;
+        break;
+    }
+}
+
+void term_feed(Term &t, const uint8_t *buf, size_t len) {
+    t.dirty = 1;
+    for (size_t i = 0; i < len; ) {
+        if (t.state == ST_GROUND && !t.utf8_need) {
+            size_t n = printable_run(&buf[i], len - i);
+            if (n > 0) {
+                put_ascii(t, &buf[i], n);
+                i += n;
+                continue;
+            }
+        }
+        step(t, buf[i++]);
+    }
+}
+
+static void resize_cells(std::vector<Cell> &cells, int rows, int cols, int old_rows, int old_cols, int shift) {
+    std::vector<Cell> out((size_t)rows * cols, Cell());
+    for (int y = 0; y < rows && y + shift < old_rows; ++y) {
+        int n = cols < old_cols ? cols : old_cols;
+        const Cell *src = &cells[(size_t)(y + shift) * old_cols];
+        Cell *dst = &out[(size_t)y * cols];
+        memcpy(dst, src, sizeof(Cell) * n);
+        if (n > 0 && (dst[n - 1].flags & CELL_WIDE)) {
+            dst[n - 1].ch = ' ';
+            dst[n - 1].flags = 0;
+        }
+    }
+    cells.swap(out);
+}
+
+void term_resize(Term &t, View &v, int rows, int cols) {
+    v.valid = 0;
+    if (rows <= 0 || cols <= 0 || (rows == t.rows && cols == t.cols)) {
+        return;
+    }
+
+    // keep the cursor line on screen, the lines above it are lost
+    int shift = t.cur.y >= rows ? t.cur.y - rows + 1 : 0;
+    resize_cells(t.main_cells, rows, cols, t.rows, t.cols, t.alt_active ? 0 : shift);
+    resize_cells(t.alt_cells, rows, cols, t.rows, t.cols, t.alt_active ? shift : 0);
+    t.cells = t.alt_active ? t.alt_cells.data() : t.main_cells.data();
+    t.rows = rows;
+    t.cols = cols;
+    t.top = 0;
+    t.bottom = rows - 1;
+    t.cur.y -= shift;
+    t.cur.x = t.cur.x < cols ? t.cur.x : cols - 1;
+    t.cur.wrap_pending = 0;
+    for (Cursor &c : t.saved) {
+        c.y = c.y < rows ? c.y : rows - 1;
+        c.x = c.x < cols ? c.x : cols - 1;
+    }
+    t.dirty = 1;
+}
+
+// render
+
+static void put_utf8(std::string &out, uint32_t cp) {
+    if (cp < 0x80) {
+        out += (char)cp;
+    } else if (cp < 0x800) {
+        out += (char)(0xc0 | cp >> 6);
+        out += (char)(0x80 | (cp & 0x3f));
+    } else if (cp < 0x10000) {
+        out += (char)(0xe0 | cp >> 12);
+        out += (char)(0x80 | ((cp >> 6) & 0x3f));
+        out += (char)(0x80 | (cp & 0x3f));
+    } else {
+        out += (char)(0xf0 | cp >> 18);
+        out += (char)(0x80 | ((cp >> 12) & 0x3f));
+        out += (char)(0x80 | ((cp >> 6) & 0x3f));
+        out += (char)(0x80 | (cp & 0x3f));
+    }
+}
+
+static void put_color(std::string &out, uint32_t color, int base) {
+    char buf[32];
+    uint32_t v = color & 0xffffff;
+    if (color == COLOR_DEFAULT) {
+        snprintf(buf, sizeof(buf), ";%d", base + 9);
+    } else if ((color & COLOR_INDEX) && v < 8) {
+        snprintf(buf, sizeof(buf), ";%u", base + v);
+    } else if ((color & COLOR_INDEX) && v < 16) {
+        snprintf(buf, sizeof(buf), ";%u", base + 60 + v - 8);
+    } else if (color & COLOR_INDEX) {
+        snprintf(buf, sizeof(buf), ";%d;5;%u", base + 8, v);
+    } else {
+        snprintf(buf, sizeof(buf), ";%d;2;%u;%u;%u", base + 8, v >> 16, (v >> 8) & 0xff, v & 0xff);
+    }
+    out += buf;
+}
+
+static void set_pen(std::string &out, View &v, const Attr &a) {
+    if (attr_eq(v.pen, a)) {
+        return;
+    }
+    static const struct {
+        uint16_t flag;
+        const char *code;
+    } k_flags[] = {
+        {ATTR_BOLD, ";1"}, {ATTR_DIM, ";2"}, {ATTR_ITALIC, ";3"}, {ATTR_UNDERLINE, ";4"},
+        {ATTR_BLINK, ";5"}, {ATTR_REVERSE, ";7"}, {ATTR_INVISIBLE, ";8"}, {ATTR_STRIKE, ";9"},
+    };
+    out += "\x1b[0";
+    for (const auto &f : k_flags) {
+        if (a.flags & f.flag) {
+            out += f.code;
+        }
+    }
+    if (a.fg != COLOR_DEFAULT) {
+        put_color(out, a.fg, 30);
+    }
+    if (a.bg != COLOR_DEFAULT) {
+        put_color(out, a.bg, 40);
+    }
+    out += 'm';
+    v.pen = a;
+}
+
+static void hide_cursor(std::string &out, View &v) {
+    if (v.modes & MODE_CURSOR_VISIBLE) {
+        out += "\x1b[?25l";
+        v.modes &= ~MODE_CURSOR_VISIBLE;
+    }
+}
+
+static void move_cursor(std::string &out, View &v, int y, int x) {
+    if (v.y == y && v.x == x) {
+        return;
+    }
+    hide_cursor(out, v);
+    char buf[32];
+    if (v.y == y && v.x >= 0 && x > v.x) {
+        snprintf(buf, sizeof(buf), "\x1b[%dC", x - v.x);
+    } else {
+        snprintf(buf, sizeof(buf), "\x1b[%d;%dH", y + 1, x + 1);
+    }
+    out += buf;
+    v.y = y;
+    v.x = x;
+}
+
+static int rows_eq(const Cell *a, const Cell *b, int cols) {
+    for (int x = 0; x < cols; ++x) {
+        if (!cell_eq(a[x], b[x])) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int shifted_matches(const Term &t, const View &v, int n) {
+    int cols = t.cols;
+    int count = 0;
+    for (int y = 0; y + n < t.rows; ++y) {
+        count += rows_eq(&t.cells[(size_t)y * cols], &v.cells[(size_t)(y + n) * cols], cols);
+    }
+    return count;
+}
+
+// lines the screen scrolled up by since the view, 0 if scrolling the view
+// would not leave more rows in place
+static int find_scroll(const Term &t, const View &v) {
+    int cols = t.cols;
+    int best = 0;
+    int best_count = shifted_matches(t, v, 0);
+    int tries = 0;
+    for (int n = 1; n < t.rows && tries < 4; ++n) {
+        // where the first row went
+        if (!rows_eq(&t.cells[0], &v.cells[(size_t)n * cols], cols)) {
+            continue;
+        }
+        tries++;
+        int count = shifted_matches(t, v, n);
+        if (count > best_count) {
+            best = n;
+            best_count = count;
+        }
+    }
+    return best;
+}
+
+static void render_row(Term &t, View &v, int y, std::string &out) {
+    int cols = t.cols;
+    const Cell *now = &t.cells[(size_t)y * cols];
+    Cell *old = &v.cells[(size_t)y * cols];
+
+    // trailing default blanks are erased with EL
+    int tail = cols;
+    Cell empty;
+    while (tail > 0 && cell_eq(now[tail - 1], empty)) {
+        tail--;
+    }
+
+    for (int x = 0; x < cols; ) {
+        if (cell_eq(now[x], old[x])) {
+            // rewriting a short run is cheaper than moving over it
+            int end = x;
+            while (end < cols && end - x < 4 && cell_eq(now[end], old[end])) {
+                end++;
+            }
+            int overdraw = v.y == y && v.x == x && end < cols && end - x < 4
+                && !(now[x].flags & CELL_WIDE_TAIL);
+            if (!overdraw) {
+                x = end;
+                continue;
+            }
+        }
+        if (x >= tail) {
+            move_cursor(out, v, y, x);
+            set_pen(out, v, empty.attr);
+            out += "\x1b[K";
+            for (int i = x; i < cols; ++i) {
+                old[i] = empty;
+            }
+            break;
+        }
+        // redraw the whole wide char
+        if ((now[x].flags & CELL_WIDE_TAIL) && x > 0 && (now[x - 1].flags & CELL_WIDE)) {
+            x--;
+        }
+
+        move_cursor(out, v, y, x);
+        set_pen(out, v, now[x].attr);
+        int w = 1;
+        if ((now[x].flags & CELL_WIDE) && x + 1 < cols) {
+            put_utf8(out, now[x].ch);
+            old[x + 1] = now[x + 1];
+            w = 2;
+        } else if (now[x].flags & CELL_WIDE_TAIL) {
+            // its head was overwritten
+            out += ' ';
+        } else {
+            put_utf8(out, now[x].ch);
+        }
+        old[x] = now[x];
+        x += w;
+        // past the last column the terminal waits to wrap, do not guess
+        v.x = x < cols ? x : -1;
+    }
+}
+
+void term_render(Term &t, View &v, std::string &out) {
+    if (!v.valid || v.rows != t.rows || v.cols != t.cols) {
+        hide_cursor(out, v);
+        out += "\x1b[0m\x1b[r\x1b[H\x1b[2J";
+        v.valid = 1;
+        v.rows = t.rows;
+        v.cols = t.cols;
+        v.cells.assign((size_t)t.rows * t.cols, Cell());
+        v.pen = Attr();
+        v.x = 0;
+        v.y = 0;
+    }
+
+    // modes first, they change what the keys the user types send
+    uint32_t changed = (t.modes ^ v.modes) & ~MODE_CURSOR_VISIBLE;
+    static const struct {
+        uint32_t bit;
+        int mode;
+    } k_modes[] = {
+        {MODE_APP_CURSOR, 1}, {MODE_MOUSE_X10, 1000}, {MODE_MOUSE_BUTTON, 1002},
+        {MODE_MOUSE_ANY, 1003}, {MODE_FOCUS, 1004}, {MODE_MOUSE_SGR, 1006}, {MODE_PASTE, 2004},
+    };
+    char buf[32];
+    for (const auto &m : k_modes) {
+        if (changed & m.bit) {
+            snprintf(buf, sizeof(buf), "\x1b[?%d%c", m.mode, (t.modes & m.bit) ? 'h' : 'l');
+            out += buf;
+        }
+    }
+    if (changed & MODE_APP_KEYPAD) {
+        out += (t.modes & MODE_APP_KEYPAD) ? "\x1b=" : "\x1b>";
+    }
+    v.modes = (v.modes & MODE_CURSOR_VISIBLE) | (t.modes & ~MODE_CURSOR_VISIBLE);
+
+    if (t.title != v.title) {
+        out += "\x1b]0;";
+        out += t.title;
+        out += '\x07';
+        v.title = t.title;
+    }
+
+    // a scrolling log becomes a few line feeds
+    if (int n = find_scroll(t, v)) {
+        move_cursor(out, v, t.rows - 1, 0);
+        set_pen(out, v, Attr());
+        out.append((size_t)n, '\n');
+        memmove(&v.cells[0], &v.cells[(size_t)n * t.cols], sizeof(Cell) * t.cols * (t.rows - n));
+        for (size_t i = (size_t)(t.rows - n) * t.cols; i < v.cells.size(); ++i) {
+            v.cells[i] = Cell();
+        }
+    }
+
+    for (int y = 0; y < t.rows; ++y) {
+        render_row(t, v, y, out);
+    }
+
+    move_cursor(out, v, t.cur.y, t.cur.x);
+    if ((t.modes & MODE_CURSOR_VISIBLE) && !(v.modes & MODE_CURSOR_VISIBLE)) {
+        out += "\x1b[?25h";
+        v.modes |= MODE_CURSOR_VISIBLE;
+    }
+    if (t.bells) {
+        out += '\a';
+        t.bells = 0;
+    }
+    t.dirty = 0;
+}
@@ -0,0 +1,121 @@
+#pragma once
+
+// system
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <vector>
+
+
+// In-memory VT100/xterm screen the slave feeds the pty output into. Instead
+// of the raw output, the master gets escape sequences that turn what its
+// terminal shows into the current screen, so states it would only see
+// scroll by are never sent.
+
+// Attr.flags
+#define ATTR_BOLD       0x01
+#define ATTR_DIM        0x02
+#define ATTR_ITALIC     0x04
+#define ATTR_UNDERLINE  0x08
+#define ATTR_BLINK      0x10
+#define ATTR_REVERSE    0x20
+#define ATTR_INVISIBLE  0x40
+#define ATTR_STRIKE     0x80
+// Cell.flags
+#define CELL_WIDE       0x01    // the next cell is its right half
+#define CELL_WIDE_TAIL  0x02
+
+// colors: COLOR_DEFAULT, COLOR_INDEX | n, or COLOR_RGB | 0xRRGGBB
+#define COLOR_DEFAULT   0
+#define COLOR_INDEX     0x01000000
+#define COLOR_RGB       0x02000000
+
+struct Attr {
+    uint32_t fg = COLOR_DEFAULT;
+    uint32_t bg = COLOR_DEFAULT;
+    uint16_t flags = 0;
+    uint16_t pad = 0;
+};
+
+struct Cell {
+    uint32_t ch = ' ';          // code point
+    Attr attr;
+    uint32_t flags = 0;
+};
+
+// modes the master's terminal must also be in, they change what keys send
+#define MODE_APP_CURSOR     0x01    // ?1
+#define MODE_APP_KEYPAD     0x02    // ESC =
+#define MODE_MOUSE_X10      0x04    // ?1000
+#define MODE_MOUSE_BUTTON   0x08    // ?1002
+#define MODE_MOUSE_ANY      0x10    // ?1003
+#define MODE_MOUSE_SGR      0x20    // ?1006
+#define MODE_FOCUS          0x40    // ?1004
+#define MODE_PASTE          0x80    // ?2004
+#define MODE_CURSOR_VISIBLE 0x100   // ?25
+
+struct Cursor {
+    int x = 0;
+    int y = 0;
+    Attr attr;
+    int wrap_pending = 0;
+    int origin = 0;
+    int charset_g0 = 0;         // DEC special graphics
+    int charset_g1 = 0;
+    int shift_out = 0;
+};
+
+struct Term {
+    int rows = 0;
+    int cols = 0;
+    std::vector<Cell> main_cells;
+    std::vector<Cell> alt_cells;
+    Cell *cells = NULL;         // the active screen
+    int alt_active = 0;
+    Cursor cur;
+    Cursor saved[2];            // main, alt
+    int top = 0;                // scroll region
+    int bottom = 0;
+    int autowrap = 1;
+    int insert = 0;
+    uint32_t modes = MODE_CURSOR_VISIBLE;
+    uint32_t last_ch = ' ';     // for REP
+    std::string title;
+    size_t bells = 0;
+    // output for the pty, answers to DSR and DA
+    std::string reply;
+    // something changed since the last term_render()
+    int dirty = 1;
+    // private, the parser
+    int state = 0;
+    uint32_t params[16];
+    size_t nparams = 0;
+    char prefix = 0;
+    char inter = 0;
+    std::string osc;
+    uint32_t utf8_cp = 0;
+    int utf8_need = 0;
+};
+
+// What the master's terminal shows, as of the last term_render().
+struct View {
+    int valid = 0;
+    int rows = 0;
+    int cols = 0;
+    std::vector<Cell> cells;
+    uint32_t modes = MODE_CURSOR_VISIBLE;
+    std::string title;
+    Attr pen;
+    int x = -1;                 // -1: unknown
+    int y = -1;
+};
+
+void term_init(Term &t, int rows, int cols);
+void term_feed(Term &t, const uint8_t *buf, size_t len);
+// the master redraws everything after a resize
+void term_resize(Term &t, View &v, int rows, int cols);
+inline const Cell &term_cell(const Term &t, int y, int x) {
+    return t.cells[(size_t)y * t.cols + x];
+}
+// appends the escape sequences that turn the view into the current screen
+void term_render(Term &t, View &v, std::string &out);
@@ -1,18 +1,82 @@
 // system
 #include <string.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <signal.h>
 #include <getopt.h>
 #include <pthread.h>
+#include <poll.h>
+#include <assert.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <string>
+#include <map>
+#include <utility>
 // proj
 #include "pty.h"
+#include "event.h"
 #include "protocol.h"
+#include "pipeline.h"
+#include "ring.h"
+#include "uring.h"
+#include "hist.h"
+#include "stats.h"
+#include "trace.h"
+#include "screen.h"
+#include "xfer.h"
+#include "fwd.h"
 #include "util.h"
 
 
+// least time between two screen updates while output keeps coming
+const uint64_t k_screen_frame_us = 20000;
+// output a --persist session keeps for a master that comes back
+const size_t k_replay_size = 1 << 20;
+// input a channel queues for a child that does not read, more is dropped
+const size_t k_chan_backlog = 8 << 20;
+
+
+struct Context;
+
+// a session started by CMD_OPEN, channel 0 is the one in Context
+struct Channel {
+    Context *ctx = NULL;
+    uint32_t id = 0;
+    pid_t pid = -1;
+    int no_tty = 0;
+    int pty_fd = -1;        // rw
+    int child_in = -1;      // w
+    int child_out = -1;     // r
+    int child_err = -1;     // r
+    int msg_eof = 0;
+    // a file instead of a command, OPEN_F_GET or OPEN_F_PUT
+    uint8_t file = 0;
+    int file_fd = -1;
+    uint64_t next = 0;      // put, offset of the next chunk
+    int failed = 0;
+    // guarded by ctx->mu: input chan_frame() queued for chan_writer()
+    WriteQueue in_q;
+    pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+    int in_eof = 0;         // nothing follows what is queued
+    int dropped = 0;        // a write failed or the child fell behind
+    // guarded by ctx->mu: output threads still running, and references
+    int srcs = 0;
+    int refs = 0;
+};
+
 struct Context {
     pid_t pid = -1;
     int pty_fd = -1;        // rw
     int no_tty = 0;
+    int proto = PROTO_VERSION;
+    uint32_t hello_flags = HELLO_F_LZ | HELLO_F_MUX | HELLO_F_PING | HELLO_F_FILE | HELLO_F_FWD | HELLO_F_REL;  // accepted
+    int hello_done = 0;
+    int mux = 0;
+    int file = 0;           // the master may open file channels
     int child_in = -1;      // w
     int child_out = -1;     // r
     int child_err = -1;     // r
@@ -22,27 +86,132 @@ struct Context {
     int l2r = 0;
     int r2l = 0;
     int msg_eof = 0;
+    int err_open = 0;       // --no-tty, r2l_err() still sends; guarded by mu
     Stream stream;
+    EscapeSet escape;       // stream.escape points here with --escape
+    // mux mode, the open channels other than 0, guarded by mu
+    std::map<uint32_t, Channel *> chans;
+    // forwarded connections, the master's range of ids comes first
+    Forwards fwd;
+    char *const *cmd_argv = NULL;
+    // output coalescing deadline
+    uint64_t coalesce_us = 0;
+    // of every output batch, for --stats
+    BatchStats batch_stats;
+    // --pipeline, buffers between the reading and the writing thread
+    size_t pipeline = 0;
+    // event loop mode, --epoll or --uring
+    int epoll = 0;
+    WriteQueue local_wq;    // pty_fd or child_in
+    // screen mode, term and view are guarded by term_mu
+    int screen = 0;
+    Term term;
+    View view;
+    pthread_mutex_t term_mu = PTHREAD_MUTEX_INITIALIZER;
+    pthread_cond_t term_cond = PTHREAD_COND_INITIALIZER;
+    int term_eof = 0;
+    // persist mode, the session outlives the transport; guarded by mu
+    int persist = 0;
+    int persist_fd = -1;    // listening
+    int resume = 0;         // the master sends CMD_RESUME
+    Ring ring;              // pty output, seq is its offset
+    int conn_fd = -1;       // the attached relay
+    int conn_busy = 0;      // written to by persist_send()
+    int replay_ready = 0;   // the attached master said where to resume
+    uint64_t sent = 0;      // seq of the next byte it gets
+    int child_done = 0;
+    // --ping, dumped on SIGUSR1 and with --latency at exit
+    uint64_t ping_us = 0;
+    int ping = 0;           // the master answers CMD_PING
+    Hist ping_hist;
+    StatsServer stats;      // --stats
 };
 
 
+static int write_local(Context &ctx, const void *buf, size_t len) {
+    if (ctx.epoll) {
+        return wq_write(ctx.local_wq, buf, len);
+    }
+    int wfd = ctx.no_tty ? ctx.child_in : ctx.pty_fd;
+    if (TEMP_FAILURE_RETRY(write(wfd, buf, len)) != (ssize_t)len) {
+        log_err(errno, "write(wfd, p.payload, p.size)");
+        return -1;
+    }
+    return 0;
+}
+
+
+static int chan_frame(Context &ctx, const Parser &p);
+
+// the attached master gets the output from seq on
+static void persist_resume(Context &ctx, uint64_t seq) {
+    pthread_mutex_lock(&ctx.mu);
+    uint64_t start = ring_start(ctx.ring);
+    if (seq < start) {
+        log_err(0, "[persist_resume] %llu bytes of output are gone", (unsigned long long)(start - seq));
+        seq = start;
+    }
+    if (seq > ctx.ring.end) {
+        // not from this session
+        seq = start;
+    }
+    log_dbg("[persist_resume] [seq:%llu][end:%llu]", (unsigned long long)seq, (unsigned long long)ctx.ring.end);
+    ctx.sent = seq;
+    ctx.replay_ready = 1;
+    pthread_cond_broadcast(&ctx.cond);
+    pthread_mutex_unlock(&ctx.mu);
+}
+
+static void log_latency(Context &ctx) {
+    hist_log(ctx.ping_hist, "ping");
+}
+
+static void stats_dump(std::string &out, void *user) {
+    Context &ctx = *(Context *)user;
+    char labels[64];
+    snprintf(labels, sizeof(labels), "role=\"slave\",pid=\"%d\"", (int)getpid());
+    stats_format(out, ctx.stream.stats, labels);
+    stats_format_hist(out, "ping", ctx.ping_hist, labels);
+    stats_format_batch(out, ctx.batch_stats, labels);
+}
+
+static int recv_ping(Context &ctx, const Parser &p) {
+    uint8_t flags = 0;
+    uint64_t time = 0;
+    if (0 != ping_decode(p.payload, p.size, flags, time)) {
+        return -1;
+    }
+    if (flags & PING_F_PONG) {
+        hist_record(ctx.ping_hist, monotonic_us() - time);
+        return 0;
+    }
+    return send_ping(&ctx.stream, PING_F_PONG, time);
+}
+
 static int frame_cb(Parser &p, void *user) {
     Context &ctx = *(Context *)user;
+    if (p.chan != 0) {
+        return chan_frame(ctx, p);
+    }
 
-    if (ctx.msg_eof) {
+    // the hello ack may follow an early CMD_EOF, pings go on after it
+    if (p.cmd == CMD_PING) {
+        return recv_ping(ctx, p);
+    }
+    if (ctx.msg_eof && p.cmd != CMD_HELLO) {
         log_err(0, "got msg after CMD_EOF");
         return 0;
     }
 
     if (p.cmd == CMD_DATA) {
-        int wfd = ctx.no_tty ? ctx.child_in : ctx.pty_fd;
-        if (TEMP_FAILURE_RETRY(write(wfd, p.payload, p.size)) != (ssize_t)p.size) {
-            log_err(errno, "write(wfd, p.payload, p.size)");
+        if (0 != write_local(ctx, p.payload, p.size)) {
             return -1;
         }
     } else if (p.cmd == CMD_EOF) {
         log_dbg("[frame_cb] EOF msg received");
-        if (ctx.no_tty) {
+        if (ctx.epoll) {
+            // closed or written by the loop once queued input is flushed
+        } else if (ctx.no_tty) {
             (void)close(ctx.child_in);
         } else {
             // ctrl+d
@@ -56,6 +225,42 @@ static int frame_cb(Parser &p, void *user) {
             log_err(0, "CMD_WS [size:%zu] < 4", p.size);
             return -1;
         }
+
+        // version offer from the master
+        Hello h;
+        if (!ctx.hello_done && 0 == hello_decode(p.payload + 4, p.size - 4, h)) {
+            ctx.hello_done = 1;
+            uint8_t version = h.version < ctx.proto ? h.version : (uint8_t)ctx.proto;
+            if (version >= PROTO_V2) {
+                Hello reply;
+                reply.version = version;
+                reply.flags = h.flags & ctx.hello_flags;
+                if (ctx.stream.base64) {
+                    // a lost char shifts every quad after it
+                    reply.flags &= ~HELLO_F_REL;
+                }
+                if (reply.flags & HELLO_F_REL) {
+                    // a block lost would break the ones after it
+                    reply.flags &= ~HELLO_F_LZ;
+                }
+                reply.max_frame = ctx.stream.bufs.max_frame;
+                if (0 != send_hello(&ctx.stream, reply, h.max_frame)) {
+                    return -1;
+                }
+                ctx.mux = !!(reply.flags & HELLO_F_MUX);
+                ctx.file = ctx.mux && (reply.flags & HELLO_F_FILE);
+                if (ctx.mux && (reply.flags & HELLO_F_FWD)) {
+                    ctx.fwd.stream = &ctx.stream;
+                }
+                ctx.resume = !!(reply.flags & HELLO_F_RESUME);
+                __atomic_store_n(&ctx.ping, !!(reply.flags & HELLO_F_PING), __ATOMIC_RELAXED);
+            }
+        }
+        if (ctx.persist && !ctx.resume && !ctx.replay_ready) {
+            // an older master, it gets what we still have
+            persist_resume(ctx, 0);
+        }
+
         if (ctx.no_tty) {
             return 0;
         }
@@ -64,12 +269,39 @@ static int frame_cb(Parser &p, void *user) {
         ws.ws_row = (uint16_t)p.payload[0] | ((uint16_t)p.payload[1] << 8);
         ws.ws_col = (uint16_t)p.payload[2] | ((uint16_t)p.payload[3] << 8);
         log_dbg("[frame_cb] got CMD_WS [row:%u][col:%u]", ws.ws_row, ws.ws_col);
+        if (ws.ws_row == 0 && ws.ws_col == 0) {
+            // only carried the hello
+            return 0;
+        }
 
         if (ioctl(ctx.pty_fd, TIOCSWINSZ, &ws) == -1) {
             log_err(errno, "ioctl(fd, TIOCSWINSZ, &ws)");
             return -1;
         }
         (void)kill(ctx.pid, SIGWINCH);
+
+        if (ctx.screen) {
+            // the master's terminal is redrawn at the new size
+            pthread_mutex_lock(&ctx.term_mu);
+            term_resize(ctx.term, ctx.view, ws.ws_row, ws.ws_col);
+            pthread_cond_signal(&ctx.term_cond);
+            pthread_mutex_unlock(&ctx.term_mu);
+        }
+    } else if (p.cmd == CMD_HELLO) {
+        // master acked the version, the parser has switched
+        log_dbg("[frame_cb] got CMD_HELLO");
+    } else if (p.cmd == CMD_RESUME) {
+        if (p.size < 8) {
+            log_err(0, "CMD_RESUME [size:%zu] < 8", p.size);
+            return -1;
+        }
+        uint64_t seq = 0;
+        for (size_t i = 0; i < 8; ++i) {
+            seq |= (uint64_t)p.payload[i] << (8 * i);
+        }
+        if (ctx.persist) {
+            persist_resume(ctx, seq);
+        }
     } else {
         log_err(0, "Unknown cmd: %u", p.cmd);
         return -1;
@@ -83,7 +315,8 @@ static void *l2r(void *user) {
     Context &ctx = *(Context *)user;
     Parser p;
     int ret = 0;
-    while (!p.eof && !ctx.msg_eof && 0 == (ret = feed_frame(p, &ctx.stream, frame_cb, &ctx))) {}
+    // other channels outlive channel 0, and with HELLO_F_REL the acks still come
+    while (!p.eof && !(ctx.msg_eof && !ctx.mux && !ctx.stream.rel) && 0 == (ret = feed_frame(p, &ctx.stream, frame_cb, &ctx))) {}
 
     pthread_mutex_lock(&ctx.mu);
     ctx.exit_flag |= 1;
@@ -93,14 +326,81 @@ static void *l2r(void *user) {
     return NULL;
 }
 
+// the totals so far, batches share them
+static void log_batch(const Batch &batch, const char *name) {
+    const BatchStats &st = *batch.stats;
+    log_dbg("[%s] [frames:%llu] flushes [size:%llu][deadline:%llu][other:%llu]", name,
+        (unsigned long long)st.frames, (unsigned long long)st.flush_size,
+        (unsigned long long)st.flush_deadline, (unsigned long long)st.flush_other);
+}
+
+// pty --> stdout, the transport is written by another thread
+static int r2l_fd_pipelined(Context &ctx, int fd, uint8_t cmd, uint32_t chan) {
+    Pipeline pl;
+    pl.stream = &ctx.stream;
+    pl.cmd = cmd;
+    pl.chan = chan;
+    if (0 != pipeline_start(pl, ctx.pipeline)) {
+        return -1;
+    }
+    int ret = 0;
+    while (PipeBuf *b = pipeline_get(pl)) {
+        int nread = TEMP_FAILURE_RETRY(read(fd, &b->data[FRAME_HEADROOM], pipeline_room(pl)));
+        if (nread < 0) {
+            log_err(errno, "read(fd)");
+            ret = -1;
+        }
+        if (nread <= 0) {
+            break;
+        }
+        b->len = nread;
+        pipeline_put(pl, b);
+    }
+    int err = pipeline_finish(pl);
+    return ret ? ret : err;
+}
+
 // pty --> stdout
-static void r2l_fd(Context &ctx, int fd, uint8_t cmd) {
+static int r2l_fd(Context &ctx, int fd, uint8_t cmd, uint32_t chan) {
+    if (ctx.pipeline) {
+        return r2l_fd_pipelined(ctx, fd, cmd, chan);
+    }
     int ret = 0;
+    Batch batch;
+    batch.deadline_us = ctx.coalesce_us;
+    batch.stats = &ctx.batch_stats;
     while (1) {
-        char output_buf[MAX_FRAME_SIZE];
-        char *buf = &output_buf[FRAME_HEADER_SIZE];
-        const size_t k_output_buf_size = MAX_FRAME_SIZE - FRAME_HEADER_SIZE;
-        int nread = TEMP_FAILURE_RETRY(read(fd, buf, k_output_buf_size));
+        // more output may follow, wait for it until the deadline
+        int64_t timeout = batch_timeout(batch, monotonic_us());
+        if (timeout == 0) {
+            if (0 != (ret = batch_flush(batch, &ctx.stream, &batch.stats->flush_deadline))) {
+                break;
+            }
+        } else if (timeout > 0) {
+            struct pollfd pfd = {fd, POLLIN, 0};
+            struct timespec ts = {(time_t)(timeout / 1000000), (long)(timeout % 1000000) * 1000};
+            int n = TEMP_FAILURE_RETRY(ppoll(&pfd, 1, &ts, NULL));
+            if (n < 0) {
+                log_err(errno, "ppoll(fd)");
+                ret = -1;
+                break;
+            }
+            if (n == 0) {
+                if (0 != (ret = batch_flush(batch, &ctx.stream, &batch.stats->flush_deadline))) {
+                    break;
+                }
+                continue;
+            }
+        }
+
+        // a commit leaves room for the next read, NULL is out of memory
+        size_t avail = 0;
+        char *buf = batch_reserve(batch, &ctx.stream, &avail);
+        if (!buf) {
+            ret = -1;
+            break;
+        }
+        int nread = TEMP_FAILURE_RETRY(read(fd, buf, avail));
         if (nread < 0) {
             log_err(errno, "read(fd)");
             ret = -1;
@@ -110,38 +410,146 @@ static void r2l_fd(Context &ctx, int fd, uint8_t cmd) {
             break;
         }
 
-        if (0 != (ret = send_payload(&ctx.stream, cmd, buf, nread))) {
+        if (0 != (ret = batch_commit(batch, &ctx.stream, cmd, nread, monotonic_us(), chan))) {
             break;
         }
     }
+    int err = batch_flush(batch, &ctx.stream, &batch.stats->flush_other);
+    ret = ret ? ret : err;
+    log_batch(batch, cmd == CMD_DATA ? "r2l_out" : "r2l_err");
+    return ret;
+}
 
-    if (cmd == CMD_DATA) {
-        // eof
-        (void)send_eof(&ctx.stream);
+// channel 0 output is done
+static void r2l_done(Context &ctx, int ret) {
+    // eof
+    (void)send_eof(&ctx.stream);
 
-        pthread_mutex_lock(&ctx.mu);
-        ctx.exit_flag |= 2;
-        ctx.r2l = ret;
-        pthread_cond_signal(&ctx.cond);
-        pthread_mutex_unlock(&ctx.mu);
+    pthread_mutex_lock(&ctx.mu);
+    ctx.exit_flag |= 2;
+    ctx.r2l = ret;
+    pthread_cond_signal(&ctx.cond);
+    pthread_mutex_unlock(&ctx.mu);
+}
+
+// pty output goes into the screen model, answers to terminal queries go back
+static int feed_screen(Context &ctx, const uint8_t *buf, size_t len) {
+    std::string reply;
+    pthread_mutex_lock(&ctx.term_mu);
+    term_feed(ctx.term, buf, len);
+    reply.swap(ctx.term.reply);
+    pthread_cond_signal(&ctx.term_cond);
+    pthread_mutex_unlock(&ctx.term_mu);
+    if (!reply.empty()) {
+        return write_local(ctx, reply.data(), reply.size());
+    }
+    return 0;
+}
+
+// Sends the changes since the last update as CMD_DATA. Called with term_mu
+// held, which is released before the possibly blocking write.
+static int send_screen(Context &ctx) {
+    std::string out(FRAME_HEADROOM, '\0');
+    term_render(ctx.term, ctx.view, out);
+    pthread_mutex_unlock(&ctx.term_mu);
+
+    // send_payload() overwrites the tail of the previous chunk with a header
+    size_t max_payload = stream_max_payload(&ctx.stream);
+    int err = 0;
+    for (size_t pos = FRAME_HEADROOM; pos < out.size() && !err; pos += max_payload) {
+        size_t len = out.size() - pos < max_payload ? out.size() - pos : max_payload;
+        err = send_payload(&ctx.stream, CMD_DATA, &out[pos], len);
+    }
+    pthread_mutex_lock(&ctx.term_mu);
+    return err;
+}
+
+// pty --> screen
+static void *r2l_screen_read(void *user) {
+    Context &ctx = *(Context *)user;
+    uint8_t *buf = (uint8_t *)malloc(ctx.stream.bufs.io);
+    if (!buf) {
+        log_err(errno, "[r2l_screen_read] out of memory");
+    }
+    while (buf) {
+        ssize_t nread = TEMP_FAILURE_RETRY(read(ctx.pty_fd, buf, ctx.stream.bufs.io));
+        if (nread <= 0) {
+            // EIO: pty closed by the child
+            break;
+        }
+        if (0 != feed_screen(ctx, buf, (size_t)nread)) {
+            break;
+        }
+    }
+    free(buf);
+
+    pthread_mutex_lock(&ctx.term_mu);
+    ctx.term_eof = 1;
+    pthread_cond_signal(&ctx.term_cond);
+    pthread_mutex_unlock(&ctx.term_mu);
+    return NULL;
+}
+
+// screen --> stdout, the states that pile up while a write blocks are skipped
+static void *r2l_screen_send(void *user) {
+    Context &ctx = *(Context *)user;
+    int ret = 0;
+    uint64_t next_at = 0;
+    size_t frames = 0;
+    pthread_mutex_lock(&ctx.term_mu);
+    while (1) {
+        while (!ctx.term.dirty && !ctx.term_eof) {
+            pthread_cond_wait(&ctx.term_cond, &ctx.term_mu);
+        }
+        if (!ctx.term.dirty) {
+            break;
+        }
+
+        uint64_t now = monotonic_us();
+        if (now < next_at && !ctx.term_eof) {
+            pthread_mutex_unlock(&ctx.term_mu);
+            (void)usleep((useconds_t)(next_at - now));
+            pthread_mutex_lock(&ctx.term_mu);
+            continue;
+        }
+        if (0 != (ret = send_screen(ctx))) {
+            break;
+        }
+        frames++;
+        next_at = monotonic_us() + k_screen_frame_us;
     }
+    pthread_mutex_unlock(&ctx.term_mu);
+    log_dbg("[r2l_screen_send] [frames:%zu]", frames);
+    r2l_done(ctx, ret);
+    return NULL;
 }
 
 static void *r2l_pty(void *user) {
     Context &ctx = *(Context *)user;
-    r2l_fd(ctx, ctx.pty_fd, CMD_DATA);
+    r2l_done(ctx, r2l_fd(ctx, ctx.pty_fd, CMD_DATA, 0));
     return NULL;
 }
 
 static void *r2l_out(void *user) {
     Context &ctx = *(Context *)user;
-    r2l_fd(ctx, ctx.child_out, CMD_DATA);
+    int ret = r2l_fd(ctx, ctx.child_out, CMD_DATA, 0);
+    // the eof goes after the last of stderr
+    pthread_mutex_lock(&ctx.mu);
+    while (ctx.err_open) {
+        pthread_cond_wait(&ctx.cond, &ctx.mu);
+    }
+    pthread_mutex_unlock(&ctx.mu);
+    r2l_done(ctx, ret);
     return NULL;
 }
 
 static void *r2l_err(void *user) {
     Context &ctx = *(Context *)user;
-    r2l_fd(ctx, ctx.child_err, CMD_ERR);
+    (void)r2l_fd(ctx, ctx.child_err, CMD_ERR, 0);
+    pthread_mutex_lock(&ctx.mu);
+    ctx.err_open = 0;
+    pthread_cond_broadcast(&ctx.cond);
+    pthread_mutex_unlock(&ctx.mu);
     return NULL;
 }
 
@@ -233,95 +641,1578 @@ L_ERR:
     return -1;
 }
 
-int main(int argc, char *const *argv) {
-    // parse args
-    int arg_base64 = 0;
-    int arg_greeting = 0;
-    int arg_no_tty = 0;
-    struct option long_options[] = {
-        /* These options set a flag. */
-        {"base64", no_argument, &arg_base64, 1},
-        {"greeting", no_argument, &arg_greeting, 1},
-        {"no-tty", no_argument, &arg_no_tty, 1},
-        {0, 0, 0, 0}
-    };
+static Channel *chan_get(Context &ctx, uint32_t id) {
+    Channel *ch = NULL;
+    pthread_mutex_lock(&ctx.mu);
+    auto it = ctx.chans.find(id);
+    if (it != ctx.chans.end()) {
+        ch = it->second;
+        ch->refs++;
+    }
+    pthread_mutex_unlock(&ctx.mu);
+    return ch;
+}
 
-    int option_index = -1;
-    while (-1 != getopt_long(argc, argv, "", long_options, &option_index)) {}
-    char *const cmd_argv_default[] = {(char *)"/bin/sh", NULL};
-    char *const *cmd_argv = argc > optind ? &argv[optind] : cmd_argv_default;
+static void chan_put(Channel *ch) {
+    Context &ctx = *ch->ctx;
+    pthread_mutex_lock(&ctx.mu);
+    int last = --ch->refs == 0;
+    pthread_mutex_unlock(&ctx.mu);
+    if (!last) {
+        return;
+    }
+    int fds[] = {ch->pty_fd, ch->child_in, ch->child_out, ch->child_err, ch->file_fd};
+    for (int fd : fds) {
+        if (fd >= 0) {
+            (void)close(fd);
+        }
+    }
+    wq_free(ch->in_q);
+    delete ch;
+}
 
-    // fork
-    Context ctx;
-    ctx.no_tty = arg_no_tty;
-    int err = 0;
-    if (ctx.no_tty) {
-        err = pipe_fork(ctx.pid, ctx.child_in, ctx.child_out, ctx.child_err);
-    } else {
-        err = pty_fork(ctx.pid, ctx.pty_fd, NULL, NULL);
+// the last output thread of a channel closes it, chan_writer() stops once
+// it wrote what is queued
+static void chan_src_done(Channel *ch) {
+    Context &ctx = *ch->ctx;
+    pthread_mutex_lock(&ctx.mu);
+    int last = --ch->srcs == 0;
+    if (last) {
+        ch->in_eof = 1;
+        pthread_cond_signal(&ch->cond);
     }
-    if (err) {
-        log_err(err, "pty_fork() or pipe_fork()");
-        return -1;
+    pthread_mutex_unlock(&ctx.mu);
+    if (last) {
+        (void)send_eof(&ctx.stream, ch->id);
+        if (ch->pid > 0) {
+            (void)TEMP_FAILURE_RETRY(waitpid(ch->pid, NULL, 0));
+        }
+        log_dbg("[chan_src_done] [chan:%u] closed", ch->id);
+
+        pthread_mutex_lock(&ctx.mu);
+        ctx.chans.erase(ch->id);
+        pthread_cond_signal(&ctx.cond);
+        pthread_mutex_unlock(&ctx.mu);
     }
+    chan_put(ch);
+}
 
-    if (ctx.pid == 0) {
-        // child
-        (void)execvp(cmd_argv[0], cmd_argv);
-        log_err(errno, "execvp()");
-        return -1;
+static void *r2l_chan(void *user) {
+    Channel *ch = (Channel *)user;
+    (void)r2l_fd(*ch->ctx, ch->no_tty ? ch->child_out : ch->pty_fd, CMD_DATA, ch->id);
+    chan_src_done(ch);
+    return NULL;
+}
+
+static void *r2l_chan_err(void *user) {
+    Channel *ch = (Channel *)user;
+    (void)r2l_fd(*ch->ctx, ch->child_err, CMD_ERR, ch->id);
+    chan_src_done(ch);
+    return NULL;
+}
+
+// queued input --> the child. Only this thread waits for the child to read,
+// the transport's reader goes on with the other channels.
+static void *chan_writer(void *user) {
+    Channel *ch = (Channel *)user;
+    Context &ctx = *ch->ctx;
+    // swapped with in_q, written without the lock
+    WriteQueue q;
+    q.fd = ch->in_q.fd;
+    q.defer = 1;
+    pthread_mutex_lock(&ctx.mu);
+    while (1) {
+        if (wq_pending(ch->in_q) == 0) {
+            if (ch->in_eof) {
+                break;
+            }
+            pthread_cond_wait(&ch->cond, &ctx.mu);
+            continue;
+        }
+        std::swap(ch->in_q, q);
+        pthread_mutex_unlock(&ctx.mu);
+        int ret = wq_drain(q);
+        pthread_mutex_lock(&ctx.mu);
+        if (ret) {
+            // the child closed its input, later input is dropped
+            ch->dropped = 1;
+            wq_free(ch->in_q);
+            wq_free(q);
+        }
     }
+    pthread_mutex_unlock(&ctx.mu);
+    wq_free(q);
 
-    // parent
-    if (isatty(STDIN_FILENO)) {
-        // prevent echoing
-        (void)tty_set_raw(STDIN_FILENO, NULL);
+    log_dbg("[chan_writer] [chan:%u] input done", ch->id);
+    if (ch->no_tty) {
+        (void)close(ch->child_in);
+        ch->child_in = -1;
     }
-    // ready to accept input and produce output
-    if (arg_greeting) {
-        const char *k_greeting = "PTY_SLAVE_GREETING";
-        (void)write(STDOUT_FILENO, k_greeting, strlen(k_greeting));
+    chan_put(ch);
+    return NULL;
+}
+
+// input for chan_writer(), a child that is k_chan_backlog behind loses it
+// rather than hold up the transport
+static void chan_queue(Context &ctx, Channel *ch, const void *data, size_t len) {
+    pthread_mutex_lock(&ctx.mu);
+    int overrun = !ch->dropped && wq_pending(ch->in_q) + len > k_chan_backlog;
+    if (overrun) {
+        ch->dropped = 1;
+    } else if (!ch->dropped && 0 != wq_write(ch->in_q, data, len)) {
+        ch->dropped = 1;
     }
+    pthread_cond_signal(&ch->cond);
+    pthread_mutex_unlock(&ctx.mu);
+    if (overrun) {
+        log_err(0, "[chan:%u] the child is %zu bytes behind, its input is dropped", ch->id, k_chan_backlog);
+        (void)xfer_error(&ctx.stream, ch->id, "pty_proxy_slave: input dropped, the command does not read it\n");
+    }
+}
 
-    // init stream
-    ctx.stream.rfd = STDIN_FILENO;
-    ctx.stream.wfd = STDOUT_FILENO;
-    ctx.stream.base64 = arg_base64;
+// a get is sent by a thread of its own, a put written by chan_frame()
+static void *r2l_chan_file(void *user) {
+    Channel *ch = (Channel *)user;
+    Context &ctx = *ch->ctx;
+    if (0 != xfer_send(&ctx.stream, ch->id, ch->file_fd, ch->next, &ch->msg_eof) && errno != ECANCELED) {
+        (void)xfer_error(&ctx.stream, ch->id, "read: %s\n", strerror(errno));
+    }
+    chan_src_done(ch);
+    return NULL;
+}
+
+// CMD_OPEN with OPEN_F_GET or OPEN_F_PUT, a file instead of cmd_argv. A put
+// starts at the offset the master asked for, or at the end with
+// k_xfer_append; we say where with CMD_RESUME.
+static int chan_open_file(Context &ctx, const Parser &p) {
+    uint8_t flags = 0;
+    uint64_t offset = 0;
+    char path[PATH_MAX];
+    if (!ctx.file || 0 != xfer_open_decode(p.payload, p.size, flags, offset, path, sizeof(path))) {
+        (void)xfer_error(&ctx.stream, p.chan, "bad file request\n");
+        return send_eof(&ctx.stream, p.chan);
+    }
+    int get = flags & OPEN_F_GET;
+    int fd = open(path, get ? O_RDONLY | O_CLOEXEC : O_WRONLY | O_CREAT | O_CLOEXEC, 0666);
+    int err = fd < 0 ? errno : 0;
+    struct stat st;
+    if (!err && !get) {
+        if (0 != fstat(fd, &st)) {
+            err = errno;
+        } else if (offset == k_xfer_append) {
+            offset = (uint64_t)st.st_size;
+        } else if (offset > (uint64_t)st.st_size) {
+            // a hole would pass for data
+            err = ESPIPE;
+        } else if (0 != ftruncate(fd, (off_t)offset)) {
+            err = errno;
+        }
+    }
+    log_dbg("[chan_open_file] [chan:%u][get:%d][offset:%llu] %s: %s", p.chan, get, (unsigned long long)offset, path, strerror(err));
+    if (err) {
+        if (fd >= 0) {
+            (void)close(fd);
+        }
+        (void)xfer_error(&ctx.stream, p.chan, "%s: %s\n", path, strerror(err));
+        return send_eof(&ctx.stream, p.chan);
+    }
+
+    Channel *ch = new Channel;
+    ch->ctx = &ctx;
+    ch->id = p.chan;
+    ch->file = get ? OPEN_F_GET : OPEN_F_PUT;
+    ch->file_fd = fd;
+    ch->next = offset;
+    ch->srcs = get ? 1 : 0;
+    ch->refs = 1;
+    pthread_mutex_lock(&ctx.mu);
+    ctx.chans[ch->id] = ch;
+    pthread_mutex_unlock(&ctx.mu);
+    if (!get) {
+        return send_resume(&ctx.stream, offset, ch->id);
+    }
 
-    // start threads
     pthread_attr_t attr;
-    if (0 != pthread_attr_init(&attr)) {
-        log_err(errno, "pthread_attr_init()");
+    if (0 != thread_attr_init(&attr, 1)) {
         return -1;
     }
-    (void)pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
     pthread_t thread_id;
-    if (0 != pthread_create(&thread_id, &attr, &l2r, &ctx)) {
-        log_err(errno, "pthread_create(&thread_id, &attr, &l2r, &ctx)");
+    err = pthread_create(&thread_id, &attr, &r2l_chan_file, ch);
+    (void)pthread_attr_destroy(&attr);
+    if (err) {
+        log_err(err, "pthread_create(&thread_id, &attr, &r2l_chan_file, ch)");
         return -1;
     }
-    if (ctx.no_tty) {
-        if (0 != pthread_create(&thread_id, &attr, &r2l_out, &ctx)) {
-            log_err(errno, "pthread_create(&thread_id, &attr, &r2l_out, &ctx)");
-            return -1;
-        }
-        if (0 != pthread_create(&thread_id, &attr, &r2l_err, &ctx)) {
-            log_err(errno, "pthread_create(&thread_id, &attr, &r2l_err, &ctx)");
-            return -1;
-        }
+    return 0;
+}
+
+// CMD_EOF on a file channel: a get is cancelled, a put complete
+static void chan_file_eof(Context &ctx, Channel *ch) {
+    __atomic_store_n(&ch->msg_eof, 1, __ATOMIC_RELAXED);
+    if (ch->file == OPEN_F_GET) {
+        // r2l_chan_file() stops and closes it
+        return;
+    }
+    int fd = ch->file_fd;
+    ch->file_fd = -1;
+    if (0 != close(fd) && !ch->failed) {
+        (void)xfer_error(&ctx.stream, ch->id, "close: %s\n", strerror(errno));
+    }
+    log_dbg("[chan_file_eof] [chan:%u] received up to %llu", ch->id, (unsigned long long)ch->next);
+    (void)send_eof(&ctx.stream, ch->id);
+
+    pthread_mutex_lock(&ctx.mu);
+    ctx.chans.erase(ch->id);
+    pthread_cond_signal(&ctx.cond);
+    pthread_mutex_unlock(&ctx.mu);
+    // the reference of the map
+    chan_put(ch);
+}
+
+// CMD_OPEN: [flags][row 2 bytes][col 2 bytes], runs another cmd_argv
+static int chan_open(Context &ctx, const Parser &p) {
+    if (p.size < 5) {
+        log_err(0, "CMD_OPEN [size:%zu] < 5", p.size);
+        return -1;
+    }
+    Channel *old = chan_get(ctx, p.chan);
+    if (old) {
+        chan_put(old);
+        log_err(0, "CMD_OPEN [chan:%u] already open", p.chan);
+        return -1;
+    }
+    if (p.payload[0] & (OPEN_F_GET | OPEN_F_PUT)) {
+        return chan_open_file(ctx, p);
+    }
+
+    Channel *ch = new Channel;
+    ch->ctx = &ctx;
+    ch->id = p.chan;
+    ch->no_tty = p.payload[0] & OPEN_F_NO_TTY;
+    struct winsize ws = {};
+    ws.ws_row = (uint16_t)p.payload[1] | ((uint16_t)p.payload[2] << 8);
+    ws.ws_col = (uint16_t)p.payload[3] | ((uint16_t)p.payload[4] << 8);
+    log_dbg("[chan_open] [chan:%u][no_tty:%d][row:%u][col:%u]", ch->id, ch->no_tty, ws.ws_row, ws.ws_col);
+
+    int err = 0;
+    if (ch->no_tty) {
+        err = pipe_fork(ch->pid, ch->child_in, ch->child_out, ch->child_err);
     } else {
-        if (0 != pthread_create(&thread_id, &attr, &r2l_pty, &ctx)) {
-            log_err(errno, "pthread_create(&thread_id, &attr, &r2l_pty, &ctx)");
-            return -1;
+        err = pty_fork(ch->pid, ch->pty_fd, NULL, ws.ws_row && ws.ws_col ? &ws : NULL);
+    }
+    if (ch->pid == 0) {
+        // child, must not return into our threads
+        if (!err) {
+            sigset_t sigset;
+            sigemptyset(&sigset);
+            (void)sigprocmask(SIG_SETMASK, &sigset, NULL);
+            (void)execvp(ctx.cmd_argv[0], ctx.cmd_argv);
+            log_err(errno, "execvp()");
         }
+        _exit(127);
+    }
+    if (err) {
+        log_err(err, "[chan_open] pty_fork() or pipe_fork()");
+        delete ch;
+        // the master sees the channel close right away
+        return send_eof(&ctx.stream, p.chan);
     }
 
-    // wait for remote exit
-    pthread_mutex_lock(&ctx.mu);
-    while (!(ctx.exit_flag & 2)) {
-        pthread_cond_wait(&ctx.cond, &ctx.mu);
+    // later children must not hold our ends open
+    int fds[] = {ch->pty_fd, ch->child_in, ch->child_out, ch->child_err};
+    for (int fd : fds) {
+        if (fd >= 0) {
+            (void)fd_set_cloexec(fd);
+        }
     }
-    log_dbg("[exit_flag:%d] [l2r:%d][r2l:%d]", ctx.exit_flag, ctx.l2r, ctx.r2l);
+
+    ch->in_q.fd = ch->no_tty ? ch->child_in : ch->pty_fd;
+    ch->in_q.defer = 1;
+    ch->srcs = ch->no_tty ? 2 : 1;
+    // and chan_writer()
+    ch->refs = ch->srcs + 1;
+    pthread_mutex_lock(&ctx.mu);
+    ctx.chans[ch->id] = ch;
     pthread_mutex_unlock(&ctx.mu);
+
+    pthread_attr_t attr;
+    if (0 != thread_attr_init(&attr, 1)) {
+        return -1;
+    }
+    pthread_t thread_id;
+    err = pthread_create(&thread_id, &attr, &chan_writer, ch);
+    if (!err) {
+        err = pthread_create(&thread_id, &attr, &r2l_chan, ch);
+    }
+    if (!err && ch->no_tty) {
+        err = pthread_create(&thread_id, &attr, &r2l_chan_err, ch);
+    }
+    (void)pthread_attr_destroy(&attr);
+    if (err) {
+        log_err(err, "pthread_create(&thread_id, &attr, &chan_writer, ch)");
+        return -1;
+    }
+    return 0;
+}
+
+// frames for channels other than 0, an error only ends that channel
+static int chan_frame(Context &ctx, const Parser &p) {
+    if (fwd_frame(ctx.fwd, p)) {
+        return 0;
+    }
+    if (p.cmd == CMD_OPEN) {
+        return chan_open(ctx, p);
+    }
+
+    Channel *ch = chan_get(ctx, p.chan);
+    if (!ch) {
+        // closed while the frame was on its way
+        log_dbg("[chan_frame] [chan:%u] not open, [cmd:%u] dropped", p.chan, p.cmd);
+        return 0;
+    }
+
+    int ret = 0;
+    if (ch->msg_eof) {
+        log_err(0, "[chan:%u] got msg after CMD_EOF", ch->id);
+    } else if (p.cmd == CMD_CHUNK && ch->file == OPEN_F_PUT) {
+        int err = ch->failed ? 0 : xfer_recv(ch->file_fd, ch->next, p.payload, p.size);
+        if (err) {
+            // the master stops sending and closes the channel
+            ch->failed = 1;
+            (void)xfer_error(&ctx.stream, ch->id, "write: %s\n", strerror(err));
+        }
+    } else if (p.cmd == CMD_EOF && ch->file) {
+        chan_file_eof(ctx, ch);
+    } else if (p.cmd == CMD_DATA) {
+        chan_queue(ctx, ch, p.payload, p.size);
+    } else if (p.cmd == CMD_EOF) {
+        log_dbg("[chan_frame] [chan:%u] EOF msg received", ch->id);
+        if (!ch->no_tty) {
+            // ctrl+d
+            chan_queue(ctx, ch, "\x04", 1);
+        }
+        // chan_writer() closes child_in once the input is written
+        pthread_mutex_lock(&ctx.mu);
+        ch->in_eof = 1;
+        pthread_cond_signal(&ch->cond);
+        pthread_mutex_unlock(&ctx.mu);
+        ch->msg_eof = 1;
+    } else if (p.cmd == CMD_WS) {
+        struct winsize ws = {};
+        if (p.size >= 4 && !ch->no_tty) {
+            ws.ws_row = (uint16_t)p.payload[0] | ((uint16_t)p.payload[1] << 8);
+            ws.ws_col = (uint16_t)p.payload[2] | ((uint16_t)p.payload[3] << 8);
+            if (ioctl(ch->pty_fd, TIOCSWINSZ, &ws) == -1) {
+                log_err(errno, "[chan:%u] ioctl(fd, TIOCSWINSZ, &ws)", ch->id);
+            }
+            (void)kill(ch->pid, SIGWINCH);
+        }
+    } else {
+        log_err(0, "Unknown cmd: %u", p.cmd);
+        ret = -1;
+    }
+    chan_put(ch);
+    return ret;
+}
+
+// pings the master every --ping, dumps the histogram on SIGUSR1
+static void *stats(void *user) {
+    Context &ctx = *(Context *)user;
+    sigset_t sigset;
+    sigemptyset(&sigset);
+    sigaddset(&sigset, SIGUSR1);
+    struct timespec ts = {(time_t)(ctx.ping_us / 1000000), (long)(ctx.ping_us % 1000000) * 1000};
+    while (1) {
+        int sig = ctx.ping_us ? sigtimedwait(&sigset, NULL, &ts) : sigwaitinfo(&sigset, NULL);
+        if (sig == SIGUSR1) {
+            log_latency(ctx);
+        } else if (sig < 0 && errno == EAGAIN && __atomic_load_n(&ctx.ping, __ATOMIC_RELAXED)) {
+            (void)send_ping(&ctx.stream, 0, monotonic_us());
+        }
+    }
+    return NULL;
+}
+
+// single threaded engine: the transport and the pty (or pipes) in one epoll loop
+static int run_epoll(Context &ctx) {
+    // stop reading a side while this much is waiting for the other
+    const size_t k_high_water = 256 * 1024;
+
+    WriteQueue twq;
+    twq.fd = ctx.stream.wfd;
+    twq.stats = &ctx.stream.stats.tx;
+    ctx.stream.wq = &twq;
+    ctx.local_wq.fd = ctx.no_tty ? ctx.child_in : ctx.pty_fd;
+
+    // sources of output, CMD_DATA first
+    const size_t k_max_src = 2;
+    EvFd ev_src[k_max_src];
+    uint8_t src_cmd[k_max_src] = {CMD_DATA, CMD_ERR};
+    size_t src_count = 0;
+    if (ctx.no_tty) {
+        ev_src[0].fd = ctx.child_out;
+        ev_src[1].fd = ctx.child_err;
+        src_count = 2;
+    } else {
+        ev_src[0].fd = ctx.pty_fd;
+        src_count = 1;
+    }
+    int src_done[k_max_src] = {0, 0};
+
+    EvFd ev_rfd;
+    ev_rfd.fd = ctx.stream.rfd;
+    EvFd ev_wfd;
+    ev_wfd.fd = ctx.stream.wfd;
+    // child_in is write only, the pty shares its EvFd with the source
+    EvFd ev_child_in;
+    ev_child_in.fd = ctx.child_in;
+    EvFd &ev_local = ctx.no_tty ? ev_child_in : ev_src[0];
+    // sigusr1 is blocked since main()
+    sigset_t sigset;
+    sigemptyset(&sigset);
+    sigaddset(&sigset, SIGUSR1);
+    EvFd ev_sig;
+    ev_sig.fd = signalfd(-1, &sigset, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (ev_sig.fd < 0) {
+        log_err(errno, "signalfd(SIGUSR1)");
+        return -1;
+    }
+
+    int fds[] = {ctx.stream.rfd, ctx.stream.wfd, ctx.pty_fd, ctx.child_in, ctx.child_out, ctx.child_err};
+    for (int fd : fds) {
+        if (fd >= 0 && 0 != fd_set_nonblock(fd, NULL)) {
+            log_err(errno, "fd_set_nonblock(%d)", fd);
+            return -1;
+        }
+    }
+
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0 || 0 != ev_update(epfd, ev_sig, EPOLLIN)) {
+        log_err(errno, "epoll_create1()");
+        (void)close(ev_sig.fd);
+        return -1;
+    }
+
+    int ret = 0;
+    int transport_done = 0;
+    uint64_t ping_at = monotonic_us() + ctx.ping_us;
+    int local_eof_sent = 0;
+    Parser p;
+    Batch batch;
+    batch.deadline_us = ctx.coalesce_us;
+    batch.stats = &ctx.batch_stats;
+    uint64_t screen_next_at = 0;
+    // the screen model reads here instead of into the batch
+    uint8_t *screen_buf = ctx.screen ? (uint8_t *)malloc(ctx.stream.bufs.io) : NULL;
+    if (ctx.screen && !screen_buf) {
+        log_err(errno, "[run_epoll] out of memory");
+        ctx.r2l = ret = -1;
+        goto L_RETURN;
+    }
+    while (1) {
+        // all output forwarded
+        size_t done_count = 0;
+        for (size_t i = 0; i < src_count; ++i) {
+            done_count += src_done[i];
+        }
+        if (done_count == src_count) {
+            break;
+        }
+
+        // CMD_EOF, after queued input is written
+        if (ctx.msg_eof && !local_eof_sent && wq_pending(ctx.local_wq) == 0) {
+            local_eof_sent = 1;
+            if (ctx.no_tty) {
+                (void)ev_update(epfd, ev_child_in, 0);
+                (void)close(ctx.child_in);
+                ctx.child_in = ctx.local_wq.fd = -1;
+            } else {
+                // ctrl+d
+                // NOTE: not working if sending EOF too early
+                (void)wq_write(ctx.local_wq, "\x04", 1);
+            }
+        }
+        if (ctx.msg_eof || p.eof) {
+            transport_done = 1;
+        }
+
+        // screen updates wait for the transport to drain
+        int64_t screen_timeout = -1;
+        if (ctx.screen && ctx.term.dirty && wq_pending(twq) == 0) {
+            uint64_t now = monotonic_us();
+            if (now >= screen_next_at) {
+                pthread_mutex_lock(&ctx.term_mu);
+                int err = send_screen(ctx);
+                pthread_mutex_unlock(&ctx.term_mu);
+                if (err) {
+                    ctx.r2l = ret = -1;
+                    goto L_RETURN;
+                }
+                screen_next_at = now + k_screen_frame_us;
+            } else {
+                screen_timeout = (int64_t)(screen_next_at - now);
+            }
+        }
+
+        // interests
+        int want_transport = !transport_done && wq_pending(ctx.local_wq) < k_high_water;
+        int want_src = wq_pending(twq) < k_high_water;
+        uint32_t local_out = wq_pending(ctx.local_wq) ? (uint32_t)EPOLLOUT : 0;
+        int err = 0;
+        err |= ev_update(epfd, ev_rfd, want_transport ? (uint32_t)EPOLLIN : 0);
+        err |= ev_update(epfd, ev_wfd, wq_pending(twq) ? (uint32_t)EPOLLOUT : 0);
+        for (size_t i = 0; i < src_count; ++i) {
+            uint32_t events = want_src && !src_done[i] ? (uint32_t)EPOLLIN : 0;
+            if (&ev_src[i] == &ev_local) {
+                events |= local_out;
+            }
+            err |= ev_update(epfd, ev_src[i], events);
+        }
+        if (ctx.no_tty && ctx.child_in >= 0) {
+            err |= ev_update(epfd, ev_child_in, local_out);
+        }
+        if (err) {
+            log_err(errno, "epoll_ctl()");
+            ret = -1;
+            break;
+        }
+
+        // epoll_wait() has ms resolution, the deadline is rounded up
+        int64_t timeout = batch_timeout(batch, monotonic_us());
+        if (timeout == 0) {
+            if (0 != (ctx.r2l = batch_flush(batch, &ctx.stream, &batch.stats->flush_deadline))) {
+                ret = -1;
+                goto L_RETURN;
+            }
+            timeout = -1;
+        }
+        if (screen_timeout >= 0 && (timeout < 0 || screen_timeout < timeout)) {
+            timeout = screen_timeout;
+        }
+        if (ctx.ping_us && ctx.ping && !transport_done) {
+            uint64_t now = monotonic_us();
+            if (now >= ping_at) {
+                (void)send_ping(&ctx.stream, 0, now);
+                ping_at = now + ctx.ping_us;
+            }
+            int64_t ping_timeout = (int64_t)(ping_at - now);
+            if (timeout < 0 || ping_timeout < timeout) {
+                timeout = ping_timeout;
+            }
+        }
+        struct epoll_event events[8];
+        int n = epoll_wait(epfd, events, 8, timeout < 0 ? -1 : (int)((timeout + 999) / 1000));
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            log_err(errno, "epoll_wait()");
+            ret = -1;
+            break;
+        }
+
+        for (int i = 0; i < n; ++i) {
+            int fd = events[i].data.fd;
+            uint32_t revents = events[i].events;
+
+            if (fd == ev_sig.fd) {
+                struct signalfd_siginfo si;
+                while (read(ev_sig.fd, &si, sizeof(si)) == sizeof(si)) {
+                    log_latency(ctx);
+                }
+                continue;
+            }
+
+            // stdin --> pty
+            if (fd == ev_rfd.fd && (revents & (EPOLLIN | EPOLLHUP | EPOLLERR)) && !transport_done) {
+                if (0 != (ctx.l2r = feed_frame(p, &ctx.stream, frame_cb, &ctx))) {
+                    transport_done = 1;
+                }
+            }
+            if (fd == ev_wfd.fd && (revents & (EPOLLOUT | EPOLLERR))) {
+                if (0 != wq_flush(twq)) {
+                    ctx.r2l = ret = -1;
+                    goto L_RETURN;
+                }
+            }
+            if (fd == ctx.local_wq.fd && (revents & (EPOLLOUT | EPOLLERR))) {
+                if (0 != wq_flush(ctx.local_wq)) {
+                    ctx.l2r = -1;
+                    transport_done = 1;
+                }
+            }
+
+            // pty --> stdout
+            for (size_t k = 0; k < src_count; ++k) {
+                if (fd != ev_src[k].fd || src_done[k] || !(revents & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+                    continue;
+                }
+                size_t avail = ctx.stream.bufs.io;
+                char *buf = (char *)screen_buf;
+                if (!ctx.screen && !(buf = batch_reserve(batch, &ctx.stream, &avail))) {
+                    ctx.r2l = ret = -1;
+                    goto L_RETURN;
+                }
+                ssize_t nread = TEMP_FAILURE_RETRY(read(fd, buf, avail));
+                if (nread < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                    continue;
+                }
+                if (nread < 0 && !(errno == EIO && !ctx.no_tty)) {
+                    log_err(errno, "read(fd)");
+                    ctx.r2l = -1;
+                }
+                if (nread <= 0) {
+                    // EIO: pty closed by the child
+                    src_done[k] = 1;
+                    (void)ev_update(epfd, ev_src[k], 0);
+                    continue;
+                }
+                if (ctx.screen) {
+                    if (0 != feed_screen(ctx, screen_buf, (size_t)nread)) {
+                        ctx.l2r = -1;
+                        transport_done = 1;
+                    }
+                    continue;
+                }
+                if (0 != (ctx.r2l = batch_commit(batch, &ctx.stream, src_cmd[k], nread, monotonic_us()))) {
+                    ret = -1;
+                    goto L_RETURN;
+                }
+            }
+        }
+    }
+
+    // eof
+    (void)batch_flush(batch, &ctx.stream, &batch.stats->flush_other);
+    if (ctx.screen && ctx.term.dirty) {
+        pthread_mutex_lock(&ctx.term_mu);
+        (void)send_screen(ctx);
+        pthread_mutex_unlock(&ctx.term_mu);
+    }
+    (void)send_eof(&ctx.stream);
+    (void)wq_drain(twq);
+
+L_RETURN:
+    free(screen_buf);
+    log_batch(batch, "run_epoll");
+    ctx.stream.wq = NULL;
+    wq_free(twq);
+    (void)close(epfd);
+    (void)close(ev_sig.fd);
+    log_dbg("[run_epoll] [ret:%d] [l2r:%d][r2l:%d]", ret, ctx.l2r, ctx.r2l);
+    return ctx.l2r ? ctx.l2r : ctx.r2l ? ctx.r2l : ret;
+}
+
+// --uring: the transport as the ring read it, feed_frame() gets it from
+// the read_cb
+struct UringRx {
+    const uint8_t *buf = NULL;
+    size_t len = 0;
+    size_t pos = 0;
+    int eof = 0;
+    int busy = 0;
+};
+
+static ssize_t uring_rx_read(void *user, void *buf, size_t len) {
+    UringRx &rx = *(UringRx *)user;
+    if (rx.pos == rx.len) {
+        if (rx.eof) {
+            return 0;
+        }
+        errno = EAGAIN;
+        return -1;
+    }
+    size_t n = rx.len - rx.pos < len ? rx.len - rx.pos : len;
+    memcpy(buf, rx.buf + rx.pos, n);
+    rx.pos += n;
+    return (ssize_t)n;
+}
+
+// completions, by user data; sources come first
+enum {
+    URING_SRC = 0,
+    URING_RX = 2,
+    URING_TX,
+    URING_LOCAL,
+    URING_SIG,
+};
+
+// The event loop of run_epoll() with io_uring: reads of the sources and
+// the transport and writes to both are requests in one ring, submitted
+// together with the wait for their completions. Output frames queue up
+// while a transport write is in flight and go out with the next one.
+static int run_uring(Context &ctx) {
+    // stop reading a side while this much is waiting for the other
+    const size_t k_high_water = 256 * 1024;
+
+    Uring ring;
+    if (0 != uring_open(ring, 16)) {
+        log_err(errno, "io_uring_setup(), --uring falls back to --epoll");
+        return run_epoll(ctx);
+    }
+    // sources are framed in place, pinned while the ring reads into them
+    const size_t k_src_size = FRAME_HEADROOM + ctx.stream.bufs.io;
+    const size_t k_rx_size = ctx.stream.bufs.io;
+    uint8_t *store = (uint8_t *)malloc(2 * k_src_size + k_rx_size);
+    if (!store) {
+        log_err(errno, "[run_uring] out of memory");
+        uring_close(ring);
+        return -1;
+    }
+    uint8_t *src_buf[2] = {store, store + k_src_size};
+    uint8_t *rx_buf = store + 2 * k_src_size;
+    struct iovec iov[] = {
+        {src_buf[0], k_src_size},
+        {src_buf[1], k_src_size},
+        {rx_buf, k_rx_size},
+    };
+    int fixed = 0 == uring_register(ring, iov, 3);
+    if (!fixed) {
+        log_dbg("[run_uring] buffers not registered [errno:%d]", errno);
+    }
+
+    WriteQueue twq;
+    twq.fd = ctx.stream.wfd;
+    twq.stats = &ctx.stream.stats.tx;
+    twq.defer = 1;
+    ctx.stream.wq = &twq;
+    UringOut tx;
+    tx.wq = &twq;
+    tx.data = URING_TX;
+    ctx.local_wq.fd = ctx.no_tty ? ctx.child_in : ctx.pty_fd;
+    ctx.local_wq.defer = 1;
+    UringOut local;
+    local.wq = &ctx.local_wq;
+    local.data = URING_LOCAL;
+    UringRx rx;
+    rx.buf = rx_buf;
+    ctx.stream.read_cb = &uring_rx_read;
+    ctx.stream.read_user = &rx;
+
+    // sources of output, CMD_DATA first
+    const size_t k_max_src = 2;
+    int src_fd[k_max_src] = {ctx.pty_fd, -1};
+    uint8_t src_cmd[k_max_src] = {CMD_DATA, CMD_ERR};
+    size_t src_count = 1;
+    if (ctx.no_tty) {
+        src_fd[0] = ctx.child_out;
+        src_fd[1] = ctx.child_err;
+        src_count = 2;
+    }
+    int src_done[k_max_src] = {0, 0};
+    int src_busy[k_max_src] = {0, 0};
+
+    // sigusr1 is blocked since main(), the fd is left blocking for the ring
+    sigset_t sigset;
+    sigemptyset(&sigset);
+    sigaddset(&sigset, SIGUSR1);
+    int sig_fd = signalfd(-1, &sigset, SFD_CLOEXEC);
+    if (sig_fd < 0) {
+        log_err(errno, "signalfd(SIGUSR1)");
+        uring_close(ring);
+        return -1;
+    }
+    struct signalfd_siginfo si;
+    int sig_busy = 0;
+
+    int ret = 0;
+    int transport_done = 0;
+    uint64_t ping_at = monotonic_us() + ctx.ping_us;
+    int local_eof_sent = 0;
+    Parser p;
+    while (1) {
+        // all output forwarded
+        size_t done_count = 0;
+        for (size_t i = 0; i < src_count; ++i) {
+            done_count += src_done[i];
+        }
+        if (done_count == src_count) {
+            break;
+        }
+
+        // CMD_EOF, after queued input is written
+        if (ctx.msg_eof && !local_eof_sent && uring_out_pending(local) == 0) {
+            local_eof_sent = 1;
+            if (ctx.no_tty) {
+                (void)close(ctx.child_in);
+                ctx.child_in = ctx.local_wq.fd = -1;
+            } else {
+                // ctrl+d
+                // NOTE: not working if sending EOF too early
+                (void)wq_write(ctx.local_wq, "\x04", 1);
+            }
+        }
+        if (ctx.msg_eof || p.eof) {
+            transport_done = 1;
+        }
+
+        // requests
+        int err = 0;
+        if (!transport_done && !rx.busy && rx.pos == rx.len && uring_out_pending(local) < k_high_water) {
+            err |= fixed
+                ? uring_read_fixed(ring, ctx.stream.rfd, rx_buf, k_rx_size, 2, URING_RX)
+                : uring_read(ring, ctx.stream.rfd, rx_buf, k_rx_size, URING_RX);
+            rx.busy = 1;
+        }
+        for (size_t k = 0; k < src_count; ++k) {
+            if (src_done[k] || src_busy[k] || uring_out_pending(tx) >= k_high_water) {
+                continue;
+            }
+            size_t max_payload = stream_max_payload(&ctx.stream);
+            size_t len = max_payload < ctx.stream.bufs.io ? max_payload : ctx.stream.bufs.io;
+            uint8_t *buf = &src_buf[k][FRAME_HEADROOM];
+            err |= fixed
+                ? uring_read_fixed(ring, src_fd[k], buf, len, (unsigned)k, URING_SRC + k)
+                : uring_read(ring, src_fd[k], buf, len, URING_SRC + k);
+            src_busy[k] = 1;
+        }
+        if (!sig_busy) {
+            err |= uring_read(ring, sig_fd, &si, sizeof(si), URING_SIG);
+            sig_busy = 1;
+        }
+        err |= uring_out_kick(ring, tx);
+        if (ctx.local_wq.fd >= 0) {
+            err |= uring_out_kick(ring, local);
+        }
+        if (err) {
+            ret = -1;
+            break;
+        }
+
+        int64_t timeout = -1;
+        if (ctx.ping_us && ctx.ping && !transport_done) {
+            uint64_t now = monotonic_us();
+            if (now >= ping_at) {
+                (void)send_ping(&ctx.stream, 0, now);
+                (void)uring_out_kick(ring, tx);
+                ping_at = now + ctx.ping_us;
+            }
+            timeout = (int64_t)(ping_at - now);
+        }
+        if (0 != uring_wait(ring, timeout)) {
+            ret = -1;
+            break;
+        }
+
+        uint64_t data = 0;
+        int32_t res = 0;
+        while (uring_pop(ring, &data, &res)) {
+            if (data == URING_SIG) {
+                sig_busy = 0;
+                if (res == (int32_t)sizeof(si)) {
+                    log_latency(ctx);
+                }
+                continue;
+            }
+            if (data == URING_TX) {
+                if (0 != uring_out_done(ring, tx, res)) {
+                    ctx.r2l = ret = -1;
+                    goto L_RETURN;
+                }
+                continue;
+            }
+            if (data == URING_LOCAL) {
+                if (0 != uring_out_done(ring, local, res)) {
+                    ctx.l2r = -1;
+                    transport_done = 1;
+                }
+                continue;
+            }
+
+            // stdin --> pty
+            if (data == URING_RX) {
+                rx.busy = 0;
+                trace(TR_READ, (uint32_t)ctx.stream.rfd, (uint64_t)(int64_t)res, res < 0 ? -res : 0);
+                if (transport_done || res == -EINTR || res == -EAGAIN) {
+                    continue;
+                }
+                if (res < 0) {
+                    log_err(-res, "read(stdin)");
+                    ctx.l2r = -1;
+                    transport_done = 1;
+                    continue;
+                }
+                rx.pos = 0;
+                rx.len = (size_t)res;
+                rx.eof = res == 0;
+                while (!p.eof && (rx.pos < rx.len || rx.eof)) {
+                    if (0 != (ctx.l2r = feed_frame(p, &ctx.stream, frame_cb, &ctx))) {
+                        transport_done = 1;
+                        break;
+                    }
+                }
+                continue;
+            }
+
+            // pty --> stdout
+            size_t k = data - URING_SRC;
+            assert(k < src_count);
+            src_busy[k] = 0;
+            trace(TR_READ, (uint32_t)src_fd[k], (uint64_t)(int64_t)res, res < 0 ? -res : 0);
+            if (res == -EINTR || res == -EAGAIN) {
+                continue;
+            }
+            if (res < 0 && !(res == -EIO && !ctx.no_tty)) {
+                log_err(-res, "read(fd)");
+                ctx.r2l = -1;
+            }
+            if (res <= 0) {
+                // EIO: pty closed by the child
+                src_done[k] = 1;
+                continue;
+            }
+            if (0 != (ctx.r2l = send_payload(&ctx.stream, src_cmd[k], (char *)&src_buf[k][FRAME_HEADROOM], (size_t)res))) {
+                ret = -1;
+                goto L_RETURN;
+            }
+        }
+    }
+
+    // eof, the other requests are dropped with the ring
+    (void)send_eof(&ctx.stream);
+    while (ret == 0 && uring_out_pending(tx) > 0) {
+        if (0 != uring_out_kick(ring, tx) || 0 != uring_wait(ring, -1)) {
+            break;
+        }
+        uint64_t data = 0;
+        int32_t res = 0;
+        while (uring_pop(ring, &data, &res)) {
+            if (data == URING_TX && 0 != uring_out_done(ring, tx, res)) {
+                ret = -1;
+                break;
+            }
+        }
+    }
+
+L_RETURN:
+    log_dbg("[run_uring] [enters:%llu] [submitted:%llu] [completed:%llu]",
+        (unsigned long long)ring.enters, (unsigned long long)ring.submitted, (unsigned long long)ring.completed);
+    // cancels what is in flight before the buffers go
+    uring_close(ring);
+    free(store);
+    ctx.stream.wq = NULL;
+    ctx.stream.read_cb = NULL;
+    uring_out_free(tx);
+    uring_out_free(local);
+    wq_free(twq);
+    (void)close(sig_fd);
+    log_dbg("[run_uring] [ret:%d] [l2r:%d][r2l:%d]", ret, ctx.l2r, ctx.r2l);
+    return ctx.l2r ? ctx.l2r : ctx.r2l ? ctx.r2l : ret;
+}
+
+// --persist: pty --> ring, also while no master is attached
+static void *persist_read(void *user) {
+    Context &ctx = *(Context *)user;
+    uint8_t *buf = (uint8_t *)malloc(ctx.stream.bufs.io);
+    if (!buf) {
+        log_err(errno, "[persist_read] out of memory");
+    }
+    while (buf) {
+        ssize_t nread = TEMP_FAILURE_RETRY(read(ctx.pty_fd, buf, ctx.stream.bufs.io));
+        if (nread <= 0) {
+            // EIO: pty closed by the child
+            break;
+        }
+        pthread_mutex_lock(&ctx.mu);
+        ring_append(ctx.ring, buf, (size_t)nread);
+        pthread_cond_broadcast(&ctx.cond);
+        pthread_mutex_unlock(&ctx.mu);
+    }
+    free(buf);
+
+    pthread_mutex_lock(&ctx.mu);
+    ctx.child_done = 1;
+    pthread_cond_broadcast(&ctx.cond);
+    pthread_mutex_unlock(&ctx.mu);
+    return NULL;
+}
+
+// --persist: ring --> the attached master, from where it left off. What
+// piles up while a write blocks goes out in one frame.
+static void *persist_send(void *user) {
+    Context &ctx = *(Context *)user;
+    char *bufstore = (char *)malloc(FRAME_HEADROOM + ctx.stream.bufs.io);
+    if (!bufstore) {
+        log_err(errno, "[persist_send] out of memory");
+    }
+    char *buf = bufstore ? &bufstore[FRAME_HEADROOM] : NULL;
+    pthread_mutex_lock(&ctx.mu);
+    while (bufstore) {
+        int ready = ctx.conn_fd >= 0 && ctx.replay_ready;
+        if (!ready || (ctx.sent == ctx.ring.end && !ctx.child_done)) {
+            pthread_cond_wait(&ctx.cond, &ctx.mu);
+            continue;
+        }
+        if (ctx.sent < ring_start(ctx.ring)) {
+            log_err(0, "[persist_send] %llu bytes of output are gone",
+                (unsigned long long)(ring_start(ctx.ring) - ctx.sent));
+            ctx.sent = ring_start(ctx.ring);
+        }
+
+        const uint8_t *data = NULL;
+        size_t len = ring_peek(ctx.ring, ctx.sent, &data);
+        size_t max_payload = stream_max_payload(&ctx.stream);
+        len = len < max_payload ? len : max_payload;
+        len = len < ctx.stream.bufs.io ? len : ctx.stream.bufs.io;
+        memcpy(buf, data, len);
+        ctx.conn_busy = 1;
+        pthread_mutex_unlock(&ctx.mu);
+        // everything is delivered once the child is gone
+        int err = len ? send_payload(&ctx.stream, CMD_DATA, buf, len) : send_eof(&ctx.stream);
+        pthread_mutex_lock(&ctx.mu);
+        ctx.conn_busy = 0;
+        pthread_cond_broadcast(&ctx.cond);
+        if (err) {
+            // the reader detaches
+            (void)shutdown(ctx.conn_fd, SHUT_RDWR);
+            ctx.replay_ready = 0;
+            continue;
+        }
+        if (len == 0) {
+            break;
+        }
+        ctx.sent += len;
+    }
+    ctx.exit_flag |= 2;
+    pthread_mutex_unlock(&ctx.mu);
+    free(bufstore);
+    // ends persist_serve()
+    (void)shutdown(ctx.persist_fd, SHUT_RDWR);
+    return NULL;
+}
+
+// --persist: the attached master --> pty
+static void *persist_recv(void *user) {
+    Context &ctx = *(Context *)user;
+    Parser p;
+    int ret = 0;
+    while (!p.eof && 0 == (ret = feed_frame(p, &ctx.stream, frame_cb, &ctx))) {}
+    log_dbg("[persist_recv] detached [ret:%d]", ret);
+
+    pthread_mutex_lock(&ctx.mu);
+    (void)shutdown(ctx.conn_fd, SHUT_RDWR);
+    while (ctx.conn_busy) {
+        pthread_cond_wait(&ctx.cond, &ctx.mu);
+    }
+    (void)close(ctx.conn_fd);
+    ctx.conn_fd = -1;
+    ctx.replay_ready = 0;
+    pthread_cond_broadcast(&ctx.cond);
+    pthread_mutex_unlock(&ctx.mu);
+    return NULL;
+}
+
+// A relay connects for each transport, the last one to come takes over.
+static int persist_serve(Context &ctx) {
+    pthread_attr_t attr;
+    if (0 != thread_attr_init(&attr, 1)) {
+        return -1;
+    }
+    pthread_t thread_id;
+    if (0 != pthread_create(&thread_id, &attr, &persist_read, &ctx)
+        || 0 != pthread_create(&thread_id, &attr, &persist_send, &ctx))
+    {
+        log_err(errno, "pthread_create(persist)");
+        return -1;
+    }
+
+    while (1) {
+        int fd = TEMP_FAILURE_RETRY(accept4(ctx.persist_fd, NULL, NULL, SOCK_CLOEXEC));
+        if (fd < 0) {
+            // EINVAL: shut down by persist_send(), the session is over
+            if (errno != EINVAL) {
+                log_err(errno, "accept(persist)");
+                return -1;
+            }
+            break;
+        }
+        // [flags] from the relay: its transport is base64 (1) or escaped
+        // (2), then the bytes it escapes
+        uint8_t flags = 0;
+        EscapeSet escape = {};
+        if (TEMP_FAILURE_RETRY(read(fd, &flags, 1)) != 1
+            || ((flags & 2) && TEMP_FAILURE_RETRY(recv(fd, &escape, sizeof(escape), MSG_WAITALL)) != (ssize_t)sizeof(escape)))
+        {
+            (void)close(fd);
+            continue;
+        }
+
+        pthread_mutex_lock(&ctx.mu);
+        if (ctx.conn_fd >= 0) {
+            // the old transport may just not know yet that it is dead
+            log_dbg("[persist_serve] taking over from [fd:%d]", ctx.conn_fd);
+            (void)shutdown(ctx.conn_fd, SHUT_RDWR);
+        }
+        while (ctx.conn_fd >= 0) {
+            pthread_cond_wait(&ctx.cond, &ctx.mu);
+        }
+        stream_reset(&ctx.stream, fd, fd);
+        ctx.escape = escape;
+        stream_set_codec(&ctx.stream, flags & 1, flags & 2 ? &ctx.escape : NULL);
+        ctx.hello_done = 0;
+        ctx.resume = 0;
+        ctx.msg_eof = 0;
+        ctx.conn_fd = fd;
+        pthread_mutex_unlock(&ctx.mu);
+        log_dbg("[persist_serve] attached [fd:%d]", fd);
+
+        if (0 != pthread_create(&thread_id, &attr, &persist_recv, &ctx)) {
+            log_err(errno, "pthread_create(&thread_id, &attr, &persist_recv, &ctx)");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// the transport <--> the session socket, until either side closes
+static int persist_relay(int fd, int base64, const EscapeSet *escape, int greeting) {
+    if (isatty(STDIN_FILENO)) {
+        // prevent echoing
+        (void)tty_set_raw(STDIN_FILENO, NULL);
+    }
+    uint8_t head[1 + sizeof(EscapeSet)] = {(uint8_t)((base64 ? 1 : 0) | (escape ? 2 : 0))};
+    size_t head_len = 1;
+    if (escape) {
+        memcpy(&head[1], escape, sizeof(EscapeSet));
+        head_len += sizeof(EscapeSet);
+    }
+    if (write_full(fd, head, head_len) != (ssize_t)head_len) {
+        log_err(errno, "write(persist)");
+        return -1;
+    }
+    if (greeting) {
+        const char *k_greeting = "PTY_SLAVE_GREETING";
+        (void)write(STDOUT_FILENO, k_greeting, strlen(k_greeting));
+    }
+
+    // no stream here, the size is the command line's
+    char *buf = (char *)malloc(g_bufs.io);
+    if (!buf) {
+        log_err(errno, "[persist_relay] out of memory");
+        return -1;
+    }
+    struct pollfd pfd[2] = {{STDIN_FILENO, POLLIN, 0}, {fd, POLLIN, 0}};
+    int out[2] = {fd, STDOUT_FILENO};
+    int ret = 1;
+    while (ret > 0) {
+        if (TEMP_FAILURE_RETRY(poll(pfd, 2, -1)) < 0) {
+            log_err(errno, "poll(relay)");
+            ret = -1;
+            break;
+        }
+        for (int i = 0; i < 2 && ret > 0; ++i) {
+            if (!pfd[i].revents) {
+                continue;
+            }
+            ssize_t nread = TEMP_FAILURE_RETRY(read(pfd[i].fd, buf, g_bufs.io));
+            if (nread <= 0 || write_full(out[i], buf, (size_t)nread) != nread) {
+                ret = 0;
+            }
+        }
+    }
+    free(buf);
+    return ret;
+}
+
+static int persist_addr(const char *path, struct sockaddr_un &addr) {
+    addr = {};
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        log_err(0, "persist path too long: %s", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    return 0;
+}
+
+// --persist=PATH: the session runs in a daemon listening on PATH, started by
+// the first slave; every slave relays its transport to it
+static int run_persist(
+    Context &ctx, const char *path, const char *replay_file, size_t replay_size,
+    char *const *cmd_argv, int base64, const EscapeSet *escape, int greeting)
+{
+    struct sockaddr_un addr;
+    if (0 != persist_addr(path, addr)) {
+        return -1;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        log_err(errno, "socket(AF_UNIX)");
+        return -1;
+    }
+    if (0 == connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+        return persist_relay(fd, base64, escape, greeting);
+    }
+    if (errno == ECONNREFUSED) {
+        // left by a session that is gone
+        (void)unlink(path);
+    } else if (errno != ENOENT) {
+        log_err(errno, "connect(%s)", path);
+        return -1;
+    }
+
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0) {
+        log_err(errno, "socket(AF_UNIX)");
+        return -1;
+    }
+    if (0 != bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) || 0 != listen(listen_fd, 4)) {
+        log_err(errno, "bind(%s)", path);
+        return -1;
+    }
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        log_err(errno, "fork()");
+        return -1;
+    }
+    if (pid > 0) {
+        (void)close(listen_fd);
+        if (0 != connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+            log_err(errno, "connect(%s)", path);
+            return -1;
+        }
+        return persist_relay(fd, base64, escape, greeting);
+    }
+
+    // daemon, off the transport's session and fds
+    (void)close(fd);
+    (void)setsid();
+    int null_fd = open("/dev/null", O_RDWR);
+    if (null_fd >= 0) {
+        (void)dup2(null_fd, STDIN_FILENO);
+        (void)dup2(null_fd, STDOUT_FILENO);
+        (void)dup2(null_fd, STDERR_FILENO);
+        if (null_fd > STDERR_FILENO) {
+            (void)close(null_fd);
+        }
+    }
+    (void)signal(SIGPIPE, SIG_IGN);
+
+    int err = 0;
+    if (0 != ring_open(ctx.ring, replay_size, replay_file)) {
+        err = -1;
+        goto L_RETURN;
+    }
+    if (0 != (err = pty_fork(ctx.pid, ctx.pty_fd, NULL, NULL))) {
+        log_err(err, "pty_fork()");
+        goto L_RETURN;
+    }
+    if (ctx.pid == 0) {
+        // child
+        (void)execvp(cmd_argv[0], cmd_argv);
+        log_err(errno, "execvp()");
+        _exit(127);
+    }
+    (void)fd_set_cloexec(ctx.pty_fd);
+    ctx.persist = 1;
+    ctx.persist_fd = listen_fd;
+    // the counters of every transport the session had
+    if (ctx.stats.path && 0 != stats_listen(ctx.stats)) {
+        err = -1;
+        goto L_RETURN;
+    }
+    err = persist_serve(ctx);
+
+L_RETURN:
+    stats_stop(ctx.stats);
+    (void)unlink(path);
+    (void)close(listen_fd);
+    return err;
+}
+
+int main(int argc, char *const *argv) {
+    trace_init();
+
+    // parse args
+    int arg_base64 = 0;
+    const char *arg_escape = NULL;
+    int arg_greeting = 0;
+    int arg_no_tty = 0;
+    int arg_epoll = 0;
+    int arg_uring = 0;
+    int arg_no_compress = 0;
+    int arg_screen = 0;
+    int arg_low_mem = 0;
+    size_t arg_io_size = 0;
+    size_t arg_max_frame = 0;
+    const char *arg_persist = NULL;
+    const char *arg_replay_file = NULL;
+    const char *arg_stats = NULL;
+    size_t arg_replay_size = k_replay_size;
+    uint64_t arg_coalesce_us = 0;
+    size_t arg_pipeline = 0;
+    int arg_latency = 0;
+    uint64_t arg_ping_us = 0;
+    int arg_proto = PROTO_VERSION;
+    struct option long_options[] = {
+        /* These options set a flag. */
+        {"base64", no_argument, &arg_base64, 1},
+        {"greeting", no_argument, &arg_greeting, 1},
+        {"no-tty", no_argument, &arg_no_tty, 1},
+        {"epoll", no_argument, &arg_epoll, 1},
+        /* the event loop with io_uring, --epoll where there is none */
+        {"uring", no_argument, &arg_uring, 1},
+        /* instead of --base64, escape only the bytes the transport mangles,
+           hex, e.g. --escape=00,03,0d */
+        {"escape", optional_argument, NULL, 'e'},
+        /* refuse the compression offered by the master */
+        {"no-compress", no_argument, &arg_no_compress, 1},
+        /* small buffers and stacks, no compression; a --no-tty session
+           stays within 1 MB of RSS */
+        {"low-mem", no_argument, &arg_low_mem, 1},
+        /* largest read sent as one frame, in bytes */
+        {"io-size", required_argument, NULL, 'z'},
+        /* largest frame the master may send, in bytes, told in the hello */
+        {"max-frame", required_argument, NULL, 'm'},
+        /* send screen updates instead of the raw pty output */
+        {"screen", no_argument, &arg_screen, 1},
+        /* log the ping histogram at exit, SIGUSR1 does any time */
+        {"latency", no_argument, &arg_latency, 1},
+        /* measure the round trip to the master every SEC seconds */
+        {"ping", required_argument, NULL, 'i'},
+        /* serve the counters on a unix socket at PATH */
+        {"stats", required_argument, NULL, 's'},
+        /* gather output for up to USEC before sending it */
+        {"coalesce", required_argument, NULL, 'c'},
+        /* read output on while a thread writes it, with N buffers */
+        {"pipeline", optional_argument, NULL, 'L'},
+        /* highest protocol version to accept */
+        {"proto", required_argument, NULL, 'p'},
+        /* keep the session in a daemon on PATH, later slaves attach to it */
+        {"persist", required_argument, NULL, 'P'},
+        /* output kept for a master that reconnects, in bytes */
+        {"replay", required_argument, NULL, 'r'},
+        /* keep it in a file mapped from PATH instead of memory */
+        {"replay-file", required_argument, NULL, 'f'},
+        {0, 0, 0, 0}
+    };
+
+    int option_index = -1;
+    int opt = 0;
+    while (-1 != (opt = getopt_long(argc, argv, "", long_options, &option_index))) {
+        if (opt == 'c') {
+            arg_coalesce_us = strtoull(optarg, NULL, 10);
+        } else if (opt == 'e') {
+            arg_escape = optarg ? optarg : "";
+        } else if (opt == 'L') {
+            arg_pipeline = optarg ? strtoull(optarg, NULL, 10) : k_pipeline_buffers;
+        } else if (opt == 'p') {
+            arg_proto = atoi(optarg);
+        } else if (opt == 'P') {
+            arg_persist = optarg;
+        } else if (opt == 'r') {
+            arg_replay_size = strtoull(optarg, NULL, 10);
+        } else if (opt == 'f') {
+            arg_replay_file = optarg;
+        } else if (opt == 'i') {
+            arg_ping_us = (uint64_t)(atof(optarg) * 1000000);
+        } else if (opt == 's') {
+            arg_stats = optarg;
+        } else if (opt == 'z') {
+            arg_io_size = strtoull(optarg, NULL, 10);
+        } else if (opt == 'm') {
+            arg_max_frame = strtoull(optarg, NULL, 10);
+        }
+    }
+    if (arg_low_mem) {
+        bufs_low_mem(g_bufs);
+        g_thread_stack = k_thread_stack_low_mem;
+    }
+    if (arg_io_size) {
+        g_bufs.io = arg_io_size;
+    }
+    if (arg_max_frame) {
+        g_bufs.max_frame = arg_max_frame > UINT32_MAX ? UINT32_MAX : (uint32_t)arg_max_frame;
+    }
+    if (arg_proto < PROTO_V1 || arg_proto > PROTO_VERSION) {
+        log_err(0, "unsupported --proto=%d", arg_proto);
+        return 1;
+    }
+    if (arg_escape && arg_base64) {
+        log_err(0, "--escape and --base64 do not go together");
+        return 1;
+    }
+    if (arg_pipeline && (arg_epoll || arg_uring || arg_screen || arg_coalesce_us)) {
+        log_err(0, "--pipeline does not go with --epoll, --uring, --screen or --coalesce");
+        return 1;
+    }
+    if (arg_uring && (arg_epoll || arg_screen || arg_coalesce_us)) {
+        log_err(0, "--uring does not go with --epoll, --screen or --coalesce");
+        return 1;
+    }
+    if (arg_screen && arg_no_tty) {
+        log_err(0, "--screen needs a tty");
+        return 1;
+    }
+    if (arg_persist && (arg_no_tty || arg_epoll || arg_uring || arg_screen)) {
+        log_err(0, "--persist needs a tty and the threaded engine, without --screen");
+        return 1;
+    }
+    if (arg_persist && (arg_latency || arg_ping_us)) {
+        // only answers pings
+        log_err(0, "--persist runs without a stderr, --ping and --latency are off");
+        arg_latency = 0;
+        arg_ping_us = 0;
+    }
+    char *const cmd_argv_default[] = {(char *)"/bin/sh", NULL};
+    char *const *cmd_argv = argc > optind ? &argv[optind] : cmd_argv_default;
+
+    // fork
+    Context ctx;
+    stream_set_bufs(&ctx.stream, g_bufs);
+    // clamped, for what relays without a stream
+    g_bufs = ctx.stream.bufs;
+    esc_set_default(&ctx.escape);
+    if (arg_escape && *arg_escape && 0 != esc_set_parse(arg_escape, &ctx.escape)) {
+        log_err(0, "bad --escape=%s", arg_escape);
+        return 1;
+    }
+    ctx.no_tty = arg_no_tty;
+    ctx.coalesce_us = arg_coalesce_us;
+    ctx.pipeline = arg_pipeline;
+    ctx.proto = arg_proto;
+    ctx.cmd_argv = cmd_argv;
+    ctx.ping_us = arg_ping_us;
+    ctx.stats.path = arg_stats;
+    ctx.stats.dump = &stats_dump;
+    ctx.stats.user = &ctx;
+    ctx.fwd.first_chan = k_fwd_first_chan + k_fwd_chans;
+    if (arg_no_compress || arg_low_mem) {
+        // the encoder and decoder take 320 KB
+        ctx.hello_flags &= ~HELLO_F_LZ;
+    }
+    if (arg_epoll || arg_uring || arg_screen) {
+        // channels run on threads and send raw output
+        ctx.hello_flags &= ~(HELLO_F_MUX | HELLO_F_FILE | HELLO_F_FWD);
+    }
+    if (arg_epoll || arg_uring) {
+        // the loop queues output, it cannot wait for acks
+        ctx.hello_flags &= ~HELLO_F_REL;
+    }
+    if (arg_persist) {
+        // channels die with the transport, the persisted session does not
+        ctx.hello_flags &= ~(HELLO_F_MUX | HELLO_F_FILE | HELLO_F_FWD);
+        ctx.hello_flags |= HELLO_F_RESUME;
+        return run_persist(ctx, arg_persist, arg_replay_file, arg_replay_size, cmd_argv, arg_base64, arg_escape ? &ctx.escape : NULL, arg_greeting);
+    }
+    if (arg_screen) {
+        // resized by the first CMD_WS
+        ctx.screen = 1;
+        term_init(ctx.term, 24, 80);
+    }
+    int err = 0;
+    if (ctx.no_tty) {
+        err = pipe_fork(ctx.pid, ctx.child_in, ctx.child_out, ctx.child_err);
+    } else {
+        err = pty_fork(ctx.pid, ctx.pty_fd, NULL, NULL);
+    }
+    if (err) {
+        log_err(err, "pty_fork() or pipe_fork()");
+        return -1;
+    }
+
+    if (ctx.pid == 0) {
+        // child
+        (void)execvp(cmd_argv[0], cmd_argv);
+        log_err(errno, "execvp()");
+        return -1;
+    }
+
+    // parent, sigusr1 is for sigwait, channel children unblock it
+    sigset_t sigset;
+    sigemptyset(&sigset);
+    sigaddset(&sigset, SIGUSR1);
+    if (0 != pthread_sigmask(SIG_BLOCK, &sigset, NULL)) {
+        log_err(errno, "pthread_sigmask(SIG_BLOCK, &sigset, NULL)");
+        return -1;
+    }
+    int fds[] = {ctx.pty_fd, ctx.child_in, ctx.child_out, ctx.child_err};
+    for (int fd : fds) {
+        if (fd >= 0) {
+            (void)fd_set_cloexec(fd);
+        }
+    }
+    if (isatty(STDIN_FILENO)) {
+        // prevent echoing
+        (void)tty_set_raw(STDIN_FILENO, NULL);
+    }
+    // ready to accept input and produce output
+    if (arg_greeting) {
+        const char *k_greeting = "PTY_SLAVE_GREETING";
+        (void)write(STDOUT_FILENO, k_greeting, strlen(k_greeting));
+    }
+
+    // init stream
+    ctx.stream.rfd = STDIN_FILENO;
+    ctx.stream.wfd = STDOUT_FILENO;
+    stream_set_codec(&ctx.stream, arg_base64, arg_escape ? &ctx.escape : NULL);
+    if (ctx.stats.path && 0 != stats_listen(ctx.stats)) {
+        return -1;
+    }
+
+    if (arg_epoll || arg_uring) {
+        ctx.epoll = 1;
+        int ret = arg_uring ? run_uring(ctx) : run_epoll(ctx);
+        stats_stop(ctx.stats);
+        if (arg_latency) {
+            log_latency(ctx);
+        }
+        return ret;
+    }
+
+    // start threads
+    pthread_attr_t attr;
+    if (0 != thread_attr_init(&attr, 1)) {
+        return -1;
+    }
+    pthread_t thread_id;
+    if (0 != pthread_create(&thread_id, &attr, &l2r, &ctx)) {
+        log_err(errno, "pthread_create(&thread_id, &attr, &l2r, &ctx)");
+        return -1;
+    }
+    if (0 != pthread_create(&thread_id, &attr, &stats, &ctx)) {
+        log_err(errno, "pthread_create(&thread_id, &attr, &stats, &ctx)");
+        return -1;
+    }
+    if (ctx.no_tty) {
+        ctx.err_open = 1;
+        if (0 != pthread_create(&thread_id, &attr, &r2l_out, &ctx)) {
+            log_err(errno, "pthread_create(&thread_id, &attr, &r2l_out, &ctx)");
+            return -1;
+        }
+        if (0 != pthread_create(&thread_id, &attr, &r2l_err, &ctx)) {
+            log_err(errno, "pthread_create(&thread_id, &attr, &r2l_err, &ctx)");
+            return -1;
+        }
+    } else if (ctx.screen) {
+        if (0 != pthread_create(&thread_id, &attr, &r2l_screen_read, &ctx)) {
+            log_err(errno, "pthread_create(&thread_id, &attr, &r2l_screen_read, &ctx)");
+            return -1;
+        }
+        if (0 != pthread_create(&thread_id, &attr, &r2l_screen_send, &ctx)) {
+            log_err(errno, "pthread_create(&thread_id, &attr, &r2l_screen_send, &ctx)");
+            return -1;
+        }
+    } else {
+        if (0 != pthread_create(&thread_id, &attr, &r2l_pty, &ctx)) {
+            log_err(errno, "pthread_create(&thread_id, &attr, &r2l_pty, &ctx)");
+            return -1;
+        }
+    }
+
+    // wait for remote exit
+    pthread_mutex_lock(&ctx.mu);
+    // and for the other channels while the transport is up
+    while (!(ctx.exit_flag & 2) || (!ctx.chans.empty() && !(ctx.exit_flag & 1))) {
+        pthread_cond_wait(&ctx.cond, &ctx.mu);
+    }
+    log_dbg("[exit_flag:%d] [l2r:%d][r2l:%d] [chans:%zu]", ctx.exit_flag, ctx.l2r, ctx.r2l, ctx.chans.size());
+    pthread_mutex_unlock(&ctx.mu);
+    fwd_stop(ctx.fwd);
+    stats_stop(ctx.stats);
+    if (arg_latency) {
+        log_latency(ctx);
+    }
     return ctx.l2r ? ctx.l2r : ctx.r2l;
 }
@@ -0,0 +1,157 @@
+// system
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+// self
+#include "stats.h"
+#include "event.h"
+#include "hist.h"
+#include "util.h"
+
+
+static const char *k_cmd_names[k_stats_cmds] = {"data", "ws", "eof", "err", "hello", "open", "resume", "ping", "chunk", "window", "ack", "other"};
+
+static uint64_t load(const uint64_t &counter) {
+    return __atomic_load_n(&counter, __ATOMIC_RELAXED);
+}
+
+static void appendf(std::string &out, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+static void appendf(std::string &out, const char *fmt, ...) {
+    char buf[256];
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    out.append(buf, n < (int)sizeof(buf) ? (size_t)n : sizeof(buf) - 1);
+}
+
+// one counter for both directions
+static void format_dirs(
+    std::string &out, const IoStats &st, const char *labels,
+    const char *name, const char *help, uint64_t DirStats::*field)
+{
+    appendf(out, "# HELP pty_proxy_%s %s\n# TYPE pty_proxy_%s counter\n", name, help, name);
+    appendf(out, "pty_proxy_%s{%s,dir=\"tx\"} %llu\n", name, labels, (unsigned long long)load(st.tx.*field));
+    appendf(out, "pty_proxy_%s{%s,dir=\"rx\"} %llu\n", name, labels, (unsigned long long)load(st.rx.*field));
+}
+
+void stats_format(std::string &out, const IoStats &st, const char *labels) {
+    format_dirs(out, st, labels, "bytes_total", "Frame bytes, before compression and base64.", &DirStats::bytes);
+    format_dirs(out, st, labels, "wire_bytes_total", "Bytes on the transport.", &DirStats::wire_bytes);
+    format_dirs(out, st, labels, "syscalls_total", "read() or write() calls on the transport.", &DirStats::syscalls);
+    format_dirs(out, st, labels, "short_io_total", "Partial writes, reads that ended inside a frame.", &DirStats::short_io);
+    format_dirs(out, st, labels, "memmove_bytes_total", "Bytes moved to keep buffers contiguous.", &DirStats::moved);
+
+    appendf(out, "# HELP pty_proxy_frames_total Frames by command.\n# TYPE pty_proxy_frames_total counter\n");
+    const DirStats *dirs[] = {&st.tx, &st.rx};
+    for (const DirStats *d : dirs) {
+        for (size_t i = 0; i < k_stats_cmds; ++i) {
+            appendf(out, "pty_proxy_frames_total{%s,dir=\"%s\",cmd=\"%s\"} %llu\n",
+                labels, d == &st.tx ? "tx" : "rx", k_cmd_names[i], (unsigned long long)load(d->frames[i]));
+        }
+    }
+
+    appendf(out, "# HELP pty_proxy_write_blocked_seconds_total Time in write() on the transport.\n"
+        "# TYPE pty_proxy_write_blocked_seconds_total counter\n");
+    appendf(out, "pty_proxy_write_blocked_seconds_total{%s} %.6f\n", labels, load(st.tx.blocked_us) / 1e6);
+    stats_format_value(out, "resent_frames_total", "counter", "Frames sent again on the reliable link.", load(st.tx.resent), labels);
+    stats_format_value(out, "dropped_frames_total", "counter", "Frames dropped on the reliable link, corrupt or twice.", load(st.rx.dropped), labels);
+}
+
+void stats_format_batch(std::string &out, const BatchStats &st, const char *labels) {
+    stats_format_value(out, "batch_frames_total", "counter", "Frames gathered into batches.", load(st.frames), labels);
+    appendf(out, "# HELP pty_proxy_batch_flushes_total Batch flushes by reason.\n# TYPE pty_proxy_batch_flushes_total counter\n");
+    appendf(out, "pty_proxy_batch_flushes_total{%s,reason=\"size\"} %llu\n", labels, (unsigned long long)load(st.flush_size));
+    appendf(out, "pty_proxy_batch_flushes_total{%s,reason=\"deadline\"} %llu\n", labels, (unsigned long long)load(st.flush_deadline));
+    appendf(out, "pty_proxy_batch_flushes_total{%s,reason=\"other\"} %llu\n", labels, (unsigned long long)load(st.flush_other));
+}
+
+void stats_format_value(std::string &out, const char *name, const char *type, const char *help, uint64_t v, const char *labels) {
+    appendf(out, "# HELP pty_proxy_%s %s\n# TYPE pty_proxy_%s %s\n", name, help, name, type);
+    appendf(out, "pty_proxy_%s{%s} %llu\n", name, labels, (unsigned long long)v);
+}
+
+void stats_format_hist(std::string &out, const char *name, const Hist &h, const char *labels) {
+    appendf(out, "# TYPE pty_proxy_%s_seconds summary\n", name);
+    const double qs[] = {0.5, 0.9, 0.99, 0.999};
+    for (double q : qs) {
+        appendf(out, "pty_proxy_%s_seconds{%s,quantile=\"%g\"} %.6f\n", name, labels, q, hist_quantile(h, q) / 1e6);
+    }
+    appendf(out, "pty_proxy_%s_seconds_sum{%s} %.6f\n", name, labels, load(h.sum) / 1e6);
+    appendf(out, "pty_proxy_%s_seconds_count{%s} %llu\n", name, labels, (unsigned long long)load(h.total));
+}
+
+static void *stats_accept(void *user) {
+    StatsServer &srv = *(StatsServer *)user;
+    while (1) {
+        int fd = TEMP_FAILURE_RETRY(accept4(srv.fd, NULL, NULL, SOCK_CLOEXEC));
+        if (fd < 0) {
+            // EINVAL: shut down by stats_stop()
+            if (errno != EINVAL) {
+                log_err(errno, "accept(stats)");
+            }
+            break;
+        }
+        std::string out;
+        srv.dump(out, srv.user);
+        (void)write_full(fd, out.data(), out.size());
+        (void)close(fd);
+    }
+    return NULL;
+}
+
+int stats_listen(StatsServer &srv) {
+    struct sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    if (strlen(srv.path) >= sizeof(addr.sun_path)) {
+        log_err(0, "stats path too long: %s", srv.path);
+        return -1;
+    }
+    strcpy(addr.sun_path, srv.path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        log_err(errno, "socket(AF_UNIX)");
+        return -1;
+    }
+    if (0 == connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+        log_err(0, "%s is in use", srv.path);
+        (void)close(fd);
+        return -1;
+    }
+    // left by a process that is gone
+    (void)unlink(srv.path);
+    if (0 != bind(fd, (struct sockaddr *)&addr, sizeof(addr)) || 0 != listen(fd, 16)) {
+        log_err(errno, "bind(%s)", srv.path);
+        (void)close(fd);
+        return -1;
+    }
+    srv.fd = fd;
+
+    pthread_attr_t attr;
+    if (0 != thread_attr_init(&attr, 1)) {
+        return -1;
+    }
+    pthread_t thread_id;
+    int err = pthread_create(&thread_id, &attr, &stats_accept, &srv);
+    (void)pthread_attr_destroy(&attr);
+    if (err) {
+        log_err(err, "pthread_create(&thread_id, &attr, &stats_accept, &srv)");
+        return -1;
+    }
+    log_dbg("[stats_listen] %s", srv.path);
+    return 0;
+}
+
+void stats_stop(StatsServer &srv) {
+    if (srv.fd >= 0 && srv.path) {
+        (void)unlink(srv.path);
+        (void)shutdown(srv.fd, SHUT_RDWR);
+        srv.path = NULL;
+    }
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+// system
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+
+
+struct Hist;
+
+// frames are counted by cmd, unknown ones share the last slot
+const size_t k_stats_cmds = 12;
+
+// One direction of a transport. The counters only grow and are updated with
+// relaxed atomics, so they can be read at any time.
+struct DirStats {
+    uint64_t bytes = 0;         // frames, before compression and base64
+    uint64_t wire_bytes = 0;    // what went through the fd
+    uint64_t frames[k_stats_cmds] = {};
+    uint64_t syscalls = 0;      // read() or write() on the fd
+    uint64_t short_io = 0;      // writes that did not take everything, reads that ended inside a frame
+    uint64_t moved = 0;         // bytes memmove()d to keep a buffer contiguous
+    uint64_t blocked_us = 0;    // in write() on a blocking fd
+    uint64_t resent = 0;        // HELLO_F_REL, frames sent again
+    uint64_t dropped = 0;       // HELLO_F_REL, frames whose payload failed its check or that came twice
+};
+
+// What a Batch counts, see protocol.h; the batches of a process may share
+// one, they update it with relaxed atomics
+struct BatchStats {
+    uint64_t frames = 0;
+    uint64_t flush_size = 0;        // full
+    uint64_t flush_deadline = 0;    // the deadline passed
+    uint64_t flush_other = 0;       // each frame without a deadline, at eof
+};
+
+// the directions are updated by different threads
+struct IoStats {
+    alignas(64) DirStats tx;    // to the peer
+    alignas(64) DirStats rx;    // from the peer
+};
+
+inline void stat_add(uint64_t &counter, uint64_t v) {
+    __atomic_fetch_add(&counter, v, __ATOMIC_RELAXED);
+}
+
+inline void stat_frame(DirStats &d, uint8_t cmd) {
+    stat_add(d.frames[cmd < k_stats_cmds - 1 ? cmd : k_stats_cmds - 1], 1);
+}
+
+// Prometheus text format, labels like `role="master"` are added to each sample
+void stats_format(std::string &out, const IoStats &st, const char *labels);
+void stats_format_batch(std::string &out, const BatchStats &st, const char *labels);
+// a single sample, type is "counter" or "gauge"
+void stats_format_value(std::string &out, const char *name, const char *type, const char *help, uint64_t v, const char *labels);
+// a summary with the p50/p90/p99/p999 of h, in seconds
+void stats_format_hist(std::string &out, const char *name, const Hist &h, const char *labels);
+
+// Every connection to the unix socket at path gets what dump() appends and
+// is closed, e.g. `socat - UNIX-CONNECT:path`.
+struct StatsServer {
+    const char *path = NULL;
+    int fd = -1;
+    void (*dump)(std::string &out, void *user) = NULL;
+    void *user = NULL;
+};
+
+int stats_listen(StatsServer &srv);
+// closes and removes the socket, idempotent
+void stats_stop(StatsServer &srv);
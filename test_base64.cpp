@@ -98,3 +98,93 @@ TEST_CASE("base64.encode.rand") {
         }
     }
 }
+
+static const char *k_impls[] = {"scalar", "sse4.1", "avx2", "avx512vbmi"};
+
+TEST_CASE("base64.simd.encode.match.scalar") {
+    const size_t N = 2000;
+    uint8_t input[N];
+    for (size_t j = 0; j < N; ++j) {
+        input[j] = rand();
+    }
+
+    REQUIRE(0 == b64_select("scalar"));
+    string expected[N / 97 + 1];
+    for (size_t size = 0, k = 0; size < N; size += 97, ++k) {
+        expected[k].resize(b64_encoded_size(size));
+        b64_encode(input, size, (uint8_t *)&expected[k][0]);
+    }
+
+    for (const char *impl : k_impls) {
+        if (0 != b64_select(impl)) {
+            continue;
+        }
+        CAPTURE(impl);
+        for (size_t size = 0, k = 0; size < N; size += 97, ++k) {
+            string encoded(b64_encoded_size(size), '\0');
+            b64_encode(input, size, (uint8_t *)&encoded[0]);
+            CHECK(encoded == expected[k]);
+        }
+    }
+    REQUIRE(0 == b64_select("scalar"));
+}
+
+TEST_CASE("base64.simd.decode.match.scalar") {
+    const size_t N = 3000;
+    uint8_t input[N];
+    for (size_t j = 0; j < N; ++j) {
+        input[j] = rand();
+    }
+
+    // concatenated padded blocks with the odd non-coding char, as seen by stream_read
+    string coded;
+    for (size_t pos = 0, block = 1; pos < N; pos += block, block = block * 7 % 501 + 1) {
+        size_t size = pos + block > N ? N - pos : block;
+        string part(b64_encoded_size(size), '\0');
+        b64_encode(input + pos, size, (uint8_t *)&part[0]);
+        coded += part;
+        if (block % 5 == 0) {
+            coded.insert(coded.size() - part.size() / 2, "\r\n");
+        }
+    }
+
+    for (const char *impl : k_impls) {
+        if (0 != b64_select(impl)) {
+            continue;
+        }
+        CAPTURE(impl);
+
+        // whole input
+        uint8_t decoded[N + 64];
+        size_t insize = coded.size();
+        size_t outsize = sizeof(decoded);
+        REQUIRE(0 == b64_decode((const uint8_t *)coded.data(), &insize, decoded, &outsize));
+        CHECK(insize == coded.size());
+        CHECK(outsize == N);
+        CHECK(0 == memcmp(input, decoded, N));
+
+        // small output buffer and truncated input
+        for (size_t cut = 1; cut < 200; cut += 13) {
+            insize = coded.size() - cut;
+            outsize = N / 2 + cut;
+            REQUIRE(0 == b64_decode((const uint8_t *)coded.data(), &insize, decoded, &outsize));
+            CHECK(outsize <= N / 2 + cut);
+            CHECK(insize <= coded.size() - cut);
+            CHECK(0 == memcmp(input, decoded, outsize));
+        }
+
+        // invalid padding
+        string bad = string(400, 'A') + "=AAA" + string(400, 'A');
+        insize = bad.size();
+        outsize = sizeof(decoded);
+        CHECK(0 != b64_decode((const uint8_t *)bad.data(), &insize, decoded, &outsize));
+    }
+    REQUIRE(0 == b64_select("scalar"));
+}
+
+TEST_CASE("base64.select") {
+    CHECK(0 == b64_select("scalar"));
+    CHECK(0 == strcmp("scalar", b64_impl_name()));
+    CHECK(0 != b64_select("no-such-impl"));
+    CHECK(0 == strcmp("scalar", b64_impl_name()));
+}
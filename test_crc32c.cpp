@@ -0,0 +1,54 @@
+#include "doctest/doctest/doctest.h"
+
+// system
+#include <string.h>
+#include <stdlib.h>
+#include <string>
+// proj
+#include "crc32c.h"
+
+
+using namespace std;
+
+
+static const char *k_impl_names[] = {"table", "sse4.2"};
+
+TEST_CASE("crc32c.vectors") {
+    for (const char *name : k_impl_names) {
+        if (0 != crc32c_select(name)) {
+            continue;
+        }
+        CAPTURE(name);
+        CHECK(crc32c(0, "", 0) == 0);
+        CHECK(crc32c(0, "123456789", 9) == 0xe3069283);
+        // iSCSI, 32 bytes of zeros and of ones
+        string zeros(32, '\0');
+        string ones(32, '\xff');
+        CHECK(crc32c(0, zeros.data(), zeros.size()) == 0x8a9136aa);
+        CHECK(crc32c(0, ones.data(), ones.size()) == 0x62a8ab43);
+    }
+}
+
+TEST_CASE("crc32c.impls.agree") {
+    string data(100000, '\0');
+    for (char &c : data) {
+        c = (char)rand();
+    }
+    REQUIRE(0 == crc32c_select("table"));
+    uint32_t expected = crc32c(0, data.data(), data.size());
+    for (const char *name : k_impl_names) {
+        if (0 != crc32c_select(name)) {
+            continue;
+        }
+        CAPTURE(name);
+        CHECK(crc32c(0, data.data(), data.size()) == expected);
+        // in pieces, at every alignment
+        uint32_t crc = 0;
+        for (size_t pos = 0, step = 1; pos < data.size(); pos += step, step = step % 61 + 1) {
+            step = min(step, data.size() - pos);
+            crc = crc32c(crc, &data[pos], step);
+        }
+        CHECK(crc == expected);
+    }
+    CHECK(0 != crc32c_select("nope"));
+}
@@ -0,0 +1,147 @@
+#include "doctest/doctest/doctest.h"
+
+// system
+#include <string.h>
+#include <stdlib.h>
+#include <string>
+// proj
+#include "escape.h"
+
+
+using namespace std;
+
+
+static const char *k_impls[] = {"scalar", "ssse3", "avx2"};
+
+static string encode(const EscapeSet &set, const string &in) {
+    string out(esc_encoded_max(in.size()), '\0');
+    out.resize(esc_encode(&set, (const uint8_t *)in.data(), in.size(), (uint8_t *)&out[0]));
+    return out;
+}
+
+TEST_CASE("escape.simple") {
+    EscapeSet set;
+    esc_set_default(&set);
+    string input("ls\r\0\x10x\x03", 7);
+    string encoded = encode(set, input);
+    CHECK(encoded == string("ls\x10\x4d\x10\x40\x10\x50x\x10\x43", 11));
+
+    uint8_t decoded[100] = {};
+    size_t insize = encoded.size();
+    size_t outsize = sizeof(decoded);
+    esc_decode((const uint8_t *)encoded.data(), &insize, decoded, &outsize);
+    CHECK(insize == encoded.size());
+    CHECK(outsize == input.size());
+    CHECK(0 == memcmp(input.data(), decoded, input.size()));
+}
+
+TEST_CASE("escape.set") {
+    EscapeSet set;
+    REQUIRE(0 == esc_set_parse("", &set));
+    for (unsigned c = 0; c < 256; ++c) {
+        CHECK(esc_set_has(&set, (uint8_t)c) == (c == ESC_CHAR));
+    }
+
+    REQUIRE(0 == esc_set_parse("1b,ff,80,7f", &set));
+    CHECK(esc_set_has(&set, 0x1b));
+    CHECK(esc_set_has(&set, 0xff));
+    CHECK(esc_set_has(&set, 0x80));
+    CHECK(esc_set_has(&set, 0x7f));
+    CHECK(esc_set_has(&set, ESC_CHAR));
+    CHECK(!esc_set_has(&set, 0x0b));
+    CHECK(!esc_set_has(&set, 0x8f));
+
+    CHECK(0 != esc_set_parse("1b,", &set));
+    CHECK(0 != esc_set_parse("100", &set));
+    CHECK(0 != esc_set_parse("0d;0a", &set));
+    // ESC_CHAR escapes to 0x50
+    CHECK(0 != esc_set_parse("50", &set));
+    CHECK(0 != esc_set_parse("00,40", &set));
+}
+
+TEST_CASE("escape.text.is.not.expanded") {
+    EscapeSet set;
+    esc_set_default(&set);
+    string text;
+    while (text.size() < 10000) {
+        text += "\x1b[1;32mok\x1b[0m  src/net/socket.cpp:42: warning: unused variable\n";
+    }
+    CHECK(esc_scan(&set, (const uint8_t *)text.data(), text.size()) == text.size());
+    CHECK(encode(set, text) == text);
+}
+
+TEST_CASE("escape.simd.match.scalar") {
+    const size_t N = 3000;
+    string input(N, '\0');
+    for (size_t j = 0; j < N; ++j) {
+        // mostly text, some of everything
+        input[j] = rand() % 8 ? 'a' + rand() % 26 : rand();
+    }
+    EscapeSet set;
+    REQUIRE(0 == esc_set_parse("00,03,04,0d,11,13,7f,80,9b,ff", &set));
+
+    REQUIRE(0 == esc_select("scalar"));
+    size_t expected_scan[N / 7 + 1];
+    for (size_t pos = 0, k = 0; pos < N; pos += 7, ++k) {
+        expected_scan[k] = esc_scan(&set, (const uint8_t *)input.data() + pos, N - pos);
+    }
+    string expected = encode(set, input);
+
+    for (const char *impl : k_impls) {
+        if (0 != esc_select(impl)) {
+            continue;
+        }
+        CAPTURE(impl);
+        for (size_t pos = 0, k = 0; pos < N; pos += 7, ++k) {
+            CHECK(esc_scan(&set, (const uint8_t *)input.data() + pos, N - pos) == expected_scan[k]);
+        }
+        CHECK(encode(set, input) == expected);
+    }
+    REQUIRE(0 == esc_select("scalar"));
+}
+
+TEST_CASE("escape.decode.in.pieces") {
+    EscapeSet set;
+    esc_set_default(&set);
+    string input;
+    for (size_t j = 0; j < 2000; ++j) {
+        input.push_back((char)rand());
+    }
+    string encoded = encode(set, input);
+    for (unsigned c : {0x00, 0x03, 0x04, 0x0d, 0x11, 0x13}) {
+        CHECK(encoded.find((char)c) == string::npos);
+    }
+
+    // as stream_read sees it: short reads, small output buffers, a split
+    // escape left over for the next call
+    string decoded;
+    string pending;
+    for (size_t pos = 0, step = 1; pos < encoded.size(); pos += step, step = step * 5 % 97 + 1) {
+        pending += encoded.substr(pos, step);
+        uint8_t out[64];
+        size_t insize = pending.size();
+        size_t outsize = step % 3 ? sizeof(out) : step % 64 + 1;
+        esc_decode((const uint8_t *)pending.data(), &insize, out, &outsize);
+        REQUIRE(insize <= pending.size());
+        REQUIRE(outsize <= sizeof(out));
+        pending.erase(0, insize);
+        decoded.append((const char *)out, outsize);
+    }
+    while (!pending.empty()) {
+        uint8_t out[64];
+        size_t insize = pending.size();
+        size_t outsize = sizeof(out);
+        esc_decode((const uint8_t *)pending.data(), &insize, out, &outsize);
+        REQUIRE(insize > 0);
+        pending.erase(0, insize);
+        decoded.append((const char *)out, outsize);
+    }
+    CHECK(decoded == input);
+}
+
+TEST_CASE("escape.select") {
+    CHECK(0 == esc_select("scalar"));
+    CHECK(0 == strcmp("scalar", esc_impl_name()));
+    CHECK(0 != esc_select("no-such-impl"));
+    CHECK(0 == strcmp("scalar", esc_impl_name()));
+}
@@ -0,0 +1,271 @@
+#include "doctest/doctest/doctest.h"
+
+// system
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <string>
+// proj
+#include "fwd.h"
+#include "protocol.h"
+
+
+using namespace std;
+
+
+TEST_CASE("fwd.split") {
+    char listen[64];
+    char target[64];
+    REQUIRE(0 == fwd_split("8080:localhost:80", listen, sizeof(listen), target, sizeof(target)));
+    CHECK(string(listen) == "8080");
+    CHECK(string(target) == "localhost:80");
+    REQUIRE(0 == fwd_split("127.0.0.1:5432:/run/pg.sock", listen, sizeof(listen), target, sizeof(target)));
+    CHECK(string(listen) == "127.0.0.1:5432");
+    CHECK(string(target) == "/run/pg.sock");
+    REQUIRE(0 == fwd_split("/tmp/x.sock:db:22", listen, sizeof(listen), target, sizeof(target)));
+    CHECK(string(listen) == "/tmp/x.sock");
+    CHECK(string(target) == "db:22");
+    CHECK(0 != fwd_split("8080", listen, sizeof(listen), target, sizeof(target)));
+    CHECK(0 != fwd_split("localhost:80", listen, sizeof(listen), target, sizeof(target)));
+    CHECK(0 != fwd_split(":/a", listen, sizeof(listen), target, sizeof(target)));
+    CHECK(0 != fwd_split("8080:host:", listen, sizeof(listen), target, sizeof(target)));
+    CHECK(0 != fwd_split("8080:localhost:80", listen, 4, target, sizeof(target)));
+}
+
+// one side of the transport: the frames it reads go to its Forwards
+struct Side {
+    Stream *rs;
+    Stream *ws;
+    Forwards fwd;
+    pthread_t reader;
+};
+
+static int side_frame(Parser &p, void *user) {
+    Side &side = *(Side *)user;
+    if (p.chan != 0) {
+        CHECK(fwd_frame(side.fwd, p));
+    }
+    return 0;
+}
+
+static void *side_read(void *user) {
+    Side &side = *(Side *)user;
+    Parser p;
+    while (!p.eof && 0 == feed_frame(p, side.rs, side_frame, &side)) {}
+    return NULL;
+}
+
+static void side_hello(Side &side) {
+    Hello h;
+    h.version = PROTO_V2;
+    h.flags = HELLO_F_MUX | HELLO_F_FWD;
+    h.max_frame = MAX_PAYLOAD_V2;
+    REQUIRE(0 == send_hello(side.ws, h, MAX_PAYLOAD_V2));
+}
+
+static string sock_path(const char *name) {
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/test_fwd.%d.%s", (int)getpid(), name);
+    (void)unlink(path);
+    return path;
+}
+
+static int sock_connect(const string &path) {
+    struct sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path.c_str());
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    REQUIRE(fd >= 0);
+    REQUIRE(0 == connect(fd, (struct sockaddr *)&addr, sizeof(addr)));
+    return fd;
+}
+
+// echoes one connection back, slowly at first so the window fills up
+struct Echo {
+    int fd;
+    size_t bytes;
+};
+
+static void *echo(void *user) {
+    Echo &e = *(Echo *)user;
+    int fd = accept(e.fd, NULL, NULL);
+    if (fd < 0) {
+        return NULL;
+    }
+    (void)usleep(200000);
+    char buf[5000];
+    ssize_t nread = 0;
+    while ((nread = read(fd, buf, sizeof(buf))) > 0) {
+        e.bytes += (size_t)nread;
+        if (write(fd, buf, (size_t)nread) != nread) {
+            break;
+        }
+    }
+    (void)close(fd);
+    return NULL;
+}
+
+struct Client {
+    int fd;
+    string input;
+};
+
+static void *client_write(void *user) {
+    Client &c = *(Client *)user;
+    for (size_t pos = 0; pos < c.input.size();) {
+        ssize_t nwrite = write(c.fd, &c.input[pos], min((size_t)70000, c.input.size() - pos));
+        if (nwrite <= 0) {
+            break;
+        }
+        pos += (size_t)nwrite;
+    }
+    // the half close goes through to the echo
+    (void)shutdown(c.fd, SHUT_WR);
+    return NULL;
+}
+
+static void fwd_roundtrip(int remote) {
+    (void)signal(SIGPIPE, SIG_IGN);
+    int ab[2];
+    int ba[2];
+    REQUIRE(0 == pipe(ab));
+    REQUIRE(0 == pipe(ba));
+    Side a;
+    Side b;
+    a.ws = new Stream;
+    a.rs = new Stream;
+    b.ws = new Stream;
+    b.rs = new Stream;
+    stream_reset(a.ws, -1, ab[1]);
+    stream_reset(b.rs, ab[0], -1);
+    stream_reset(b.ws, -1, ba[1]);
+    stream_reset(a.rs, ba[0], -1);
+    a.fwd.stream = a.ws;
+    b.fwd.stream = b.ws;
+    b.fwd.first_chan = k_fwd_first_chan + k_fwd_chans;
+    REQUIRE(0 == pthread_create(&a.reader, NULL, &side_read, &a));
+    REQUIRE(0 == pthread_create(&b.reader, NULL, &side_read, &b));
+    side_hello(a);
+    side_hello(b);
+
+    string listen_path = sock_path("listen");
+    string echo_path = sock_path("echo");
+    Echo e = {socket(AF_UNIX, SOCK_STREAM, 0), 0};
+    struct sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, echo_path.c_str());
+    REQUIRE(0 == bind(e.fd, (struct sockaddr *)&addr, sizeof(addr)));
+    REQUIRE(0 == listen(e.fd, 1));
+    pthread_t echo_tid;
+    REQUIRE(0 == pthread_create(&echo_tid, NULL, &echo, &e));
+
+    if (remote) {
+        // b listens, as the slave with -R
+        REQUIRE(0 == fwd_request(a.fwd, listen_path.c_str(), echo_path.c_str()));
+        for (int i = 0; i < 100 && 0 != access(listen_path.c_str(), F_OK); ++i) {
+            (void)usleep(10000);
+        }
+    } else {
+        REQUIRE(0 == fwd_listen(a.fwd, listen_path.c_str(), echo_path.c_str()));
+    }
+
+    Client c = {sock_connect(listen_path), string(3000000, '\0')};
+    for (char &ch : c.input) {
+        ch = (char)rand();
+    }
+    pthread_t client_tid;
+    REQUIRE(0 == pthread_create(&client_tid, NULL, &client_write, &c));
+    string got;
+    char buf[65536];
+    ssize_t nread = 0;
+    while ((nread = read(c.fd, buf, sizeof(buf))) > 0) {
+        got.append(buf, (size_t)nread);
+    }
+    pthread_join(client_tid, NULL);
+    pthread_join(echo_tid, NULL);
+    CHECK(got == c.input);
+    CHECK(e.bytes == c.input.size());
+    (void)close(c.fd);
+
+    // within the window: no more than k_fwd_window bytes queued for the echo
+    Forwards &acceptor = remote ? b.fwd : a.fwd;
+    Forwards &connector = remote ? a.fwd : b.fwd;
+    CHECK(acceptor.opened == 1);
+    CHECK(connector.opened == 1);
+    CHECK(a.ws->stats.tx.frames[CMD_WINDOW] > 0);
+    CHECK(b.ws->stats.tx.frames[CMD_WINDOW] > 0);
+
+    fwd_stop(a.fwd);
+    fwd_stop(b.fwd);
+    CHECK(0 != access(listen_path.c_str(), F_OK));
+    // the readers end with the pipes
+    (void)close(ab[1]);
+    (void)close(ba[1]);
+    pthread_join(a.reader, NULL);
+    pthread_join(b.reader, NULL);
+    int fds[] = {ab[0], ba[0], e.fd};
+    for (int fd : fds) {
+        (void)close(fd);
+    }
+    (void)unlink(echo_path.c_str());
+    delete a.ws;
+    delete a.rs;
+    delete b.ws;
+    delete b.rs;
+}
+
+TEST_CASE("fwd.local") {
+    fwd_roundtrip(0);
+}
+
+TEST_CASE("fwd.remote") {
+    fwd_roundtrip(1);
+}
+
+TEST_CASE("fwd.connect.refused") {
+    int ab[2];
+    REQUIRE(0 == pipe(ab));
+    Stream *ws = new Stream;
+    Stream *rs = new Stream;
+    stream_reset(ws, -1, ab[1]);
+    stream_reset(rs, ab[0], -1);
+    Forwards f;
+    f.stream = ws;
+    Hello h;
+    h.version = PROTO_V2;
+    h.flags = HELLO_F_MUX | HELLO_F_FWD;
+    REQUIRE(0 == send_hello(ws, h, MAX_PAYLOAD_V2));
+
+    // as if the peer accepted a connection for a target nobody listens on
+    Parser open;
+    string payload = string(5, '\0') + sock_path("nobody");
+    payload[0] = OPEN_F_CONNECT;
+    open.cmd = CMD_OPEN;
+    open.chan = k_fwd_first_chan + 7;
+    open.payload = (uint8_t *)&payload[0];
+    open.size = payload.size();
+    CHECK(fwd_frame(f, open));
+    // fwd_stop() would end it quietly
+    for (int i = 0; i < 100 && !f.failed; ++i) {
+        (void)usleep(10000);
+    }
+    fwd_stop(f);
+    CHECK(f.opened == 1);
+    CHECK(f.failed == 1);
+    CHECK(ws->stats.tx.frames[CMD_ERR] == 1);
+
+    // not a forward
+    open.chan = 3;
+    CHECK(!fwd_frame(f, open));
+    (void)close(ab[0]);
+    (void)close(ab[1]);
+    delete ws;
+    delete rs;
+}
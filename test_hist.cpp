@@ -0,0 +1,62 @@
+#include "doctest/doctest/doctest.h"
+
+// system
+#include <math.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <vector>
+// proj
+#include "hist.h"
+
+
+using namespace std;
+
+
+TEST_CASE("hist.empty") {
+    Hist h;
+    CHECK(hist_quantile(h, 0.5) == 0);
+    CHECK(hist_quantile(h, 1) == 0);
+}
+
+TEST_CASE("hist.small.values.are.exact") {
+    Hist h;
+    for (uint64_t v = 0; v < 16; ++v) {
+        hist_record(h, v);
+    }
+    CHECK(h.total == 16);
+    CHECK(hist_quantile(h, 0.5) == 7);
+    CHECK(hist_quantile(h, 1) == 15);
+    CHECK(h.max == 15);
+}
+
+TEST_CASE("hist.quantiles") {
+    Hist h;
+    vector<uint64_t> vals;
+    srand(1);
+    for (int i = 0; i < 100000; ++i) {
+        // mostly fast, a long tail
+        uint64_t v = (uint64_t)(rand() % 1000) + (rand() % 100 == 0 ? (uint64_t)(rand() % 1000000) : 0);
+        vals.push_back(v);
+        hist_record(h, v);
+    }
+    sort(vals.begin(), vals.end());
+    const double qs[] = {0.5, 0.9, 0.99, 0.999, 1};
+    for (double q : qs) {
+        CAPTURE(q);
+        size_t rank = (size_t)ceil(q * vals.size());
+        uint64_t exact = vals[rank - 1];
+        uint64_t got = hist_quantile(h, q);
+        // the top of the bucket, within 1/16 above
+        CHECK(got >= exact);
+        CHECK(got <= exact + exact / 16 + 1);
+    }
+    CHECK(hist_quantile(h, 1) == vals.back());
+}
+
+TEST_CASE("hist.huge") {
+    Hist h;
+    hist_record(h, ~(uint64_t)0);
+    hist_record(h, (uint64_t)1 << 40);
+    CHECK(hist_quantile(h, 0.5) >= (uint64_t)1 << 40);
+    CHECK(hist_quantile(h, 1) == ~(uint64_t)0);
+}
@@ -0,0 +1,109 @@
+#include "doctest/doctest/doctest.h"
+
+// system
+#include <string.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+// proj
+#include "lz.h"
+
+
+using namespace std;
+
+
+static string rand_bytes(size_t n) {
+    string s(n, '\0');
+    for (size_t i = 0; i < n; ++i) {
+        s[i] = (char)rand();
+    }
+    return s;
+}
+
+static string log_lines(size_t n) {
+    string s;
+    for (size_t i = 0; s.size() < n; ++i) {
+        s += "\x1b[1;32m[build]\x1b[0m compiling src/module_" + to_string(i % 37) + ".cpp\r\n";
+    }
+    s.resize(n);
+    return s;
+}
+
+// compresses the blocks in order with one context, returns the compressed size
+static size_t roundtrip(const vector<string> &blocks) {
+    LzEncoder *e = lz_encoder_new();
+    LzDecoder *d = lz_decoder_new();
+    REQUIRE(e);
+    REQUIRE(d);
+
+    size_t total = 0;
+    vector<uint8_t> out(k_lz_block_size);
+    for (size_t i = 0; i < blocks.size(); ++i) {
+        CAPTURE(i);
+        const string &b = blocks[i];
+        size_t len = lz_compress(e, (const uint8_t *)b.data(), b.size(), out.data(), b.size() - 1);
+        const uint8_t *dec = NULL;
+        size_t declen = 0;
+        if (len == 0) {
+            total += b.size();
+            REQUIRE(0 == lz_store(d, (const uint8_t *)b.data(), b.size(), &dec, &declen));
+        } else {
+            total += len;
+            REQUIRE(0 == lz_decompress(d, out.data(), len, &dec, &declen));
+        }
+        REQUIRE(declen == b.size());
+        CHECK(0 == memcmp(dec, b.data(), declen));
+    }
+
+    lz_encoder_free(e);
+    lz_decoder_free(d);
+    return total;
+}
+
+TEST_CASE("lz.text") {
+    string text = log_lines(k_lz_block_size);
+    size_t len = roundtrip({text});
+    CAPTURE(len);
+    CHECK(len < text.size() / 4);
+}
+
+TEST_CASE("lz.history.across.blocks") {
+    string prompt = "\x1b]0;user@host: ~/src\x07\x1b[01;32muser@host\x1b[00m:\x1b[01;34m~/src\x1b[00m$ ";
+    size_t first = roundtrip({prompt});
+    size_t both = roundtrip({prompt, prompt});
+    // the second prompt is a single back reference
+    CHECK(both - first < 8);
+}
+
+TEST_CASE("lz.incompressible") {
+    string noise = rand_bytes(k_lz_block_size);
+    CHECK(roundtrip({noise}) == noise.size());
+    // stored blocks are still history
+    CHECK(roundtrip({noise, noise}) < noise.size() + 1024);
+}
+
+TEST_CASE("lz.window.slides") {
+    vector<string> blocks;
+    for (size_t i = 0; i < 40; ++i) {
+        size_t n = 1 + (size_t)rand() % k_lz_block_size;
+        blocks.push_back(i % 3 ? log_lines(n) : rand_bytes(n));
+    }
+    roundtrip(blocks);
+}
+
+TEST_CASE("lz.small") {
+    roundtrip({"a", "ab", "abc", "abcd", "abcdabcdabcd", "x"});
+}
+
+TEST_CASE("lz.bad.input") {
+    LzDecoder *d = lz_decoder_new();
+    const uint8_t *out = NULL;
+    size_t outlen = 0;
+    // match before the start of the history
+    uint8_t far[] = {0x10, 'a', 0x02, 0x00};
+    CHECK(0 != lz_decompress(d, far, sizeof(far), &out, &outlen));
+    // literals past the end of the input
+    uint8_t short_lit[] = {0x50, 'a', 'b'};
+    CHECK(0 != lz_decompress(d, short_lit, sizeof(short_lit), &out, &outlen));
+    lz_decoder_free(d);
+}
@@ -0,0 +1,256 @@
+#include "doctest/doctest/doctest.h"
+
+// system
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <string>
+// proj
+#include "pipeline.h"
+
+
+using namespace std;
+
+
+struct Producer {
+    SpscQueue *q;
+    uintptr_t count;
+};
+
+static void *produce(void *user) {
+    Producer &pr = *(Producer *)user;
+    for (uintptr_t i = 1; i <= pr.count; ++i) {
+        while (0 != spsc_push(*pr.q, (void *)i)) {
+            sched_yield();
+        }
+    }
+    spsc_end(*pr.q);
+    return NULL;
+}
+
+TEST_CASE("spsc.full") {
+    SpscQueue q;
+    REQUIRE(0 == spsc_open(q, 3));
+    CHECK(NULL == spsc_pop(q, 0));
+    for (uintptr_t i = 1; i <= 4; ++i) {
+        CHECK(0 == spsc_push(q, (void *)i));
+    }
+    CHECK(0 != spsc_push(q, (void *)5));
+    CHECK((void *)1 == spsc_pop(q, 0));
+    CHECK(0 == spsc_push(q, (void *)5));
+    spsc_end(q);
+    for (uintptr_t i = 2; i <= 5; ++i) {
+        CHECK((void *)i == spsc_pop(q, 1));
+    }
+    CHECK(NULL == spsc_pop(q, 1));
+    spsc_close(q);
+}
+
+TEST_CASE("spsc.order.across.threads") {
+    SpscQueue q;
+    REQUIRE(0 == spsc_open(q, 4));
+    Producer pr = {&q, 200000};
+    pthread_t tid;
+    REQUIRE(0 == pthread_create(&tid, NULL, &produce, &pr));
+    uintptr_t expected = 1;
+    int ok = 1;
+    while (void *item = spsc_pop(q, 1)) {
+        ok &= (uintptr_t)item == expected++;
+    }
+    pthread_join(tid, NULL);
+    CHECK(ok);
+    CHECK(expected == pr.count + 1);
+    spsc_close(q);
+}
+
+struct Receiver {
+    Stream *s;
+    string data;
+    int eof;
+    int err;
+};
+
+static int collect(Parser &p, void *user) {
+    Receiver &rc = *(Receiver *)user;
+    if (p.cmd == CMD_DATA) {
+        rc.data.append((const char *)p.payload, p.size);
+    }
+    return 0;
+}
+
+static void *receive(void *user) {
+    Receiver &rc = *(Receiver *)user;
+    Parser p;
+    while (!p.eof && 0 == (rc.err = feed_frame(p, rc.s, collect, &rc))) {}
+    rc.eof = p.eof;
+    return NULL;
+}
+
+static void pipeline_roundtrip(const EscapeSet *escape, size_t buffers) {
+    int fds[2];
+    REQUIRE(0 == pipe(fds));
+    Stream *ws = new Stream;
+    Stream *rs = new Stream;
+    stream_reset(ws, -1, fds[1]);
+    stream_reset(rs, fds[0], -1);
+    stream_set_codec(ws, 0, escape);
+    stream_set_codec(rs, 0, escape);
+
+    Receiver rc = {rs, string(), 0, 0};
+    pthread_t tid;
+    REQUIRE(0 == pthread_create(&tid, NULL, &receive, &rc));
+
+    string input;
+    for (size_t i = 0; i < 300000; ++i) {
+        input.push_back((char)rand());
+    }
+    Pipeline pl;
+    pl.stream = ws;
+    REQUIRE(0 == pipeline_start(pl, buffers));
+    // as the read()s of the binaries, short and full ones
+    for (size_t pos = 0, step = 1; pos < input.size(); pos += step, step = step * 7 % 5000 + 1) {
+        PipeBuf *b = pipeline_get(pl);
+        REQUIRE(b);
+        b->len = min(min(step, input.size() - pos), pipeline_room(pl));
+        step = b->len;
+        memcpy(&b->data[FRAME_HEADROOM], &input[pos], b->len);
+        pipeline_put(pl, b);
+    }
+    CHECK(0 == pipeline_finish(pl));
+    CHECK(0 == send_eof(ws));
+    (void)close(fds[1]);
+    pthread_join(tid, NULL);
+    (void)close(fds[0]);
+
+    CHECK(rc.err == 0);
+    CHECK(rc.eof);
+    CHECK(rc.data == input);
+    CHECK(pl.sent > 0);
+    delete ws;
+    delete rs;
+}
+
+TEST_CASE("pipeline.roundtrip") {
+    pipeline_roundtrip(NULL, k_pipeline_buffers);
+    pipeline_roundtrip(NULL, 1);
+    EscapeSet escape;
+    esc_set_default(&escape);
+    pipeline_roundtrip(&escape, 3);
+}
+
+TEST_CASE("pipeline.write.error") {
+    (void)signal(SIGPIPE, SIG_IGN);
+    for (int keep_going : {0, 1}) {
+        CAPTURE(keep_going);
+        int fds[2];
+        REQUIRE(0 == pipe(fds));
+        (void)close(fds[0]);
+        Stream *ws = new Stream;
+        stream_reset(ws, -1, fds[1]);
+
+        Pipeline pl;
+        pl.stream = ws;
+        pl.keep_going = keep_going;
+        REQUIRE(0 == pipeline_start(pl, 2));
+        // the reader learns of the failure from pipeline_get() only
+        int puts = 0;
+        while (puts < 100) {
+            PipeBuf *b = pipeline_get(pl);
+            if (!b) {
+                break;
+            }
+            b->len = 10;
+            memset(&b->data[FRAME_HEADROOM], 'x', b->len);
+            pipeline_put(pl, b);
+            ++puts;
+        }
+        CHECK((puts < 100) == !keep_going);
+        CHECK(pipeline_finish(pl) == (keep_going ? 0 : -1));
+        CHECK(pl.sent == 0);
+        (void)close(fds[1]);
+        delete ws;
+    }
+}
+
+struct Drain {
+    int fd;
+    string data;
+};
+
+static void *drain(void *user) {
+    Drain &dr = *(Drain *)user;
+    char buf[1000];
+    ssize_t nread = 0;
+    while ((nread = read(dr.fd, buf, sizeof(buf))) > 0) {
+        dr.data.append(buf, (size_t)nread);
+        // a slow terminal
+        if (dr.data.size() % 7 == 0) {
+            (void)usleep(100);
+        }
+    }
+    return NULL;
+}
+
+TEST_CASE("outq.order.and.limit") {
+    int fds[2];
+    REQUIRE(0 == pipe(fds));
+    Drain dr = {fds[0], string()};
+    pthread_t tid;
+    REQUIRE(0 == pthread_create(&tid, NULL, &drain, &dr));
+
+    OutQueue o;
+    o.fd = fds[1];
+    o.limit = 20000;
+    REQUIRE(0 == outq_start(o));
+    string input;
+    size_t calls = 0;
+    for (size_t pos = 0, step = 1; pos < 2000000; pos += step, step = step * 7 % 3000 + 1) {
+        string chunk(step, '\0');
+        for (char &c : chunk) {
+            c = (char)rand();
+        }
+        REQUIRE(0 == outq_write(o, chunk.data(), chunk.size()));
+        input += chunk;
+        // as after a feed_frame() pass
+        if (++calls % 5 == 0) {
+            outq_kick(o);
+        }
+    }
+    CHECK(0 == outq_finish(o));
+    (void)close(fds[1]);
+    pthread_join(tid, NULL);
+    (void)close(fds[0]);
+
+    CHECK(dr.data == input);
+    CHECK(o.bytes == input.size());
+    CHECK(o.writes < calls);
+    CHECK(o.high_water <= o.limit + 3000);
+    CHECK(o.stalls > 0);
+    // stopped
+    CHECK(0 != outq_write(o, "x", 1));
+}
+
+TEST_CASE("outq.write.error") {
+    (void)signal(SIGPIPE, SIG_IGN);
+    int fds[2];
+    REQUIRE(0 == pipe(fds));
+    (void)close(fds[0]);
+    OutQueue o;
+    o.fd = fds[1];
+    REQUIRE(0 == outq_start(o));
+    int err = 0;
+    for (int i = 0; i < 1000 && !err; ++i) {
+        err = outq_write(o, "hello", 5);
+        outq_kick(o);
+        (void)usleep(100);
+    }
+    CHECK(err != 0);
+    CHECK(errno == EPIPE);
+    CHECK(0 != outq_finish(o));
+    (void)close(fds[1]);
+}
@@ -0,0 +1,111 @@
+#include "doctest/doctest/doctest.h"
+
+// system
+#include <string>
+// proj
+#include "predict.h"
+
+
+using namespace std;
+
+
+static string type(Predict &pr, const string &keys) {
+    string out;
+    predict_input(pr, (const uint8_t *)keys.data(), keys.size(), out);
+    return out;
+}
+
+// what goes to the terminal for the remote's output
+static string echo(Predict &pr, const string &output) {
+    string before;
+    string after;
+    predict_output(pr, (const uint8_t *)output.data(), output.size(), before, after);
+    return before + output + after;
+}
+
+TEST_CASE("predict.echo") {
+    Predict pr;
+    CHECK(echo(pr, "$ ") == "$ ");
+    // the first key of an epoch waits for its echo
+    CHECK(type(pr, "l") == "");
+    CHECK(echo(pr, "l") == "l");
+    CHECK(pr.confirmed == 1);
+    // then they show right away, underlined
+    CHECK(type(pr, "s") == "\x1b[4ms\x1b[24m");
+    CHECK(type(pr, " -") == "\x1b[4m -\x1b[24m");
+    // the echo takes their place, the ones still pending are put back
+    CHECK(echo(pr, "s ") == "\x1b[3D\x1b[Ks \x1b[4m-\x1b[24m");
+    CHECK(echo(pr, "\x1b[1m-\x1b[0m") == "\x1b[1D\x1b[K\x1b[1m-\x1b[0m");
+    CHECK(pr.pending.empty());
+    CHECK(pr.confirmed == 4);
+    CHECK(pr.wrong == 0);
+
+    // a new line, a new epoch
+    CHECK(type(pr, "\r") == "");
+    CHECK(echo(pr, "\r\nfile\r\n$ ") == "\r\nfile\r\n$ ");
+    CHECK(type(pr, "c") == "");
+    CHECK(echo(pr, "c") == "c");
+    CHECK(type(pr, "d") == "\x1b[4md\x1b[24m");
+}
+
+TEST_CASE("predict.wrong") {
+    Predict pr;
+    CHECK(echo(pr, "$ ") == "$ ");
+    CHECK(type(pr, "a") == "");
+    CHECK(echo(pr, "a") == "a");
+    CHECK(type(pr, "bc") == "\x1b[4mbc\x1b[24m");
+    // not the echo, taken off and not shown again
+    CHECK(echo(pr, "\r\nDone\r\n") == "\x1b[2D\x1b[K\r\nDone\r\n");
+    CHECK(pr.wrong == 1);
+    CHECK(pr.pending.empty());
+    CHECK(type(pr, "d") == "");
+}
+
+TEST_CASE("predict.noecho") {
+    Predict pr;
+    CHECK(echo(pr, "Password: ") == "Password: ");
+    // nothing is ever echoed, nothing is shown
+    for (char c : string("secret")) {
+        CHECK(type(pr, string(1, c)) == "");
+    }
+    CHECK(type(pr, "\r") == "");
+    CHECK(echo(pr, "\r\n$ ") == "\r\n$ ");
+    CHECK(pr.confirmed == 0);
+}
+
+TEST_CASE("predict.app") {
+    Predict pr;
+    CHECK(echo(pr, "$ ") == "$ ");
+    CHECK(type(pr, "v") == "");
+    CHECK(echo(pr, "v") == "v");
+    CHECK(type(pr, "i") == "\x1b[4mi\x1b[24m");
+    CHECK(echo(pr, "i") == "\x1b[1D\x1b[Ki");
+    CHECK(type(pr, "\r") == "");
+    // the alternate screen
+    CHECK(echo(pr, "\r\n\x1b[?1049h\x1b[H\x1b[2J") == "\r\n\x1b[?1049h\x1b[H\x1b[2J");
+    CHECK(type(pr, "j") == "");
+    CHECK(echo(pr, "\x1b[2;1H") == "\x1b[2;1H");
+    CHECK(type(pr, "x") == "");
+    // keys with sequences of their own
+    CHECK(type(pr, "\x1b[A") == "");
+    CHECK(echo(pr, "\x1b[?1049l") == "\x1b[?1049l");
+    CHECK(pr.guessed == 2);
+}
+
+TEST_CASE("predict.line") {
+    Predict pr;
+    pr.cols = 10;
+    // not at the end of the line
+    CHECK(echo(pr, "$ abc\x1b[3D") == "$ abc\x1b[3D");
+    CHECK(type(pr, "x") == "");
+    CHECK(pr.guessed == 0);
+    CHECK(echo(pr, "\x1b[K") == "\x1b[K");
+    CHECK(type(pr, "x") == "");
+    CHECK(echo(pr, "x") == "x");
+    // not up to the right margin
+    CHECK(type(pr, "yyyyyyyy") == "\x1b[4myyyyyy\x1b[24m");
+    CHECK(pr.guessed == 7);
+    string out;
+    predict_resize(pr, 80, out);
+    CHECK(out == "\x1b[6D\x1b[K");
+}
@@ -0,0 +1,684 @@
+#include "doctest/doctest/doctest.h"
+
+// system
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/wait.h>
+#include <string>
+#include <vector>
+// proj
+#include "protocol.h"
+#include "util.h"
+
+
+using namespace std;
+
+
+struct Frame {
+    uint8_t cmd;
+    string data;
+    uint32_t chan = 0;
+};
+
+struct Sender {
+    Stream *s;
+    const vector<Frame> *frames;
+    int hello_at;   // switch to v2 before this frame, -1 for never
+    uint32_t flags; // of the hello
+    int err;
+};
+
+static void *send_frames(void *user) {
+    Sender &sd = *(Sender *)user;
+    sd.err = 0;
+    for (size_t i = 0; i < sd.frames->size(); ++i) {
+        if ((int)i == sd.hello_at) {
+            Hello h;
+            h.version = PROTO_V2;
+            h.flags = sd.flags;
+            h.max_frame = MAX_PAYLOAD_V2;
+            sd.err |= send_hello(sd.s, h, MAX_PAYLOAD_V2);
+        }
+        const Frame &f = (*sd.frames)[i];
+        if (f.cmd == CMD_EOF) {
+            sd.err |= send_eof(sd.s, f.chan);
+            continue;
+        }
+        if (f.cmd == CMD_OPEN) {
+            struct winsize ws = {};
+            ws.ws_row = (uint8_t)f.data[1] | ((uint8_t)f.data[2] << 8);
+            ws.ws_col = (uint8_t)f.data[3] | ((uint8_t)f.data[4] << 8);
+            sd.err |= send_open(sd.s, f.chan, (uint8_t)f.data[0], ws);
+            continue;
+        }
+        if (f.cmd == CMD_PING) {
+            uint8_t flags = 0;
+            uint64_t time = 0;
+            REQUIRE(0 == ping_decode((const uint8_t *)f.data.data(), f.data.size(), flags, time));
+            sd.err |= send_ping(sd.s, flags, time);
+            continue;
+        }
+        vector<char> buf(FRAME_HEADROOM + f.data.size());
+        memcpy(&buf[FRAME_HEADROOM], f.data.data(), f.data.size());
+        sd.err |= send_payload(sd.s, f.cmd, &buf[FRAME_HEADROOM], f.data.size(), f.chan);
+    }
+    (void)close(sd.s->wfd);
+    return NULL;
+}
+
+static int collect(Parser &p, void *user) {
+    vector<Frame> &out = *(vector<Frame> *)user;
+    if (p.cmd == CMD_HELLO) {
+        return 0;
+    }
+    out.push_back(Frame{p.cmd, string((const char *)p.payload, p.size), p.chan});
+    return 0;
+}
+
+enum { WIRE_RAW, WIRE_BASE64, WIRE_ESCAPE };
+
+// over a new pipe, ws and rs may have carried an earlier transport
+static void roundtrip_on(
+    Stream *ws, Stream *rs, const vector<Frame> &frames, int hello_at, int wire, uint32_t flags)
+{
+    static EscapeSet escape;
+    esc_set_default(&escape);
+    int fds[2];
+    REQUIRE(0 == pipe(fds));
+    stream_reset(ws, -1, fds[1]);
+    stream_set_codec(ws, wire == WIRE_BASE64, wire == WIRE_ESCAPE ? &escape : NULL);
+    stream_reset(rs, fds[0], -1);
+    stream_set_codec(rs, wire == WIRE_BASE64, wire == WIRE_ESCAPE ? &escape : NULL);
+
+    Sender sd = {ws, &frames, hello_at, flags, 0};
+    pthread_t tid;
+    REQUIRE(0 == pthread_create(&tid, NULL, &send_frames, &sd));
+
+    vector<Frame> got;
+    Parser p;
+    int err = 0;
+    while (!p.eof && 0 == (err = feed_frame(p, rs, collect, &got))) {}
+    pthread_join(tid, NULL);
+    (void)close(fds[0]);
+
+    CHECK(err == 0);
+    CHECK(sd.err == 0);
+    CHECK(p.version == (hello_at >= 0 ? PROTO_V2 : PROTO_V1));
+    CHECK((rs->zrx != NULL) == (hello_at >= 0 && (flags & HELLO_F_LZ)));
+    REQUIRE(got.size() == frames.size());
+    for (size_t i = 0; i < frames.size(); ++i) {
+        CAPTURE(i);
+        CHECK(got[i].cmd == frames[i].cmd);
+        CHECK(got[i].data == frames[i].data);
+        CHECK(got[i].chan == frames[i].chan);
+    }
+}
+
+static void roundtrip(const vector<Frame> &frames, int hello_at, int wire, uint32_t flags = 0) {
+    Stream *ws = new Stream;
+    Stream *rs = new Stream;
+    roundtrip_on(ws, rs, frames, hello_at, wire, flags);
+    delete ws;
+    delete rs;
+}
+
+static string rand_bytes(size_t n) {
+    string s(n, '\0');
+    for (size_t i = 0; i < n; ++i) {
+        s[i] = (char)rand();
+    }
+    return s;
+}
+
+TEST_CASE("protocol.v1") {
+    vector<Frame> frames = {
+        {CMD_DATA, "a"},
+        {CMD_ERR, rand_bytes(300)},
+        {CMD_DATA, rand_bytes(MAX_FRAME_SIZE - FRAME_HEADER_SIZE)},
+        {CMD_EOF, ""},
+    };
+    roundtrip(frames, -1, WIRE_RAW);
+    roundtrip(frames, -1, WIRE_BASE64);
+    roundtrip(frames, -1, WIRE_ESCAPE);
+}
+
+TEST_CASE("protocol.v2.switch.and.sizes") {
+    vector<Frame> frames = {
+        {CMD_DATA, "before hello"},
+        {CMD_DATA, "x"},
+        {CMD_DATA, rand_bytes(COMPACT_MAX_SIZE)},
+        {CMD_DATA, rand_bytes(COMPACT_MAX_SIZE + 1)},
+        {CMD_ERR, "e"},
+        {CMD_DATA, rand_bytes(70000)},
+        {CMD_DATA, rand_bytes(MAX_PAYLOAD_V2)},
+        {CMD_DATA, "y"},
+        {CMD_EOF, ""},
+    };
+    roundtrip(frames, 1, WIRE_RAW);
+    roundtrip(frames, 1, WIRE_BASE64);
+    roundtrip(frames, 1, WIRE_ESCAPE);
+}
+
+TEST_CASE("protocol.lz") {
+    string prompt = "\x1b[01;32muser@host\x1b[00m:\x1b[01;34m~\x1b[00m$ ";
+    vector<Frame> frames = {
+        {CMD_DATA, "before hello"},
+        {CMD_DATA, prompt},
+        {CMD_DATA, "l"},
+        {CMD_DATA, "s"},
+        {CMD_DATA, prompt},
+        {CMD_ERR, rand_bytes(5000)},
+        {CMD_DATA, string(200000, 'z')},
+        {CMD_DATA, rand_bytes(70000)},
+        {CMD_DATA, prompt},
+        {CMD_EOF, ""},
+    };
+    roundtrip(frames, 1, WIRE_RAW, HELLO_F_LZ);
+    roundtrip(frames, 1, WIRE_BASE64, HELLO_F_LZ);
+    roundtrip(frames, 1, WIRE_ESCAPE, HELLO_F_LZ);
+}
+
+TEST_CASE("protocol.mux") {
+    vector<Frame> frames = {
+        {CMD_DATA, "channel 0 before hello"},
+        {CMD_OPEN, string("\x00\x18\x00\x50\x00", 5), 1},
+        {CMD_OPEN, string("\x01\x00\x00\x00\x00", 5), MAX_CHANNEL},
+        {CMD_DATA, "x", 0},
+        {CMD_DATA, "y", 1},
+        {CMD_ERR, rand_bytes(300), MAX_CHANNEL},
+        {CMD_DATA, rand_bytes(COMPACT_MAX_SIZE), 0},
+        {CMD_DATA, rand_bytes(70000), 200},
+        {CMD_EOF, "", 1},
+        {CMD_DATA, "z", 0},
+        {CMD_EOF, "", MAX_CHANNEL},
+        {CMD_EOF, ""},
+    };
+    roundtrip(frames, 1, WIRE_RAW, HELLO_F_MUX);
+    roundtrip(frames, 1, WIRE_BASE64, HELLO_F_MUX | HELLO_F_LZ);
+}
+
+TEST_CASE("protocol.reset") {
+    vector<Frame> frames = {
+        {CMD_DATA, "first transport"},
+        {CMD_DATA, rand_bytes(3000)},
+        {CMD_EOF, ""},
+    };
+    // a transport that is lost midway leaves state behind
+    vector<Frame> cut = {{CMD_DATA, "x"}, {CMD_DATA, string(3000, 'y')}};
+    Stream *ws = new Stream;
+    Stream *rs = new Stream;
+    roundtrip_on(ws, rs, cut, 1, WIRE_BASE64, HELLO_F_LZ);
+    roundtrip_on(ws, rs, frames, -1, WIRE_RAW, 0);
+    roundtrip_on(ws, rs, frames, 1, WIRE_RAW, HELLO_F_LZ | HELLO_F_RESUME);
+    delete ws;
+    delete rs;
+}
+
+TEST_CASE("protocol.ping") {
+    string ping("\x00\x01\x02\x03\x04\x05\x06\x07\x08", 9);
+    string pong("\x01\xff\xfe\xfd\xfc\xfb\xfa\xf9\xf8", 9);
+    vector<Frame> frames = {
+        {CMD_PING, ping},
+        {CMD_DATA, "between"},
+        {CMD_PING, pong},
+        {CMD_EOF, ""},
+    };
+    roundtrip(frames, 0, WIRE_RAW, HELLO_F_PING);
+    roundtrip(frames, 0, WIRE_BASE64, HELLO_F_PING | HELLO_F_LZ);
+
+    uint8_t flags = 0;
+    uint64_t time = 0;
+    REQUIRE(0 == ping_decode((const uint8_t *)pong.data(), pong.size(), flags, time));
+    CHECK(flags == PING_F_PONG);
+    CHECK(time == 0xf8f9fafbfcfdfeffull);
+    CHECK(0 != ping_decode((const uint8_t *)pong.data(), 8, flags, time));
+}
+
+TEST_CASE("protocol.stats") {
+    vector<Frame> frames = {
+        {CMD_DATA, "before hello"},
+        {CMD_DATA, string(100000, 'z')},
+        {CMD_ERR, rand_bytes(5000)},
+        {CMD_DATA, "x"},
+        {CMD_EOF, ""},
+    };
+    Stream *ws = new Stream;
+    Stream *rs = new Stream;
+    roundtrip_on(ws, rs, frames, 1, WIRE_BASE64, HELLO_F_LZ);
+    const DirStats &tx = ws->stats.tx;
+    const DirStats &rx = rs->stats.rx;
+    CHECK(tx.bytes == rx.bytes);
+    CHECK(tx.wire_bytes == rx.wire_bytes);
+    // compressed, then base64
+    CHECK(tx.wire_bytes < tx.bytes);
+    for (size_t i = 0; i < k_stats_cmds; ++i) {
+        CAPTURE(i);
+        CHECK(tx.frames[i] == rx.frames[i]);
+    }
+    CHECK(tx.frames[CMD_DATA] == 3);
+    CHECK(tx.frames[CMD_HELLO] == 1);
+    CHECK(tx.syscalls > 0);
+    CHECK(rx.syscalls > 0);
+
+    string text;
+    stats_format(text, ws->stats, "role=\"test\"");
+    CHECK(text.find("pty_proxy_frames_total{role=\"test\",dir=\"tx\",cmd=\"data\"} 3\n") != string::npos);
+    delete ws;
+    delete rs;
+}
+
+struct BatchRun {
+    Stream *s;
+    vector<Frame> sent;
+};
+
+// a payload of up to len bytes, committed at now
+static int batch_one(BatchRun &r, Batch &b, size_t len, uint64_t now) {
+    size_t avail = 0;
+    char *buf = batch_reserve(b, r.s, &avail);
+    REQUIRE(buf);
+    string data = rand_bytes(len < avail ? len : avail);
+    memcpy(buf, data.data(), data.size());
+    r.sent.push_back(Frame{CMD_DATA, data});
+    return batch_commit(b, r.s, CMD_DATA, data.size(), now);
+}
+
+TEST_CASE("protocol.batch.flush") {
+    int fds[2];
+    REQUIRE(0 == pipe(fds));
+    Stream *ws = new Stream;
+    Stream *rs = new Stream;
+    stream_reset(ws, -1, fds[1]);
+    stream_reset(rs, fds[0], -1);
+    // room for two v1 frames
+    BufSizes bufs;
+    bufs.batch = MAX_FRAME_SIZE * 2;
+    stream_set_bufs(ws, bufs);
+    BatchRun r = {ws, {}};
+
+    // deadline_us == 0: each frame goes out on its own
+    BatchStats total;
+    Batch each;
+    each.stats = &total;
+    for (int i = 0; i < 3; ++i) {
+        CHECK(0 == batch_one(r, each, 100, 0));
+        CHECK(batch_timeout(each, 0) == -1);
+    }
+    CHECK(total.frames == 3);
+    CHECK(total.flush_other == 3);
+
+    // full: flushed by the commit that leaves less than a frame of room
+    Batch full;
+    full.deadline_us = 1000000;
+    CHECK(0 == batch_one(r, full, 100, 0));
+    CHECK(full.counters.flush_size == 0);
+    CHECK(batch_timeout(full, 0) == 1000000);
+    CHECK(0 == batch_one(r, full, MAX_FRAME_SIZE, 0));
+    CHECK(full.counters.frames == 2);
+    CHECK(full.counters.flush_size == 1);
+    CHECK(batch_timeout(full, 0) == -1);
+
+    // the deadline of the first frame: batch_timeout() says when, the
+    // caller flushes
+    Batch late;
+    late.deadline_us = 500;
+    late.stats = &total;
+    CHECK(0 == batch_one(r, late, 100, 1000));
+    CHECK(0 == batch_one(r, late, 100, 1200));
+    CHECK(batch_timeout(late, 1200) == 300);
+    CHECK(batch_timeout(late, 1600) == 0);
+    CHECK(0 == batch_flush(late, ws, &late.stats->flush_deadline));
+    CHECK(batch_timeout(late, 1600) == -1);
+    CHECK(total.frames == 5);
+    CHECK(total.flush_size == 0);
+    CHECK(total.flush_deadline == 1);
+    CHECK(total.flush_other == 3);
+
+    string text;
+    stats_format_batch(text, total, "role=\"test\"");
+    CHECK(text.find("pty_proxy_batch_frames_total{role=\"test\"} 5\n") != string::npos);
+    CHECK(text.find("pty_proxy_batch_flushes_total{role=\"test\",reason=\"deadline\"} 1\n") != string::npos);
+
+    // everything arrived, in order
+    (void)close(fds[1]);
+    vector<Frame> got;
+    Parser p;
+    int err = 0;
+    while (!p.eof && 0 == (err = feed_frame(p, rs, collect, &got))) {}
+    CHECK(err == 0);
+    REQUIRE(got.size() == r.sent.size());
+    for (size_t i = 0; i < got.size(); ++i) {
+        CAPTURE(i);
+        CHECK(got[i].data == r.sent[i].data);
+    }
+    (void)close(fds[0]);
+    delete ws;
+    delete rs;
+}
+
+TEST_CASE("protocol.no.copies") {
+    // frames cut by every read, parsed where they were read
+    vector<Frame> frames;
+    for (size_t i = 0; i < 300; ++i) {
+        frames.push_back({CMD_DATA, rand_bytes(1 + (size_t)rand() % (MAX_FRAME_SIZE - FRAME_HEADER_SIZE))});
+    }
+    frames.push_back({CMD_EOF, ""});
+    for (int wire : {WIRE_RAW, WIRE_BASE64, WIRE_ESCAPE}) {
+        CAPTURE(wire);
+        Stream *ws = new Stream;
+        Stream *rs = new Stream;
+        roundtrip_on(ws, rs, frames, -1, wire, 0);
+        CHECK(rs->stats.rx.short_io > 0);
+        CHECK(rs->stats.rx.moved == 0);
+        delete ws;
+        delete rs;
+    }
+}
+
+struct Producer {
+    Stream *s;
+    int id;
+    int count;
+    int err;
+};
+
+static void *produce(void *user) {
+    Producer &pr = *(Producer *)user;
+    for (int i = 0; i < pr.count; ++i) {
+        char buf[FRAME_HEADROOM + 32];
+        int len = snprintf(&buf[FRAME_HEADROOM], 32, "%d:%d", pr.id, i);
+        pr.err |= send_payload(pr.s, pr.id % 2 ? CMD_ERR : CMD_DATA, &buf[FRAME_HEADROOM], (size_t)len);
+    }
+    return NULL;
+}
+
+struct Seqs {
+    vector<int> next;       // per sender
+    int got;
+};
+
+static int collect_seq(Parser &p, void *user) {
+    Seqs &sq = *(Seqs *)user;
+    vector<int> &next = sq.next;
+    int id = 0;
+    int i = 0;
+    string text((const char *)p.payload, p.size);
+    REQUIRE(2 == sscanf(text.c_str(), "%d:%d", &id, &i));
+    REQUIRE((size_t)id < next.size());
+    CHECK(p.cmd == (id % 2 ? CMD_ERR : CMD_DATA));
+    CHECK(i == next[id]);
+    next[id] = i + 1;
+    sq.got++;
+    return 0;
+}
+
+TEST_CASE("protocol.concurrent.senders") {
+    // each sender's frames arrive in order, the parser checks the seqs
+    for (int wire : {WIRE_RAW, WIRE_BASE64}) {
+        CAPTURE(wire);
+        int fds[2];
+        REQUIRE(0 == pipe(fds));
+        Stream *ws = new Stream;
+        Stream *rs = new Stream;
+        stream_reset(ws, -1, fds[1]);
+        stream_reset(rs, fds[0], -1);
+        stream_set_codec(ws, wire == WIRE_BASE64, NULL);
+        stream_set_codec(rs, wire == WIRE_BASE64, NULL);
+
+        const int k_senders = 4;
+        const int k_count = 20000;
+        Producer prs[k_senders];
+        pthread_t tids[k_senders];
+        for (int id = 0; id < k_senders; ++id) {
+            prs[id] = Producer{ws, id, k_count, 0};
+            REQUIRE(0 == pthread_create(&tids[id], NULL, &produce, &prs[id]));
+        }
+        Seqs sq = {vector<int>(k_senders, 0), 0};
+        Parser p;
+        int err = 0;
+        while (sq.got < k_senders * k_count && 0 == (err = feed_frame(p, rs, collect_seq, &sq))) {}
+        for (int id = 0; id < k_senders; ++id) {
+            pthread_join(tids[id], NULL);
+            CHECK(prs[id].err == 0);
+            CHECK(sq.next[id] == k_count);
+        }
+        CHECK(err == 0);
+        CHECK(ws->stats.tx.frames[CMD_DATA] + ws->stats.tx.frames[CMD_ERR] == (uint64_t)(k_senders * k_count));
+        CHECK(ws->txq == NULL);
+        (void)close(fds[0]);
+        (void)close(fds[1]);
+        delete ws;
+        delete rs;
+    }
+}
+
+TEST_CASE("protocol.instances") {
+    // interleaved streams, each keeps its own seqs
+    const size_t k_streams = 8;
+    Stream *ws[k_streams];
+    Stream *rs[k_streams];
+    int fds[k_streams][2];
+    for (size_t i = 0; i < k_streams; ++i) {
+        REQUIRE(0 == pipe(fds[i]));
+        ws[i] = new Stream;
+        rs[i] = new Stream;
+        stream_reset(ws[i], -1, fds[i][1]);
+        stream_reset(rs[i], fds[i][0], -1);
+        if (i % 2) {
+            Hello h;
+            h.version = PROTO_V2;
+            h.max_frame = MAX_PAYLOAD_V2;
+            REQUIRE(0 == send_hello(ws[i], h, MAX_PAYLOAD_V2));
+        }
+    }
+    Parser ps[k_streams];
+    for (int round = 0; round < 300; ++round) {
+        for (size_t i = 0; i < k_streams; ++i) {
+            Frame f = {CMD_DATA, rand_bytes(1 + (size_t)rand() % 200)};
+            vector<char> buf(FRAME_HEADROOM + f.data.size());
+            memcpy(&buf[FRAME_HEADROOM], f.data.data(), f.data.size());
+            REQUIRE(0 == send_payload(ws[i], f.cmd, &buf[FRAME_HEADROOM], f.data.size()));
+
+            vector<Frame> got;
+            while (got.empty()) {
+                REQUIRE(0 == feed_frame(ps[i], rs[i], collect, &got));
+            }
+            REQUIRE(got.size() == 1);
+            CHECK(got[0].data == f.data);
+        }
+    }
+    for (size_t i = 0; i < k_streams; ++i) {
+        CHECK(ps[i].version == (i % 2 ? PROTO_V2 : PROTO_V1));
+        (void)close(fds[i][0]);
+        (void)close(fds[i][1]);
+        delete ws[i];
+        delete rs[i];
+    }
+}
+
+TEST_CASE("protocol.hello") {
+    Hello h;
+    h.version = PROTO_V2;
+    h.flags = 0x12345678;
+    h.max_frame = 1 << 20;
+    uint8_t buf[k_hello_size + 1];
+    REQUIRE(k_hello_size == hello_encode(h, buf));
+
+    Hello out;
+    REQUIRE(0 == hello_decode(buf, k_hello_size, out));
+    CHECK(out.version == h.version);
+    CHECK(out.flags == h.flags);
+    CHECK(out.max_frame == h.max_frame);
+    CHECK(0 != hello_decode(buf, k_hello_size - 1, out));
+    buf[0] = 'x';
+    CHECK(0 != hello_decode(buf, k_hello_size, out));
+}
+
+TEST_CASE("protocol.max.frame") {
+    // a peer that ignores a low-memory hello is cut off at the header,
+    // before the Parser grows for the frame
+    BufSizes bufs;
+    bufs_low_mem(bufs);
+    int fds[2];
+    REQUIRE(0 == pipe(fds));
+    Stream *ws = new Stream;
+    Stream *rs = new Stream;
+    stream_reset(ws, -1, fds[1]);
+    stream_reset(rs, fds[0], -1);
+    stream_set_bufs(rs, bufs);
+
+    Hello h;
+    h.version = PROTO_V2;
+    h.max_frame = MAX_PAYLOAD_V2;
+    REQUIRE(0 == send_hello(ws, h, MAX_PAYLOAD_V2));
+    // the largest frame it offered, then a header of MAX_PAYLOAD_V2
+    vector<char> buf(FRAME_HEADROOM + bufs.max_frame, 'x');
+    REQUIRE(0 == send_payload(ws, CMD_DATA, &buf[FRAME_HEADROOM], bufs.max_frame));
+    const uint8_t head[] = {CMD_DATA, 0, 0x80, 0x80, 0x40};
+    REQUIRE(write(fds[1], head, sizeof(head)) == (ssize_t)sizeof(head));
+    (void)close(fds[1]);
+
+    vector<Frame> got;
+    Parser p;
+    int err = 0;
+    while (!p.eof && 0 == (err = feed_frame(p, rs, collect, &got))) {}
+    CHECK(err == -1);
+    CHECK(p.version == PROTO_V2);
+    REQUIRE(got.size() == 1);
+    CHECK(got[0].data.size() == bufs.max_frame);
+    CHECK(p.input.cap < MAX_PAYLOAD_V2);
+    (void)close(fds[0]);
+    delete ws;
+    delete rs;
+}
+
+// kB, from /proc/self/status
+static long proc_status(const char *key) {
+    FILE *f = fopen("/proc/self/status", "r");
+    if (!f) {
+        return -1;
+    }
+    char line[256];
+    long kb = -1;
+    size_t key_len = strlen(key);
+    while (fgets(line, sizeof(line), f)) {
+        if (0 == strncmp(line, key, key_len) && line[key_len] == ':') {
+            kb = atol(&line[key_len + 1]);
+            break;
+        }
+    }
+    (void)fclose(f);
+    return kb;
+}
+
+struct Bulk {
+    Stream *s;
+    size_t total;
+    int err;
+};
+
+// bufs.io at a time, as the slave reads its child
+static void *send_bulk(void *user) {
+    Bulk &b = *(Bulk *)user;
+    const BufSizes &bufs = b.s->bufs;
+    Hello h;
+    h.version = PROTO_V2;
+    h.max_frame = bufs.max_frame;
+    b.err = send_hello(b.s, h, bufs.max_frame);
+    vector<char> buf(FRAME_HEADROOM + bufs.io, 'x');
+    for (size_t sent = 0; !b.err && sent < b.total; sent += bufs.io) {
+        b.err = send_payload(b.s, CMD_DATA, &buf[FRAME_HEADROOM], bufs.io);
+    }
+    (void)close(b.s->wfd);
+    return NULL;
+}
+
+static int count_bytes(Parser &p, void *user) {
+    if (p.cmd == CMD_DATA) {
+        *(size_t *)user += p.size;
+    }
+    return 0;
+}
+
+struct LowMem {
+    long growth_kb;
+    double mb_per_s;
+    int err;
+};
+
+// in a child of its own, so the peak is of this session only
+static LowMem low_mem_session(int wire, size_t total) {
+    BufSizes bufs;
+    bufs_low_mem(bufs);
+    g_thread_stack = k_thread_stack_low_mem;
+    LowMem r = {0, 0, 0};
+    long start_kb = proc_status("VmRSS");
+    uint64_t start_us = monotonic_us();
+
+    int fds[2];
+    if (0 != pipe(fds)) {
+        r.err = 1;
+        return r;
+    }
+    Stream *ws = new Stream;
+    Stream *rs = new Stream;
+    stream_reset(ws, -1, fds[1]);
+    stream_reset(rs, fds[0], -1);
+    stream_set_codec(ws, wire == WIRE_BASE64, NULL);
+    stream_set_codec(rs, wire == WIRE_BASE64, NULL);
+    stream_set_bufs(ws, bufs);
+    stream_set_bufs(rs, bufs);
+    Bulk b = {ws, total, 0};
+    pthread_attr_t attr;
+    pthread_t tid;
+    if (0 != thread_attr_init(&attr, 0) || 0 != pthread_create(&tid, &attr, &send_bulk, &b)) {
+        r.err = 1;
+        return r;
+    }
+    (void)pthread_attr_destroy(&attr);
+    size_t got = 0;
+    Parser p;
+    while (!p.eof && 0 == (r.err = feed_frame(p, rs, count_bytes, &got))) {}
+    pthread_join(tid, NULL);
+    r.err |= b.err || got < total || p.version != PROTO_V2;
+
+    r.mb_per_s = (double)got / (double)(monotonic_us() - start_us + 1);
+    r.growth_kb = proc_status("VmHWM") - start_kb;
+    (void)close(fds[0]);
+    delete ws;
+    delete rs;
+    return r;
+}
+
+TEST_CASE("protocol.low.mem") {
+    // the budget bufs_low_mem() documents, and a throughput floor well
+    // below what a slow board does
+    const long k_budget_kb = 1024;
+    const double k_min_mb_per_s = 20;
+    for (int wire : {WIRE_RAW, WIRE_BASE64}) {
+        CAPTURE(wire);
+        int fds[2];
+        REQUIRE(0 == pipe(fds));
+        pid_t pid = fork();
+        REQUIRE(pid >= 0);
+        if (pid == 0) {
+            LowMem r = low_mem_session(wire, 64 << 20);
+            _exit(write(fds[1], &r, sizeof(r)) == (ssize_t)sizeof(r) ? 0 : 1);
+        }
+        LowMem r = {0, 0, 1};
+        CHECK(read(fds[0], &r, sizeof(r)) == (ssize_t)sizeof(r));
+        int status = 0;
+        (void)waitpid(pid, &status, 0);
+        (void)close(fds[0]);
+        (void)close(fds[1]);
+        CAPTURE(r.growth_kb);
+        CAPTURE(r.mb_per_s);
+        CHECK(r.err == 0);
+        CHECK(r.growth_kb >= 0);
+        CHECK(r.growth_kb < k_budget_kb);
+        CHECK(r.mb_per_s > k_min_mb_per_s);
+    }
+}
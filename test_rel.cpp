@@ -0,0 +1,499 @@
+#include "doctest/doctest/doctest.h"
+
+// system
+#include <poll.h>
+#include <signal.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <string>
+// proj
+#include "event.h"
+#include "protocol.h"
+#include "rel.h"
+#include "util.h"
+
+
+using namespace std;
+
+
+TEST_CASE("rel.frame") {
+    uint8_t payload[100];
+    for (size_t i = 0; i < sizeof(payload); ++i) {
+        payload[i] = (uint8_t)(i * 7);
+    }
+    uint8_t buf[256];
+    size_t size = rel_encode(buf, CMD_DATA, 3, 0x12345678, payload, sizeof(payload));
+    CHECK(size == rel_frame_size(sizeof(payload)));
+
+    RelFrame f;
+    REQUIRE((int)size == rel_decode(buf, size, f));
+    CHECK(f.cmd == CMD_DATA);
+    CHECK(f.chan == 3);
+    CHECK(f.seq == 0x12345678);
+    CHECK(f.len == sizeof(payload));
+    CHECK(!f.bad);
+    CHECK(0 == memcmp(f.payload, payload, sizeof(payload)));
+
+    // incomplete
+    RelFrame g;
+    CHECK(0 == rel_decode(buf, 5, g));
+    CHECK(g.need == k_rel_header_size);
+    CHECK(0 == rel_decode(buf, size - 1, g));
+    CHECK(g.need == size);
+
+    // garbage in front is skipped up to the magic byte
+    uint8_t noisy[300] = {1, 2, 3};
+    memcpy(noisy + 3, buf, size);
+    CHECK(-3 == rel_decode(noisy, size + 3, g));
+
+    // any bit flipped is caught
+    for (size_t bit = 0; bit < size * 8; ++bit) {
+        CAPTURE(bit);
+        buf[bit / 8] ^= (uint8_t)(1 << (bit % 8));
+        RelFrame h;
+        int n = rel_decode(buf, size, h);
+        if (bit < k_rel_header_size * 8) {
+            CHECK(n < 0);
+        } else {
+            CHECK(n == (int)size);
+            CHECK(h.bad);
+        }
+        buf[bit / 8] ^= (uint8_t)(1 << (bit % 8));
+    }
+
+    // no payload, no payload crc
+    CHECK(k_rel_header_size == rel_encode(buf, CMD_EOF, 0, 1, NULL, 0));
+    CHECK((int)k_rel_header_size == rel_decode(buf, k_rel_header_size, f));
+    CHECK(f.cmd == CMD_EOF);
+}
+
+TEST_CASE("rel.receiver") {
+    RelLink *r = rel_new();
+    REQUIRE(r);
+    uint8_t ack[64];
+    RelFrame f;
+    uint32_t cum = 0;
+    uint64_t sack = 0;
+
+    // in order, acked a little later
+    CHECK(REL_DELIVER == rel_accept(*r, 0, 1000));
+    CHECK(r->ack_at == 1000 + k_rel_ack_delay_us);
+    // 1 is missing, 2 and 4 are kept and acked at once
+    CHECK(REL_STORE == rel_accept(*r, 2, 2000));
+    CHECK(r->ack_at == 2000);
+    CHECK(REL_STORE == rel_accept(*r, 4, 2000));
+    CHECK(REL_DROP == rel_accept(*r, 2, 2000));
+    CHECK(REL_DROP == rel_accept(*r, 0, 2000));
+    CHECK(REL_DROP == rel_accept(*r, 1 + k_rel_max_frames, 2000));
+    CHECK(-1 == rel_next(*r, 2000));
+
+    size_t size = rel_ack(*r, ack);
+    CHECK(r->ack_at == 0);
+    REQUIRE((int)size == rel_decode(ack, size, f));
+    CHECK(f.cmd == CMD_ACK);
+    REQUIRE(0 == rel_ack_decode(f.payload, f.len, cum, sack));
+    CHECK(cum == 1);
+    CHECK(sack == 0x5);
+
+    // 1 came again, 2 follows it, 3 is still missing
+    CHECK(REL_DELIVER == rel_accept(*r, 1, 3000));
+    CHECK(2 == rel_next(*r, 3000));
+    CHECK(-1 == rel_next(*r, 3000));
+    CHECK(REL_DELIVER == rel_accept(*r, 3, 3000));
+    CHECK(4 == rel_next(*r, 3000));
+    CHECK(-1 == rel_next(*r, 3000));
+    size = rel_ack(*r, ack);
+    REQUIRE((int)size == rel_decode(ack, size, f));
+    REQUIRE(0 == rel_ack_decode(f.payload, f.len, cum, sack));
+    CHECK(cum == 5);
+    CHECK(sack == 0);
+
+    // across the wrap of the seq
+    r->expected = UINT32_MAX;
+    CHECK(REL_STORE == rel_accept(*r, 0, 4000));
+    CHECK(REL_DELIVER == rel_accept(*r, UINT32_MAX, 4000));
+    CHECK(0 == rel_next(*r, 4000));
+    CHECK(r->expected == 1);
+    rel_free(r);
+}
+
+TEST_CASE("rel.sender") {
+    RelLink *r = rel_new();
+    REQUIRE(r);
+    r->tx_on = 1;
+    uint8_t payload[100] = {};
+    size_t size = rel_frame_size(sizeof(payload));
+    uint64_t now = 1000;
+    RelTx f;
+
+    // nothing in flight
+    CHECK(rel_deadline(*r) == UINT64_MAX);
+    for (int i = 0; i < 4; ++i) {
+        REQUIRE(rel_fits(*r, size, 0));
+        rel_push(*r, CMD_DATA, 0, payload, sizeof(payload), now);
+    }
+    CHECK(mirror_len(r->out) == 4 * size);
+    CHECK(rel_deadline(*r) == now + k_rel_rto_init_us);
+    CHECK(!rel_resend(*r, now + 1000, f));
+
+    // 0 is acked after 10 ms, 2 is sacked: 1 is lost, sent again after
+    // the round trip and a quarter
+    rel_acked(*r, 1, 0x1, now + 10000);
+    CHECK(r->unacked.size() == 3);
+    CHECK(mirror_len(r->out) == 3 * size);
+    CHECK(r->srtt_us == 10000);
+    CHECK(r->rto_us == k_rel_rto_min_us);
+    CHECK(rel_deadline(*r) == now + 12500);
+    CHECK(!rel_resend(*r, now + 12000, f));
+    REQUIRE(rel_resend(*r, now + 12500, f));
+    CHECK(f.seq == 1);
+    CHECK(f.sends == 2);
+    CHECK(f.pos == r->out.begin);
+    CHECK(!rel_resend(*r, now + 13000, f));
+
+    // 1 is not sent again that soon, 3 times out; the timeout is doubled
+    // only when the oldest one does
+    REQUIRE(rel_resend(*r, now + k_rel_rto_min_us, f));
+    CHECK(f.seq == 3);
+    CHECK(r->rto_us == k_rel_rto_min_us);
+    REQUIRE(rel_resend(*r, now + 12500 + k_rel_rto_min_us, f));
+    CHECK(f.seq == 1);
+    CHECK(r->rto_us == 2 * k_rel_rto_min_us);
+
+    // all acked, a frame sent twice is no sample
+    rel_acked(*r, 4, 0, now + 100000);
+    CHECK(r->unacked.empty());
+    CHECK(mirror_len(r->out) == 0);
+    CHECK(r->srtt_us == 10000);
+    // an old ack changes nothing
+    rel_acked(*r, 2, 0, now + 100000);
+    CHECK(r->next_seq == 4);
+
+    // the window is full after k_rel_max_frames, small frames still fit
+    size_t frames = 0;
+    while (rel_fits(*r, size, 0)) {
+        rel_push(*r, CMD_DATA, 0, payload, sizeof(payload), now);
+        frames++;
+    }
+    CHECK(frames == k_rel_max_frames);
+    CHECK(rel_fits(*r, rel_frame_size(k_rel_small), 1));
+    CHECK(!rel_fits(*r, rel_frame_size(k_rel_max_payload), 0));
+    rel_free(r);
+}
+
+// One side of a link whose bytes get flipped, dropped and inserted on the
+// way, by a relay thread per direction
+struct Relay {
+    int in;
+    int out;
+    uint64_t rng;
+    int stop;
+    size_t damaged;
+};
+
+static uint32_t next_rand(uint64_t &rng) {
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return (uint32_t)rng;
+}
+
+static void *relay(void *user) {
+    Relay &r = *(Relay *)user;
+    // the hello, [v1 header][11 bytes], goes through intact
+    size_t clean = FRAME_HEADER_SIZE + k_hello_size;
+    uint8_t buf[8192];
+    uint8_t out[8192 * 2];
+    while (!__atomic_load_n(&r.stop, __ATOMIC_RELAXED)) {
+        struct pollfd pfd = {r.in, POLLIN, 0};
+        if (poll(&pfd, 1, 10) <= 0) {
+            continue;
+        }
+        ssize_t nread = read(r.in, buf, sizeof(buf));
+        if (nread <= 0) {
+            break;
+        }
+        size_t len = 0;
+        for (ssize_t i = 0; i < nread; ++i) {
+            uint32_t dice = next_rand(r.rng) % 200000;
+            if (clean > 0) {
+                clean--;
+                dice = UINT32_MAX;
+            }
+            if (dice == 0) {
+                r.damaged++;
+                continue;
+            }
+            out[len++] = buf[i];
+            if (dice == 1) {
+                r.damaged++;
+                out[len - 1] ^= (uint8_t)(1 << (next_rand(r.rng) % 8));
+            } else if (dice == 2) {
+                r.damaged++;
+                out[len++] = (uint8_t)next_rand(r.rng);
+            }
+        }
+        if (write_full(r.out, out, len) != (ssize_t)len) {
+            break;
+        }
+    }
+    (void)close(r.out);
+    return NULL;
+}
+
+struct Peer {
+    Stream *s;
+    string got;
+    string chans[2];
+    size_t bytes;
+    pthread_t reader;
+    int slow;           // sleeps now and then, so the sender's window fills
+    size_t pongs;
+};
+
+static int peer_frame(Parser &p, void *user) {
+    Peer &peer = *(Peer *)user;
+    if (p.cmd == CMD_DATA) {
+        peer.got.append((const char *)p.payload, p.size);
+        if (p.chan < 2) {
+            peer.chans[p.chan].append((const char *)p.payload, p.size);
+        }
+        __atomic_store_n(&peer.bytes, peer.got.size(), __ATOMIC_RELEASE);
+        if (peer.slow && rand() % 16 == 0) {
+            (void)usleep(1000);
+        }
+    } else if (p.cmd == CMD_PING) {
+        uint8_t flags = 0;
+        uint64_t time = 0;
+        REQUIRE(0 == ping_decode(p.payload, p.size, flags, time));
+        if (flags & PING_F_PONG) {
+            __atomic_add_fetch(&peer.pongs, 1, __ATOMIC_RELAXED);
+        } else {
+            // answered by the reader, as the master and the slave do
+            return send_ping(peer.s, PING_F_PONG, time);
+        }
+    }
+    return 0;
+}
+
+static void *peer_read(void *user) {
+    Peer &peer = *(Peer *)user;
+    Parser p;
+    while (!p.eof && 0 == feed_frame(p, peer.s, peer_frame, &peer)) {}
+    return NULL;
+}
+
+struct Bulk {
+    Stream *s;
+    string data;
+    uint32_t chan;
+};
+
+static void *bulk_send(void *user) {
+    Bulk &b = *(Bulk *)user;
+    size_t chunk = 3000;
+    char buf[FRAME_HEADROOM + 3000];
+    for (size_t pos = 0; pos < b.data.size(); pos += chunk) {
+        size_t len = min(chunk, b.data.size() - pos);
+        memcpy(buf + FRAME_HEADROOM, &b.data[pos], len);
+        if (0 != send_payload(b.s, CMD_DATA, buf + FRAME_HEADROOM, len, b.chan)) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+TEST_CASE("rel.noisy") {
+    (void)signal(SIGPIPE, SIG_IGN);
+    // a -> relay -> b and back
+    int ab[2];
+    int ab2[2];
+    int ba[2];
+    int ba2[2];
+    REQUIRE(0 == pipe(ab));
+    REQUIRE(0 == pipe(ab2));
+    REQUIRE(0 == pipe(ba));
+    REQUIRE(0 == pipe(ba2));
+    Relay to_b = {ab[0], ab2[1], 0x9e3779b97f4a7c15ull, 0, 0};
+    Relay to_a = {ba[0], ba2[1], 0xdeadbeefcafef00dull, 0, 0};
+    Peer a = {};
+    Peer b = {};
+    a.s = new Stream;
+    b.s = new Stream;
+    stream_reset(a.s, ba2[0], ab[1]);
+    stream_reset(b.s, ab2[0], ba[1]);
+    pthread_t relays[2];
+    REQUIRE(0 == pthread_create(&relays[0], NULL, &relay, &to_b));
+    REQUIRE(0 == pthread_create(&relays[1], NULL, &relay, &to_a));
+    REQUIRE(0 == pthread_create(&a.reader, NULL, &peer_read, &a));
+    REQUIRE(0 == pthread_create(&b.reader, NULL, &peer_read, &b));
+
+    Hello h;
+    h.version = PROTO_V2;
+    h.flags = HELLO_F_REL;
+    h.max_frame = MAX_PAYLOAD_V2;
+    REQUIRE(0 == send_hello(a.s, h, MAX_PAYLOAD_V2));
+    REQUIRE(0 == send_hello(b.s, h, MAX_PAYLOAD_V2));
+    CHECK(stream_max_payload(a.s) == k_rel_max_payload);
+
+    // bulk one way, keystrokes the other
+    Bulk bulk = {a.s, string(2000000, '\0'), 0};
+    for (char &c : bulk.data) {
+        c = (char)rand();
+    }
+    pthread_t sender;
+    REQUIRE(0 == pthread_create(&sender, NULL, &bulk_send, &bulk));
+    string keys;
+    for (int i = 0; i < 300; ++i) {
+        char buf[FRAME_HEADROOM + 1];
+        buf[FRAME_HEADROOM] = (char)('a' + i % 26);
+        keys += buf[FRAME_HEADROOM];
+        REQUIRE(0 == send_payload(b.s, CMD_DATA, buf + FRAME_HEADROOM, 1));
+    }
+    pthread_join(sender, NULL);
+
+    uint64_t deadline = monotonic_us() + 60000000;
+    while (monotonic_us() < deadline) {
+        if (__atomic_load_n(&b.bytes, __ATOMIC_ACQUIRE) >= bulk.data.size()
+            && __atomic_load_n(&a.bytes, __ATOMIC_ACQUIRE) >= keys.size())
+        {
+            break;
+        }
+        (void)usleep(10000);
+    }
+    // the readers end with the relays
+    __atomic_store_n(&to_b.stop, 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&to_a.stop, 1, __ATOMIC_RELAXED);
+    pthread_join(relays[0], NULL);
+    pthread_join(relays[1], NULL);
+    pthread_join(a.reader, NULL);
+    pthread_join(b.reader, NULL);
+
+    CHECK(b.got.size() == bulk.data.size());
+    CHECK(b.got == bulk.data);
+    CHECK(a.got == keys);
+    CAPTURE(to_b.damaged);
+    CAPTURE(to_a.damaged);
+    CHECK(to_b.damaged > 0);
+    CHECK(b.s->stats.rx.dropped > 0);
+    CHECK(a.s->stats.tx.resent > 0);
+    CHECK(a.s->stats.rx.frames[CMD_ACK] > 0);
+
+    delete a.s;
+    delete b.s;
+    int fds[] = {ab[0], ab[1], ab2[0], ba[0], ba[1], ba2[0]};
+    for (int fd : fds) {
+        (void)close(fd);
+    }
+}
+
+struct Pinger {
+    Stream *s;
+    int stop;
+};
+
+static void *pinger(void *user) {
+    Pinger &pg = *(Pinger *)user;
+    while (!__atomic_load_n(&pg.stop, __ATOMIC_RELAXED)) {
+        if (0 != send_ping(pg.s, 0, monotonic_us())) {
+            break;
+        }
+        (void)usleep(1000);
+    }
+    return NULL;
+}
+
+// the slave's way, the turn is held across the batch
+static void *batch_send(void *user) {
+    Bulk &b = *(Bulk *)user;
+    Batch batch;
+    batch.deadline_us = 1000000;
+    for (size_t pos = 0; pos < b.data.size(); ) {
+        size_t avail = 0;
+        char *buf = batch_reserve(batch, b.s, &avail);
+        if (!buf) {
+            if (0 != batch_flush(batch, b.s, &batch.stats->flush_size)) {
+                return NULL;
+            }
+            continue;
+        }
+        size_t len = min(min(avail, (size_t)3000), b.data.size() - pos);
+        memcpy(buf, &b.data[pos], len);
+        if (0 != batch_commit(batch, b.s, CMD_DATA, len, monotonic_us(), b.chan)) {
+            return NULL;
+        }
+        pos += len;
+    }
+    (void)batch_flush(batch, b.s, &batch.stats->flush_other);
+    return NULL;
+}
+
+TEST_CASE("rel.pings") {
+    (void)signal(SIGPIPE, SIG_IGN);
+    // b's window fills, from a batch and from txq, while both readers
+    // answer pings
+    int ab[2];
+    int ba[2];
+    REQUIRE(0 == pipe(ab));
+    REQUIRE(0 == pipe(ba));
+    Peer a = {};
+    Peer b = {};
+    a.s = new Stream;
+    b.s = new Stream;
+    a.slow = 1;
+    stream_reset(a.s, ba[0], ab[1]);
+    stream_reset(b.s, ab[0], ba[1]);
+    REQUIRE(0 == pthread_create(&a.reader, NULL, &peer_read, &a));
+    REQUIRE(0 == pthread_create(&b.reader, NULL, &peer_read, &b));
+
+    Hello h;
+    h.version = PROTO_V2;
+    h.flags = HELLO_F_REL | HELLO_F_MUX;
+    h.max_frame = MAX_PAYLOAD_V2;
+    REQUIRE(0 == send_hello(a.s, h, MAX_PAYLOAD_V2));
+    REQUIRE(0 == send_hello(b.s, h, MAX_PAYLOAD_V2));
+
+    // in one channel each, the reader keeps them apart
+    Bulk batched = {b.s, string(2000000, '\0'), 0};
+    Bulk queued = {b.s, string(2000000, '\0'), 1};
+    for (size_t i = 0; i < batched.data.size(); ++i) {
+        batched.data[i] = (char)rand();
+        queued.data[i] = (char)rand();
+    }
+    Pinger ping_a = {a.s, 0};
+    Pinger ping_b = {b.s, 0};
+    pthread_t threads[4];
+    REQUIRE(0 == pthread_create(&threads[0], NULL, &pinger, &ping_a));
+    REQUIRE(0 == pthread_create(&threads[1], NULL, &pinger, &ping_b));
+    REQUIRE(0 == pthread_create(&threads[2], NULL, &batch_send, &batched));
+    REQUIRE(0 == pthread_create(&threads[3], NULL, &bulk_send, &queued));
+
+    size_t total = batched.data.size() + queued.data.size();
+    uint64_t deadline = monotonic_us() + 60000000;
+    while (monotonic_us() < deadline && __atomic_load_n(&a.bytes, __ATOMIC_ACQUIRE) < total) {
+        (void)usleep(10000);
+    }
+    CHECK(__atomic_load_n(&a.bytes, __ATOMIC_ACQUIRE) == total);
+    __atomic_store_n(&ping_a.stop, 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&ping_b.stop, 1, __ATOMIC_RELAXED);
+    for (pthread_t t : threads) {
+        pthread_join(t, NULL);
+    }
+    // the readers end with the write ends
+    (void)close(ab[1]);
+    (void)close(ba[1]);
+    pthread_join(a.reader, NULL);
+    pthread_join(b.reader, NULL);
+
+    CHECK(a.chans[0] == batched.data);
+    CHECK(a.chans[1] == queued.data);
+    CHECK(a.pongs > 0);
+    CHECK(b.pongs > 0);
+
+    delete a.s;
+    delete b.s;
+    (void)close(ab[0]);
+    (void)close(ba[0]);
+}
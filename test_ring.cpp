@@ -0,0 +1,115 @@
+#include "doctest/doctest/doctest.h"
+
+// system
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <string>
+// proj
+#include "ring.h"
+
+
+using namespace std;
+
+
+static string read_from(const Ring &r, uint64_t seq) {
+    string s;
+    while (seq < r.end) {
+        const uint8_t *p = NULL;
+        size_t n = ring_peek(r, seq, &p);
+        REQUIRE(n > 0);
+        s.append((const char *)p, n);
+        seq += n;
+    }
+    return s;
+}
+
+TEST_CASE("ring.append.and.wrap") {
+    Ring r;
+    REQUIRE(0 == ring_open(r, 100, NULL));
+    CHECK(r.cap == 4096);
+    CHECK(ring_start(r) == 0);
+
+    string all;
+    for (int i = 0; i < 1000; ++i) {
+        string line = "line " + to_string(i) + "\r\n";
+        ring_append(r, line.data(), line.size());
+        all += line;
+    }
+    CHECK(r.end == all.size());
+    CHECK(ring_start(r) == all.size() - r.cap);
+    // resuming anywhere in the window gets exactly the rest
+    for (uint64_t seq : {ring_start(r), ring_start(r) + 1, r.end - 100, r.end}) {
+        CAPTURE(seq);
+        CHECK(read_from(r, seq) == all.substr(seq));
+    }
+    ring_close(r);
+}
+
+TEST_CASE("ring.large.append") {
+    Ring r;
+    REQUIRE(0 == ring_open(r, 4096, NULL));
+    string big(10000, '\0');
+    for (size_t i = 0; i < big.size(); ++i) {
+        big[i] = (char)rand();
+    }
+    ring_append(r, "abc", 3);
+    ring_append(r, big.data(), big.size());
+    CHECK(r.end == 10003);
+    CHECK(read_from(r, ring_start(r)) == big.substr(big.size() - r.cap));
+    ring_close(r);
+}
+
+TEST_CASE("ring.file") {
+    char path[] = "/tmp/test_ring.XXXXXX";
+    int fd = mkstemp(path);
+    REQUIRE(fd >= 0);
+    (void)close(fd);
+
+    Ring r;
+    REQUIRE(0 == ring_open(r, 8192, path));
+    ring_append(r, "persisted", 9);
+    CHECK(read_from(r, 0) == "persisted");
+    ring_close(r);
+    CHECK(0 == unlink(path));
+}
+
+TEST_CASE("mirror.wrap") {
+    MirrorRing m;
+    REQUIRE(0 == mirror_open(m, 4096));
+    REQUIRE(m.cap >= 4096);
+    // queued bytes straddle the end of the buffer, read in one piece
+    string all;
+    for (size_t i = 0; i < 100; ++i) {
+        string chunk(1000 + i, (char)('a' + i % 26));
+        REQUIRE(mirror_room(m) >= chunk.size());
+        memcpy(mirror_tail(m), chunk.data(), chunk.size());
+        mirror_commit(m, chunk.size());
+        all += chunk;
+        REQUIRE(string((const char *)mirror_data(m), mirror_len(m)) == all);
+        // keep the last 3 bytes queued
+        mirror_consume(m, all.size() - 3);
+        all = all.substr(all.size() - 3);
+    }
+    CHECK(m.end > m.cap);
+    mirror_close(m);
+    CHECK(m.buf == NULL);
+}
+
+TEST_CASE("mirror.reserve") {
+    MirrorRing m;
+    REQUIRE(0 == mirror_reserve(m, 100));
+    size_t cap = m.cap;
+    CHECK(cap >= 4096);
+    memset(mirror_tail(m), 'x', cap - 96);
+    mirror_commit(m, cap - 96);
+    mirror_consume(m, cap - 106);
+    memcpy(mirror_tail(m), "0123456789", 10);
+    mirror_commit(m, 10);
+    REQUIRE(0 == mirror_reserve(m, cap + 1));
+    CHECK(m.cap == cap * 2);
+    CHECK(string((const char *)mirror_data(m), mirror_len(m)) == "xxxxxxxxxx0123456789");
+    REQUIRE(0 == mirror_reserve(m, 100));
+    CHECK(m.cap == cap * 2);
+    mirror_close(m);
+}
@@ -0,0 +1,199 @@
+#include "doctest/doctest/doctest.h"
+
+// system
+#include <string.h>
+#include <stdlib.h>
+#include <string>
+// proj
+#include "screen.h"
+
+
+using namespace std;
+
+
+static void feed(Term &t, const string &s) {
+    term_feed(t, (const uint8_t *)s.data(), s.size());
+}
+
+static string row_text(const Term &t, int y) {
+    string s;
+    for (int x = 0; x < t.cols; ++x) {
+        uint32_t ch = term_cell(t, y, x).ch;
+        s += ch < 0x80 ? (char)ch : '?';
+    }
+    while (!s.empty() && s.back() == ' ') {
+        s.pop_back();
+    }
+    return s;
+}
+
+// the master's terminal is modeled by a second Term fed with the render
+static void check_render(Term &t, View &v, Term &peer, size_t *len = NULL) {
+    string out;
+    term_render(t, v, out);
+    feed(peer, out);
+    if (len) {
+        *len = out.size();
+    }
+    REQUIRE(peer.rows == t.rows);
+    for (int y = 0; y < t.rows; ++y) {
+        for (int x = 0; x < t.cols; ++x) {
+            CAPTURE(y);
+            CAPTURE(x);
+            const Cell &a = term_cell(t, y, x);
+            const Cell &b = term_cell(peer, y, x);
+            CHECK(a.ch == b.ch);
+            CHECK(a.flags == b.flags);
+            CHECK(a.attr.fg == b.attr.fg);
+            CHECK(a.attr.bg == b.attr.bg);
+            CHECK(a.attr.flags == b.attr.flags);
+        }
+    }
+    CHECK(peer.cur.y == t.cur.y);
+    CHECK(peer.cur.x == t.cur.x);
+    CHECK(peer.modes == t.modes);
+    CHECK(peer.title == t.title);
+}
+
+TEST_CASE("screen.text.and.wrap") {
+    Term t;
+    term_init(t, 4, 10);
+    feed(t, "hello\r\nworld, this wraps");
+    CHECK(row_text(t, 0) == "hello");
+    CHECK(row_text(t, 1) == "world, thi");
+    CHECK(row_text(t, 2) == "s wraps");
+    CHECK(t.cur.y == 2);
+    CHECK(t.cur.x == 7);
+
+    // scrolls at the bottom
+    feed(t, "\r\n1\r\n2\r\n3");
+    CHECK(row_text(t, 0) == "s wraps");
+    CHECK(row_text(t, 3) == "3");
+}
+
+TEST_CASE("screen.csi") {
+    Term t;
+    term_init(t, 5, 20);
+    feed(t, "abcdef\x1b[3D\x1b[1P");
+    CHECK(row_text(t, 0) == "abcef");
+    feed(t, "\x1b[2@XY");
+    CHECK(row_text(t, 0) == "abcXYef");
+    feed(t, "\x1b[3;5Hz\x1b[1;31mR\x1b[0m");
+    CHECK(term_cell(t, 2, 4).ch == 'z');
+    CHECK(term_cell(t, 2, 5).attr.fg == (COLOR_INDEX | 1));
+    CHECK(term_cell(t, 2, 5).attr.flags == ATTR_BOLD);
+    feed(t, "\x1b[1;1H\x1b[K");
+    CHECK(row_text(t, 0) == "");
+    feed(t, "\x1b[2J\x1b[38;2;1;2;3mc");
+    CHECK(row_text(t, 2) == "");
+    CHECK(term_cell(t, 0, 0).attr.fg == (COLOR_RGB | 0x010203));
+}
+
+TEST_CASE("screen.queries") {
+    Term t;
+    term_init(t, 5, 20);
+    feed(t, "\x1b[3;7H\x1b[6n\x1b[c");
+    CHECK(t.reply == "\x1b[3;7R\x1b[?62;22c");
+}
+
+TEST_CASE("screen.alt.and.modes") {
+    Term t;
+    term_init(t, 3, 10);
+    feed(t, "shell$ ");
+    feed(t, "\x1b[?1049h\x1b[?1h\x1b[?2004h\x1b[Hfull screen");
+    CHECK(t.alt_active);
+    CHECK(row_text(t, 0) == "full scree");
+    CHECK((t.modes & MODE_APP_CURSOR));
+    feed(t, "\x1b[?1049l\x1b[?1l");
+    CHECK(row_text(t, 0) == "shell$");
+    CHECK(t.cur.x == 7);
+    CHECK(!(t.modes & MODE_APP_CURSOR));
+}
+
+TEST_CASE("screen.utf8.wide") {
+    Term t;
+    term_init(t, 2, 6);
+    feed(t, "a\xe4\xb8\xad" "b\x1b(0q\x1b(B");
+    CHECK(term_cell(t, 0, 1).ch == 0x4e2d);
+    CHECK(term_cell(t, 0, 1).flags == CELL_WIDE);
+    CHECK(term_cell(t, 0, 2).flags == CELL_WIDE_TAIL);
+    CHECK(term_cell(t, 0, 3).ch == 'b');
+    CHECK(term_cell(t, 0, 4).ch == 0x2500);
+    // overwriting the tail clears the head
+    feed(t, "\x1b[1;3Hx");
+    CHECK(term_cell(t, 0, 1).ch == ' ');
+    CHECK(term_cell(t, 0, 1).flags == 0);
+}
+
+TEST_CASE("screen.render.roundtrip") {
+    Term t;
+    term_init(t, 6, 20);
+    View v;
+    Term peer;
+    term_init(peer, 6, 20);
+
+    feed(t, "\x1b]0;title\x07$ ls\r\n\x1b[1;34mdir\x1b[0m  file\r\n$ ");
+    check_render(t, v, peer);
+
+    // typing echoes with a single byte
+    size_t len = 0;
+    feed(t, "x");
+    check_render(t, v, peer, &len);
+    CHECK(len == 1);
+
+    feed(t, "\x1b[?1049h\x1b[?1h\x1b[H\x1b[2J\x1b[7mstatus\x1b[0m\x1b[6;1Hbottom\xe4\xb8\xad");
+    check_render(t, v, peer);
+    feed(t, "\x1b[2;1H\x1b[Kedit\x1b[?25l");
+    check_render(t, v, peer);
+    feed(t, "\x1b[?1049l\x1b[?1l\x1b[?25h");
+    check_render(t, v, peer);
+}
+
+TEST_CASE("screen.render.scroll") {
+    Term t;
+    term_init(t, 24, 80);
+    View v;
+    Term peer;
+    term_init(peer, 24, 80);
+    for (int i = 0; i < 30; ++i) {
+        feed(t, "line " + to_string(i) + " of a long build log\r\n");
+    }
+    size_t full = 0;
+    check_render(t, v, peer, &full);
+
+    // only the new lines are sent
+    for (int i = 30; i < 33; ++i) {
+        feed(t, "line " + to_string(i) + " of a long build log\r\n");
+    }
+    size_t len = 0;
+    check_render(t, v, peer, &len);
+    CHECK(len < 150);
+}
+
+TEST_CASE("screen.render.random") {
+    const char *pieces[] = {
+        "abc", "\r\n", "\x1b[K", "\x1b[2J", "\x1b[5;5H", "\x1b[1;32m", "\x1b[0m", "\x1b[7m",
+        "\x1b[3L", "\x1b[2M", "\x1b[4P", "\x1b[2@", "\x1b[2;7r", "\x1b[r", "\x1bM", "\x1b[S",
+        "\xe4\xb8\xad", "\xe6\x96\x87", "\b", "\t", "\x1b[48;5;200m", "\x1b[?1049h", "\x1b[?1049l",
+        "\x1b[10X", "\x1b[3b", "0123456789abcdefghij", "\x1b[?7l", "\x1b[?7h", "\x1b[4h", "\x1b[4l",
+    };
+    srand(1);
+    Term t;
+    term_init(t, 8, 17);
+    View v;
+    Term peer;
+    term_init(peer, 8, 17);
+    for (int round = 0; round < 300; ++round) {
+        CAPTURE(round);
+        for (int i = rand() % 6; i >= 0; --i) {
+            feed(t, pieces[rand() % (sizeof(pieces) / sizeof(pieces[0]))]);
+        }
+        // the peer only follows autowrap and insert mode if told, keep them at the default
+        feed(t, "\x1b[?7h\x1b[4l");
+        check_render(t, v, peer);
+        if (round == 150) {
+            term_resize(t, v, 10, 13);
+            term_init(peer, 10, 13);
+        }
+    }
+}
@@ -0,0 +1,109 @@
+#include "doctest/doctest/doctest.h"
+
+// system
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <vector>
+// proj
+#include "trace.h"
+
+
+using namespace std;
+
+
+static void *record(void *user) {
+    uint64_t n = (uint64_t)(uintptr_t)user;
+    for (uint64_t i = 0; i < n; ++i) {
+        trace(TR_FRAME_IN, (uint32_t)n, i, i * 2);
+    }
+    return NULL;
+}
+
+static vector<TraceThread> dump_and_load() {
+    char path[] = "/tmp/test_trace.XXXXXX";
+    int fd = mkstemp(path);
+    REQUIRE(fd >= 0);
+    close(fd);
+    REQUIRE(trace_dump(path) == 0);
+    uint32_t pid = 0;
+    vector<TraceThread> threads;
+    REQUIRE(trace_load(path, pid, threads) == 0);
+    unlink(path);
+    CHECK(pid == (uint32_t)getpid());
+    return threads;
+}
+
+// the records of record(n), and the thread they were attributed to
+static vector<TraceRec> find_records(const vector<TraceThread> &threads, uint64_t n, uint32_t *tid = NULL) {
+    vector<TraceRec> out;
+    for (const TraceThread &t : threads) {
+        uint32_t owner = t.tid;
+        for (const TraceRec &rec : t.recs) {
+            if (rec.event == TR_THREAD) {
+                owner = rec.a;
+            } else if (rec.event == TR_FRAME_IN && rec.a == n) {
+                out.push_back(rec);
+                if (tid) {
+                    *tid = owner;
+                }
+            }
+        }
+    }
+    return out;
+}
+
+TEST_CASE("trace.off") {
+    g_trace_on = 0;
+    record((void *)(uintptr_t)10);
+    CHECK(find_records(dump_and_load(), 10).empty());
+}
+
+TEST_CASE("trace.threads") {
+    g_trace_on = 1;
+    record((void *)(uintptr_t)7);
+    pthread_t thread_id;
+    REQUIRE(pthread_create(&thread_id, NULL, record, (void *)(uintptr_t)100) == 0);
+    pthread_join(thread_id, NULL);
+    vector<TraceThread> threads = dump_and_load();
+
+    uint32_t main_tid = 0;
+    CHECK(find_records(threads, 7, &main_tid).size() == 7);
+    CHECK(main_tid == (uint32_t)gettid());
+
+    uint32_t tid = 0;
+    vector<TraceRec> recs = find_records(threads, 100, &tid);
+    CHECK(tid != main_tid);
+    REQUIRE(recs.size() == 100);
+    for (size_t i = 0; i < recs.size(); ++i) {
+        CHECK(recs[i].b == i);
+        CHECK(recs[i].c == i * 2);
+        if (i > 0) {
+            CHECK(recs[i].ns >= recs[i - 1].ns);
+        }
+    }
+
+    // the ring of a thread that exited is taken over, its records stay
+    REQUIRE(pthread_create(&thread_id, NULL, record, (void *)(uintptr_t)50) == 0);
+    pthread_join(thread_id, NULL);
+    g_trace_on = 0;
+    vector<TraceThread> after = dump_and_load();
+    CHECK(after.size() == threads.size());
+    uint32_t tid_after = 0;
+    CHECK(find_records(after, 100, &tid_after).size() == 100);
+    CHECK(tid_after == tid);
+    CHECK(find_records(after, 50).size() == 50);
+}
+
+TEST_CASE("trace.ring.keeps.the.newest") {
+    g_trace_on = 1;
+    const uint64_t n = k_trace_ring_size * 2 + 100;
+    pthread_t thread_id;
+    REQUIRE(pthread_create(&thread_id, NULL, record, (void *)(uintptr_t)n) == 0);
+    pthread_join(thread_id, NULL);
+    g_trace_on = 0;
+    vector<TraceRec> recs = find_records(dump_and_load(), n);
+    REQUIRE(recs.size() == k_trace_ring_size);
+    CHECK(recs.front().b == n - k_trace_ring_size);
+    CHECK(recs.back().b == n - 1);
+}
@@ -0,0 +1,139 @@
+#include "doctest/doctest/doctest.h"
+
+// system
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string>
+// proj
+#include "uring.h"
+#include "util.h"
+
+
+using namespace std;
+
+
+// kernels without io_uring skip the cases, the binaries fall back
+static int open_or_skip(Uring &r) {
+    if (0 != uring_open(r, 4)) {
+        log_err(errno, "no io_uring, skipped");
+        return -1;
+    }
+    return 0;
+}
+
+TEST_CASE("uring.read.write") {
+    Uring r;
+    if (open_or_skip(r)) {
+        return;
+    }
+    int fds[2];
+    REQUIRE(0 == pipe(fds));
+    char out[16] = {};
+    static char in[16];
+    struct iovec iov = {in, sizeof(in)};
+    int fixed = 0 == uring_register(r, &iov, 1);
+
+    // the read waits in the kernel until the write comes
+    REQUIRE(0 == (fixed ? uring_read_fixed(r, fds[0], in, sizeof(in), 0, 1) : uring_read(r, fds[0], in, sizeof(in), 1)));
+    REQUIRE(0 == uring_wait(r, 0));
+    uint64_t data = 0;
+    int32_t res = 0;
+    CHECK(0 == uring_pop(r, &data, &res));
+
+    strcpy(out, "hello");
+    REQUIRE(0 == uring_write(r, fds[1], out, 5, 2));
+    int got = 0;
+    while (got < 2) {
+        REQUIRE(0 == uring_wait(r, -1));
+        while (uring_pop(r, &data, &res)) {
+            CHECK(res == 5);
+            got |= (int)data;
+        }
+    }
+    CHECK(got == 3);
+    CHECK(0 == memcmp(in, "hello", 5));
+    CHECK(r.submitted == 2);
+    CHECK(r.completed == 2);
+    (void)close(fds[0]);
+    (void)close(fds[1]);
+    uring_close(r);
+}
+
+TEST_CASE("uring.wait.timeout") {
+    Uring r;
+    if (open_or_skip(r)) {
+        return;
+    }
+    int fds[2];
+    REQUIRE(0 == pipe(fds));
+    char buf[4];
+    REQUIRE(0 == uring_read(r, fds[0], buf, sizeof(buf), 7));
+    uint64_t start = monotonic_us();
+    CHECK(0 == uring_wait(r, 20000));
+    CHECK(monotonic_us() - start >= 20000);
+    uint64_t data = 0;
+    int32_t res = 0;
+    CHECK(0 == uring_pop(r, &data, &res));
+
+    // eof
+    (void)close(fds[1]);
+    REQUIRE(0 == uring_wait(r, -1));
+    REQUIRE(1 == uring_pop(r, &data, &res));
+    CHECK(data == 7);
+    CHECK(res == 0);
+    (void)close(fds[0]);
+    uring_close(r);
+}
+
+TEST_CASE("uring.out") {
+    Uring r;
+    if (open_or_skip(r)) {
+        return;
+    }
+    int fds[2];
+    REQUIRE(0 == pipe(fds));
+    WriteQueue q;
+    q.fd = fds[1];
+    q.defer = 1;
+    UringOut o;
+    o.wq = &q;
+    o.data = 9;
+
+    // queued while the first write is in flight, sent by the next one
+    string expected;
+    for (int i = 0; i < 100; ++i) {
+        string chunk(1 + i * 37 % 500, (char)('a' + i % 26));
+        REQUIRE(0 == wq_write(q, chunk.data(), chunk.size()));
+        expected += chunk;
+        if (i % 10 == 0) {
+            REQUIRE(0 == uring_out_kick(r, o));
+        }
+    }
+    REQUIRE(0 == uring_out_kick(r, o));
+    while (uring_out_pending(o) > 0) {
+        REQUIRE(0 == uring_wait(r, -1));
+        uint64_t data = 0;
+        int32_t res = 0;
+        while (uring_pop(r, &data, &res)) {
+            CHECK(data == 9);
+            REQUIRE(0 == uring_out_done(r, o, res));
+        }
+    }
+    CHECK(r.submitted < 100);
+
+    string got(expected.size(), '\0');
+    size_t n = 0;
+    while (n < got.size()) {
+        ssize_t nread = read(fds[0], &got[n], got.size() - n);
+        REQUIRE(nread > 0);
+        n += (size_t)nread;
+    }
+    CHECK(got == expected);
+    uring_out_free(o);
+    wq_free(q);
+    (void)close(fds[0]);
+    (void)close(fds[1]);
+    uring_close(r);
+}
@@ -0,0 +1,189 @@
+#include "doctest/doctest/doctest.h"
+
+// system
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <limits.h>
+#include <pthread.h>
+#include <string>
+// proj
+#include "crc32c.h"
+#include "protocol.h"
+#include "xfer.h"
+
+
+using namespace std;
+
+
+static int temp_file(const string &data) {
+    FILE *f = tmpfile();
+    REQUIRE(f);
+    int fd = dup(fileno(f));
+    (void)fclose(f);
+    REQUIRE((ssize_t)data.size() == pwrite(fd, data.data(), data.size(), 0));
+    return fd;
+}
+
+static string file_data(int fd) {
+    string data;
+    char buf[4096];
+    ssize_t nread = 0;
+    for (off_t off = 0; (nread = pread(fd, buf, sizeof(buf), off)) > 0; off += nread) {
+        data.append(buf, (size_t)nread);
+    }
+    return data;
+}
+
+struct FileSender {
+    Stream *s;
+    int fd;
+    uint64_t offset;
+    int cancel;
+    int err;
+};
+
+static void *send_file(void *user) {
+    FileSender &fs = *(FileSender *)user;
+    Hello h;
+    h.version = PROTO_V2;
+    h.flags = HELLO_F_MUX | HELLO_F_FILE;
+    h.max_frame = MAX_PAYLOAD_V2;
+    fs.err = send_hello(fs.s, h, MAX_PAYLOAD_V2);
+    fs.err |= xfer_open(fs.s, 5, OPEN_F_GET, fs.offset, "/some/where");
+    fs.err |= xfer_send(fs.s, 5, fs.fd, fs.offset, &fs.cancel);
+    fs.err |= send_eof(fs.s, 5);
+    return NULL;
+}
+
+struct FileReceiver {
+    int fd;
+    uint64_t next;
+    int opened;
+    int chunks;
+    int eof;        // of the channel, the parser's is channel 0
+    int err;
+};
+
+static int recv_file(Parser &p, void *user) {
+    FileReceiver &fr = *(FileReceiver *)user;
+    if (p.cmd == CMD_OPEN) {
+        uint8_t flags = 0;
+        uint64_t offset = 0;
+        char path[PATH_MAX];
+        CHECK(0 == xfer_open_decode(p.payload, p.size, flags, offset, path, sizeof(path)));
+        CHECK(flags == OPEN_F_GET);
+        CHECK(offset == fr.next);
+        CHECK(string(path) == "/some/where");
+        fr.opened = 1;
+    } else if (p.cmd == CMD_CHUNK) {
+        CHECK(p.chan == 5);
+        fr.chunks++;
+        fr.err |= xfer_recv(fr.fd, fr.next, p.payload, p.size);
+    } else if (p.cmd == CMD_EOF && p.chan == 5) {
+        fr.eof = 1;
+    }
+    return 0;
+}
+
+TEST_CASE("xfer.roundtrip") {
+    string input(1000123, '\0');
+    for (char &c : input) {
+        c = (char)rand();
+    }
+    for (uint64_t offset : {(uint64_t)0, (uint64_t)70000, (uint64_t)input.size()}) {
+        CAPTURE(offset);
+        int fds[2];
+        REQUIRE(0 == pipe(fds));
+        Stream *ws = new Stream;
+        Stream *rs = new Stream;
+        stream_reset(ws, -1, fds[1]);
+        stream_reset(rs, fds[0], -1);
+
+        // the receiver has the part before the offset already
+        int in_fd = temp_file(input);
+        int out_fd = temp_file(input.substr(0, offset));
+        FileSender fs = {ws, in_fd, offset, 0, 0};
+        pthread_t tid;
+        REQUIRE(0 == pthread_create(&tid, NULL, &send_file, &fs));
+        FileReceiver fr = {out_fd, offset, 0, 0, 0, 0};
+        Parser p;
+        int err = 0;
+        while (!fr.eof && 0 == (err = feed_frame(p, rs, recv_file, &fr))) {}
+        pthread_join(tid, NULL);
+
+        CHECK(err == 0);
+        CHECK(fs.err == 0);
+        CHECK(fr.err == 0);
+        CHECK(fr.opened);
+        CHECK(fr.next == input.size());
+        CHECK(fr.chunks == (int)((input.size() - offset + k_chunk_size - 1) / k_chunk_size));
+        CHECK(file_data(out_fd) == input);
+        CHECK(rs->stats.rx.frames[CMD_CHUNK] == (uint64_t)fr.chunks);
+        (void)close(in_fd);
+        (void)close(out_fd);
+        (void)close(fds[0]);
+        (void)close(fds[1]);
+        delete ws;
+        delete rs;
+    }
+}
+
+static string chunk(uint64_t offset, const string &data, uint32_t crc) {
+    string buf(k_chunk_header_size, '\0');
+    for (size_t i = 0; i < 8; ++i) {
+        buf[i] = (char)(offset >> (8 * i));
+    }
+    for (size_t i = 0; i < 4; ++i) {
+        buf[8 + i] = (char)(crc >> (8 * i));
+    }
+    return buf + data;
+}
+
+TEST_CASE("xfer.recv.checks") {
+    int fd = temp_file("");
+    uint64_t next = 0;
+    string hello = "hello";
+    uint32_t crc = crc32c(0, hello.data(), hello.size());
+    auto recv = [&](const string &buf) {
+        return xfer_recv(fd, next, (const uint8_t *)buf.data(), buf.size());
+    };
+
+    CHECK(EBADMSG == recv(chunk(0, hello, crc ^ 1)));
+    CHECK(EBADMSG == recv(chunk(0, "", 0)));
+    CHECK(EBADMSG == recv(string(5, 'x')));
+    CHECK(EPROTO == recv(chunk(5, hello, crc)));
+    CHECK(next == 0);
+    CHECK(0 == recv(chunk(0, hello, crc)));
+    CHECK(0 == recv(chunk(5, hello, crc)));
+    CHECK(next == 10);
+    // a chunk sent twice
+    CHECK(EPROTO == recv(chunk(5, hello, crc)));
+    CHECK(file_data(fd) == "hellohello");
+    (void)close(fd);
+}
+
+TEST_CASE("xfer.cancel") {
+    int fds[2];
+    REQUIRE(0 == pipe(fds));
+    Stream *ws = new Stream;
+    stream_reset(ws, -1, fds[1]);
+    int fd = temp_file("data");
+    int cancel = 1;
+    CHECK(-1 == xfer_send(ws, 0, fd, 0, &cancel));
+    CHECK(errno == ECANCELED);
+    CHECK(ws->stats.tx.frames[CMD_CHUNK] == 0);
+
+    uint8_t flags = 0;
+    uint64_t offset = 0;
+    char path[4];
+    const uint8_t session[5] = {OPEN_F_NO_TTY, 24, 0, 80, 0};
+    CHECK(0 != xfer_open_decode(session, sizeof(session), flags, offset, path, sizeof(path)));
+    CHECK(0 != xfer_open(ws, 1, OPEN_F_PUT, 0, ""));
+    (void)close(fd);
+    (void)close(fds[0]);
+    (void)close(fds[1]);
+    delete ws;
+}
@@ -0,0 +1,237 @@
+// system
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+// self
+#include "trace.h"
+#include "util.h"
+
+
+int g_trace_on = 0;
+
+struct TraceRing {
+    TraceRing *next = NULL;     // all rings, never removed
+    int owner = 0;              // a live thread writes to it
+    uint32_t tid = 0;
+    uint64_t head = 0;          // records written
+    TraceRec recs[k_trace_ring_size];
+};
+
+static TraceRing *g_rings = NULL;
+static pthread_key_t g_ring_key;
+static pthread_once_t g_ring_key_once = PTHREAD_ONCE_INIT;
+static thread_local TraceRing *t_ring = NULL;
+static char g_trace_path[4096];
+
+static const char *k_names[TR_EVENT_COUNT] = {
+    "none", "thread", "read", "write", "b64_decode", "lz_decode", "lz_encode",
+    "feed", "feed_short", "frame_in", "frame_out", "batch_flush", "wq_queue",
+    "esc_decode", "uring_enter", "tx_drain", "rel_resend", "rel_drop",
+};
+
+const char *trace_name(uint16_t event) {
+    return event < TR_EVENT_COUNT ? k_names[event] : "?";
+}
+
+// the ring goes back to the pool when its thread exits, what it recorded
+// stays until overwritten
+static void ring_release(void *user) {
+    TraceRing *r = (TraceRing *)user;
+    __atomic_store_n(&r->owner, 0, __ATOMIC_RELEASE);
+}
+
+static void ring_key_create() {
+    if (0 != pthread_key_create(&g_ring_key, ring_release)) {
+        abort();
+    }
+}
+
+static TraceRing *ring_claim() {
+    (void)pthread_once(&g_ring_key_once, ring_key_create);
+    TraceRing *r = __atomic_load_n(&g_rings, __ATOMIC_ACQUIRE);
+    for (; r; r = r->next) {
+        int idle = 0;
+        if (__atomic_compare_exchange_n(&r->owner, &idle, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+    if (!r) {
+        r = (TraceRing *)calloc(1, sizeof(TraceRing));
+        if (!r) {
+            return NULL;
+        }
+        r->owner = 1;
+        r->next = __atomic_load_n(&g_rings, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&g_rings, &r->next, r, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {}
+    }
+    r->tid = (uint32_t)syscall(SYS_gettid);
+    (void)pthread_setspecific(g_ring_key, r);
+    t_ring = r;
+    trace_rec(TR_THREAD, r->tid, r->head, 0);
+    return r;
+}
+
+void trace_rec(uint16_t event, uint32_t a, uint64_t b, uint64_t c) {
+    TraceRing *r = t_ring ? t_ring : ring_claim();
+    if (!r) {
+        return;
+    }
+    struct timespec ts;
+    (void)clock_gettime(CLOCK_MONOTONIC, &ts);
+    uint64_t head = r->head;
+    TraceRec &rec = r->recs[head & (k_trace_ring_size - 1)];
+    rec.ns = (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+    rec.event = event;
+    rec.a = a;
+    rec.b = b;
+    rec.c = c;
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+}
+
+static int write_all(int fd, const void *buf, size_t len) {
+    const char *p = (const char *)buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+// Records being written while we copy may come out torn, the rest is a
+// consistent history.
+int trace_dump(const char *path) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        return -1;
+    }
+    int err = 0;
+    uint32_t head[2] = {(uint32_t)getpid(), (uint32_t)sizeof(TraceRec)};
+    err |= write_all(fd, "PPTRACE1", 8);
+    err |= write_all(fd, head, sizeof(head));
+    for (TraceRing *r = __atomic_load_n(&g_rings, __ATOMIC_ACQUIRE); r && !err; r = r->next) {
+        uint64_t end = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        uint64_t begin = end > k_trace_ring_size ? end - k_trace_ring_size : 0;
+        uint32_t thread[2] = {r->tid, (uint32_t)(end - begin)};
+        err |= write_all(fd, thread, sizeof(thread));
+        // up to the wrap, then from the start
+        size_t first = (size_t)(begin & (k_trace_ring_size - 1));
+        size_t count = (size_t)(end - begin);
+        size_t n = count < k_trace_ring_size - first ? count : k_trace_ring_size - first;
+        err |= write_all(fd, &r->recs[first], n * sizeof(TraceRec));
+        err |= write_all(fd, &r->recs[0], (count - n) * sizeof(TraceRec));
+    }
+    (void)close(fd);
+    return err ? -1 : 0;
+}
+
+// PATH.<pid>, formatted by hand to stay async-signal-safe, and at dump time
+// so a forked daemon does not overwrite its parent's
+static void dump_own() {
+    char path[sizeof(g_trace_path) + 16];
+    size_t len = strlen(g_trace_path);
+    memcpy(path, g_trace_path, len);
+    path[len++] = '.';
+    char digits[16];
+    size_t n = 0;
+    for (unsigned pid = (unsigned)getpid(); pid || n == 0; pid /= 10) {
+        digits[n++] = (char)('0' + pid % 10);
+    }
+    while (n > 0) {
+        path[len++] = digits[--n];
+    }
+    path[len] = 0;
+    (void)trace_dump(path);
+}
+
+static void dump_at_exit() {
+    dump_own();
+}
+
+static void dump_on_signal(int sig) {
+    int saved = errno;
+    dump_own();
+    errno = saved;
+    if (sig != SIGUSR2) {
+        // SA_RESETHAND, dies as it would have
+        (void)raise(sig);
+    }
+}
+
+void trace_init() {
+    const char *path = getenv("PTY_PROXY_TRACE");
+    if (!path || !*path) {
+        return;
+    }
+    if (strlen(path) >= sizeof(g_trace_path)) {
+        log_err(0, "PTY_PROXY_TRACE too long");
+        return;
+    }
+    strcpy(g_trace_path, path);
+    if (atexit(dump_at_exit) != 0) {
+        log_err(errno, "atexit(dump_at_exit)");
+        return;
+    }
+
+    struct sigaction sa = {};
+    sa.sa_handler = &dump_on_signal;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    (void)sigaction(SIGUSR2, &sa, NULL);
+    sa.sa_flags = SA_RESETHAND;
+    const int k_crash[] = {SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT};
+    for (int sig : k_crash) {
+        (void)sigaction(sig, &sa, NULL);
+    }
+    g_trace_on = 1;
+}
+
+int trace_load(const char *path, uint32_t &pid, std::vector<TraceThread> &threads) {
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        log_err(errno, "fopen(%s)", path);
+        return -1;
+    }
+    int err = 0;
+    char magic[8];
+    uint32_t head[2] = {};
+    if (fread(magic, 8, 1, f) != 1 || memcmp(magic, "PPTRACE1", 8) != 0
+        || fread(head, sizeof(head), 1, f) != 1 || head[1] != sizeof(TraceRec))
+    {
+        log_err(0, "%s: not a trace", path);
+        err = -1;
+    }
+    pid = head[0];
+    uint32_t thread[2];
+    while (!err && fread(thread, sizeof(thread), 1, f) == 1) {
+        TraceThread t;
+        t.tid = thread[0];
+        if (thread[1] > k_trace_ring_size) {
+            log_err(0, "%s: bad record count %u", path, thread[1]);
+            err = -1;
+            break;
+        }
+        t.recs.resize(thread[1]);
+        if (thread[1] && fread(t.recs.data(), sizeof(TraceRec), thread[1], f) != thread[1]) {
+            log_err(0, "%s: truncated", path);
+            err = -1;
+            break;
+        }
+        threads.push_back(std::move(t));
+    }
+    (void)fclose(f);
+    return err;
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+// system
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+
+// Flight recorder for the hot path. Each thread appends fixed size binary
+// records to a ring of its own, without locks or formatting, and the rings
+// are written to a file at exit, on SIGUSR2 and on a crash. Enabled by
+// PTY_PROXY_TRACE=PATH, the dump goes to PATH.<pid>; pty_proxy_trace
+// prints it. Disabled, a record is a single branch.
+
+enum TraceEvent : uint16_t {
+    TR_NONE = 0,
+    TR_THREAD,              // a: tid, the ring changed hands, b: records before
+    TR_READ,                // a: fd, b: result, c: errno
+    TR_WRITE,               // a: fd, b: result, c: errno
+    TR_B64_DECODE,          // a: -, b: consumed, c: decoded
+    TR_LZ_DECODE,           // a: stored, b: block, c: decoded
+    TR_LZ_ENCODE,           // a: stored, b: raw, c: block
+    TR_FEED,                // a: -, b: buffered, c: -
+    TR_FEED_SHORT,          // a: cmd or 0xff before the header, b: frame size, c: buffered
+    TR_FRAME_IN,            // a: chan << 8 | cmd, b: size, c: seq
+    TR_FRAME_OUT,           // a: chan << 8 | cmd, b: size, c: seq
+    TR_BATCH_FLUSH,         // a: -, b: framed, c: wire
+    TR_WQ_QUEUE,            // a: fd, b: queued, c: pending
+    TR_ESC_DECODE,          // a: -, b: consumed, c: decoded
+    TR_URING_ENTER,         // a: queued, b: submitted, c: errno
+    TR_TX_DRAIN,            // a: frames, b: bytes, c: -
+    TR_REL_RESEND,          // a: seq, b: size, c: sends
+    TR_REL_DROP,            // a: cmd or 0xff before the header, b: bytes, c: seq
+    TR_EVENT_COUNT
+};
+
+struct TraceRec {
+    uint64_t ns;            // CLOCK_MONOTONIC
+    uint16_t event;
+    uint16_t pad;
+    uint32_t a;
+    uint64_t b;
+    uint64_t c;
+};
+
+// records kept per thread, a power of 2
+const size_t k_trace_ring_size = 4096;
+
+extern int g_trace_on;
+
+void trace_rec(uint16_t event, uint32_t a, uint64_t b, uint64_t c);
+
+inline void trace(uint16_t event, uint32_t a = 0, uint64_t b = 0, uint64_t c = 0) {
+    if (__builtin_expect(g_trace_on, 0)) {
+        trace_rec(event, a, b, c);
+    }
+}
+
+// reads PTY_PROXY_TRACE, installs the exit and signal handlers
+void trace_init();
+// async-signal-safe
+int trace_dump(const char *path);
+const char *trace_name(uint16_t event);
+
+// File: "PPTRACE1", [pid 4][record size 4], then per ring [tid 4][count 4]
+// and its records, oldest first, in host byte order. A ring outlives its
+// thread and is taken over by the next one, TR_THREAD marks where.
+struct TraceThread {
+    uint32_t tid = 0;           // the last owner
+    std::vector<TraceRec> recs;
+};
+
+int trace_load(const char *path, uint32_t &pid, std::vector<TraceThread> &threads);
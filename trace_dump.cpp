@@ -0,0 +1,68 @@
+// Prints the flight recorder dumps written with PTY_PROXY_TRACE=PATH:
+//
+//     pty_proxy_trace PATH.<pid>...
+//
+// The records of all threads and files are merged by time, one per line:
+// seconds since the first record, pid, tid, event and its arguments (see
+// trace.h for what they mean). Records left by a thread whose TR_THREAD was
+// overwritten show tid 0.
+
+// system
+#include <inttypes.h>
+#include <stdio.h>
+#include <algorithm>
+#include <vector>
+// proj
+#include "trace.h"
+#include "util.h"
+
+
+using namespace std;
+
+
+struct Line {
+    const TraceRec *rec;
+    uint32_t pid;
+    uint32_t tid;
+};
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s FILE...\n", argv[0]);
+        return 2;
+    }
+
+    vector<vector<TraceThread>> files(argc - 1);
+    vector<Line> lines;
+    for (int i = 1; i < argc; ++i) {
+        uint32_t pid = 0;
+        if (0 != trace_load(argv[i], pid, files[i - 1])) {
+            return 1;
+        }
+        for (const TraceThread &t : files[i - 1]) {
+            int handed_over = 0;
+            for (const TraceRec &rec : t.recs) {
+                handed_over |= rec.event == TR_THREAD;
+            }
+            uint32_t tid = handed_over ? 0 : t.tid;
+            for (const TraceRec &rec : t.recs) {
+                if (rec.event == TR_THREAD) {
+                    tid = rec.a;
+                }
+                lines.push_back(Line{&rec, pid, tid});
+            }
+        }
+    }
+    stable_sort(lines.begin(), lines.end(), [](const Line &l, const Line &r) {
+        return l.rec->ns < r.rec->ns;
+    });
+
+    uint64_t start = lines.empty() ? 0 : lines[0].rec->ns;
+    for (const Line &l : lines) {
+        const TraceRec &r = *l.rec;
+        uint64_t ns = r.ns - start;
+        printf("%4" PRIu64 ".%09" PRIu64 " %6u %6u %-12s %u %" PRIu64 " %" PRIu64 "\n",
+            ns / 1000000000, ns % 1000000000, l.pid, l.tid, trace_name(r.event), r.a, r.b, r.c);
+    }
+    return 0;
+}
@@ -0,0 +1,265 @@
+// system
+#include <assert.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+// self
+#include "uring.h"
+#include "trace.h"
+#include "util.h"
+
+
+static int sys_uring_setup(unsigned entries, struct io_uring_params *p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags, const void *arg, size_t argsz) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+static int sys_uring_register(int fd, unsigned opcode, const void *arg, unsigned nr_args) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+int uring_open(Uring &r, unsigned entries) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    r.fd = sys_uring_setup(entries, &p);
+    if (r.fd < 0) {
+        return -1;
+    }
+    if (!(p.features & IORING_FEAT_EXT_ARG)) {
+        (void)close(r.fd);
+        r.fd = -1;
+        errno = ENOSYS;
+        return -1;
+    }
+
+    r.sq_map_len = p.sq_off.array + p.sq_entries * sizeof(uint32_t);
+    r.cq_map_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    int single = !!(p.features & IORING_FEAT_SINGLE_MMAP);
+    if (single && r.cq_map_len > r.sq_map_len) {
+        r.sq_map_len = r.cq_map_len;
+    }
+    r.sq_map = mmap(NULL, r.sq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r.fd, IORING_OFF_SQ_RING);
+    if (r.sq_map == MAP_FAILED) {
+        r.sq_map = NULL;
+        goto L_ERROR;
+    }
+    r.cq_map = r.sq_map;
+    if (!single) {
+        r.cq_map = mmap(NULL, r.cq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r.fd, IORING_OFF_CQ_RING);
+        if (r.cq_map == MAP_FAILED) {
+            r.cq_map = NULL;
+            goto L_ERROR;
+        }
+    }
+    r.sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    r.sqes = (struct io_uring_sqe *)mmap(NULL, r.sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r.fd, IORING_OFF_SQES);
+    if (r.sqes == MAP_FAILED) {
+        r.sqes = NULL;
+        goto L_ERROR;
+    }
+
+    {
+        uint8_t *sq = (uint8_t *)r.sq_map;
+        uint8_t *cq = (uint8_t *)r.cq_map;
+        r.sq_head = (uint32_t *)(sq + p.sq_off.head);
+        r.sq_tail = (uint32_t *)(sq + p.sq_off.tail);
+        r.sq_array = (uint32_t *)(sq + p.sq_off.array);
+        r.sq_mask = *(uint32_t *)(sq + p.sq_off.ring_mask);
+        r.sq_entries = p.sq_entries;
+        r.cq_head = (uint32_t *)(cq + p.cq_off.head);
+        r.cq_tail = (uint32_t *)(cq + p.cq_off.tail);
+        r.cq_mask = *(uint32_t *)(cq + p.cq_off.ring_mask);
+        r.cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    }
+    // the slots map 1:1 to the sqes, only the tail moves
+    for (uint32_t i = 0; i < r.sq_entries; ++i) {
+        r.sq_array[i] = i;
+    }
+    return 0;
+
+L_ERROR:
+    int err = errno;
+    uring_close(r);
+    errno = err;
+    return -1;
+}
+
+void uring_close(Uring &r) {
+    if (r.sqes) {
+        (void)munmap(r.sqes, r.sqes_len);
+    }
+    if (r.cq_map && r.cq_map != r.sq_map) {
+        (void)munmap(r.cq_map, r.cq_map_len);
+    }
+    if (r.sq_map) {
+        (void)munmap(r.sq_map, r.sq_map_len);
+    }
+    if (r.fd >= 0) {
+        (void)close(r.fd);
+    }
+    r.sqes = NULL;
+    r.sq_map = r.cq_map = NULL;
+    r.fd = -1;
+}
+
+int uring_register(Uring &r, const struct iovec *iov, unsigned count) {
+    return sys_uring_register(r.fd, IORING_REGISTER_BUFFERS, iov, count) < 0 ? -1 : 0;
+}
+
+static int uring_submit(Uring &r, unsigned min_complete, unsigned flags, const void *arg, size_t argsz) {
+    r.enters++;
+    int n = sys_uring_enter(r.fd, r.queued, min_complete, flags, arg, argsz);
+    trace(TR_URING_ENTER, r.queued, n < 0 ? 0 : (uint64_t)n, n < 0 ? errno : 0);
+    if (n < 0) {
+        return -1;
+    }
+    assert((uint32_t)n <= r.queued);
+    r.queued -= (uint32_t)n;
+    r.submitted += (uint64_t)n;
+    return 0;
+}
+
+static struct io_uring_sqe *uring_sqe(Uring &r) {
+    if (r.queued == r.sq_entries && 0 != uring_submit(r, 0, 0, NULL, 0)) {
+        log_err(errno, "io_uring_enter()");
+        return NULL;
+    }
+    // only we move the tail
+    uint32_t tail = *r.sq_tail;
+    if (tail - __atomic_load_n(r.sq_head, __ATOMIC_ACQUIRE) == r.sq_entries) {
+        errno = EBUSY;
+        log_err(errno, "io_uring: the submission queue is full");
+        return NULL;
+    }
+    struct io_uring_sqe *sqe = &r.sqes[tail & r.sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    __atomic_store_n(r.sq_tail, tail + 1, __ATOMIC_RELEASE);
+    r.queued++;
+    return sqe;
+}
+
+static int uring_rw(Uring &r, uint8_t opcode, int fd, const void *buf, size_t len, uint64_t data) {
+    struct io_uring_sqe *sqe = uring_sqe(r);
+    if (!sqe) {
+        return -1;
+    }
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)buf;
+    sqe->len = (uint32_t)len;
+    // -1: the file position, pipes and ttys have none
+    sqe->off = (uint64_t)-1;
+    sqe->user_data = data;
+    return 0;
+}
+
+int uring_read(Uring &r, int fd, void *buf, size_t len, uint64_t data) {
+    return uring_rw(r, IORING_OP_READ, fd, buf, len, data);
+}
+
+int uring_read_fixed(Uring &r, int fd, void *buf, size_t len, unsigned index, uint64_t data) {
+    if (0 != uring_rw(r, IORING_OP_READ_FIXED, fd, buf, len, data)) {
+        return -1;
+    }
+    r.sqes[(*r.sq_tail - 1) & r.sq_mask].buf_index = (uint16_t)index;
+    return 0;
+}
+
+int uring_write(Uring &r, int fd, const void *buf, size_t len, uint64_t data) {
+    return uring_rw(r, IORING_OP_WRITE, fd, buf, len, data);
+}
+
+int uring_wait(Uring &r, int64_t timeout_us) {
+    struct __kernel_timespec ts = {};
+    struct io_uring_getevents_arg arg = {};
+    if (timeout_us >= 0) {
+        ts.tv_sec = timeout_us / 1000000;
+        ts.tv_nsec = (timeout_us % 1000000) * 1000;
+        arg.ts = (uint64_t)(uintptr_t)&ts;
+    }
+    // completions ready already, only submit
+    uint32_t ready = __atomic_load_n(r.cq_tail, __ATOMIC_ACQUIRE) - *r.cq_head;
+    if (ready && r.queued == 0) {
+        return 0;
+    }
+    unsigned flags = IORING_ENTER_EXT_ARG | (ready ? 0 : IORING_ENTER_GETEVENTS);
+    if (0 != uring_submit(r, ready ? 0 : 1, flags, &arg, sizeof(arg))) {
+        if (errno == ETIME || errno == EINTR) {
+            return 0;
+        }
+        log_err(errno, "io_uring_enter()");
+        return -1;
+    }
+    return 0;
+}
+
+int uring_pop(Uring &r, uint64_t *data, int32_t *res) {
+    uint32_t head = *r.cq_head;
+    if (head == __atomic_load_n(r.cq_tail, __ATOMIC_ACQUIRE)) {
+        return 0;
+    }
+    const struct io_uring_cqe *cqe = &r.cqes[head & r.cq_mask];
+    *data = cqe->user_data;
+    *res = cqe->res;
+    __atomic_store_n(r.cq_head, head + 1, __ATOMIC_RELEASE);
+    r.completed++;
+    return 1;
+}
+
+static int uring_out_submit(Uring &r, UringOut &o) {
+    o.busy = 1;
+    return uring_write(r, o.flight.fd, o.flight.buf + o.flight.begin, wq_pending(o.flight), o.data);
+}
+
+int uring_out_kick(Uring &r, UringOut &o) {
+    WriteQueue &q = *o.wq;
+    assert(q.defer);
+    if (o.busy || wq_pending(q) == 0) {
+        return 0;
+    }
+    // the queue takes the emptied buffer of the last write
+    WriteQueue &f = o.flight;
+    uint8_t *buf = f.buf;
+    size_t cap = f.cap;
+    f.buf = q.buf;
+    f.cap = q.cap;
+    f.begin = q.begin;
+    f.end = q.end;
+    f.fd = q.fd;
+    q.buf = buf;
+    q.cap = cap;
+    q.begin = q.end = 0;
+    return uring_out_submit(r, o);
+}
+
+int uring_out_done(Uring &r, UringOut &o, int32_t res) {
+    WriteQueue &f = o.flight;
+    assert(o.busy);
+    o.busy = 0;
+    trace(TR_WRITE, (uint32_t)f.fd, (uint64_t)(int64_t)res, res < 0 ? -res : 0);
+    if (res == -EINTR || res == -EAGAIN) {
+        return uring_out_submit(r, o);
+    }
+    if (res <= 0) {
+        log_err(res < 0 ? -res : 0, "[uring_out_done] write(fd:%d)", f.fd);
+        return -1;
+    }
+    if (o.wq->stats) {
+        stat_add(o.wq->stats->short_io, (size_t)res < wq_pending(f));
+    }
+    f.begin += (size_t)res;
+    if (wq_pending(f) > 0) {
+        return uring_out_submit(r, o);
+    }
+    f.begin = f.end = 0;
+    return uring_out_kick(r, o);
+}
+
+void uring_out_free(UringOut &o) {
+    wq_free(o.flight);
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+// system
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+// proj
+#include "event.h"
+
+
+// A small io_uring without liburing. Requests are queued in the submission
+// ring and go to the kernel together with the next uring_wait(), which also
+// waits for completions; uring_pop() hands those out one by one. Fds are
+// left blocking, the kernel polls them for us.
+struct Uring {
+    int fd = -1;
+    // private
+    uint32_t *sq_head = NULL;
+    uint32_t *sq_tail = NULL;
+    uint32_t *sq_array = NULL;
+    uint32_t sq_mask = 0;
+    uint32_t sq_entries = 0;
+    struct io_uring_sqe *sqes = NULL;
+    uint32_t *cq_head = NULL;
+    uint32_t *cq_tail = NULL;
+    uint32_t cq_mask = 0;
+    struct io_uring_cqe *cqes = NULL;
+    void *sq_map = NULL;
+    size_t sq_map_len = 0;
+    void *cq_map = NULL;        // sq_map with IORING_FEAT_SINGLE_MMAP
+    size_t cq_map_len = 0;
+    size_t sqes_len = 0;
+    uint32_t queued = 0;        // not submitted yet
+    // counters
+    uint64_t enters = 0;        // io_uring_enter() calls
+    uint64_t submitted = 0;
+    uint64_t completed = 0;
+};
+
+// -1 with errno if the kernel has no io_uring, e.g. ENOSYS, or one too old
+// to wait with a timeout
+int uring_open(Uring &r, unsigned entries);
+void uring_close(Uring &r);
+// pins buffers for uring_read_fixed(), index is their position in iov
+int uring_register(Uring &r, const struct iovec *iov, unsigned count);
+
+// data comes back with the completion
+int uring_read(Uring &r, int fd, void *buf, size_t len, uint64_t data);
+int uring_read_fixed(Uring &r, int fd, void *buf, size_t len, unsigned index, uint64_t data);
+int uring_write(Uring &r, int fd, const void *buf, size_t len, uint64_t data);
+// submits the queued requests and waits up to timeout_us for a completion,
+// -1: no limit; a timeout or a signal is not an error
+int uring_wait(Uring &r, int64_t timeout_us);
+// 0 if there is no completion left, res is the syscall's result or -errno
+int uring_pop(Uring &r, uint64_t *data, int32_t *res);
+
+// Output of one fd through the ring. Stream writes queue in wq, put in
+// defer mode; what was queued goes out with a single write while the
+// queue fills up again.
+struct UringOut {
+    WriteQueue *wq = NULL;
+    uint64_t data = 0;          // of its completions
+    // private
+    WriteQueue flight;          // being written
+    int busy = 0;
+};
+
+inline size_t uring_out_pending(const UringOut &o) {
+    return wq_pending(*o.wq) + wq_pending(o.flight);
+}
+
+// starts a write of the queue unless one is in flight
+int uring_out_kick(Uring &r, UringOut &o);
+// the write completed, writes the rest or what was queued meanwhile
+int uring_out_done(Uring &r, UringOut &o, int32_t res);
+void uring_out_free(UringOut &o);
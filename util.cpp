@@ -5,6 +5,7 @@
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <time.h>
 #include <libgen.h>     // for basename
 // proj
 #include "util.h"
@@ -90,3 +91,26 @@ void log_dbg(const char *fmt, ...) {
     do_vlog(0, fmt, args);
     va_end(args);
 }
+
+size_t g_thread_stack = k_thread_stack;
+
+int thread_attr_init(pthread_attr_t *attr, int detached) {
+    int err = pthread_attr_init(attr);
+    if (err) {
+        log_err(err, "pthread_attr_init()");
+        return -1;
+    }
+    if (detached) {
+        (void)pthread_attr_setdetachstate(attr, PTHREAD_CREATE_DETACHED);
+    }
+    if (0 != (err = pthread_attr_setstacksize(attr, g_thread_stack))) {
+        log_err(err, "pthread_attr_setstacksize(%zu)", g_thread_stack);
+    }
+    return 0;
+}
+
+uint64_t monotonic_us() {
+    struct timespec ts = {};
+    (void)clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
@@ -1,5 +1,10 @@
 #pragma once
 
+// system
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
 
 #ifndef TEMP_FAILURE_RETRY
 #   define TEMP_FAILURE_RETRY(exp)             \
@@ -15,3 +20,14 @@
 
 void log_err(int errnum, const char *fmt, ...);
 void log_dbg(const char *fmt, ...);
+// CLOCK_MONOTONIC
+uint64_t monotonic_us();
+
+// The stack of every thread we start, instead of the 8 MB default. I/O
+// buffers are on the heap, sized by the stream they serve.
+const size_t k_thread_stack = 256 * 1024;
+// the slave's --low-mem
+const size_t k_thread_stack_low_mem = 128 * 1024;
+extern size_t g_thread_stack;
+// pthread_attr_init() with g_thread_stack, detached or joinable
+int thread_attr_init(pthread_attr_t *attr, int detached);
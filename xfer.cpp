@@ -0,0 +1,159 @@
+// system
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+// self
+#include "xfer.h"
+#include "crc32c.h"
+#include "util.h"
+
+
+static void put_u64(uint8_t *buf, uint64_t v) {
+    for (size_t i = 0; i < 8; ++i) {
+        buf[i] = (uint8_t)(v >> (8 * i));
+    }
+}
+
+static uint64_t get_u64(const uint8_t *buf) {
+    uint64_t v = 0;
+    for (size_t i = 0; i < 8; ++i) {
+        v |= (uint64_t)buf[i] << (8 * i);
+    }
+    return v;
+}
+
+int xfer_open(Stream *s, uint32_t chan, uint8_t flags, uint64_t offset, const char *path) {
+    log_dbg("[xfer_open] [chan:%u][flags:%u][offset:%llu] %s", chan, flags, (unsigned long long)offset, path);
+    size_t path_len = strlen(path);
+    if (path_len == 0 || path_len >= PATH_MAX) {
+        errno = path_len ? ENAMETOOLONG : EINVAL;
+        log_err(errno, "xfer_open()");
+        return -1;
+    }
+
+    // no window, the session fields stay 0
+    char buf[FRAME_HEADROOM + 13 + PATH_MAX] = {};
+    uint8_t *payload = (uint8_t *)&buf[FRAME_HEADROOM];
+    payload[0] = flags;
+    put_u64(&payload[5], offset);
+    memcpy(&payload[13], path, path_len);
+    return send_payload(s, CMD_OPEN, (const char *)payload, 13 + path_len, chan);
+}
+
+int xfer_open_decode(const uint8_t *buf, size_t len, uint8_t &flags, uint64_t &offset, char *path, size_t path_size) {
+    if (len <= 13 || !(buf[0] & (OPEN_F_GET | OPEN_F_PUT))) {
+        log_err(0, "CMD_OPEN [size:%zu] is no file open", len);
+        return -1;
+    }
+    size_t path_len = len - 13;
+    if (path_len >= path_size || memchr(&buf[13], '\0', path_len)) {
+        log_err(0, "CMD_OPEN bad path [size:%zu]", path_len);
+        return -1;
+    }
+    flags = buf[0];
+    offset = get_u64(&buf[5]);
+    memcpy(path, &buf[13], path_len);
+    path[path_len] = '\0';
+    return 0;
+}
+
+int xfer_send(Stream *s, uint32_t chan, int fd, uint64_t offset, const int *cancel) {
+    // read ahead further, every page is read once
+    (void)posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    size_t max_payload = stream_max_payload(s) - k_chunk_header_size;
+    size_t chunk = max_payload < s->bufs.io ? max_payload : s->bufs.io;
+    char *bufstore = (char *)malloc(FRAME_HEADROOM + k_chunk_header_size + chunk);
+    if (!bufstore) {
+        log_err(errno, "[xfer_send] out of memory");
+        return -1;
+    }
+    uint8_t *payload = (uint8_t *)&bufstore[FRAME_HEADROOM];
+    uint8_t *data = &payload[k_chunk_header_size];
+    uint64_t start = offset;
+    int ret = -1;
+    int err = ECANCELED;
+    while (!__atomic_load_n(cancel, __ATOMIC_RELAXED)) {
+        // straight into the frame, the only copy on our side
+        ssize_t nread = TEMP_FAILURE_RETRY(pread(fd, data, chunk, (off_t)offset));
+        if (nread < 0) {
+            err = errno;
+            log_err(err, "[xfer_send] [chan:%u] pread()", chan);
+            break;
+        }
+        if (nread == 0) {
+            log_dbg("[xfer_send] [chan:%u] %llu bytes sent", chan, (unsigned long long)(offset - start));
+            ret = 0;
+            break;
+        }
+        uint32_t crc = crc32c(0, data, (size_t)nread);
+        put_u64(payload, offset);
+        for (size_t i = 0; i < 4; ++i) {
+            payload[8 + i] = (uint8_t)(crc >> (8 * i));
+        }
+        if (0 != send_payload(s, CMD_CHUNK, (const char *)payload, k_chunk_header_size + (size_t)nread, chan)) {
+            err = errno;
+            break;
+        }
+        offset += (uint64_t)nread;
+    }
+    if (ret != 0 && err == ECANCELED) {
+        log_dbg("[xfer_send] [chan:%u] cancelled at %llu", chan, (unsigned long long)offset);
+    }
+    free(bufstore);
+    errno = err;
+    return ret;
+}
+
+int xfer_recv(int fd, uint64_t &next, const uint8_t *buf, size_t len) {
+    if (len <= k_chunk_header_size) {
+        log_err(0, "CMD_CHUNK [size:%zu] <= %zu", len, k_chunk_header_size);
+        return EBADMSG;
+    }
+    uint64_t offset = get_u64(buf);
+    uint32_t crc = 0;
+    for (size_t i = 0; i < 4; ++i) {
+        crc |= (uint32_t)buf[8 + i] << (8 * i);
+    }
+    const uint8_t *data = &buf[k_chunk_header_size];
+    size_t size = len - k_chunk_header_size;
+    if (crc32c(0, data, size) != crc) {
+        log_err(0, "CMD_CHUNK [offset:%llu] checksum mismatch", (unsigned long long)offset);
+        return EBADMSG;
+    }
+    if (offset != next) {
+        log_err(0, "CMD_CHUNK [offset:%llu] expected %llu", (unsigned long long)offset, (unsigned long long)next);
+        return EPROTO;
+    }
+    while (size > 0) {
+        ssize_t nwritten = TEMP_FAILURE_RETRY(pwrite(fd, data, size, (off_t)offset));
+        if (nwritten <= 0) {
+            int err = nwritten < 0 ? errno : ENOSPC;
+            log_err(err, "[xfer_recv] pwrite()");
+            return err;
+        }
+        data += nwritten;
+        size -= (size_t)nwritten;
+        offset += (uint64_t)nwritten;
+    }
+    next = offset;
+    return 0;
+}
+
+int xfer_error(Stream *s, uint32_t chan, const char *fmt, ...) {
+    char buf[FRAME_HEADROOM + 512];
+    va_list args;
+    va_start(args, fmt);
+    int len = vsnprintf(&buf[FRAME_HEADROOM], sizeof(buf) - FRAME_HEADROOM, fmt, args);
+    va_end(args);
+    if (len <= 0) {
+        return -1;
+    }
+    size_t size = (size_t)len < sizeof(buf) - FRAME_HEADROOM ? (size_t)len : sizeof(buf) - FRAME_HEADROOM - 1;
+    return send_payload(s, CMD_ERR, &buf[FRAME_HEADROOM], size, chan);
+}
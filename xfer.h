@@ -0,0 +1,36 @@
+#pragma once
+
+// system
+#include <stdint.h>
+#include <stddef.h>
+// proj
+#include "protocol.h"
+
+
+// File transfers ride on a channel opened with OPEN_F_GET or OPEN_F_PUT,
+// CMD_OPEN then carries [offset 8 bytes][path] after the window size. The
+// side that writes the file answers a put with CMD_RESUME on the channel,
+// the offset it continues at. The file follows as CMD_CHUNK frames, in
+// order and without acks, and ends with CMD_EOF; CMD_ERR says why early.
+// Either side cancels with CMD_EOF.
+//
+// CMD_CHUNK: [offset 8 bytes][crc32c of data 4 bytes][data]
+const size_t k_chunk_header_size = 12;
+// chunks are no larger than a read() of a session, the stream's bufs.io,
+// interactive frames do not wait behind more
+const size_t k_chunk_size = k_io_buf_size;
+// put offset: append to what the file has
+const uint64_t k_xfer_append = UINT64_MAX;
+
+int xfer_open(Stream *s, uint32_t chan, uint8_t flags, uint64_t offset, const char *path);
+// path is NUL terminated, -1 if the payload is no file open or the path
+// does not fit
+int xfer_open_decode(const uint8_t *buf, size_t len, uint8_t &flags, uint64_t &offset, char *path, size_t path_size);
+// reads fd from offset on and sends it until the end or *cancel, -1 with
+// errno: ECANCELED or the read()'s or the stream's
+int xfer_send(Stream *s, uint32_t chan, int fd, uint64_t offset, const int *cancel);
+// writes a CMD_CHUNK at next, which it advances; 0 or an errno: EBADMSG if
+// the checksum does not match, EPROTO if it is not the next one
+int xfer_recv(int fd, uint64_t &next, const uint8_t *buf, size_t len);
+// CMD_ERR with a message for the user
+int xfer_error(Stream *s, uint32_t chan, const char *fmt, ...) __attribute__((format(printf, 3, 4)));